@@ -0,0 +1,166 @@
+// Compares the AGGREGATE kernels on registry-style columns against the
+// scalar loop over an array of device_status_t that clients used to run
+// on a full LIST.
+
+#include "aggregate.h"
+#include "protocol.h"
+
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_DEVICES 1000000
+#define DEFAULT_ROUNDS 50
+
+static device_status_t *g_devices;
+static size_t g_device_count;
+
+static uint64_t now_ns(void);
+static void aggregate_rows(aggregate_t *agg, const aggregate_filter_t *f);
+static double run_rows(const aggregate_filter_t *f, int rounds, aggregate_t *out);
+static double run_columns(const aggregate_filter_t *f, int rounds, const float *temperature,
+                          const uint8_t *battery, const uint8_t *status, aggregate_t *out);
+static int same_result(const aggregate_t *a, const aggregate_t *b);
+
+int main(int argc, char *argv[]) {
+    size_t devices = DEFAULT_DEVICES;
+    int rounds = DEFAULT_ROUNDS;
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:r:h")) != -1) {
+        switch(opt) {
+            case 'n': devices = strtoull(optarg, NULL, 10); break;
+            case 'r': rounds = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n devices] [-r rounds]\n", argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(devices == 0 || rounds <= 0) {
+        fprintf(stderr, "invalid arguments\n");
+        return 1;
+    }
+
+    g_devices = malloc(devices * sizeof(*g_devices));
+    float *temperature = aligned_alloc(64, (devices * sizeof(float) + 63) & ~(size_t)63);
+    uint8_t *battery = aligned_alloc(64, (devices + 63) & ~(size_t)63);
+    uint8_t *status = aligned_alloc(64, (devices + 63) & ~(size_t)63);
+    if(!g_devices || !temperature || !battery || !status) {
+        fprintf(stderr, "allocation failed\n");
+        return 1;
+    }
+    g_device_count = devices;
+
+    uint32_t rng = 0x2545f491u;
+    for(size_t i = 0; i < devices; i++) {
+        rng = rng * 1664525u + 1013904223u;
+        g_devices[i].device_id = (uint32_t)i + 1;
+        g_devices[i].temperature = 15.0f + (float)(rng >> 8) / (float)(1u << 24) * 20.0f;
+        g_devices[i].battery = (uint8_t)((rng >> 4) % 101);
+        g_devices[i].status = (uint8_t)((rng >> 12) % 3);
+        temperature[i] = g_devices[i].temperature;
+        battery[i] = g_devices[i].battery;
+        status[i] = g_devices[i].status;
+    }
+
+    aggregate_filter_t filters[2];
+    aggregate_filter_all(&filters[0]);
+    aggregate_filter_all(&filters[1]);
+    filters[1].status_mask = 1u << 1; // ONLINE
+    filters[1].battery_max = 19;
+    const char *filter_names[] = { "all devices", "online, battery < 20%" };
+    const char *kernels[] = { "scalar", "sse4.1", "avx2" };
+
+    printf("%zu devices, %d rounds, default kernel %s\n", devices, rounds, aggregate_kernel_name());
+    int rc = 0;
+    for(int fi = 0; fi < 2; fi++) {
+        aggregate_t rows;
+        double rows_ns = run_rows(&filters[fi], rounds, &rows);
+        printf("%s: %llu matched\n", filter_names[fi], (unsigned long long)rows.count);
+        printf("  %-22s %7.3f ns/device\n", "rows (device_status_t)", rows_ns);
+
+        for(size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+            if(aggregate_use_kernel(kernels[k]) < 0) {
+                printf("  %-22s unsupported on this CPU\n", kernels[k]);
+                continue;
+            }
+            aggregate_t cols;
+            double ns = run_columns(&filters[fi], rounds, temperature, battery, status, &cols);
+            int ok = same_result(&rows, &cols);
+            printf("  %-22s %7.3f ns/device  %5.1fx%s\n", kernels[k], ns, rows_ns / ns, ok ? "" : "  MISMATCH");
+            rc |= !ok;
+        }
+    }
+
+    free(g_devices);
+    free(temperature);
+    free(battery);
+    free(status);
+    return rc;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// The client-side reduction: one pass over packed rows, one branch per field.
+static void aggregate_rows(aggregate_t *agg, const aggregate_filter_t *f) {
+    float scale = TLV_AGGREGATE_TEMP_BINS / (f->hist_hi - f->hist_lo);
+    for(size_t i = 0; i < g_device_count; i++) {
+        const device_status_t *d = &g_devices[i];
+        float t = d->temperature;
+        if(d->status >= 8 || !((f->status_mask >> d->status) & 1) ||
+           d->battery < f->battery_min || d->battery > f->battery_max ||
+           !(t >= f->temp_min && t <= f->temp_max)) {
+            continue;
+        }
+        agg->count++;
+        if(t < agg->temp_min) agg->temp_min = t;
+        if(t > agg->temp_max) agg->temp_max = t;
+        agg->temp_sum += t;
+        agg->battery_sum += d->battery;
+        float bin = (t - f->hist_lo) * scale;
+        bin = (bin > 0.0f) ? bin : 0.0f;
+        bin = (bin < TLV_AGGREGATE_TEMP_BINS - 1) ? bin : TLV_AGGREGATE_TEMP_BINS - 1;
+        agg->temp_hist[(int)bin]++;
+        agg->battery_hist[(d->battery < 90) ? d->battery / 10 : TLV_AGGREGATE_BATTERY_BINS - 1]++;
+    }
+}
+
+static double run_rows(const aggregate_filter_t *f, int rounds, aggregate_t *out) {
+    uint64_t t0 = now_ns();
+    for(int r = 0; r < rounds; r++) {
+        aggregate_init(out);
+        aggregate_rows(out, f);
+    }
+    return (double)(now_ns() - t0) / ((double)rounds * (double)g_device_count);
+}
+
+static double run_columns(const aggregate_filter_t *f, int rounds, const float *temperature,
+                          const uint8_t *battery, const uint8_t *status, aggregate_t *out) {
+    uint64_t t0 = now_ns();
+    for(int r = 0; r < rounds; r++) {
+        aggregate_init(out);
+        aggregate_columns(out, f, temperature, battery, status, g_device_count);
+    }
+    return (double)(now_ns() - t0) / ((double)rounds * (double)g_device_count);
+}
+
+// Sums are accumulated in a different order per kernel, so they only have
+// to agree closely; everything else must match exactly.
+static int same_result(const aggregate_t *a, const aggregate_t *b) {
+    if(a->count != b->count || a->battery_sum != b->battery_sum ||
+       (a->count > 0 && (a->temp_min != b->temp_min || a->temp_max != b->temp_max)) ||
+       fabs(a->temp_sum - b->temp_sum) > 1e-9 * fabs(a->temp_sum) + 1e-6 ||
+       memcmp(a->temp_hist, b->temp_hist, sizeof(a->temp_hist)) != 0 ||
+       memcmp(a->battery_hist, b->battery_hist, sizeof(a->battery_hist)) != 0) {
+        return 0;
+    }
+    return 1;
+}
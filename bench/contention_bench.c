@@ -0,0 +1,223 @@
+// Measures SET latency on one connection while many other connections
+// run LIST in a tight loop against a running server.
+
+#include "protocol.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "5001"
+#define DEFAULT_LIST_CLIENTS 64
+#define DEFAULT_SECONDS 5
+#define MAX_SET_SAMPLES (1u << 22)
+
+typedef struct {
+    const char *host;
+    const char *port;
+    int list_clients;
+    int seconds;
+    uint32_t device_id;
+} bench_config_t;
+
+static atomic_int g_stop;
+static _Atomic uint64_t g_lists_done;
+
+static int connect_to(const char *host, const char *port);
+static uint64_t now_ns(void);
+static void *list_thread(void *arg);
+static int run_sets(const bench_config_t *cfg, uint64_t *samples, size_t *out_count);
+static int cmp_u64(const void *a, const void *b);
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p);
+
+int main(int argc, char *argv[]) {
+    bench_config_t cfg = {
+        .host = DEFAULT_HOST,
+        .port = DEFAULT_PORT,
+        .list_clients = DEFAULT_LIST_CLIENTS,
+        .seconds = DEFAULT_SECONDS,
+        .device_id = 1,
+    };
+
+    int opt;
+    while((opt = getopt(argc, argv, "H:p:c:d:i:h")) != -1) {
+        switch(opt) {
+            case 'H': cfg.host = optarg; break;
+            case 'p': cfg.port = optarg; break;
+            case 'c': cfg.list_clients = atoi(optarg); break;
+            case 'd': cfg.seconds = atoi(optarg); break;
+            case 'i': cfg.device_id = (uint32_t)strtoul(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "usage: %s [-H host] [-p port] [-c list_clients] [-d seconds] [-i device_id]\n", argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(cfg.list_clients < 0 || cfg.seconds <= 0) {
+        fprintf(stderr, "invalid arguments\n");
+        return 1;
+    }
+
+    pthread_t *threads = calloc((size_t)cfg.list_clients + 1, sizeof(*threads));
+    uint64_t *samples = malloc(MAX_SET_SAMPLES * sizeof(*samples));
+    if(!threads || !samples) {
+        fprintf(stderr, "allocation failed\n");
+        return 1;
+    }
+
+    int started = 0;
+    for(; started < cfg.list_clients; started++) {
+        if(pthread_create(&threads[started], NULL, list_thread, &cfg) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            break;
+        }
+    }
+
+    size_t count = 0;
+    uint64_t t0 = now_ns();
+    int rc = run_sets(&cfg, samples, &count);
+    double elapsed = (double)(now_ns() - t0) / 1e9;
+
+    atomic_store(&g_stop, 1);
+    for(int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if(rc == 0 && count > 0) {
+        qsort(samples, count, sizeof(*samples), cmp_u64);
+        printf("list clients:   %d\n", started);
+        printf("LIST/s:         %.0f\n", (double)atomic_load(&g_lists_done) / elapsed);
+        printf("SET/s:          %.0f\n", (double)count / elapsed);
+        printf("SET latency us: p50=%.1f p99=%.1f p999=%.1f max=%.1f\n",
+               (double)percentile(samples, count, 0.50) / 1e3,
+               (double)percentile(samples, count, 0.99) / 1e3,
+               (double)percentile(samples, count, 0.999) / 1e3,
+               (double)samples[count - 1] / 1e3);
+    }
+
+    free(samples);
+    free(threads);
+    return rc == 0 ? 0 : 1;
+}
+
+static int connect_to(const char *host, const char *port) {
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int err = getaddrinfo(host, port, &hints, &res);
+    if(err != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+        return -1;
+    }
+
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if(fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        perror("connect");
+        if(fd >= 0) close(fd);
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void *list_thread(void *arg) {
+    const bench_config_t *cfg = arg;
+    int fd = connect_to(cfg->host, cfg->port);
+    if(fd < 0) {
+        return NULL;
+    }
+
+    uint8_t *rx = malloc(UINT16_MAX);
+    while(rx && !atomic_load_explicit(&g_stop, memory_order_relaxed)) {
+        if(send_tlv(fd, TLV_TYPE_LIST_REQUEST, NULL, 0) < 0) {
+            break;
+        }
+        uint16_t type = 0, len = 0;
+        do {
+            if(recv_tlv(fd, &type, rx, UINT16_MAX, &len) != 0) {
+                type = 0;
+                break;
+            }
+        } while(type == TLV_TYPE_LIST_CHUNK);
+        if(type != TLV_TYPE_LIST_END) {
+            break;
+        }
+        atomic_fetch_add_explicit(&g_lists_done, 1, memory_order_relaxed);
+    }
+
+    free(rx);
+    close(fd);
+    return NULL;
+}
+
+static int run_sets(const bench_config_t *cfg, uint64_t *samples, size_t *out_count) {
+    int fd = connect_to(cfg->host, cfg->port);
+    if(fd < 0) {
+        return -1;
+    }
+
+    uint64_t deadline = now_ns() + (uint64_t)cfg->seconds * 1000000000ull;
+    size_t n = 0;
+    float temp = 20.0f;
+
+    while(n < MAX_SET_SAMPLES && now_ns() < deadline) {
+        uint32_t payload[2];
+        uint32_t temp_bits;
+        temp = (temp > 30.0f) ? 20.0f : temp + 0.1f;
+        memcpy(&temp_bits, &temp, sizeof(temp_bits));
+        payload[0] = htonl(cfg->device_id);
+        payload[1] = htonl(temp_bits);
+
+        uint8_t rx[16];
+        uint16_t type = 0, len = 0;
+        uint64_t t0 = now_ns();
+        if(send_tlv(fd, TLV_TYPE_SET_REQUEST, payload, sizeof(payload)) < 0 ||
+           recv_tlv(fd, &type, rx, sizeof(rx), &len) != 0 ||
+           type != TLV_TYPE_SET_RESPONSE) {
+            fprintf(stderr, "SET round trip failed\n");
+            close(fd);
+            return -1;
+        }
+        samples[n++] = now_ns() - t0;
+    }
+
+    close(fd);
+    *out_count = n;
+    return 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p) {
+    size_t i = (size_t)(p * (double)(n - 1));
+    return sorted[i];
+}
@@ -0,0 +1,189 @@
+// Sends TELEMETRY datagrams to a running server's ingest port as fast as
+// sendmmsg() allows, cycling through device ids 1..N. Compare the sent
+// count with the server's "ingest" stats line to see how many arrived.
+
+#include "protocol.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "5002"
+#define DEFAULT_DEVICES 1000
+#define DEFAULT_SECONDS 5
+#define SEND_BATCH 64
+#define MAX_RECORDS_PER_DATAGRAM 100
+
+typedef struct {
+    const char *host;
+    const char *port;
+    uint32_t devices;
+    int seconds;
+    int senders;
+    int per_datagram;
+} bench_config_t;
+
+static atomic_int g_stop;
+static _Atomic uint64_t g_sent;
+
+static int connect_udp(const char *host, const char *port);
+static uint64_t now_ns(void);
+static void *send_thread(void *arg);
+
+int main(int argc, char *argv[]) {
+    bench_config_t cfg = {
+        .host = DEFAULT_HOST,
+        .port = DEFAULT_PORT,
+        .devices = DEFAULT_DEVICES,
+        .seconds = DEFAULT_SECONDS,
+        .senders = 1,
+        .per_datagram = 1,
+    };
+
+    int opt;
+    while((opt = getopt(argc, argv, "H:p:n:d:t:r:h")) != -1) {
+        switch(opt) {
+            case 'H': cfg.host = optarg; break;
+            case 'p': cfg.port = optarg; break;
+            case 'n': cfg.devices = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'd': cfg.seconds = atoi(optarg); break;
+            case 't': cfg.senders = atoi(optarg); break;
+            case 'r': cfg.per_datagram = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-H host] [-p port] [-n devices] [-d seconds] [-t senders] "
+                        "[-r records_per_datagram]\n", argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(cfg.devices == 0 || cfg.seconds <= 0 || cfg.senders <= 0 ||
+       cfg.per_datagram <= 0 || cfg.per_datagram > MAX_RECORDS_PER_DATAGRAM) {
+        fprintf(stderr, "invalid arguments\n");
+        return 1;
+    }
+
+    pthread_t *threads = calloc((size_t)cfg.senders, sizeof(*threads));
+    if(!threads) {
+        fprintf(stderr, "allocation failed\n");
+        return 1;
+    }
+
+    uint64_t t0 = now_ns();
+    int started = 0;
+    for(; started < cfg.senders; started++) {
+        if(pthread_create(&threads[started], NULL, send_thread, &cfg) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            break;
+        }
+    }
+    struct timespec nap = { .tv_sec = cfg.seconds, .tv_nsec = 0 };
+    nanosleep(&nap, NULL);
+    atomic_store(&g_stop, 1);
+    for(int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = (double)(now_ns() - t0) / 1e9;
+
+    uint64_t sent = atomic_load(&g_sent);
+    printf("senders:        %d\n", started);
+    printf("datagrams sent: %llu\n", (unsigned long long)sent);
+    printf("datagrams/s:    %.0f\n", (double)sent / elapsed);
+    printf("records/s:      %.0f\n", (double)sent * cfg.per_datagram / elapsed);
+
+    free(threads);
+    return started == cfg.senders ? 0 : 1;
+}
+
+static int connect_udp(const char *host, const char *port) {
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    int err = getaddrinfo(host, port, &hints, &res);
+    if(err != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+        return -1;
+    }
+
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if(fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        perror("connect");
+        if(fd >= 0) close(fd);
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void *send_thread(void *arg) {
+    const bench_config_t *cfg = arg;
+    int fd = connect_udp(cfg->host, cfg->port);
+    if(fd < 0) {
+        return NULL;
+    }
+
+    size_t record = sizeof(tlv_header_t) + TLV_TELEMETRY_LEN;
+    size_t dgram = record * (size_t)cfg->per_datagram;
+    uint8_t *buf = malloc(SEND_BATCH * dgram);
+    struct mmsghdr msgs[SEND_BATCH];
+    struct iovec iovs[SEND_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for(int i = 0; i < SEND_BATCH; i++) {
+        iovs[i].iov_base = buf + (size_t)i * dgram;
+        iovs[i].iov_len = dgram;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    uint32_t rng = (uint32_t)(uintptr_t)&rng ^ (uint32_t)now_ns();
+    uint32_t next_id = 0;
+    while(buf && !atomic_load_explicit(&g_stop, memory_order_relaxed)) {
+        for(size_t r = 0; r < SEND_BATCH * (size_t)cfg->per_datagram; r++) {
+            rng = rng * 1664525u + 1013904223u;
+            uint8_t *p = buf + r * record;
+            uint8_t v[TLV_TELEMETRY_LEN];
+            float temp = 15.0f + (float)(rng >> 8) / (float)(1u << 24) * 20.0f;
+            uint32_t id_net = htonl(next_id + 1);
+            uint32_t temp_bits;
+            memcpy(&temp_bits, &temp, sizeof(temp_bits));
+            temp_bits = htonl(temp_bits);
+            memcpy(v, &id_net, sizeof(id_net));
+            memcpy(v + 4, &temp_bits, sizeof(temp_bits));
+            v[8] = (uint8_t)((rng >> 4) % 101);
+            v[9] = 1;
+            size_t out_len;
+            tlv_encode_buf(p, record, TLV_TYPE_TELEMETRY, v, sizeof(v), &out_len);
+            next_id = (next_id + 1) % cfg->devices;
+        }
+        int n = sendmmsg(fd, msgs, SEND_BATCH, 0);
+        if(n < 0) {
+            perror("sendmmsg");
+            break;
+        }
+        atomic_fetch_add_explicit(&g_sent, (uint64_t)n, memory_order_relaxed);
+    }
+
+    free(buf);
+    close(fd);
+    return NULL;
+}
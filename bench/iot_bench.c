@@ -0,0 +1,795 @@
+// Load generator for a running server: 'conns' connections, spread over
+// 'threads' threads, send a weighted mix of GET, SET, MULTI_GET, MULTI_SET
+// and LIST requests with up to 'depth' of them in flight per connection.
+//
+// With -r the requests follow a fixed schedule and each latency is measured
+// from the time the request was due, not the time it could be sent, so a
+// stalled server is charged for the requests it kept us from sending
+// (coordinated omission). Without -r the run is closed-loop and the
+// histograms are corrected afterwards the way HdrHistogram does for an
+// expected interval between requests. Results are printed and, with -j,
+// written as JSON.
+
+#include "protocol.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "5001"
+#define DEFAULT_CONNS 4
+#define DEFAULT_THREADS 1
+#define DEFAULT_DEPTH 1
+#define DEFAULT_SECONDS 10
+#define DEFAULT_WARMUP 1
+#define DEFAULT_DEVICES 1000
+#define DEFAULT_BATCH 64
+#define RX_INITIAL_SIZE (64 * 1024)
+#define MAX_EVENTS 256
+// Longest epoll wait, so threads notice the end of the run.
+#define POLL_MS 100
+
+// Latency histograms: 32 linear sub-buckets per power of two of
+// nanoseconds, so percentiles are within about 3%.
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1u << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+enum {
+    OP_GET = 0,
+    OP_SET,
+    OP_MGET,
+    OP_MSET,
+    OP_LIST,
+    OP_COUNT
+};
+
+static const char *const g_op_names[OP_COUNT] = { "get", "set", "mget", "mset", "list" };
+static const uint16_t g_op_responses[OP_COUNT] = {
+    TLV_TYPE_GET_RESPONSE, TLV_TYPE_SET_RESPONSE, TLV_TYPE_MULTI_GET_RESPONSE,
+    TLV_TYPE_MULTI_SET_RESPONSE, TLV_TYPE_LIST_END,
+};
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+typedef struct {
+    const char *host;
+    const char *port;
+    int conns;
+    int threads;
+    int depth;
+    int seconds;
+    int warmup;
+    double rate;             // requests per second over all connections, 0 = closed loop
+    uint32_t devices;
+    uint32_t batch;          // items per MULTI_GET / MULTI_SET
+    unsigned weights[OP_COUNT];
+    double expected_us;      // closed-loop correction interval, 0 = mean latency
+    const char *json_path;   // NULL = no JSON, "-" = stdout
+} bench_config_t;
+
+typedef struct {
+    int op;
+    uint64_t due_ns;  // when the schedule wanted it sent
+    uint64_t sent_ns;
+} pending_t;
+
+typedef struct {
+    int fd;
+    int dead;
+    tlv_reader_t rx;
+    tlv_writer_t tx;
+    pending_t *queue; // ring of 'depth' requests awaiting a response
+    unsigned head;
+    unsigned count;
+    uint64_t next_ns; // fixed rate: when the next request is due
+} bench_conn_t;
+
+typedef struct {
+    const bench_config_t *cfg;
+    int first_conn;
+    int conn_count;
+    uint32_t rng;
+    hist_t due[OP_COUNT];  // measured from the scheduled time
+    hist_t sent[OP_COUNT]; // measured from the actual send
+    uint64_t errors[OP_COUNT];
+    uint64_t failed_conns;
+} bench_thread_t;
+
+typedef struct {
+    double mean, p50, p90, p99, p999, max; // microseconds
+} summary_t;
+
+static atomic_int g_stop;
+static uint64_t g_measure_from; // requests due earlier are warmup
+static uint64_t g_measure_to;
+
+static int parse_mix(const char *spec, unsigned *weights);
+static int connect_tcp(const char *host, const char *port);
+static int set_nonblocking(int fd);
+static uint64_t now_ns(void);
+static void *bench_thread(void *arg);
+static int conn_issue(bench_thread_t *t, bench_conn_t *c, uint64_t now, uint64_t interval);
+static int conn_put_request(bench_thread_t *t, bench_conn_t *c, int op);
+static int conn_receive(bench_thread_t *t, bench_conn_t *c);
+static int response_failed(int op, uint16_t type, const uint8_t *value, uint16_t len, uint32_t batch);
+static int pick_op(bench_thread_t *t);
+static uint32_t next_rand(uint32_t *state);
+static unsigned hist_bucket(uint64_t v);
+static uint64_t hist_value(unsigned bucket);
+static void hist_record(hist_t *h, uint64_t v, uint64_t n);
+static void hist_add(hist_t *dst, const hist_t *src);
+static void hist_correct(hist_t *dst, const hist_t *src, uint64_t expected);
+static uint64_t hist_percentile(const hist_t *h, double q);
+static summary_t hist_summary(const hist_t *h);
+static void print_summary(const char *name, uint64_t count, uint64_t errors, double elapsed, const summary_t *s);
+static void json_summary(FILE *f, const char *key, const summary_t *s);
+static int write_json(const bench_config_t *cfg, FILE *f, double elapsed, uint64_t expected_ns,
+                      const hist_t *corrected, const hist_t *raw, const uint64_t *errors, uint64_t failed_conns);
+
+int main(int argc, char *argv[]) {
+    bench_config_t cfg = {
+        .host = DEFAULT_HOST,
+        .port = DEFAULT_PORT,
+        .conns = DEFAULT_CONNS,
+        .threads = DEFAULT_THREADS,
+        .depth = DEFAULT_DEPTH,
+        .seconds = DEFAULT_SECONDS,
+        .warmup = DEFAULT_WARMUP,
+        .rate = 0.0,
+        .devices = DEFAULT_DEVICES,
+        .batch = DEFAULT_BATCH,
+        .weights = { [OP_GET] = 90, [OP_SET] = 10 },
+        .expected_us = 0.0,
+        .json_path = NULL,
+    };
+
+    int opt;
+    while((opt = getopt(argc, argv, "H:p:c:t:D:d:w:r:n:b:m:e:j:h")) != -1) {
+        switch(opt) {
+            case 'H': cfg.host = optarg; break;
+            case 'p': cfg.port = optarg; break;
+            case 'c': cfg.conns = atoi(optarg); break;
+            case 't': cfg.threads = atoi(optarg); break;
+            case 'D': cfg.depth = atoi(optarg); break;
+            case 'd': cfg.seconds = atoi(optarg); break;
+            case 'w': cfg.warmup = atoi(optarg); break;
+            case 'r': cfg.rate = strtod(optarg, NULL); break;
+            case 'n': cfg.devices = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'b': cfg.batch = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'm':
+                if(parse_mix(optarg, cfg.weights) < 0) {
+                    fprintf(stderr, "invalid mix: %s (e.g. get=80,set=10,mget=5,mset=4,list=1)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'e': cfg.expected_us = strtod(optarg, NULL); break;
+            case 'j': cfg.json_path = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-H host] [-p port] [-c connections] [-t threads] [-D depth]\n"
+                        "          [-d seconds] [-w warmup_seconds] [-r requests_per_second]\n"
+                        "          [-n devices] [-b batch] [-m get=N,set=N,mget=N,mset=N,list=N]\n"
+                        "          [-e expected_interval_us] [-j json_file|-]\n", argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(cfg.threads > cfg.conns) {
+        cfg.threads = cfg.conns;
+    }
+    if(cfg.conns <= 0 || cfg.threads <= 0 || cfg.depth <= 0 || cfg.seconds <= 0 || cfg.warmup < 0 ||
+       cfg.rate < 0.0 || cfg.devices == 0 || cfg.batch == 0 || cfg.batch > TLV_MULTI_MAX_ITEMS) {
+        fprintf(stderr, "invalid arguments\n");
+        return 1;
+    }
+
+    bench_thread_t *threads = calloc((size_t)cfg.threads, sizeof(*threads));
+    pthread_t *tids = calloc((size_t)cfg.threads, sizeof(*tids));
+    if(!threads || !tids) {
+        fprintf(stderr, "allocation failed\n");
+        return 1;
+    }
+
+    uint64_t start = now_ns();
+    g_measure_from = start + (uint64_t)cfg.warmup * 1000000000ull;
+    g_measure_to = g_measure_from + (uint64_t)cfg.seconds * 1000000000ull;
+
+    int started = 0;
+    for(; started < cfg.threads; started++) {
+        bench_thread_t *t = &threads[started];
+        t->cfg = &cfg;
+        t->first_conn = cfg.conns * started / cfg.threads;
+        t->conn_count = cfg.conns * (started + 1) / cfg.threads - t->first_conn;
+        t->rng = 0x9e3779b9u * (uint32_t)(started + 1);
+        if(pthread_create(&tids[started], NULL, bench_thread, t) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            break;
+        }
+    }
+    uint64_t end = g_measure_to;
+    for(uint64_t now = now_ns(); now < end; now = now_ns()) {
+        uint64_t left = end - now;
+        struct timespec nap = { .tv_sec = (time_t)(left / 1000000000ull), .tv_nsec = (long)(left % 1000000000ull) };
+        nanosleep(&nap, NULL);
+    }
+    atomic_store(&g_stop, 1);
+    for(int i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    hist_t *raw = calloc(2 * OP_COUNT + 2, sizeof(hist_t));
+    if(!raw) {
+        fprintf(stderr, "allocation failed\n");
+        return 1;
+    }
+    hist_t *corrected = raw + OP_COUNT + 1;
+    uint64_t errors[OP_COUNT + 1] = { 0 };
+    uint64_t failed_conns = 0;
+    for(int i = 0; i < started; i++) {
+        for(int op = 0; op < OP_COUNT; op++) {
+            hist_add(&raw[op], &threads[i].sent[op]);
+            hist_add(&corrected[op], &threads[i].due[op]);
+            errors[op] += threads[i].errors[op];
+        }
+        failed_conns += threads[i].failed_conns;
+    }
+    for(int op = 0; op < OP_COUNT; op++) {
+        hist_add(&raw[OP_COUNT], &raw[op]);
+        errors[OP_COUNT] += errors[op];
+    }
+
+    // Closed loop: each slot sends its next request when the previous one
+    // returns, so a stall hides the requests that would have followed it.
+    uint64_t expected_ns = 0;
+    if(cfg.rate == 0.0) {
+        expected_ns = cfg.expected_us > 0.0 ? (uint64_t)(cfg.expected_us * 1e3)
+                                            : (raw[OP_COUNT].count ? raw[OP_COUNT].sum / raw[OP_COUNT].count : 0);
+        for(int op = 0; op < OP_COUNT; op++) {
+            memset(&corrected[op], 0, sizeof(corrected[op]));
+            hist_correct(&corrected[op], &raw[op], expected_ns);
+        }
+    }
+    for(int op = 0; op < OP_COUNT; op++) {
+        hist_add(&corrected[OP_COUNT], &corrected[op]);
+    }
+
+    double elapsed = (double)cfg.seconds;
+    printf("%d connections on %d threads, depth %d, %s", cfg.conns, started, cfg.depth,
+           cfg.rate > 0.0 ? "fixed rate" : "closed loop");
+    if(cfg.rate > 0.0) {
+        printf(" %.0f req/s", cfg.rate);
+    } else {
+        printf(", corrected for %.1f us between requests", (double)expected_ns / 1e3);
+    }
+    printf(", %d s\n", cfg.seconds);
+    printf("%-6s %12s %8s %12s %9s %9s %9s %9s %9s (us)\n",
+           "op", "requests", "errors", "req/s", "mean", "p50", "p99", "p99.9", "max");
+    for(int op = 0; op <= OP_COUNT; op++) {
+        if(raw[op].count == 0 && op != OP_COUNT) {
+            continue;
+        }
+        summary_t s = hist_summary(&corrected[op]);
+        print_summary(op == OP_COUNT ? "all" : g_op_names[op], raw[op].count, errors[op], elapsed, &s);
+    }
+    if(failed_conns > 0) {
+        printf("%llu connections failed\n", (unsigned long long)failed_conns);
+    }
+
+    int rc = (started == cfg.threads && failed_conns == 0) ? 0 : 1;
+    if(cfg.json_path) {
+        FILE *f = strcmp(cfg.json_path, "-") == 0 ? stdout : fopen(cfg.json_path, "w");
+        if(!f || write_json(&cfg, f, elapsed, expected_ns, corrected, raw, errors, failed_conns) < 0) {
+            fprintf(stderr, "cannot write %s: %s\n", cfg.json_path, strerror(errno));
+            rc = 1;
+        }
+        if(f && f != stdout && fclose(f) != 0) {
+            fprintf(stderr, "cannot write %s: %s\n", cfg.json_path, strerror(errno));
+            rc = 1;
+        }
+    }
+
+    free(raw);
+    free(tids);
+    free(threads);
+    return rc;
+}
+
+// "get=80,set=20": ops left out get weight 0.
+static int parse_mix(const char *spec, unsigned *weights) {
+    unsigned parsed[OP_COUNT] = { 0 };
+    unsigned total = 0;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", spec);
+
+    for(char *save = NULL, *item = strtok_r(buf, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(item, '=');
+        if(!eq) {
+            return -1;
+        }
+        *eq = '\0';
+        int op = 0;
+        while(op < OP_COUNT && strcmp(item, g_op_names[op]) != 0) {
+            op++;
+        }
+        char *end = NULL;
+        unsigned long w = strtoul(eq + 1, &end, 10);
+        if(op == OP_COUNT || *end != '\0' || w > 1000000) {
+            return -1;
+        }
+        parsed[op] = (unsigned)w;
+        total += (unsigned)w;
+    }
+    if(total == 0) {
+        return -1;
+    }
+    memcpy(weights, parsed, sizeof(parsed));
+    return 0;
+}
+
+static int connect_tcp(const char *host, const char *port) {
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int err = getaddrinfo(host, port, &hints, &res);
+    if(err != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+        return -1;
+    }
+
+    int fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+    if(fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        perror("connect");
+        if(fd >= 0) close(fd);
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return (flags < 0) ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void *bench_thread(void *arg) {
+    bench_thread_t *t = arg;
+    const bench_config_t *cfg = t->cfg;
+    bench_conn_t *conns = calloc((size_t)t->conn_count, sizeof(*conns));
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if(!conns || ep < 0) {
+        perror("bench thread setup");
+        t->failed_conns += (uint64_t)t->conn_count;
+        free(conns);
+        if(ep >= 0) close(ep);
+        return NULL;
+    }
+
+    // Each connection gets an equal share of the rate, staggered so the
+    // connections do not all send at once.
+    uint64_t interval = cfg->rate > 0.0 ? (uint64_t)(1e9 * (double)cfg->conns / cfg->rate) : 0;
+    uint64_t start = now_ns();
+    int live = 0;
+    for(int i = 0; i < t->conn_count; i++) {
+        bench_conn_t *c = &conns[i];
+        c->fd = connect_tcp(cfg->host, cfg->port);
+        c->queue = calloc((size_t)cfg->depth, sizeof(*c->queue));
+        if(c->fd < 0 || !c->queue || tlv_reader_init(&c->rx, RX_INITIAL_SIZE, TLV_MAX_FRAME) < 0) {
+            c->dead = 1;
+            t->failed_conns++;
+            continue;
+        }
+        tlv_writer_init(&c->tx);
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = c };
+        if(set_nonblocking(c->fd) < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+            c->dead = 1;
+            t->failed_conns++;
+            continue;
+        }
+        c->next_ns = start + interval * (uint64_t)(t->first_conn + i) / (uint64_t)cfg->conns;
+        live++;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while(live > 0 && !atomic_load_explicit(&g_stop, memory_order_relaxed)) {
+        uint64_t now = now_ns();
+        uint64_t next_due = UINT64_MAX;
+        for(int i = 0; i < t->conn_count; i++) {
+            bench_conn_t *c = &conns[i];
+            if(c->dead) {
+                continue;
+            }
+            if(conn_issue(t, c, now, interval) < 0) {
+                c->dead = 1;
+                t->failed_conns++;
+                live--;
+                continue;
+            }
+            if(interval > 0 && c->count < (unsigned)cfg->depth && c->next_ns < next_due) {
+                next_due = c->next_ns;
+            }
+        }
+
+        // Sleep until the next request is due, to the nanosecond: rounding
+        // to epoll_wait()'s milliseconds would show up as latency.
+        uint64_t wait = (uint64_t)POLL_MS * 1000000;
+        if(next_due != UINT64_MAX) {
+            now = now_ns();
+            uint64_t until = next_due > now ? next_due - now : 0;
+            wait = until < wait ? until : wait;
+        }
+        struct timespec timeout = { .tv_sec = (time_t)(wait / 1000000000ull), .tv_nsec = (long)(wait % 1000000000ull) };
+        int n = epoll_pwait2(ep, events, MAX_EVENTS, &timeout, NULL);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for(int i = 0; i < n; i++) {
+            bench_conn_t *c = events[i].data.ptr;
+            if(c->dead) {
+                continue;
+            }
+            int rc = 0;
+            if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                rc = conn_receive(t, c);
+            }
+            if(rc == 0 && (events[i].events & EPOLLOUT)) {
+                rc = tlv_writer_flush(&c->tx, c->fd) < 0 ? -1 : 0;
+            }
+            if(rc < 0) {
+                c->dead = 1;
+                t->failed_conns++;
+                live--;
+            }
+        }
+    }
+
+    for(int i = 0; i < t->conn_count; i++) {
+        if(conns[i].fd >= 0) {
+            close(conns[i].fd);
+        }
+        tlv_reader_free(&conns[i].rx);
+        tlv_writer_free(&conns[i].tx);
+        free(conns[i].queue);
+    }
+    free(conns);
+    close(ep);
+    return NULL;
+}
+
+// Queue every request the connection may send now and flush them.
+static int conn_issue(bench_thread_t *t, bench_conn_t *c, uint64_t now, uint64_t interval) {
+    unsigned depth = (unsigned)t->cfg->depth;
+    int queued = 0;
+    while(c->count < depth) {
+        uint64_t due = now;
+        if(interval > 0) {
+            if(c->next_ns > now) {
+                break;
+            }
+            // A late request keeps its slot, so the delay counts as latency.
+            due = c->next_ns;
+            c->next_ns += interval;
+        }
+        int op = pick_op(t);
+        if(conn_put_request(t, c, op) < 0) {
+            return -1;
+        }
+        pending_t *p = &c->queue[(c->head + c->count) % depth];
+        p->op = op;
+        p->due_ns = due;
+        p->sent_ns = now;
+        c->count++;
+        queued = 1;
+    }
+    if(!queued) {
+        return 0;
+    }
+    return tlv_writer_flush(&c->tx, c->fd) < 0 ? -1 : 0;
+}
+
+static int conn_put_request(bench_thread_t *t, bench_conn_t *c, int op) {
+    static const uint16_t types[OP_COUNT] = {
+        TLV_TYPE_GET_REQUEST, TLV_TYPE_SET_REQUEST, TLV_TYPE_MULTI_GET_REQUEST,
+        TLV_TYPE_MULTI_SET_REQUEST, TLV_TYPE_LIST_REQUEST,
+    };
+    uint8_t buf[TLV_MULTI_MAX_ITEMS * 2 * sizeof(uint32_t)];
+    uint32_t items = (op == OP_MGET || op == OP_MSET) ? t->cfg->batch : (op == OP_LIST ? 0 : 1);
+    size_t len = 0;
+
+    for(uint32_t i = 0; i < items; i++) {
+        uint32_t id_net = htonl(1 + next_rand(&t->rng) % t->cfg->devices);
+        memcpy(buf + len, &id_net, sizeof(id_net));
+        len += sizeof(id_net);
+        if(op == OP_SET || op == OP_MSET) {
+            float temp = 15.0f + (float)(next_rand(&t->rng) % 1500) / 100.0f;
+            uint32_t bits;
+            memcpy(&bits, &temp, sizeof(bits));
+            bits = htonl(bits);
+            memcpy(buf + len, &bits, sizeof(bits));
+            len += sizeof(bits);
+        }
+    }
+    return tlv_writer_put(&c->tx, types[op], buf, (uint16_t)len);
+}
+
+// Read until the socket is drained, completing requests in order; a LIST
+// completes with its LIST_END.
+static int conn_receive(bench_thread_t *t, bench_conn_t *c) {
+    unsigned depth = (unsigned)t->cfg->depth;
+    while(1) {
+        ssize_t n = tlv_reader_fill(&c->rx, c->fd);
+        if(n == 0) {
+            fprintf(stderr, "server closed a connection\n");
+            return -1;
+        }
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            perror("recv");
+            return -1;
+        }
+
+        uint64_t now = now_ns();
+        uint16_t type = 0, len = 0;
+        const uint8_t *value = NULL;
+        int rc;
+        while((rc = tlv_reader_next(&c->rx, &type, &value, &len)) == 1) {
+            if(c->count == 0) {
+                fprintf(stderr, "unexpected frame type 0x%04x\n", type);
+                return -1;
+            }
+            pending_t *p = &c->queue[c->head];
+            if(p->op == OP_LIST && type == TLV_TYPE_LIST_CHUNK) {
+                continue;
+            }
+            c->head = (c->head + 1) % depth;
+            c->count--;
+            if(p->due_ns < g_measure_from || now > g_measure_to) {
+                continue;
+            }
+            hist_record(&t->due[p->op], now - p->due_ns, 1);
+            hist_record(&t->sent[p->op], now - p->sent_ns, 1);
+            if(response_failed(p->op, type, value, len, t->cfg->batch)) {
+                t->errors[p->op]++;
+            }
+        }
+        if(rc < 0) {
+            fprintf(stderr, "malformed response frame\n");
+            return -1;
+        }
+    }
+}
+
+// Wrong response type, or a device the server did not find.
+static int response_failed(int op, uint16_t type, const uint8_t *value, uint16_t len, uint32_t batch) {
+    if(type != g_op_responses[op]) {
+        return 1;
+    }
+    switch(op) {
+        case OP_GET:
+            return len != sizeof(device_status_t);
+        case OP_SET:
+            return len != 1 || value[0] != 0;
+        case OP_MGET:
+        case OP_MSET:
+            if(len < batch) {
+                return 1;
+            }
+            for(uint32_t i = 0; i < batch; i++) {
+                if(value[i] != 0) {
+                    return 1;
+                }
+            }
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+static int pick_op(bench_thread_t *t) {
+    const unsigned *w = t->cfg->weights;
+    unsigned total = 0;
+    for(int op = 0; op < OP_COUNT; op++) {
+        total += w[op];
+    }
+    unsigned r = next_rand(&t->rng) % total;
+    int op = 0;
+    while(r >= w[op]) {
+        r -= w[op];
+        op++;
+    }
+    return op;
+}
+
+// xorshift32
+static uint32_t next_rand(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Values below HIST_SUB get a bucket each; above, every power of two is
+// split into HIST_SUB equal buckets.
+static unsigned hist_bucket(uint64_t v) {
+    if(v < HIST_SUB) {
+        return (unsigned)v;
+    }
+    unsigned msb = 63u - (unsigned)__builtin_clzll(v);
+    if(msb >= HIST_MAX_BITS) {
+        return HIST_BUCKETS - 1;
+    }
+    unsigned shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (unsigned)((v >> shift) & (HIST_SUB - 1));
+}
+
+// Largest value that lands in 'bucket'.
+static uint64_t hist_value(unsigned bucket) {
+    if(bucket < HIST_SUB) {
+        return bucket;
+    }
+    unsigned shift = bucket / HIST_SUB - 1;
+    uint64_t sub = HIST_SUB + bucket % HIST_SUB;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void hist_record(hist_t *h, uint64_t v, uint64_t n) {
+    h->count += n;
+    h->sum += v * n;
+    if(v > h->max) {
+        h->max = v;
+    }
+    h->buckets[hist_bucket(v)] += n;
+}
+
+static void hist_add(hist_t *dst, const hist_t *src) {
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if(src->max > dst->max) {
+        dst->max = src->max;
+    }
+    for(unsigned i = 0; i < HIST_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+}
+
+// HdrHistogram's copyCorrectedForCoordinatedOmission(): a latency of v
+// stood for the requests that would have been sent every 'expected' ns
+// meanwhile, which would have waited v - expected, v - 2 * expected, ...
+static void hist_correct(hist_t *dst, const hist_t *src, uint64_t expected) {
+    hist_add(dst, src);
+    if(expected == 0) {
+        return;
+    }
+    for(unsigned i = 0; i < HIST_BUCKETS; i++) {
+        uint64_t n = src->buckets[i];
+        if(n == 0) {
+            continue;
+        }
+        uint64_t v = hist_value(i) < src->max ? hist_value(i) : src->max;
+        for(uint64_t missing = v > expected ? v - expected : 0; missing >= expected; missing -= expected) {
+            hist_record(dst, missing, n);
+        }
+    }
+}
+
+static uint64_t hist_percentile(const hist_t *h, double q) {
+    if(h->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * (double)h->count + 0.5);
+    if(rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for(unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if(seen >= rank) {
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+        }
+    }
+    return h->max;
+}
+
+static summary_t hist_summary(const hist_t *h) {
+    summary_t s = {
+        .mean = h->count ? (double)h->sum / (double)h->count / 1e3 : 0.0,
+        .p50 = (double)hist_percentile(h, 0.5) / 1e3,
+        .p90 = (double)hist_percentile(h, 0.9) / 1e3,
+        .p99 = (double)hist_percentile(h, 0.99) / 1e3,
+        .p999 = (double)hist_percentile(h, 0.999) / 1e3,
+        .max = (double)h->max / 1e3,
+    };
+    return s;
+}
+
+static void print_summary(const char *name, uint64_t count, uint64_t errors, double elapsed, const summary_t *s) {
+    printf("%-6s %12llu %8llu %12.0f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name,
+           (unsigned long long)count, (unsigned long long)errors, (double)count / elapsed,
+           s->mean, s->p50, s->p99, s->p999, s->max);
+}
+
+static void json_summary(FILE *f, const char *key, const summary_t *s) {
+    fprintf(f, "\"%s\": {\"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}",
+            key, s->mean, s->p50, s->p90, s->p99, s->p999, s->max);
+}
+
+// 'corrected', 'raw' and 'errors' have OP_COUNT + 1 entries, the last one
+// summing all operations.
+static int write_json(const bench_config_t *cfg, FILE *f, double elapsed, uint64_t expected_ns,
+                      const hist_t *corrected, const hist_t *raw, const uint64_t *errors, uint64_t failed_conns) {
+    fprintf(f, "{\n  \"config\": {\"host\": \"%s\", \"port\": \"%s\", \"connections\": %d, \"threads\": %d, "
+               "\"depth\": %d, \"duration_s\": %d, \"warmup_s\": %d, \"mode\": \"%s\", \"rate\": %.1f, "
+               "\"devices\": %u, \"batch\": %u, \"mix\": {",
+            cfg->host, cfg->port, cfg->conns, cfg->threads, cfg->depth, cfg->seconds, cfg->warmup,
+            cfg->rate > 0.0 ? "fixed-rate" : "closed-loop", cfg->rate, cfg->devices, cfg->batch);
+    for(int op = 0; op < OP_COUNT; op++) {
+        fprintf(f, "%s\"%s\": %u", op ? ", " : "", g_op_names[op], cfg->weights[op]);
+    }
+    fprintf(f, "}},\n");
+    fprintf(f, "  \"expected_interval_us\": %.3f,\n", (double)expected_ns / 1e3);
+    fprintf(f, "  \"failed_connections\": %llu,\n", (unsigned long long)failed_conns);
+    fprintf(f, "  \"ops\": {");
+    int first = 1;
+    for(int op = 0; op <= OP_COUNT; op++) {
+        if(raw[op].count == 0 && op != OP_COUNT) {
+            continue;
+        }
+        summary_t c = hist_summary(&corrected[op]);
+        summary_t r = hist_summary(&raw[op]);
+        fprintf(f, "%s\n    \"%s\": {\"requests\": %llu, \"errors\": %llu, \"throughput_rps\": %.1f, ",
+                first ? "" : ",", op == OP_COUNT ? "all" : g_op_names[op],
+                (unsigned long long)raw[op].count, (unsigned long long)errors[op], (double)raw[op].count / elapsed);
+        json_summary(f, "latency_us", &c);
+        fprintf(f, ", ");
+        json_summary(f, "uncorrected_latency_us", &r);
+        fprintf(f, "}");
+        first = 0;
+    }
+    fprintf(f, "\n  }\n}\n");
+    fflush(f);
+    return ferror(f) ? -1 : 0;
+}
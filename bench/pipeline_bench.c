@@ -0,0 +1,247 @@
+// Closed-loop request benchmark against a running server: each connection
+// keeps 'depth' GET requests outstanding and sends a new one for every
+// response. With -P the server's CPU time is sampled from /proc to report
+// CPU per request, e.g. to compare the epoll and io_uring backends.
+
+#include "protocol.h"
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "5001"
+#define DEFAULT_CONNS 4
+#define DEFAULT_DEPTH 16
+#define DEFAULT_SECONDS 5
+#define DEFAULT_DEVICES 1000
+#define RECV_BUF (64 * 1024)
+
+typedef struct {
+    const char *host;
+    const char *port;
+    int conns;
+    int depth;
+    int seconds;
+    uint32_t devices;
+} bench_config_t;
+
+static atomic_int g_stop;
+static _Atomic uint64_t g_responses;
+
+static int connect_tcp(const char *host, const char *port);
+static uint64_t now_ns(void);
+static double process_cpu_seconds(long pid);
+static int send_gets(int fd, int count, uint32_t *next_id, uint32_t devices);
+static void *conn_thread(void *arg);
+
+int main(int argc, char *argv[]) {
+    bench_config_t cfg = {
+        .host = DEFAULT_HOST,
+        .port = DEFAULT_PORT,
+        .conns = DEFAULT_CONNS,
+        .depth = DEFAULT_DEPTH,
+        .seconds = DEFAULT_SECONDS,
+        .devices = DEFAULT_DEVICES,
+    };
+    long pid = 0;
+
+    int opt;
+    while((opt = getopt(argc, argv, "H:p:c:D:d:n:P:h")) != -1) {
+        switch(opt) {
+            case 'H': cfg.host = optarg; break;
+            case 'p': cfg.port = optarg; break;
+            case 'c': cfg.conns = atoi(optarg); break;
+            case 'D': cfg.depth = atoi(optarg); break;
+            case 'd': cfg.seconds = atoi(optarg); break;
+            case 'n': cfg.devices = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'P': pid = strtol(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "usage: %s [-H host] [-p port] [-c connections] [-D depth] [-d seconds] "
+                        "[-n devices] [-P server_pid]\n", argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(cfg.conns <= 0 || cfg.depth <= 0 || cfg.seconds <= 0 || cfg.devices == 0) {
+        fprintf(stderr, "invalid arguments\n");
+        return 1;
+    }
+
+    pthread_t *threads = calloc((size_t)cfg.conns, sizeof(*threads));
+    if(!threads) {
+        fprintf(stderr, "allocation failed\n");
+        return 1;
+    }
+
+    double cpu0 = pid > 0 ? process_cpu_seconds(pid) : 0.0;
+    uint64_t t0 = now_ns();
+    int started = 0;
+    for(; started < cfg.conns; started++) {
+        if(pthread_create(&threads[started], NULL, conn_thread, &cfg) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            break;
+        }
+    }
+    struct timespec nap = { .tv_sec = cfg.seconds, .tv_nsec = 0 };
+    nanosleep(&nap, NULL);
+    uint64_t responses = atomic_load(&g_responses);
+    double elapsed = (double)(now_ns() - t0) / 1e9;
+    double cpu1 = pid > 0 ? process_cpu_seconds(pid) : 0.0;
+    atomic_store(&g_stop, 1);
+    for(int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("connections:    %d x depth %d\n", started, cfg.depth);
+    printf("requests:       %llu\n", (unsigned long long)responses);
+    printf("requests/s:     %.0f\n", (double)responses / elapsed);
+    if(pid > 0 && cpu0 >= 0.0 && cpu1 >= 0.0 && responses > 0) {
+        printf("server cpu:     %.2f s (%.0f%%)\n", cpu1 - cpu0, (cpu1 - cpu0) * 100.0 / elapsed);
+        printf("cpu/request:    %.2f us\n", (cpu1 - cpu0) * 1e6 / (double)responses);
+    }
+
+    free(threads);
+    return started == cfg.conns ? 0 : 1;
+}
+
+static int connect_tcp(const char *host, const char *port) {
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int err = getaddrinfo(host, port, &hints, &res);
+    if(err != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+        return -1;
+    }
+
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if(fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        perror("connect");
+        if(fd >= 0) close(fd);
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// utime + stime of every thread of 'pid', or -1 if it cannot be read.
+static double process_cpu_seconds(long pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+    FILE *f = fopen(path, "r");
+    if(!f) {
+        return -1.0;
+    }
+    char line[1024];
+    char *ok = fgets(line, sizeof(line), f);
+    fclose(f);
+    // The command name may contain spaces; fields resume after its ')'.
+    char *p = ok ? strrchr(line, ')') : NULL;
+    unsigned long utime, stime;
+    if(!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+        return -1.0;
+    }
+    return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+static int send_gets(int fd, int count, uint32_t *next_id, uint32_t devices) {
+    uint8_t buf[DEFAULT_DEPTH * 8];
+    while(count > 0) {
+        int batch = count < DEFAULT_DEPTH ? count : DEFAULT_DEPTH;
+        size_t len = 0;
+        for(int i = 0; i < batch; i++) {
+            uint32_t id_net = htonl(*next_id + 1);
+            size_t out_len;
+            tlv_encode_buf(buf + len, sizeof(buf) - len, TLV_TYPE_GET_REQUEST, &id_net, sizeof(id_net), &out_len);
+            len += out_len;
+            *next_id = (*next_id + 1) % devices;
+        }
+        for(size_t off = 0; off < len;) {
+            ssize_t n = send(fd, buf + off, len - off, MSG_NOSIGNAL);
+            if(n < 0) {
+                return -1;
+            }
+            off += (size_t)n;
+        }
+        count -= batch;
+    }
+    return 0;
+}
+
+static void *conn_thread(void *arg) {
+    const bench_config_t *cfg = arg;
+    int fd = connect_tcp(cfg->host, cfg->port);
+    uint8_t *buf = malloc(RECV_BUF);
+    if(fd < 0 || !buf) {
+        if(fd >= 0) close(fd);
+        free(buf);
+        return NULL;
+    }
+
+    uint32_t next_id = (uint32_t)(uintptr_t)&next_id % cfg->devices;
+    size_t have = 0;
+    if(send_gets(fd, cfg->depth, &next_id, cfg->devices) < 0) {
+        perror("send");
+        goto out;
+    }
+    while(!atomic_load_explicit(&g_stop, memory_order_relaxed)) {
+        ssize_t n = recv(fd, buf + have, RECV_BUF - have, 0);
+        if(n <= 0) {
+            if(n < 0) perror("recv");
+            break;
+        }
+        have += (size_t)n;
+
+        // Count complete responses and keep the partial tail.
+        size_t off = 0;
+        int done = 0;
+        while(have - off >= sizeof(tlv_header_t)) {
+            uint16_t len_net;
+            memcpy(&len_net, buf + off + 2, sizeof(len_net));
+            size_t frame = sizeof(tlv_header_t) + ntohs(len_net);
+            if(have - off < frame) {
+                break;
+            }
+            off += frame;
+            done++;
+        }
+        memmove(buf, buf + off, have - off);
+        have -= off;
+
+        atomic_fetch_add_explicit(&g_responses, (uint64_t)done, memory_order_relaxed);
+        if(done > 0 && send_gets(fd, done, &next_id, cfg->devices) < 0) {
+            perror("send");
+            break;
+        }
+    }
+
+out:
+    free(buf);
+    close(fd);
+    return NULL;
+}
@@ -0,0 +1,425 @@
+// Microbenchmarks of the TLV codec and framing layer: ns per operation and
+// throughput of tlv_encode_buf/tlv_decode_buf/tlv_writer_put over a range
+// of payload sizes, parsing of back-to-back frames from one buffer, and
+// frames per second through a socketpair and a pipe, one send_tlv/recv_tlv
+// per frame or batched through tlv_writer/tlv_reader. No server needed.
+
+#include "protocol.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_CASE_MS 300
+#define PARSE_BUFFER_SIZE (1024 * 1024)
+// Batched framing writes once this much is queued.
+#define BATCH_BYTES (64 * 1024)
+#define MAX_RESULTS 128
+// Sent by the framing writer after its last frame.
+#define TYPE_END 0xffff
+
+typedef struct {
+    const char *name;
+    const char *transport;
+    size_t payload;
+    double ns_per_op;
+    double ops_per_s;
+    double mb_per_s;
+} result_t;
+
+typedef struct {
+    uint8_t *buf;       // frames or scratch space
+    size_t buf_size;
+    const uint8_t *payload;
+    uint16_t len;
+    size_t frames;      // back-to-back frames in buf
+    tlv_reader_t reader;
+    tlv_writer_t writer;
+} codec_ctx_t;
+
+typedef struct {
+    int fd;
+    uint16_t len;
+    int batched;
+    const uint8_t *payload;
+} framing_writer_t;
+
+typedef void (*bench_fn_t)(codec_ctx_t *ctx, uint64_t iters);
+
+static const size_t g_codec_sizes[] = { 0, 4, 10, 64, 256, 1024, 4096, 16384, 65535 };
+static const size_t g_parse_sizes[] = { 4, 10, 64, 256 };
+static const size_t g_framing_sizes[] = { 16, 256, 4096, 65535 };
+
+static unsigned g_case_ms = DEFAULT_CASE_MS;
+static result_t g_results[MAX_RESULTS];
+static int g_result_count;
+static atomic_int g_stop_writer;
+static volatile uint64_t g_sink;
+
+static uint64_t now_ns(void);
+static void record(const char *name, const char *transport, size_t payload, uint64_t ops, uint64_t bytes, uint64_t ns);
+static void run_codec_case(const char *name, size_t payload, size_t bytes_per_op, bench_fn_t fn, codec_ctx_t *ctx);
+static void bench_encode(codec_ctx_t *ctx, uint64_t iters);
+static void bench_decode(codec_ctx_t *ctx, uint64_t iters);
+static void bench_writer_put(codec_ctx_t *ctx, uint64_t iters);
+static void bench_parse_decode(codec_ctx_t *ctx, uint64_t iters);
+static void bench_parse_reader(codec_ctx_t *ctx, uint64_t iters);
+static int run_framing(const char *transport, int batched, uint16_t len, const uint8_t *payload);
+static void *framing_writer(void *arg);
+static int write_all(int fd, const uint8_t *buf, size_t len);
+static int write_json(const char *path);
+
+int main(int argc, char *argv[]) {
+    const char *json_path = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "t:j:h")) != -1) {
+        switch(opt) {
+            case 't': g_case_ms = (unsigned)strtoul(optarg, NULL, 10); break;
+            case 'j': json_path = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-t ms_per_case] [-j json_file|-]\n", argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(g_case_ms == 0) {
+        fprintf(stderr, "invalid arguments\n");
+        return 1;
+    }
+
+    codec_ctx_t ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.buf_size = PARSE_BUFFER_SIZE;
+    ctx.buf = malloc(ctx.buf_size);
+    uint8_t *payload = malloc(UINT16_MAX);
+    if(!ctx.buf || !payload || tlv_reader_init(&ctx.reader, PARSE_BUFFER_SIZE, PARSE_BUFFER_SIZE) < 0) {
+        fprintf(stderr, "allocation failed\n");
+        return 1;
+    }
+    for(size_t i = 0; i < UINT16_MAX; i++) {
+        payload[i] = (uint8_t)(i * 31u);
+    }
+    ctx.payload = payload;
+    tlv_writer_init(&ctx.writer);
+
+    printf("%-18s %-10s %8s %12s %14s %12s\n", "case", "transport", "payload", "ns/op", "ops/s", "MB/s");
+
+    for(size_t i = 0; i < sizeof(g_codec_sizes) / sizeof(g_codec_sizes[0]); i++) {
+        ctx.len = (uint16_t)g_codec_sizes[i];
+        run_codec_case("encode", ctx.len, sizeof(tlv_header_t) + ctx.len, bench_encode, &ctx);
+    }
+    // Decoding reads only the header and hands out a pointer to the payload,
+    // so its MB/s counts header bytes.
+    for(size_t i = 0; i < sizeof(g_codec_sizes) / sizeof(g_codec_sizes[0]); i++) {
+        ctx.len = (uint16_t)g_codec_sizes[i];
+        tlv_encode_buf(ctx.buf, ctx.buf_size, TLV_TYPE_GET_RESPONSE, payload, ctx.len, NULL);
+        run_codec_case("decode", ctx.len, sizeof(tlv_header_t), bench_decode, &ctx);
+    }
+    for(size_t i = 0; i < sizeof(g_codec_sizes) / sizeof(g_codec_sizes[0]); i++) {
+        ctx.len = (uint16_t)g_codec_sizes[i];
+        run_codec_case("writer_put", ctx.len, sizeof(tlv_header_t) + ctx.len, bench_writer_put, &ctx);
+    }
+
+    // Many frames back to back, as a pipelining client sends them.
+    for(size_t i = 0; i < sizeof(g_parse_sizes) / sizeof(g_parse_sizes[0]); i++) {
+        ctx.len = (uint16_t)g_parse_sizes[i];
+        size_t frame = sizeof(tlv_header_t) + ctx.len;
+        ctx.frames = ctx.buf_size / frame;
+        for(size_t f = 0; f < ctx.frames; f++) {
+            tlv_encode_buf(ctx.buf + f * frame, frame, TLV_TYPE_GET_REQUEST, payload, ctx.len, NULL);
+        }
+        run_codec_case("parse_decode", ctx.len, frame, bench_parse_decode, &ctx);
+
+        ctx.reader.head = ctx.reader.tail = 0;
+        if(tlv_reader_append(&ctx.reader, ctx.buf, ctx.frames * frame) != ctx.frames * frame) {
+            fprintf(stderr, "reader append failed\n");
+            return 1;
+        }
+        run_codec_case("parse_reader", ctx.len, frame, bench_parse_reader, &ctx);
+    }
+
+    for(size_t i = 0; i < sizeof(g_framing_sizes) / sizeof(g_framing_sizes[0]); i++) {
+        uint16_t len = (uint16_t)g_framing_sizes[i];
+        if(run_framing("socketpair", 0, len, payload) < 0 || run_framing("socketpair", 1, len, payload) < 0 ||
+           run_framing("pipe", 0, len, payload) < 0 || run_framing("pipe", 1, len, payload) < 0) {
+            return 1;
+        }
+    }
+
+    int rc = 0;
+    if(json_path && write_json(json_path) < 0) {
+        fprintf(stderr, "cannot write %s: %s\n", json_path, strerror(errno));
+        rc = 1;
+    }
+    tlv_reader_free(&ctx.reader);
+    tlv_writer_free(&ctx.writer);
+    free(ctx.buf);
+    free(payload);
+    return rc;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void record(const char *name, const char *transport, size_t payload, uint64_t ops, uint64_t bytes, uint64_t ns) {
+    result_t r = {
+        .name = name,
+        .transport = transport,
+        .payload = payload,
+        .ns_per_op = (double)ns / (double)ops,
+        .ops_per_s = (double)ops * 1e9 / (double)ns,
+        .mb_per_s = (double)bytes * 1e3 / (double)ns,
+    };
+    printf("%-18s %-10s %8zu %12.2f %14.0f %12.1f\n", r.name, r.transport, r.payload, r.ns_per_op, r.ops_per_s, r.mb_per_s);
+    if(g_result_count < MAX_RESULTS) {
+        g_results[g_result_count++] = r;
+    }
+}
+
+// Double the iteration count until a run takes a tenth of the case time,
+// then scale it to the full time.
+static void run_codec_case(const char *name, size_t payload, size_t bytes_per_op, bench_fn_t fn, codec_ctx_t *ctx) {
+    uint64_t target = (uint64_t)g_case_ms * 1000000ull;
+    uint64_t iters = 1024;
+    uint64_t ns = 0;
+    while(1) {
+        uint64_t t0 = now_ns();
+        fn(ctx, iters);
+        ns = now_ns() - t0;
+        if(ns >= target / 10) {
+            break;
+        }
+        iters *= 2;
+    }
+    iters = (uint64_t)((double)iters * (double)target / (double)(ns ? ns : 1));
+    if(iters == 0) {
+        iters = 1;
+    }
+    uint64_t t0 = now_ns();
+    fn(ctx, iters);
+    ns = now_ns() - t0;
+    record(name, "memory", payload, iters, iters * bytes_per_op, ns ? ns : 1);
+}
+
+static void bench_encode(codec_ctx_t *ctx, uint64_t iters) {
+    size_t out_len = 0;
+    for(uint64_t i = 0; i < iters; i++) {
+        tlv_encode_buf(ctx->buf, ctx->buf_size, TLV_TYPE_GET_RESPONSE, ctx->payload, ctx->len, &out_len);
+    }
+    g_sink = out_len + ctx->buf[0];
+}
+
+static void bench_decode(codec_ctx_t *ctx, uint64_t iters) {
+    uint64_t sum = 0;
+    for(uint64_t i = 0; i < iters; i++) {
+        uint16_t type = 0, len = 0;
+        const uint8_t *value = NULL;
+        tlv_decode_buf(ctx->buf, ctx->buf_size, &type, &value, &len);
+        sum += type + len + (uintptr_t)value;
+    }
+    g_sink = sum;
+}
+
+static void bench_writer_put(codec_ctx_t *ctx, uint64_t iters) {
+    for(uint64_t i = 0; i < iters; i++) {
+        tlv_writer_put(&ctx->writer, TLV_TYPE_GET_RESPONSE, ctx->payload, ctx->len);
+        // Drained as a flush would, without the syscall.
+        if(tlv_writer_pending(&ctx->writer) >= BATCH_BYTES) {
+            tlv_writer_consumed(&ctx->writer, tlv_writer_pending(&ctx->writer));
+        }
+    }
+    tlv_writer_consumed(&ctx->writer, tlv_writer_pending(&ctx->writer));
+}
+
+// One op is one frame; the buffer is walked as often as needed.
+static void bench_parse_decode(codec_ctx_t *ctx, uint64_t iters) {
+    uint64_t sum = 0;
+    size_t off = 0;
+    size_t end = ctx->frames * (sizeof(tlv_header_t) + ctx->len);
+    for(uint64_t i = 0; i < iters; i++) {
+        if(off == end) {
+            off = 0;
+        }
+        uint16_t type = 0, len = 0;
+        const uint8_t *value = NULL;
+        tlv_decode_buf(ctx->buf + off, end - off, &type, &value, &len);
+        off += sizeof(tlv_header_t) + len;
+        sum += type;
+    }
+    g_sink = sum;
+}
+
+static void bench_parse_reader(codec_ctx_t *ctx, uint64_t iters) {
+    uint64_t sum = 0;
+    for(uint64_t i = 0; i < iters; i++) {
+        uint16_t type = 0, len = 0;
+        const uint8_t *value = NULL;
+        if(tlv_reader_next(&ctx->reader, &type, &value, &len) != 1) {
+            ctx->reader.head = 0; // rewind over the same frames
+            tlv_reader_next(&ctx->reader, &type, &value, &len);
+        }
+        sum += type;
+    }
+    g_sink = sum;
+}
+
+// A writer thread streams frames of 'len' bytes for the case time and the
+// calling thread reads them back.
+static int run_framing(const char *transport, int batched, uint16_t len, const uint8_t *payload) {
+    int fds[2];
+    int rc = strcmp(transport, "pipe") == 0 ? pipe(fds) : socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    if(rc < 0) {
+        perror(transport);
+        return -1;
+    }
+
+    framing_writer_t w = { .fd = fds[1], .len = len, .batched = batched, .payload = payload };
+    atomic_store(&g_stop_writer, 0);
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, framing_writer, &w) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    uint8_t *buf = malloc(UINT16_MAX);
+    tlv_reader_t reader;
+    int have_reader = tlv_reader_init(&reader, BATCH_BYTES, TLV_MAX_FRAME) == 0;
+    int ok = buf != NULL && have_reader;
+    uint64_t frames = 0;
+    uint64_t t0 = now_ns();
+    uint64_t deadline = t0 + (uint64_t)g_case_ms * 1000000ull;
+    int done = !ok;
+    while(!done) {
+        if(batched) {
+            ssize_t n = tlv_reader_fill(&reader, fds[0]);
+            if(n <= 0) {
+                ok = 0;
+                break;
+            }
+            uint16_t type = 0, flen = 0;
+            const uint8_t *value = NULL;
+            while(tlv_reader_next(&reader, &type, &value, &flen) == 1) {
+                if(type == TYPE_END) {
+                    done = 1;
+                    break;
+                }
+                frames++;
+            }
+        } else {
+            uint16_t type = 0, flen = 0;
+            if(recv_tlv(fds[0], &type, buf, UINT16_MAX, &flen) != 0) {
+                ok = 0;
+                break;
+            }
+            if(type == TYPE_END) {
+                break;
+            }
+            frames++;
+        }
+        if((frames & 1023) == 0 && now_ns() >= deadline) {
+            atomic_store(&g_stop_writer, 1);
+        }
+    }
+    uint64_t ns = now_ns() - t0;
+    if(!ok) {
+        // Unblock a writer stuck on a full pipe or socket.
+        atomic_store(&g_stop_writer, 1);
+        close(fds[0]);
+        fds[0] = -1;
+    }
+    pthread_join(thread, NULL);
+
+    if(ok) {
+        record(batched ? "framing_batched" : "framing_send_recv", transport, len, frames,
+               frames * (sizeof(tlv_header_t) + len), ns);
+    } else {
+        fprintf(stderr, "%s framing failed\n", transport);
+    }
+    if(have_reader) {
+        tlv_reader_free(&reader);
+    }
+    free(buf);
+    if(fds[0] >= 0) close(fds[0]);
+    close(fds[1]);
+    return ok ? 0 : -1;
+}
+
+static void *framing_writer(void *arg) {
+    framing_writer_t *w = arg;
+    tlv_writer_t tx;
+    tlv_writer_init(&tx);
+
+    while(!atomic_load_explicit(&g_stop_writer, memory_order_relaxed)) {
+        if(!w->batched) {
+            if(send_tlv(w->fd, TLV_TYPE_GET_RESPONSE, w->payload, w->len) < 0) {
+                break;
+            }
+            continue;
+        }
+        while(tlv_writer_pending(&tx) < BATCH_BYTES) {
+            tlv_writer_put(&tx, TLV_TYPE_GET_RESPONSE, w->payload, w->len);
+        }
+        // write() rather than tlv_writer_flush(): send() fails on a pipe.
+        if(write_all(w->fd, tx.buf + tx.off, tlv_writer_pending(&tx)) < 0) {
+            break;
+        }
+        tlv_writer_consumed(&tx, tlv_writer_pending(&tx));
+    }
+    if(w->batched) {
+        tlv_writer_put(&tx, TYPE_END, NULL, 0);
+        write_all(w->fd, tx.buf + tx.off, tlv_writer_pending(&tx));
+    } else {
+        send_tlv(w->fd, TYPE_END, NULL, 0);
+    }
+    tlv_writer_free(&tx);
+    return NULL;
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t len) {
+    while(len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int write_json(const char *path) {
+    FILE *f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if(!f) {
+        return -1;
+    }
+    fprintf(f, "[");
+    for(int i = 0; i < g_result_count; i++) {
+        const result_t *r = &g_results[i];
+        fprintf(f, "%s\n  {\"case\": \"%s\", \"transport\": \"%s\", \"payload\": %zu, \"ns_per_op\": %.3f, "
+                   "\"ops_per_s\": %.1f, \"mb_per_s\": %.2f}",
+                i ? "," : "", r->name, r->transport, r->payload, r->ns_per_op, r->ops_per_s, r->mb_per_s);
+    }
+    fprintf(f, "\n]\n");
+    int failed = ferror(f);
+    if(f != stdout) {
+        failed |= fclose(f) != 0;
+    } else {
+        fflush(f);
+    }
+    return failed ? -1 : 0;
+}
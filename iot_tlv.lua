@@ -15,6 +15,25 @@ local TLV_NAMES = {
   [0x0014] = "GET_RESPONSE",
   [0x0015] = "SET_REQUEST",
   [0x0016] = "SET_RESPONSE",
+  [0x0017] = "MULTI_GET_REQUEST",
+  [0x0018] = "MULTI_GET_RESPONSE",
+  [0x0019] = "MULTI_SET_REQUEST",
+  [0x001A] = "MULTI_SET_RESPONSE",
+  [0x001B] = "LIST_CHUNK",
+  [0x001C] = "LIST_END",
+  [0x001D] = "LIST_SINCE_REQUEST",
+  [0x001E] = "LIST_FILTER_REQUEST",
+  [0x0020] = "SUBSCRIBE_REQUEST",
+  [0x0021] = "SUBSCRIBE_RESPONSE",
+  [0x0022] = "STATUS_UPDATE",
+  [0x0023] = "UNSUBSCRIBE_REQUEST",
+  [0x0030] = "HISTORY_REQUEST",
+  [0x0031] = "HISTORY_RESPONSE",
+  [0x0032] = "AGGREGATE_REQUEST",
+  [0x0033] = "AGGREGATE_RESPONSE",
+  [0x0040] = "TELEMETRY",
+  [0x0050] = "STATS_REQUEST",
+  [0x0051] = "STATS_RESPONSE",
 }
 
 function p_iot.dissector(tvbuf, pinfo, tree)
@@ -63,3 +82,4 @@ end
 
 DissectorTable.get("tcp.port"):add(5001, p_iot)
 DissectorTable.get("udp.port"):add(5000, p_iot)
+DissectorTable.get("udp.port"):add(5002, p_iot)
@@ -1,22 +1,24 @@
-#include "protocol.h"
+#include "iotclient.h"
 
-#include <bits/types/struct_timeval.h>
+#include <errno.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include <poll.h>
 #include <unistd.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netdb.h>
 #include <arpa/inet.h>
+#include <endian.h>
 
 
-#define DISCOVERY_MCAST_ADDR "239.0.0.1"
-#define DISCOVERY_PORT 5000
-#define RX_BUFF_SIZE 1024
-#define LINE_BUFF_SIZE 256
+#define DISCOVERY_TIMEOUT_MS 5000
+#define DISCOVERY_MAX_SERVERS 64
+#define LINE_BUFF_SIZE 1024
+#define CMD_MAX_ITEMS 4096
+#define PIPELINE_WINDOW 256
 
 
 typedef enum {
@@ -25,17 +27,59 @@ typedef enum {
     CMD_LIST,
     CMD_GET,
     CMD_SET,
+    CMD_MGET,
+    CMD_MSET,
+    CMD_WATCH,
+    CMD_HISTORY,
+    CMD_AGGREGATE,
+    CMD_STATS,
     CMD_EXIT
 } command_type_t;
 
 
 typedef struct {
     command_type_t type;
-    uint32_t id;
-    float temp;
+    size_t count;
+    int has_since;
+    uint64_t since; // list: generation to list changes after
+    uint32_t window_s; // history: how far back to look
+    uint32_t bucket_s; // history: bucket width, 0 = raw samples
+    int has_filter;
+    uint8_t status_mask; // list / aggregate: filter, aggregate: histogram range
+    uint8_t battery_min;
+    uint8_t battery_max;
+    float temp_min;
+    float temp_max;
+    float hist_lo;
+    float hist_hi;
+    uint32_t ids[CMD_MAX_ITEMS];
+    float temps[CMD_MAX_ITEMS];
 } command_t;
 
 
+// State shared by the reply callbacks of one command. It outlives the
+// command so that callbacks run by a later poll or iot_client_destroy()
+// never see a dead stack frame.
+typedef struct {
+    const command_t *cmd;
+    size_t done;          // devices answered for, in request order
+    size_t found;         // get: devices found, mset: devices updated
+    size_t received;      // list/history: records printed, watch: updates
+    uint64_t generation;  // list: from LIST_END
+    int64_t resume_ms;    // history: from_ms of the follow-up, 0 when complete
+    uint32_t resume_skip; // ... and the samples at resume_ms it leaves out
+    int accepted;         // watch: subscription accepted, history: device known
+    int failed;           // a request failed; reported once
+} reply_ctx_t;
+
+
+typedef struct {
+    int up;
+    int seen; // first connection attempt finished
+    int err;
+} link_state_t;
+
+
 static void trim_newline(char *str);
 static char *skip_spaces(char *str);
 static char *next_token(char **strp);
@@ -45,32 +89,77 @@ static void print_device(const device_status_t *dev);
 static void print_help(void);
 
 static int parse_command(char *line, command_t *cmd);
-
-static int cmd_list(int fd);
-static int cmd_get(int fd, uint32_t id);
-static int cmd_set(int fd, uint32_t id, float temp);
-
-static int recv_expect(int fd, uint16_t expected_type, void *buf, uint16_t bufsize, uint16_t *out_len);
-
-static int discover_server(char *out_ip, size_t ip_size, uint16_t *out_port);
-
-static int connect_to_server(const char *ip, const char *port);
+static int parse_filter(char *p, command_t *cmd, int with_hist);
+static int parse_float_range(const char *str, float *lo, float *hi);
+
+static int cmd_list(iot_client_t *client, reply_ctx_t *reply);
+static int cmd_get(iot_client_t *client, reply_ctx_t *reply);
+static int cmd_set(iot_client_t *client, reply_ctx_t *reply);
+static int cmd_multi_get(iot_client_t *client, reply_ctx_t *reply);
+static int cmd_multi_set(iot_client_t *client, reply_ctx_t *reply);
+static int cmd_watch(iot_client_t *client, reply_ctx_t *reply);
+static int cmd_history(iot_client_t *client, reply_ctx_t *reply);
+static int cmd_aggregate(iot_client_t *client, reply_ctx_t *reply);
+static int cmd_stats(iot_client_t *client, reply_ctx_t *reply);
+static const char *request_name(uint16_t type);
+static void print_server(const iot_server_info_t *s);
+
+static void on_list(void *arg, const iot_response_t *resp);
+static void on_get(void *arg, const iot_response_t *resp);
+static void on_set(void *arg, const iot_response_t *resp);
+static void on_multi_get(void *arg, const iot_response_t *resp);
+static void on_multi_set(void *arg, const iot_response_t *resp);
+static void on_subscribe(void *arg, const iot_response_t *resp);
+static void on_update(void *arg, const device_status_t *devs, size_t count);
+static void on_history(void *arg, const iot_response_t *resp);
+static void on_aggregate(void *arg, const iot_response_t *resp);
+static void on_stats(void *arg, const iot_response_t *resp);
+static void on_connection(void *arg, unsigned index, int up, int err);
+
+static int reply_ok(reply_ctx_t *reply, const iot_response_t *resp, uint16_t request);
+static void reply_invalid(reply_ctx_t *reply, const iot_response_t *resp);
+static int wait_for_room(iot_client_t *client, uint16_t request);
+static int wait_idle(iot_client_t *client);
 
 int client_run(void) {
 
-    char ip[INET_ADDRSTRLEN];
-    uint16_t port = 0;
-
-    if(discover_server(ip, sizeof(ip), &port) < 0) {
-        printf("[client] server discovery failed\n");
+    printf("Searching for server...\n");
+    static iot_server_info_t servers[DISCOVERY_MAX_SERVERS];
+    int found = iot_client_discover_all(servers, DISCOVERY_MAX_SERVERS, DISCOVERY_TIMEOUT_MS,
+                                        IOT_CLIENT_DISCOVER_WINDOW_MS);
+    if(found < 0) {
+        printf("[client] server discovery failed: %s\n", strerror(errno));
         return 1;
     }
-
-    char port_str[16];
-    snprintf(port_str, sizeof(port_str), "%u", port);
-
-    int fd = connect_to_server(ip, port_str);
-    if(fd < 0) {
+    for(int i = 0; found > 1 && i < found; i++) {
+        print_server(&servers[i]);
+    }
+    const iot_server_info_t *server = &servers[iot_client_pick_server(servers, (size_t)found)];
+    printf("Found server at %s:%u\n", server->host, server->port);
+
+    iot_client_config_t cfg = {
+        .host = server->host,
+        .port = server->port,
+        .connections = 1, // keeps replies in the order the commands print them
+        .max_inflight = PIPELINE_WINDOW,
+    };
+    iot_client_t *client = iot_client_create(&cfg);
+    if(!client) {
+        printf("[client] cannot create client: %s\n", strerror(errno));
+        return 1;
+    }
+    link_state_t link = { 0 };
+    iot_client_on_connection(client, on_connection, &link);
+    while(!link.seen) {
+        if(iot_client_poll(client, -1) < 0) {
+            printf("[client] poll failed: %s\n", strerror(errno));
+            iot_client_destroy(client);
+            return 1;
+        }
+    }
+    if(!link.up) {
+        printf("[client] connect failed: %s\n", strerror(link.err));
+        iot_client_destroy(client);
         return 1;
     }
 
@@ -78,6 +167,8 @@ int client_run(void) {
     print_help();
 
     char line[LINE_BUFF_SIZE];
+    static command_t cmd;
+    reply_ctx_t reply;
 
     while(1) {
         printf("> ");
@@ -89,7 +180,6 @@ int client_run(void) {
         }
         trim_newline(line);
 
-        command_t cmd;
         int prc = parse_command(line, &cmd);
 
         if(prc == 0 && cmd.type == CMD_NONE) {
@@ -104,6 +194,15 @@ int client_run(void) {
             continue;
         }
 
+        // Catch up on anything that happened while waiting for input, such
+        // as a reconnect that has become due.
+        if(iot_client_poll(client, 0) < 0) {
+            printf("[client] poll failed: %s\n", strerror(errno));
+            break;
+        }
+        memset(&reply, 0, sizeof(reply));
+        reply.cmd = &cmd;
+
         int rc = 0;
 
         switch(cmd.type) {
@@ -111,31 +210,47 @@ int client_run(void) {
                 print_help();
                 break;
             case CMD_LIST:
-                rc = cmd_list(fd);
+                rc = cmd_list(client, &reply);
                 break;
             case CMD_GET:
-                rc = cmd_get(fd, cmd.id);
+                rc = cmd_get(client, &reply);
                 break;
             case CMD_SET:
-                rc = cmd_set(fd, cmd.id, cmd.temp);
+                rc = cmd_set(client, &reply);
+                break;
+            case CMD_MGET:
+                rc = cmd_multi_get(client, &reply);
+                break;
+            case CMD_MSET:
+                rc = cmd_multi_set(client, &reply);
+                break;
+            case CMD_WATCH:
+                rc = cmd_watch(client, &reply);
+                break;
+            case CMD_HISTORY:
+                rc = cmd_history(client, &reply);
+                break;
+            case CMD_AGGREGATE:
+                rc = cmd_aggregate(client, &reply);
+                break;
+            case CMD_STATS:
+                rc = cmd_stats(client, &reply);
                 break;
             case CMD_EXIT:
                 printf("[client] exiting on user request\n");
-                close(fd);
+                iot_client_destroy(client);
                 return 0;
                 break;
             default:
                 break;
         }
 
-        if(rc == 1) {
-            break;
-        } else if(rc < 0) {
+        if(rc < 0) {
             printf("[client] command failed\n");
             break;
         }
     }
-    close(fd);
+    iot_client_destroy(client);
     return 0;
 }
 
@@ -178,16 +293,32 @@ static void print_device(const device_status_t *dev) {
 
 static void print_help(void) {
     printf("Available commands:\n");
-    printf("  list             - show all devices\n");
-    printf("  get <id>         - show details of selected device\n");
-    printf("  set <id> <temp>  - set temperature of selected device\n");
+    printf("  list [<gen>]     - show all devices, or only those changed after\n");
+    printf("                     generation <gen> (printed by the previous list)\n");
+    printf("  list [status=<s>[,<s>...]] [battery=<min>-<max>] [temp=<min>:<max>]\n");
+    printf("                   - show only the matching devices\n");
+    printf("  get <id> [...]   - show details of selected devices (ids or ranges like 1-100)\n");
+    printf("  set <id> <temp> [<id> <temp> ...]\n");
+    printf("                   - set temperature of selected devices\n");
+    printf("  mget / mset      - like get / set, using one batch request per %d devices\n", TLV_MULTI_MAX_ITEMS);
+    printf("  watch [<id> ...] - print changes to all or selected devices as they happen,\n");
+    printf("                     until Enter is pressed\n");
+    printf("  history <id> [<seconds> [<bucket>]]\n");
+    printf("                   - temperature samples of the last <seconds> (default 3600),\n");
+    printf("                     or min/max/avg per <bucket> seconds\n");
+    printf("  aggregate [status=<s>[,<s>...]] [battery=<min>-<max>] [temp=<min>:<max>]\n");
+    printf("            [hist=<lo>:<hi>]\n");
+    printf("                   - count, temperature stats and histograms of matching\n");
+    printf("                     devices; <s> is offline, online, error or a number\n");
+    printf("  stats            - server request counts, latency percentiles and traffic\n");
     printf("  help             - show this help\n");
     printf("  exit / quit      - close connection and exit\n");
 }
 
 static int parse_command(char *line, command_t *cmd) {
-    memset(cmd, 0, sizeof(*cmd));
     cmd->type = CMD_NONE;
+    cmd->count = 0;
+    cmd->has_since = 0;
 
     char *p = line;
     char *token = next_token(&p);
@@ -199,124 +330,315 @@ static int parse_command(char *line, command_t *cmd) {
     }
     if(strcmp(token, "list") == 0) {
         cmd->type = CMD_LIST;
+        char *rest = skip_spaces(p);
+        if(memchr(rest, '=', strcspn(rest, " \t"))) {
+            return parse_filter(rest, cmd, 0);
+        }
+        cmd->has_filter = 0;
+        char *gen_str = next_token(&p);
+        if(gen_str) {
+            char *end = NULL;
+            cmd->since = strtoull(gen_str, &end, 10);
+            if(*end != '\0') {
+                return -1;
+            }
+            cmd->has_since = 1;
+        }
         return 0;
     }
+    if(strcmp(token, "stats") == 0) {
+        cmd->type = CMD_STATS;
+        return next_token(&p) ? -1 : 0;
+    }
     if(strcmp(token, "exit") == 0 || strcmp(token, "quit") == 0) {
         cmd->type = CMD_EXIT;
         return 0;
     }
-    if(strcmp(token, "get") == 0) {
-        char *id_str = next_token(&p);
-        if(!id_str) {
+    if(strcmp(token, "history") == 0) {
+        char *args[3] = { next_token(&p), next_token(&p), next_token(&p) };
+        unsigned long values[3] = { 0, 3600, 0 };
+        if(!args[0] || next_token(&p)) {
             return -1;
         }
-        uint32_t id = (uint32_t)strtoul(id_str, NULL, 10);
-        cmd->type = CMD_GET;
-        cmd->id = id;
+        for(int i = 0; i < 3 && args[i]; i++) {
+            char *end = NULL;
+            values[i] = strtoul(args[i], &end, 10);
+            if(*end != '\0' || values[i] > UINT32_MAX) {
+                return -1;
+            }
+        }
+        cmd->ids[0] = (uint32_t)values[0];
+        cmd->window_s = (uint32_t)values[1];
+        cmd->bucket_s = (uint32_t)values[2];
+        cmd->type = CMD_HISTORY;
         return 0;
     }
-    if(strcmp(token, "set") == 0) {
-        char *id_str = next_token(&p);
-        char *temp_str = next_token(&p);
-        if(!id_str || !temp_str) {
+    if(strcmp(token, "aggregate") == 0 || strcmp(token, "agg") == 0) {
+        cmd->type = CMD_AGGREGATE;
+        return parse_filter(p, cmd, 1);
+    }
+    int watch = (strcmp(token, "watch") == 0);
+    if(strcmp(token, "get") == 0 || strcmp(token, "mget") == 0 || watch) {
+        char *id_str;
+        while((id_str = next_token(&p)) != NULL) {
+            char *end = NULL;
+            uint32_t first = (uint32_t)strtoul(id_str, &end, 10);
+            uint32_t last = first;
+            if(*end == '-') {
+                last = (uint32_t)strtoul(end + 1, NULL, 10);
+            }
+            if(last < first || last - first >= CMD_MAX_ITEMS - cmd->count) {
+                return -1;
+            }
+            for(uint32_t id = first; ; id++) {
+                cmd->ids[cmd->count++] = id;
+                if(id == last) break;
+            }
+        }
+        if(watch) {
+            cmd->type = CMD_WATCH; // no ids follows every device
+            return 0;
+        }
+        if(cmd->count == 0) {
             return -1;
         }
-
-        uint32_t id = (uint32_t)strtoul(id_str, NULL, 10);
-        float temp = strtof(temp_str, NULL);
-        cmd->type = CMD_SET;
-        cmd->id = id;
-        cmd->temp = temp;
+        cmd->type = (token[0] == 'm') ? CMD_MGET : CMD_GET;
+        return 0;
+    }
+    if(strcmp(token, "set") == 0 || strcmp(token, "mset") == 0) {
+        char *id_str, *temp_str;
+        while((id_str = next_token(&p)) != NULL) {
+            temp_str = next_token(&p);
+            if(!temp_str || cmd->count == CMD_MAX_ITEMS) {
+                return -1;
+            }
+            cmd->ids[cmd->count] = (uint32_t)strtoul(id_str, NULL, 10);
+            cmd->temps[cmd->count] = strtof(temp_str, NULL);
+            cmd->count++;
+        }
+        if(cmd->count == 0) {
+            return -1;
+        }
+        cmd->type = (token[0] == 'm') ? CMD_MSET : CMD_SET;
         return 0;
     }
 
     return -2; // unknown command
 }
 
-static int cmd_list(int fd) {
-    int status = send_tlv(fd, TLV_TYPE_LIST_REQUEST, NULL, 0);
-    if (status < 0) {
-        printf("[client] send_tlv LIST_REQUEST failed\n");
-        return -1;
+// Devices are printed chunk by chunk as they arrive, so memory use stays
+// at one frame no matter how large the fleet is.
+// key=value filters of the list and aggregate commands; the server's
+// defaults apply to anything left out. hist= is only accepted 'with_hist'.
+static int parse_filter(char *p, command_t *cmd, int with_hist) {
+    static const char *status_names[] = { "offline", "online", "error" };
+
+    cmd->has_filter = 0;
+    cmd->status_mask = 0;
+    cmd->battery_min = 0;
+    cmd->battery_max = UINT8_MAX;
+    cmd->temp_min = -INFINITY;
+    cmd->temp_max = INFINITY;
+    cmd->hist_lo = TLV_AGGREGATE_DEFAULT_HIST_LO;
+    cmd->hist_hi = TLV_AGGREGATE_DEFAULT_HIST_HI;
+
+    char *token;
+    while((token = next_token(&p)) != NULL) {
+        char *value = strchr(token, '=');
+        if(!value) {
+            return -1;
+        }
+        *value++ = '\0';
+        cmd->has_filter = 1;
+
+        if(strcmp(token, "status") == 0) {
+            char *save = NULL;
+            for(char *name = strtok_r(value, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+                int s = -1;
+                for(int i = 0; i < 3; i++) {
+                    if(strcmp(name, status_names[i]) == 0) s = i;
+                }
+                if(s < 0) {
+                    char *end = NULL;
+                    unsigned long v = strtoul(name, &end, 10);
+                    if(*end != '\0' || v > 7) {
+                        return -1;
+                    }
+                    s = (int)v;
+                }
+                cmd->status_mask |= (uint8_t)(1u << s);
+            }
+        } else if(strcmp(token, "battery") == 0) {
+            char *end = NULL;
+            unsigned long lo = strtoul(value, &end, 10);
+            unsigned long hi = lo;
+            if(*end == '-') {
+                hi = strtoul(end + 1, &end, 10);
+            }
+            if(*end != '\0' || lo > hi || hi > UINT8_MAX) {
+                return -1;
+            }
+            cmd->battery_min = (uint8_t)lo;
+            cmd->battery_max = (uint8_t)hi;
+        } else if(strcmp(token, "temp") == 0) {
+            if(parse_float_range(value, &cmd->temp_min, &cmd->temp_max) < 0) {
+                return -1;
+            }
+        } else if(strcmp(token, "hist") == 0 && with_hist) {
+            if(parse_float_range(value, &cmd->hist_lo, &cmd->hist_hi) < 0 || cmd->hist_lo >= cmd->hist_hi) {
+                return -1;
+            }
+        } else {
+            return -1;
+        }
     }
+    return 0;
+}
 
-    uint8_t rx[RX_BUFF_SIZE];
-    uint16_t len = 0;
-
-    status = recv_expect(fd, TLV_TYPE_LIST_RESPONSE, rx, sizeof(rx), &len);
-    if (status != 0) return status;
-
-    if(len % sizeof(device_status_t) != 0) {
-        printf("[client] invalid LIST_RESPONSE length=%u\n", len);
+// "<lo>:<hi>", either side may be empty to leave that bound open.
+static int parse_float_range(const char *str, float *lo, float *hi) {
+    const char *colon = strchr(str, ':');
+    if(!colon) {
         return -1;
     }
-
-    size_t count = len / sizeof(device_status_t);
-    printf("[client] received %zu devices:\n", count);
-
-    device_status_t *devs = (device_status_t *)rx;
-    for(size_t i = 0; i < count; ++i) {
-        print_device(&devs[i]);
+    char *end = NULL;
+    if(colon != str) {
+        *lo = strtof(str, &end);
+        if(end != colon) {
+            return -1;
+        }
     }
-    return 0;
+    if(colon[1] != '\0') {
+        *hi = strtof(colon + 1, &end);
+        if(*end != '\0') {
+            return -1;
+        }
+    }
+    return (*lo <= *hi) ? 0 : -1;
 }
 
-static int cmd_get(int fd, uint32_t id) {
-    uint32_t id_net = htonl(id);
-    int status = send_tlv(fd, TLV_TYPE_GET_REQUEST, &id_net, sizeof(id_net));
+static int cmd_list(iot_client_t *client, reply_ctx_t *reply) {
+    const command_t *cmd = reply->cmd;
+    int status;
+    if(cmd->has_filter) {
+        status = iot_client_list_filter(client, cmd->status_mask, cmd->battery_min, cmd->battery_max,
+                                        cmd->temp_min, cmd->temp_max, on_list, reply);
+    } else if(cmd->has_since) {
+        status = iot_client_list_since(client, cmd->since, on_list, reply);
+    } else {
+        status = iot_client_list(client, on_list, reply);
+    }
     if(status < 0) {
-        printf("[client] send_tlv GET_REQUEST failed\n");
+        printf("[client] LIST_REQUEST failed: %s\n", strerror(errno));
+        return 0;
+    }
+    if(wait_idle(client) < 0) {
         return -1;
     }
+    if(!reply->failed) {
+        printf("[client] received %zu devices, generation %llu\n", reply->received,
+               (unsigned long long)reply->generation);
+    }
+    return 0;
+}
 
-    uint8_t rx[RX_BUFF_SIZE];
-    uint16_t len = 0;
-
-    status = recv_expect(fd, TLV_TYPE_GET_RESPONSE, rx, sizeof(rx), &len);
-    if (status != 0) return status;
+static void on_list(void *arg, const iot_response_t *resp) {
+    reply_ctx_t *reply = arg;
+    if(!reply_ok(reply, resp, TLV_TYPE_LIST_REQUEST) || reply->failed) {
+        return;
+    }
+    if(resp->type == TLV_TYPE_LIST_END) {
+        if(resp->len >= sizeof(uint32_t) + sizeof(uint64_t)) {
+            uint64_t generation_net;
+            memcpy(&generation_net, resp->value + sizeof(uint32_t), sizeof(generation_net));
+            reply->generation = be64toh(generation_net);
+        }
+        return;
+    }
+    if(resp->len < sizeof(uint32_t) || (resp->len - sizeof(uint32_t)) % sizeof(device_status_t) != 0) {
+        reply_invalid(reply, resp);
+        return;
+    }
 
-    if(len == 0) {
-        printf("[client] device %u not found\n", id);
-        return 0;
+    size_t chunk = (resp->len - sizeof(uint32_t)) / sizeof(device_status_t);
+    for(size_t i = 0; i < chunk; ++i) {
+        device_status_t dev;
+        memcpy(&dev, resp->value + sizeof(uint32_t) + i * sizeof(dev), sizeof(dev));
+        print_device(&dev);
     }
+    reply->received += chunk;
+}
 
-    if(len != sizeof(device_status_t)) {
-        printf("[client] invalid GET_RESPONSE length=%u\n", len);
+// Up to PIPELINE_WINDOW requests are in flight at once; replies come back in
+// request order and are printed as they arrive.
+static int cmd_get(iot_client_t *client, reply_ctx_t *reply) {
+    const command_t *cmd = reply->cmd;
+    for(size_t i = 0; i < cmd->count; i++) {
+        while(iot_client_get(client, cmd->ids[i], on_get, reply) < 0) {
+            if(wait_for_room(client, TLV_TYPE_GET_REQUEST) < 0) {
+                goto drain;
+            }
+        }
+    }
+drain:
+    if(wait_idle(client) < 0) {
         return -1;
     }
-
-    device_status_t dev;
-    memcpy(&dev, rx, sizeof(dev));
-    printf("[client] device details:\n");
-    print_device(&dev);
+    if(cmd->count > 1) {
+        printf("[client] %zu of %zu devices found\n", reply->found, cmd->count);
+    }
     return 0;
 }
 
-static int cmd_set(int fd, uint32_t id, float temp) {
-    uint32_t payload[2];
-    payload[0] = htonl(id);
-    uint32_t temp_bits;
-    memcpy(&temp_bits, &temp, sizeof(float));
-    payload[1] = htonl(temp_bits);
-
-    int status = send_tlv(fd, TLV_TYPE_SET_REQUEST, payload, sizeof(payload));
-    if(status < 0) {
-        printf("[client] send_tlv SET_REQUEST failed\n");
-        return -1;
+static void on_get(void *arg, const iot_response_t *resp) {
+    reply_ctx_t *reply = arg;
+    uint32_t id = reply->cmd->ids[reply->done++];
+    if(!reply_ok(reply, resp, TLV_TYPE_GET_REQUEST)) {
+        return;
+    }
+    if(resp->len == 0) {
+        printf("[client] device %u not found\n", id);
+        return;
+    }
+    if(resp->len != sizeof(device_status_t)) {
+        reply_invalid(reply, resp);
+        return;
     }
 
-    uint8_t rx[RX_BUFF_SIZE];
-    uint16_t len = 0;
+    device_status_t dev;
+    memcpy(&dev, resp->value, sizeof(dev));
+    if(reply->cmd->count == 1) {
+        printf("[client] device details:\n");
+    }
+    print_device(&dev);
+    reply->found++;
+}
 
-    status = recv_expect(fd, TLV_TYPE_SET_RESPONSE, rx, sizeof(rx), &len);
-    if (status != 0) return status;
+static int cmd_set(iot_client_t *client, reply_ctx_t *reply) {
+    const command_t *cmd = reply->cmd;
+    for(size_t i = 0; i < cmd->count; i++) {
+        while(iot_client_set(client, cmd->ids[i], cmd->temps[i], on_set, reply) < 0) {
+            if(wait_for_room(client, TLV_TYPE_SET_REQUEST) < 0) {
+                goto drain;
+            }
+        }
+    }
+drain:
+    return wait_idle(client);
+}
 
-    if(len != 1) {
-        printf("[client] invalid SET_RESPONSE length=%u\n", len);
-        return -1;
+static void on_set(void *arg, const iot_response_t *resp) {
+    reply_ctx_t *reply = arg;
+    uint32_t id = reply->cmd->ids[reply->done++];
+    if(!reply_ok(reply, resp, TLV_TYPE_SET_REQUEST)) {
+        return;
+    }
+    if(resp->len != 1) {
+        reply_invalid(reply, resp);
+        return;
     }
 
-    uint8_t code = rx[0];
+    uint8_t code = resp->value[0];
     if(code == 0) {
         printf("[client] SET successful for device %u\n", id);
     } else if(code == 1) {
@@ -326,128 +648,442 @@ static int cmd_set(int fd, uint32_t id, float temp) {
     } else {
         printf("[client] SET failed: unknown error code %u\n", code);
     }
+}
 
+static int cmd_multi_get(iot_client_t *client, reply_ctx_t *reply) {
+    const command_t *cmd = reply->cmd;
+    for(size_t base = 0; base < cmd->count; base += TLV_MULTI_MAX_ITEMS) {
+        size_t batch = (cmd->count - base < TLV_MULTI_MAX_ITEMS) ? cmd->count - base : TLV_MULTI_MAX_ITEMS;
+        while(iot_client_multi_get(client, cmd->ids + base, batch, on_multi_get, reply) < 0) {
+            if(wait_for_room(client, TLV_TYPE_MULTI_GET_REQUEST) < 0) {
+                goto drain;
+            }
+        }
+    }
+drain:
+    if(wait_idle(client) < 0) {
+        return -1;
+    }
+    printf("[client] %zu of %zu devices found\n", reply->found, cmd->count);
     return 0;
+}
+
+static void on_multi_get(void *arg, const iot_response_t *resp) {
+    reply_ctx_t *reply = arg;
+    size_t base = reply->done;
+    size_t batch = (reply->cmd->count - base < TLV_MULTI_MAX_ITEMS) ? reply->cmd->count - base : TLV_MULTI_MAX_ITEMS;
+    reply->done += batch;
+    if(!reply_ok(reply, resp, TLV_TYPE_MULTI_GET_REQUEST)) {
+        return;
+    }
+    if(resp->len < batch) {
+        reply_invalid(reply, resp);
+        return;
+    }
 
+    const uint8_t *rx = resp->value;
+    const uint8_t *rec = rx + batch;
+    for(size_t i = 0; i < batch; i++) {
+        if(rx[i] != 0) {
+            printf("[client] device %u not found\n", reply->cmd->ids[base + i]);
+            continue;
+        }
+        if(rec + sizeof(device_status_t) > rx + resp->len) {
+            printf("[client] truncated MULTI_GET_RESPONSE\n");
+            reply->failed = 1;
+            return;
+        }
+        device_status_t dev;
+        memcpy(&dev, rec, sizeof(dev));
+        rec += sizeof(dev);
+        print_device(&dev);
+        reply->found++;
+    }
 }
 
-static int recv_expect(int fd, uint16_t expected_type, void *buf, uint16_t bufsize, uint16_t *out_len) {
-    uint16_t type = 0, len = 0;
-    int rc = recv_tlv(fd, &type, buf, bufsize, &len);
-    if (rc == 1) {
-        printf("[client] server closed connection (EOF)\n");
-        return 1;
-    } else if (rc < 0) {
-        printf("[client] recv_tlv failed\n");
-        return -1;
+static int cmd_multi_set(iot_client_t *client, reply_ctx_t *reply) {
+    const command_t *cmd = reply->cmd;
+    for(size_t base = 0; base < cmd->count; base += TLV_MULTI_MAX_ITEMS) {
+        size_t batch = (cmd->count - base < TLV_MULTI_MAX_ITEMS) ? cmd->count - base : TLV_MULTI_MAX_ITEMS;
+        while(iot_client_multi_set(client, cmd->ids + base, cmd->temps + base, batch, on_multi_set, reply) < 0) {
+            if(wait_for_room(client, TLV_TYPE_MULTI_SET_REQUEST) < 0) {
+                goto drain;
+            }
+        }
     }
-    if (type != expected_type) {
-        printf("[client] unexpected response type=0x%04x\n", type);
+drain:
+    if(wait_idle(client) < 0) {
         return -1;
     }
-    
-    if (out_len) *out_len = len;
+    printf("[client] updated %zu of %zu devices\n", reply->found, cmd->count);
     return 0;
 }
 
-static int discover_server(char *out_ip, size_t ip_size, uint16_t *out_port) {
-    printf("Searching for server...\n");
-    int fd = socket(AF_INET, SOCK_DGRAM, 0);
-    if(fd < 0) {
-        perror("discovery socket");
-        return -1;
+static void on_multi_set(void *arg, const iot_response_t *resp) {
+    reply_ctx_t *reply = arg;
+    size_t base = reply->done;
+    size_t batch = (reply->cmd->count - base < TLV_MULTI_MAX_ITEMS) ? reply->cmd->count - base : TLV_MULTI_MAX_ITEMS;
+    reply->done += batch;
+    if(!reply_ok(reply, resp, TLV_TYPE_MULTI_SET_REQUEST)) {
+        return;
+    }
+    if(resp->len != batch) {
+        reply_invalid(reply, resp);
+        return;
     }
 
-    struct timeval tv;
-    tv.tv_sec = 5;
-    tv.tv_usec = 0;
-    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
-
-    struct sockaddr_in mcast_addr;
-    memset(&mcast_addr, 0, sizeof(mcast_addr));
-    mcast_addr.sin_family = AF_INET;
-    mcast_addr.sin_port = htons(DISCOVERY_PORT);
-    inet_pton(AF_INET, DISCOVERY_MCAST_ADDR, &mcast_addr.sin_addr);
+    for(size_t i = 0; i < batch; i++) {
+        uint32_t id = reply->cmd->ids[base + i];
+        if(resp->value[i] == 0) {
+            reply->found++;
+        } else if(resp->value[i] == 1) {
+            printf("[client] SET failed: device %u not found\n", id);
+        } else {
+            printf("[client] SET failed for device %u: error code %u\n", id, resp->value[i]);
+        }
+    }
+}
 
-    uint8_t tx[1024];
-    size_t tx_len = 0;
-    int rc = tlv_encode_buf(tx, sizeof(tx), TLV_TYPE_DISCOVER_REQUEST, NULL, 0, &tx_len);
-    if(rc < 0) {
-        printf("[client] tlv_encode_buf DISCOVER_REQUEST failed\n");
-        close(fd);
+// Subscribes, then prints the STATUS_UPDATE frames the server pushes until
+// a line is entered on stdin, and unsubscribes again. The client's fd is
+// polled next to stdin.
+static int cmd_watch(iot_client_t *client, reply_ctx_t *reply) {
+    const command_t *cmd = reply->cmd;
+    if(iot_client_subscribe(client, cmd->ids, cmd->count, on_update, reply, on_subscribe, reply) < 0) {
+        printf("[client] SUBSCRIBE_REQUEST failed: %s\n", strerror(errno));
+        return 0;
+    }
+    if(wait_idle(client) < 0) {
         return -1;
     }
+    if(reply->failed) {
+        return 0;
+    }
+    if(!reply->accepted) {
+        printf("[client] subscription rejected\n");
+        return 0;
+    }
+    printf("[client] watching %s, press Enter to stop\n", cmd->count ? "selected devices" : "all devices");
 
-    ssize_t n = sendto(fd, tx, tx_len, 0, (struct sockaddr *)&mcast_addr, sizeof(mcast_addr));
-    if(n < 0) {
-        perror("discovery sendto");
-        close(fd);
-        return -1;
+    while(1) {
+        struct pollfd pfds[2] = {
+            { .fd = iot_client_fd(client), .events = POLLIN },
+            { .fd = STDIN_FILENO, .events = POLLIN },
+        };
+        if(poll(pfds, 2, -1) < 0) {
+            if(errno == EINTR) continue;
+            printf("[client] poll failed\n");
+            return -1;
+        }
+        if(pfds[1].revents) {
+            char line[LINE_BUFF_SIZE];
+            if(!fgets(line, sizeof(line), stdin)) {
+                clearerr(stdin);
+            }
+            break;
+        }
+        if(pfds[0].revents && iot_client_poll(client, 0) < 0) {
+            printf("[client] poll failed: %s\n", strerror(errno));
+            return -1;
+        }
     }
 
-    uint8_t rx[1024];
-    struct sockaddr_in src_addr;
-    socklen_t src_addr_len = sizeof(src_addr);
-    n = recvfrom(fd, rx, sizeof(rx), 0, (struct sockaddr *)&src_addr, &src_addr_len);
-    if(n < 0) {
-        perror("discovery recvfrom");
-        close(fd);
+    // Updates queued before the unsubscribe still arrive ahead of its reply.
+    if(iot_client_unsubscribe(client, NULL, NULL) < 0) {
+        printf("[client] UNSUBSCRIBE_REQUEST failed: %s\n", strerror(errno));
+    }
+    if(wait_idle(client) < 0) {
         return -1;
     }
+    printf("[client] received %zu updates\n", reply->received);
+    return 0;
+}
 
-    uint16_t type = 0, len = 0;
-    const uint8_t *val = NULL;
-    rc = tlv_decode_buf(rx, (size_t)n, &type, &val, &len);
-    if(rc < 0) {
-        printf("[client] discovery tlv_decode_buf failed\n");
-        close(fd);
-        return -1;
+static void on_subscribe(void *arg, const iot_response_t *resp) {
+    reply_ctx_t *reply = arg;
+    if(!reply_ok(reply, resp, TLV_TYPE_SUBSCRIBE_REQUEST)) {
+        return;
     }
+    reply->accepted = (resp->len == 1 && resp->value[0] == 0);
+}
 
-    if(type != TLV_TYPE_DISCOVER_RESPONSE) {
-        printf("[client] unexpected discovery response type=0x%04x\n", type);
-        close(fd);
-        return -1;
+static void on_update(void *arg, const device_status_t *devs, size_t count) {
+    reply_ctx_t *reply = arg;
+    for(size_t i = 0; i < count; i++) {
+        device_status_t dev;
+        memcpy(&dev, &devs[i], sizeof(dev));
+        print_device(&dev);
     }
+    reply->received += count;
+}
 
-    uint16_t port_net;
-    memcpy(&port_net, val, sizeof(port_net));
-    *out_port = ntohs(port_net);
+// Follows resume_ms until the whole window has been printed.
+static int cmd_history(iot_client_t *client, reply_ctx_t *reply) {
+    const command_t *cmd = reply->cmd;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t to_ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    int64_t from_ms = to_ms - (int64_t)cmd->window_s * 1000;
+    uint32_t skip = 0;
+
+    while(1) {
+        reply->resume_ms = 0;
+        reply->resume_skip = 0;
+        if(iot_client_history(client, cmd->ids[0], from_ms, skip, to_ms, cmd->bucket_s * 1000u, on_history, reply) < 0) {
+            printf("[client] HISTORY_REQUEST failed: %s\n", strerror(errno));
+            return 0;
+        }
+        if(wait_idle(client) < 0) {
+            return -1;
+        }
+        if(reply->failed || !reply->accepted) {
+            return 0;
+        }
+        // Stop unless the server moved on, if only within one timestamp.
+        if(reply->resume_ms < from_ms || (reply->resume_ms == from_ms && reply->resume_skip <= skip)) {
+            break;
+        }
+        from_ms = reply->resume_ms;
+        skip = reply->resume_skip;
+    }
 
-    inet_ntop(AF_INET, &src_addr.sin_addr, out_ip, ip_size);
-    close(fd);
-    printf("Found server at %s:%u\n", out_ip, *out_port);
+    printf("[client] received %zu %s\n", reply->received, cmd->bucket_s ? "buckets" : "samples");
     return 0;
 }
 
-static int connect_to_server(const char *ip, const char *port) {
-    struct addrinfo hints;
-    struct addrinfo *res = NULL;
+static void on_history(void *arg, const iot_response_t *resp) {
+    reply_ctx_t *reply = arg;
+    if(!reply_ok(reply, resp, TLV_TYPE_HISTORY_REQUEST)) {
+        return;
+    }
+    const uint8_t *rx = resp->value;
+    if(resp->len < TLV_HISTORY_HEADER_LEN) {
+        reply_invalid(reply, resp);
+        return;
+    }
+    reply->accepted = (rx[0] == 0);
+    if(!reply->accepted) {
+        printf("[client] no history for device %u\n", reply->cmd->ids[0]);
+        return;
+    }
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family   = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
+    uint64_t resume_net;
+    memcpy(&resume_net, rx + 2, sizeof(resume_net));
+    uint32_t resume_skip_net;
+    memcpy(&resume_skip_net, rx + 2 + sizeof(resume_net), sizeof(resume_skip_net));
+    reply->resume_ms = (int64_t)be64toh(resume_net);
+    reply->resume_skip = ntohl(resume_skip_net);
+    const uint8_t *records = rx + TLV_HISTORY_HEADER_LEN;
+    size_t records_len = resp->len - TLV_HISTORY_HEADER_LEN;
+    if(rx[1] == 0) {
+        for(size_t off = 0; off + sizeof(history_sample_t) <= records_len; off += sizeof(history_sample_t)) {
+            history_sample_t s;
+            memcpy(&s, records + off, sizeof(s));
+            time_t t = (time_t)(s.ts_ms / 1000);
+            struct tm tm;
+            char when[32];
+            strftime(when, sizeof(when), "%F %T", localtime_r(&t, &tm));
+            printf("  %s.%03d  temp=%.2f C\n", when, (int)(s.ts_ms % 1000), s.value);
+            reply->received++;
+        }
+    } else {
+        for(size_t off = 0; off + sizeof(history_bucket_t) <= records_len; off += sizeof(history_bucket_t)) {
+            history_bucket_t b;
+            memcpy(&b, records + off, sizeof(b));
+            time_t t = (time_t)(b.start_ms / 1000);
+            struct tm tm;
+            char when[32];
+            strftime(when, sizeof(when), "%F %T", localtime_r(&t, &tm));
+            printf("  %s  min=%.2f max=%.2f avg=%.2f samples=%u\n", when, b.min, b.max, b.avg, b.count);
+            reply->received++;
+        }
+    }
+}
 
-    int err = getaddrinfo(ip, port, &hints, &res);
-    if (err != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
-        return -1;
+static int cmd_aggregate(iot_client_t *client, reply_ctx_t *reply) {
+    const command_t *cmd = reply->cmd;
+    uint8_t req[TLV_AGGREGATE_REQUEST_LEN];
+    iot_client_aggregate_request(req, cmd->status_mask, cmd->battery_min, cmd->battery_max,
+                                 cmd->temp_min, cmd->temp_max, cmd->hist_lo, cmd->hist_hi);
+    if(iot_client_aggregate(client, cmd->has_filter ? req : NULL, on_aggregate, reply) < 0) {
+        printf("[client] AGGREGATE_REQUEST failed: %s\n", strerror(errno));
+        return 0;
     }
+    return wait_idle(client);
+}
 
-    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (fd < 0) {
-        perror("socket");
-        freeaddrinfo(res);
-        return -1;
+static void on_aggregate(void *arg, const iot_response_t *resp) {
+    reply_ctx_t *reply = arg;
+    const command_t *cmd = reply->cmd;
+    if(!reply_ok(reply, resp, TLV_TYPE_AGGREGATE_REQUEST)) {
+        return;
+    }
+    if(resp->len != sizeof(aggregate_stats_t)) {
+        reply_invalid(reply, resp);
+        return;
+    }
+
+    aggregate_stats_t st;
+    memcpy(&st, resp->value, sizeof(st));
+    printf("[client] %u matching devices\n", st.count);
+    if(st.count == 0) {
+        return;
+    }
+    printf("  temp: min=%.2f max=%.2f mean=%.2f sum=%.2f C\n", st.temp_min, st.temp_max, st.temp_mean, st.temp_sum);
+    printf("  battery: mean=%.1f%%\n", st.battery_mean);
+
+    float width = (cmd->hist_hi - cmd->hist_lo) / TLV_AGGREGATE_TEMP_BINS;
+    printf("  temperature histogram:\n");
+    for(int i = 0; i < TLV_AGGREGATE_TEMP_BINS; i++) {
+        if(st.temp_hist[i] == 0) continue;
+        float lo = cmd->hist_lo + width * (float)i;
+        printf("    %7.2f .. %7.2f  %u\n", lo, lo + width, st.temp_hist[i]);
+    }
+    printf("  battery histogram:\n");
+    for(int i = 0; i < TLV_AGGREGATE_BATTERY_BINS; i++) {
+        if(st.battery_hist[i] == 0) continue;
+        printf("    %3d .. %3d %%  %u\n", i * 10, (i == TLV_AGGREGATE_BATTERY_BINS - 1) ? 100 : i * 10 + 9, st.battery_hist[i]);
+    }
+}
+
+static int cmd_stats(iot_client_t *client, reply_ctx_t *reply) {
+    if(iot_client_stats(client, on_stats, reply) < 0) {
+        printf("[client] STATS_REQUEST failed: %s\n", strerror(errno));
+        return 0;
+    }
+    return wait_idle(client);
+}
+
+static void on_stats(void *arg, const iot_response_t *resp) {
+    reply_ctx_t *reply = arg;
+    if(!reply_ok(reply, resp, TLV_TYPE_STATS_REQUEST)) {
+        return;
+    }
+
+    stats_header_t hdr;
+    if(resp->len < sizeof(hdr)) {
+        reply_invalid(reply, resp);
+        return;
+    }
+    memcpy(&hdr, resp->value, sizeof(hdr));
+    if(resp->len != sizeof(hdr) + (size_t)hdr.type_count * sizeof(stats_request_t)) {
+        reply_invalid(reply, resp);
+        return;
     }
 
-    if (connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
-        perror("connect");
-        close(fd);
-        freeaddrinfo(res);
+    printf("[client] server up %.1f s, %llu connections open, %llu accepted\n",
+           (double)hdr.uptime_ms / 1e3, (unsigned long long)hdr.connections_active,
+           (unsigned long long)hdr.connections_accepted);
+    printf("  traffic: %llu bytes in, %llu bytes out\n",
+           (unsigned long long)hdr.bytes_in, (unsigned long long)hdr.bytes_out);
+    printf("  registry locks: %llu taken, %llu contended, %.3f ms waited\n",
+           (unsigned long long)hdr.lock_acquired, (unsigned long long)hdr.lock_contended,
+           (double)hdr.lock_wait_ns / 1e6);
+    printf("  list cache: %llu hits, %llu misses, %llu rebuilds\n",
+           (unsigned long long)hdr.list_cache_hits, (unsigned long long)hdr.list_cache_misses,
+           (unsigned long long)hdr.list_cache_rebuilds);
+    if(hdr.type_count == 0) {
+        return;
+    }
+    printf("  %-12s %10s %7s %9s %9s %9s %9s %9s %9s (us)\n",
+           "request", "count", "failed", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for(uint32_t i = 0; i < hdr.type_count; i++) {
+        stats_request_t rec;
+        memcpy(&rec, resp->value + sizeof(hdr) + i * sizeof(rec), sizeof(rec));
+        printf("  %-12s %10llu %7llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", request_name(rec.type),
+               (unsigned long long)rec.count, (unsigned long long)rec.failed,
+               (double)rec.mean_ns / 1e3, (double)rec.p50_ns / 1e3, (double)rec.p90_ns / 1e3,
+               (double)rec.p99_ns / 1e3, (double)rec.p999_ns / 1e3, (double)rec.max_ns / 1e3);
+    }
+}
+
+static void print_server(const iot_server_info_t *s) {
+    if(s->workers == 0) {
+        printf("  %s:%u\n", s->host, s->port);
+        return;
+    }
+    printf("  %s:%u id %08x: %u workers, %u connections, %u requests/s, %u devices in %u shards\n",
+           s->host, s->port, s->server_id, s->workers, s->connections, s->request_rate, s->devices, s->shards);
+}
+
+static const char *request_name(uint16_t type) {
+    switch(type) {
+        case TLV_TYPE_LIST_REQUEST:        return "list";
+        case TLV_TYPE_LIST_SINCE_REQUEST:  return "list_since";
+        case TLV_TYPE_LIST_FILTER_REQUEST: return "list_filter";
+        case TLV_TYPE_GET_REQUEST:         return "get";
+        case TLV_TYPE_SET_REQUEST:         return "set";
+        case TLV_TYPE_MULTI_GET_REQUEST:   return "multi_get";
+        case TLV_TYPE_MULTI_SET_REQUEST:   return "multi_set";
+        case TLV_TYPE_SUBSCRIBE_REQUEST:   return "subscribe";
+        case TLV_TYPE_UNSUBSCRIBE_REQUEST: return "unsubscribe";
+        case TLV_TYPE_HISTORY_REQUEST:     return "history";
+        case TLV_TYPE_AGGREGATE_REQUEST:   return "aggregate";
+        case TLV_TYPE_STATS_REQUEST:       return "stats";
+        default:                           return "other";
+    }
+}
+
+// The library reconnects by itself; this only tells the user about it.
+static void on_connection(void *arg, unsigned index, int up, int err) {
+    link_state_t *link = arg;
+    (void)index;
+    if(up && !link->up && link->seen) {
+        printf("[client] reconnected to server\n");
+    } else if(!up && link->up) {
+        printf("[client] connection lost (%s), reconnecting\n", err ? strerror(err) : "closed by server");
+    }
+    link->up = up;
+    link->err = err;
+    link->seen = 1;
+}
+
+// 0 if the request failed; only the first failure of a command is printed.
+static int reply_ok(reply_ctx_t *reply, const iot_response_t *resp, uint16_t request) {
+    if(resp->status == IOT_CLIENT_OK) {
+        return 1;
+    }
+    if(!reply->failed) {
+        const char *why = "request canceled";
+        if(resp->status == IOT_CLIENT_ECONN) {
+            why = "connection to the server lost";
+        } else if(resp->status == IOT_CLIENT_ETIMEDOUT) {
+            why = "timed out";
+        } else if(resp->status == IOT_CLIENT_EPROTO) {
+            why = "unexpected response";
+        }
+        printf("[client] %s failed: %s\n", request_name(request), why);
+    }
+    reply->failed = 1;
+    return 0;
+}
+
+static void reply_invalid(reply_ctx_t *reply, const iot_response_t *resp) {
+    printf("[client] invalid response type=0x%04x length=%u\n", resp->type, resp->len);
+    reply->failed = 1;
+}
+
+// After a submit failed: 0 once a poll may have made room to retry, -1 if
+// retrying cannot help.
+static int wait_for_room(iot_client_t *client, uint16_t request) {
+    if(errno != EAGAIN) {
+        printf("[client] %s failed: %s\n", request_name(request), strerror(errno));
         return -1;
     }
+    if(iot_client_poll(client, -1) < 0) {
+        printf("[client] poll failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
 
-    freeaddrinfo(res);
-    return fd;
-}
\ No newline at end of file
+// Runs the client until every submitted request has completed.
+static int wait_idle(iot_client_t *client) {
+    while(iot_client_pending(client) > 0) {
+        if(iot_client_poll(client, -1) < 0) {
+            printf("[client] poll failed: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,901 @@
+#include "iotclient.h"
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DISCOVERY_MCAST_ADDR "239.0.0.1"
+#define DISCOVERY_PORT 5000
+#define RX_INITIAL_CAP 1024
+#define POLL_EVENTS 64
+// epoll data of the timerfd; connections are tagged with their pool index.
+#define TIMER_TAG UINT32_MAX
+
+// pending_t.flags
+#define PENDING_SUBSCRIBE   0x1
+#define PENDING_UNSUBSCRIBE 0x2
+
+typedef enum {
+    CONN_DOWN = 0,
+    CONN_CONNECTING,
+    CONN_UP
+} conn_state_t;
+
+typedef struct {
+    uint16_t response; // expected reply type; LIST_END for LIST streams
+    uint16_t flags;
+    iot_response_cb_t cb; // NULL for the client's own renewals
+    void *arg;
+} pending_t;
+
+// The protocol has no request ids: replies arrive in request order, so each
+// connection keeps its outstanding requests in a FIFO ring.
+typedef struct {
+    unsigned index;
+    int fd;
+    conn_state_t state;
+    uint32_t events; // registered with epoll, 0 = not registered
+    tlv_reader_t rx;
+    tlv_writer_t tx;
+    pending_t *pending;
+    size_t slots; // max_inflight plus one for a subscription renewal
+    size_t head;
+    size_t count;
+    uint64_t progress_ns; // connect started, or last reply with requests outstanding
+    uint64_t retry_ns;    // DOWN: when to reconnect
+    unsigned backoff_ms;
+} client_conn_t;
+
+struct iot_client {
+    iot_client_config_t cfg;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int epfd;
+    int timerfd;
+    uint64_t timer_ns; // deadline the timerfd is armed for, 0 = disarmed
+    uint64_t now_ns;   // clock at the start of the current poll
+    client_conn_t *conns;
+    unsigned next;     // round-robin start for picking a connection
+    size_t pending;
+    int calls;         // callbacks run in the current poll
+    int closing;
+
+    iot_update_cb_t on_update;
+    void *update_arg;
+    iot_connection_cb_t on_connection;
+    void *connection_arg;
+    uint32_t *sub_ids; // network order
+    size_t sub_count;
+    int sub_wanted;    // subscribed by the caller and not unsubscribed since
+    int subscribed;    // ... and accepted by the server: renewed on reconnect
+};
+
+static uint64_t now_ns(void);
+static uint16_t response_type(uint16_t request);
+
+static void conn_open(iot_client_t *c, client_conn_t *conn);
+static void conn_close(iot_client_t *c, client_conn_t *conn);
+static void conn_down(iot_client_t *c, client_conn_t *conn, int err);
+static void conn_fail(iot_client_t *c, client_conn_t *conn, int status, int err);
+static void conn_fail_pending(iot_client_t *c, client_conn_t *conn, int status, int rest_status);
+static int conn_watch(iot_client_t *c, client_conn_t *conn, uint32_t events);
+static void conn_connected(iot_client_t *c, client_conn_t *conn);
+static void conn_event(iot_client_t *c, client_conn_t *conn, uint32_t events);
+static int conn_flush(iot_client_t *c, client_conn_t *conn);
+static void conn_read(iot_client_t *c, client_conn_t *conn);
+static int conn_dispatch(iot_client_t *c, client_conn_t *conn, uint16_t type, const uint8_t *value, uint16_t len);
+static int conn_queue(iot_client_t *c, client_conn_t *conn, uint16_t type, const void *value, uint16_t len,
+                      uint16_t flags, iot_response_cb_t cb, void *arg);
+static client_conn_t *pick_conn(iot_client_t *c);
+
+static void run_timers(iot_client_t *c);
+static void arm_timer(iot_client_t *c);
+
+iot_client_t *iot_client_create(const iot_client_config_t *cfg) {
+    if(!cfg || !cfg->host || cfg->port == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct addrinfo hints;
+    struct addrinfo *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    char port[8];
+    snprintf(port, sizeof(port), "%u", cfg->port);
+    int err = getaddrinfo(cfg->host, port, &hints, &res);
+    if(err != 0) {
+        errno = (err == EAI_SYSTEM) ? errno : EHOSTUNREACH;
+        return NULL;
+    }
+
+    iot_client_t *c = calloc(1, sizeof(*c));
+    if(!c) {
+        freeaddrinfo(res);
+        return NULL;
+    }
+    memcpy(&c->addr, res->ai_addr, res->ai_addrlen);
+    c->addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    c->cfg = *cfg;
+    c->cfg.host = NULL; // not kept past this call
+    if(c->cfg.connections == 0) c->cfg.connections = IOT_CLIENT_DEFAULT_CONNECTIONS;
+    if(c->cfg.max_inflight == 0) c->cfg.max_inflight = IOT_CLIENT_DEFAULT_MAX_INFLIGHT;
+    if(c->cfg.connect_timeout_ms == 0) c->cfg.connect_timeout_ms = IOT_CLIENT_DEFAULT_CONNECT_TIMEOUT_MS;
+    if(c->cfg.reconnect_min_ms == 0) c->cfg.reconnect_min_ms = IOT_CLIENT_DEFAULT_RECONNECT_MIN_MS;
+    if(c->cfg.reconnect_max_ms < c->cfg.reconnect_min_ms) {
+        c->cfg.reconnect_max_ms = c->cfg.reconnect_min_ms > IOT_CLIENT_DEFAULT_RECONNECT_MAX_MS
+                                ? c->cfg.reconnect_min_ms : IOT_CLIENT_DEFAULT_RECONNECT_MAX_MS;
+    }
+
+    c->epfd = epoll_create1(EPOLL_CLOEXEC);
+    c->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    c->conns = calloc(c->cfg.connections, sizeof(*c->conns));
+    if(c->epfd < 0 || c->timerfd < 0 || !c->conns) {
+        goto fail;
+    }
+    for(unsigned i = 0; i < c->cfg.connections; i++) {
+        c->conns[i].fd = -1;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = TIMER_TAG };
+    if(epoll_ctl(c->epfd, EPOLL_CTL_ADD, c->timerfd, &ev) < 0) {
+        goto fail;
+    }
+
+    for(unsigned i = 0; i < c->cfg.connections; i++) {
+        client_conn_t *conn = &c->conns[i];
+        conn->index = i;
+        conn->slots = (size_t)c->cfg.max_inflight + 1;
+        conn->pending = calloc(conn->slots, sizeof(*conn->pending));
+        conn->backoff_ms = c->cfg.reconnect_min_ms;
+        tlv_writer_init(&conn->tx);
+        if(!conn->pending || tlv_reader_init(&conn->rx, RX_INITIAL_CAP, TLV_MAX_FRAME) < 0) {
+            goto fail;
+        }
+    }
+
+    c->now_ns = now_ns();
+    for(unsigned i = 0; i < c->cfg.connections; i++) {
+        conn_open(c, &c->conns[i]);
+    }
+    arm_timer(c);
+    return c;
+
+fail:
+    err = errno;
+    iot_client_destroy(c);
+    errno = err;
+    return NULL;
+}
+
+void iot_client_destroy(iot_client_t *c) {
+    if(!c) {
+        return;
+    }
+    c->closing = 1;
+    for(unsigned i = 0; c->conns && i < c->cfg.connections; i++) {
+        client_conn_t *conn = &c->conns[i];
+        conn->state = CONN_DOWN;
+        conn_close(c, conn);
+        if(conn->pending) {
+            conn_fail_pending(c, conn, IOT_CLIENT_ECANCELED, IOT_CLIENT_ECANCELED);
+        }
+        tlv_reader_free(&conn->rx);
+        tlv_writer_free(&conn->tx);
+        free(conn->pending);
+    }
+    if(c->timerfd >= 0) close(c->timerfd);
+    if(c->epfd >= 0) close(c->epfd);
+    free(c->conns);
+    free(c->sub_ids);
+    free(c);
+}
+
+void iot_client_on_connection(iot_client_t *c, iot_connection_cb_t cb, void *arg) {
+    c->on_connection = cb;
+    c->connection_arg = arg;
+}
+
+int iot_client_fd(const iot_client_t *c) {
+    return c->epfd;
+}
+
+int iot_client_poll(iot_client_t *c, int timeout_ms) {
+    struct epoll_event events[POLL_EVENTS];
+    int n = epoll_wait(c->epfd, events, POLL_EVENTS, timeout_ms);
+    if(n < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    c->calls = 0;
+    c->now_ns = now_ns();
+    for(int i = 0; i < n; i++) {
+        if(events[i].data.u32 == TIMER_TAG) {
+            uint64_t expirations;
+            if(read(c->timerfd, &expirations, sizeof(expirations)) < 0) {
+                // nothing to drain; run_timers() checks the clock anyway
+            }
+            c->timer_ns = 0;
+            continue;
+        }
+        client_conn_t *conn = &c->conns[events[i].data.u32];
+        // A connection that failed earlier in this batch may still have
+        // events queued for its old socket.
+        if(conn->state != CONN_DOWN) {
+            conn_event(c, conn, events[i].events);
+        }
+    }
+    run_timers(c);
+    arm_timer(c);
+    return c->calls;
+}
+
+size_t iot_client_pending(const iot_client_t *c) {
+    return c->pending;
+}
+
+unsigned iot_client_connected(const iot_client_t *c) {
+    unsigned up = 0;
+    for(unsigned i = 0; i < c->cfg.connections; i++) {
+        up += (c->conns[i].state == CONN_UP);
+    }
+    return up;
+}
+
+int iot_client_submit(iot_client_t *c, uint16_t type, const void *value, uint16_t len,
+                      iot_response_cb_t cb, void *arg) {
+    // Subscriptions are tied to one connection, see iot_client_subscribe().
+    if(response_type(type) == 0 || type == TLV_TYPE_SUBSCRIBE_REQUEST || type == TLV_TYPE_UNSUBSCRIBE_REQUEST) {
+        errno = EINVAL;
+        return -1;
+    }
+    client_conn_t *conn = pick_conn(c);
+    if(!conn) {
+        return -1;
+    }
+    return conn_queue(c, conn, type, value, len, 0, cb, arg);
+}
+
+int iot_client_get(iot_client_t *c, uint32_t device_id, iot_response_cb_t cb, void *arg) {
+    uint32_t id_net = htonl(device_id);
+    return iot_client_submit(c, TLV_TYPE_GET_REQUEST, &id_net, sizeof(id_net), cb, arg);
+}
+
+int iot_client_set(iot_client_t *c, uint32_t device_id, float temperature, iot_response_cb_t cb, void *arg) {
+    uint32_t payload[2];
+    uint32_t temp_bits;
+    memcpy(&temp_bits, &temperature, sizeof(temp_bits));
+    payload[0] = htonl(device_id);
+    payload[1] = htonl(temp_bits);
+    return iot_client_submit(c, TLV_TYPE_SET_REQUEST, payload, sizeof(payload), cb, arg);
+}
+
+int iot_client_multi_get(iot_client_t *c, const uint32_t *ids, size_t count, iot_response_cb_t cb, void *arg) {
+    uint32_t payload[TLV_MULTI_MAX_ITEMS];
+    if(count == 0 || count > TLV_MULTI_MAX_ITEMS) {
+        errno = EINVAL;
+        return -1;
+    }
+    for(size_t i = 0; i < count; i++) {
+        payload[i] = htonl(ids[i]);
+    }
+    return iot_client_submit(c, TLV_TYPE_MULTI_GET_REQUEST, payload, (uint16_t)(count * sizeof(uint32_t)), cb, arg);
+}
+
+int iot_client_multi_set(iot_client_t *c, const uint32_t *ids, const float *temps, size_t count,
+                         iot_response_cb_t cb, void *arg) {
+    uint32_t payload[TLV_MULTI_MAX_ITEMS * 2];
+    if(count == 0 || count > TLV_MULTI_MAX_ITEMS) {
+        errno = EINVAL;
+        return -1;
+    }
+    for(size_t i = 0; i < count; i++) {
+        uint32_t temp_bits;
+        memcpy(&temp_bits, &temps[i], sizeof(temp_bits));
+        payload[2 * i] = htonl(ids[i]);
+        payload[2 * i + 1] = htonl(temp_bits);
+    }
+    return iot_client_submit(c, TLV_TYPE_MULTI_SET_REQUEST, payload, (uint16_t)(count * 2 * sizeof(uint32_t)), cb, arg);
+}
+
+int iot_client_list(iot_client_t *c, iot_response_cb_t cb, void *arg) {
+    return iot_client_submit(c, TLV_TYPE_LIST_REQUEST, NULL, 0, cb, arg);
+}
+
+int iot_client_list_since(iot_client_t *c, uint64_t generation, iot_response_cb_t cb, void *arg) {
+    uint64_t since_net = htobe64(generation);
+    return iot_client_submit(c, TLV_TYPE_LIST_SINCE_REQUEST, &since_net, sizeof(since_net), cb, arg);
+}
+
+int iot_client_list_filter(iot_client_t *c, uint8_t status_mask, uint8_t battery_min, uint8_t battery_max,
+                           float temp_min, float temp_max, iot_response_cb_t cb, void *arg) {
+    uint8_t req[TLV_LIST_FILTER_REQUEST_LEN] = { status_mask, battery_min, battery_max, 0 };
+    const float bounds[2] = { temp_min, temp_max };
+    for(int i = 0; i < 2; i++) {
+        uint32_t bits;
+        memcpy(&bits, &bounds[i], sizeof(bits));
+        bits = htonl(bits);
+        memcpy(req + 4 + 4 * i, &bits, sizeof(bits));
+    }
+    return iot_client_submit(c, TLV_TYPE_LIST_FILTER_REQUEST, req, sizeof(req), cb, arg);
+}
+
+int iot_client_history(iot_client_t *c, uint32_t device_id, int64_t from_ms, uint32_t skip, int64_t to_ms,
+                       uint32_t bucket_ms, iot_response_cb_t cb, void *arg) {
+    uint8_t req[TLV_HISTORY_REQUEST_LEN + sizeof(uint32_t)];
+    uint32_t id_net = htonl(device_id), bucket_net = htonl(bucket_ms), skip_net = htonl(skip);
+    uint64_t from_net = htobe64((uint64_t)from_ms), to_net = htobe64((uint64_t)to_ms);
+    memcpy(req, &id_net, 4);
+    memcpy(req + 4, &from_net, 8);
+    memcpy(req + 12, &to_net, 8);
+    memcpy(req + 20, &bucket_net, 4);
+    memcpy(req + 24, &skip_net, 4);
+    return iot_client_submit(c, TLV_TYPE_HISTORY_REQUEST, req, sizeof(req), cb, arg);
+}
+
+int iot_client_aggregate(iot_client_t *c, const uint8_t *filter, iot_response_cb_t cb, void *arg) {
+    return iot_client_submit(c, TLV_TYPE_AGGREGATE_REQUEST, filter, filter ? TLV_AGGREGATE_REQUEST_LEN : 0, cb, arg);
+}
+
+void iot_client_aggregate_request(uint8_t out[TLV_AGGREGATE_REQUEST_LEN], uint8_t status_mask,
+                                  uint8_t battery_min, uint8_t battery_max, float temp_min, float temp_max,
+                                  float hist_lo, float hist_hi) {
+    const float bounds[4] = { temp_min, temp_max, hist_lo, hist_hi };
+    out[0] = status_mask;
+    out[1] = battery_min;
+    out[2] = battery_max;
+    out[3] = 0;
+    for(int i = 0; i < 4; i++) {
+        uint32_t bits;
+        memcpy(&bits, &bounds[i], sizeof(bits));
+        bits = htonl(bits);
+        memcpy(out + 4 + 4 * i, &bits, sizeof(bits));
+    }
+}
+
+int iot_client_stats(iot_client_t *c, iot_response_cb_t cb, void *arg) {
+    return iot_client_submit(c, TLV_TYPE_STATS_REQUEST, NULL, 0, cb, arg);
+}
+
+int iot_client_subscribe(iot_client_t *c, const uint32_t *ids, size_t count, iot_update_cb_t update,
+                         void *update_arg, iot_response_cb_t cb, void *arg) {
+    client_conn_t *conn = &c->conns[0];
+    if(count > UINT16_MAX / sizeof(uint32_t)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if(c->closing || conn->state == CONN_DOWN) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    if(conn->count >= c->cfg.max_inflight) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    uint32_t *sub_ids = realloc(c->sub_ids, (count ? count : 1) * sizeof(uint32_t));
+    if(!sub_ids) {
+        return -1;
+    }
+    for(size_t i = 0; i < count; i++) {
+        sub_ids[i] = htonl(ids[i]);
+    }
+    c->sub_ids = sub_ids;
+    c->sub_count = count;
+    c->sub_wanted = 1;
+    c->on_update = update;
+    c->update_arg = update_arg;
+    return conn_queue(c, conn, TLV_TYPE_SUBSCRIBE_REQUEST, c->sub_ids, (uint16_t)(count * sizeof(uint32_t)),
+                      PENDING_SUBSCRIBE, cb, arg);
+}
+
+int iot_client_unsubscribe(iot_client_t *c, iot_response_cb_t cb, void *arg) {
+    client_conn_t *conn = &c->conns[0];
+    if(c->closing || conn->state == CONN_DOWN) {
+        // The server forgot the subscription with the connection.
+        c->sub_wanted = 0;
+        c->subscribed = 0;
+        c->on_update = NULL;
+        c->update_arg = NULL;
+        errno = ENOTCONN;
+        return -1;
+    }
+    if(conn->count >= c->cfg.max_inflight) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if(conn_queue(c, conn, TLV_TYPE_UNSUBSCRIBE_REQUEST, NULL, 0, PENDING_UNSUBSCRIBE, cb, arg) < 0) {
+        return -1;
+    }
+    c->sub_wanted = 0;
+    c->subscribed = 0;
+    return 0;
+}
+
+int iot_client_discover_all(iot_server_info_t *out, size_t max, unsigned timeout_ms, unsigned window_ms) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        return -1;
+    }
+
+    struct sockaddr_in mcast_addr;
+    memset(&mcast_addr, 0, sizeof(mcast_addr));
+    mcast_addr.sin_family = AF_INET;
+    mcast_addr.sin_port = htons(DISCOVERY_PORT);
+    inet_pton(AF_INET, DISCOVERY_MCAST_ADDR, &mcast_addr.sin_addr);
+
+    uint8_t tx[sizeof(tlv_header_t)];
+    size_t tx_len = 0;
+    tlv_encode_buf(tx, sizeof(tx), TLV_TYPE_DISCOVER_REQUEST, NULL, 0, &tx_len);
+    if(sendto(fd, tx, tx_len, 0, (struct sockaddr *)&mcast_addr, sizeof(mcast_addr)) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    size_t found = 0;
+    uint64_t deadline = now_ns() + (uint64_t)timeout_ms * 1000000ull;
+    while(1) {
+        uint64_t now = now_ns();
+        if(now >= deadline) {
+            break;
+        }
+        struct pollfd p = { .fd = fd, .events = POLLIN };
+        int prc = poll(&p, 1, (int)((deadline - now + 999999) / 1000000));
+        if(prc < 0 && errno != EINTR) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        if(prc <= 0) {
+            continue;
+        }
+
+        uint8_t rx[1024];
+        struct sockaddr_in src_addr;
+        socklen_t src_addr_len = sizeof(src_addr);
+        ssize_t n = recvfrom(fd, rx, sizeof(rx), 0, (struct sockaddr *)&src_addr, &src_addr_len);
+        uint16_t type = 0, len = 0;
+        const uint8_t *val = NULL;
+        if(n < 0 || tlv_decode_buf(rx, (size_t)n, &type, &val, &len) < 0 || type != TLV_TYPE_DISCOVER_RESPONSE ||
+           len < sizeof(uint16_t)) {
+            continue;
+        }
+
+        iot_server_info_t info = { 0 };
+        inet_ntop(AF_INET, &src_addr.sin_addr, info.host, sizeof(info.host));
+        uint16_t u16;
+        uint32_t u32;
+        memcpy(&u16, val, 2);
+        info.port = ntohs(u16);
+        if(len >= TLV_DISCOVER_RESPONSE_LEN) {
+            memcpy(&u32, val + 2, 4);
+            info.server_id = ntohl(u32);
+            memcpy(&u16, val + 6, 2);
+            info.workers = ntohs(u16);
+            memcpy(&u32, val + 8, 4);
+            info.connections = ntohl(u32);
+            memcpy(&u32, val + 12, 4);
+            info.request_rate = ntohl(u32);
+            memcpy(&u32, val + 16, 4);
+            info.shards = ntohl(u32);
+            memcpy(&u32, val + 20, 4);
+            info.devices = ntohl(u32);
+        }
+
+        // A server reachable over several routes answers more than once.
+        size_t i = 0;
+        while(i < found && !(out[i].server_id == info.server_id && out[i].port == info.port &&
+                             strcmp(out[i].host, info.host) == 0)) {
+            i++;
+        }
+        if(i < found || found == max) {
+            continue;
+        }
+        if(found == 0) {
+            deadline = now_ns() + (uint64_t)window_ms * 1000000ull;
+        }
+        out[found++] = info;
+    }
+    close(fd);
+
+    if(found == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return (int)found;
+}
+
+size_t iot_client_pick_server(const iot_server_info_t *servers, size_t count) {
+    if(count < 2) {
+        return 0;
+    }
+    // splitmix64 of the clock and pid: enough to decorrelate clients.
+    uint64_t x = now_ns() ^ ((uint64_t)getpid() << 32);
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    size_t a = (size_t)(x % count);
+    size_t b = (size_t)((x >> 32) % count);
+
+    const iot_server_info_t *sa = &servers[a], *sb = &servers[b];
+    if(sa->workers == 0 || sb->workers == 0) {
+        return (sa->workers == 0 && sb->workers > 0) ? b : a; // no load reported
+    }
+    // Compare per-worker figures without dividing.
+    uint64_t la = (uint64_t)sa->request_rate * sb->workers, lb = (uint64_t)sb->request_rate * sa->workers;
+    if(la == lb) {
+        la = (uint64_t)sa->connections * sb->workers;
+        lb = (uint64_t)sb->connections * sa->workers;
+    }
+    return (lb < la) ? b : a;
+}
+
+int iot_client_discover(char *out_host, size_t host_size, uint16_t *out_port, unsigned timeout_ms) {
+    iot_server_info_t servers[64];
+    int found = iot_client_discover_all(servers, sizeof(servers) / sizeof(servers[0]), timeout_ms,
+                                        IOT_CLIENT_DISCOVER_WINDOW_MS);
+    if(found < 0) {
+        return -1;
+    }
+    const iot_server_info_t *s = &servers[iot_client_pick_server(servers, (size_t)found)];
+    snprintf(out_host, host_size, "%s", s->host);
+    *out_port = s->port;
+    return 0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Reply type of a request the server answers, 0 for the others.
+static uint16_t response_type(uint16_t request) {
+    switch(request) {
+        case TLV_TYPE_LIST_REQUEST:
+        case TLV_TYPE_LIST_SINCE_REQUEST:
+        case TLV_TYPE_LIST_FILTER_REQUEST: return TLV_TYPE_LIST_END;
+        case TLV_TYPE_GET_REQUEST:         return TLV_TYPE_GET_RESPONSE;
+        case TLV_TYPE_SET_REQUEST:         return TLV_TYPE_SET_RESPONSE;
+        case TLV_TYPE_MULTI_GET_REQUEST:   return TLV_TYPE_MULTI_GET_RESPONSE;
+        case TLV_TYPE_MULTI_SET_REQUEST:   return TLV_TYPE_MULTI_SET_RESPONSE;
+        case TLV_TYPE_SUBSCRIBE_REQUEST:
+        case TLV_TYPE_UNSUBSCRIBE_REQUEST: return TLV_TYPE_SUBSCRIBE_RESPONSE;
+        case TLV_TYPE_HISTORY_REQUEST:     return TLV_TYPE_HISTORY_RESPONSE;
+        case TLV_TYPE_AGGREGATE_REQUEST:   return TLV_TYPE_AGGREGATE_RESPONSE;
+        case TLV_TYPE_STATS_REQUEST:       return TLV_TYPE_STATS_RESPONSE;
+        default:                           return 0;
+    }
+}
+
+// Starts a non-blocking connect; completion shows up as EPOLLOUT.
+static void conn_open(iot_client_t *c, client_conn_t *conn) {
+    int fd = socket(c->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        conn_down(c, conn, errno);
+        return;
+    }
+    // Requests are batched per poll; don't let Nagle hold them back.
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if(connect(fd, (struct sockaddr *)&c->addr, c->addr_len) < 0 && errno != EINPROGRESS) {
+        int err = errno;
+        close(fd);
+        conn_down(c, conn, err);
+        return;
+    }
+    conn->fd = fd;
+    conn->state = CONN_CONNECTING;
+    conn->progress_ns = c->now_ns;
+    if(conn_watch(c, conn, EPOLLIN | EPOLLOUT) < 0) {
+        conn_fail(c, conn, IOT_CLIENT_ECONN, errno);
+    }
+}
+
+static void conn_close(iot_client_t *c, client_conn_t *conn) {
+    if(conn->fd >= 0) {
+        epoll_ctl(c->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->events = 0;
+    conn->rx.head = conn->rx.tail = 0;
+    tlv_writer_consumed(&conn->tx, tlv_writer_pending(&conn->tx));
+}
+
+// Schedules the next connection attempt with exponential backoff.
+static void conn_down(iot_client_t *c, client_conn_t *conn, int err) {
+    conn->state = CONN_DOWN;
+    conn->retry_ns = c->now_ns + (uint64_t)conn->backoff_ms * 1000000ull;
+    conn->backoff_ms = (conn->backoff_ms > c->cfg.reconnect_max_ms / 2) ? c->cfg.reconnect_max_ms : conn->backoff_ms * 2;
+    if(c->on_connection) {
+        c->on_connection(c->connection_arg, conn->index, 0, err);
+    }
+}
+
+// 'status' goes to the oldest outstanding request, the others lost their
+// connection with it.
+static void conn_fail(iot_client_t *c, client_conn_t *conn, int status, int err) {
+    conn_close(c, conn);
+    conn->state = CONN_DOWN;
+    conn_fail_pending(c, conn, status, IOT_CLIENT_ECONN);
+    conn_down(c, conn, err);
+}
+
+static void conn_fail_pending(iot_client_t *c, client_conn_t *conn, int status, int rest_status) {
+    iot_response_t resp = { .status = status };
+    while(conn->count > 0) {
+        pending_t p = conn->pending[conn->head];
+        conn->head = (conn->head + 1) % conn->slots;
+        conn->count--;
+        c->pending--;
+        if(p.cb) {
+            p.cb(p.arg, &resp);
+            c->calls++;
+        }
+        resp.status = rest_status;
+    }
+    conn->head = 0;
+}
+
+static int conn_watch(iot_client_t *c, client_conn_t *conn, uint32_t events) {
+    if(conn->events == events) {
+        return 0;
+    }
+    struct epoll_event ev = { .events = events, .data.u32 = conn->index };
+    if(epoll_ctl(c->epfd, conn->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+        return -1;
+    }
+    conn->events = events;
+    return 0;
+}
+
+static void conn_connected(iot_client_t *c, client_conn_t *conn) {
+    conn->state = CONN_UP;
+    conn->backoff_ms = c->cfg.reconnect_min_ms;
+    conn->progress_ns = c->now_ns;
+    if(conn->index == 0 && c->subscribed) {
+        // Uses the slot kept free for it, so it cannot fail for lack of room.
+        conn_queue(c, conn, TLV_TYPE_SUBSCRIBE_REQUEST, c->sub_ids, (uint16_t)(c->sub_count * sizeof(uint32_t)),
+                   PENDING_SUBSCRIBE, NULL, NULL);
+    }
+    if(c->on_connection) {
+        c->on_connection(c->connection_arg, conn->index, 1, 0);
+    }
+}
+
+static void conn_event(iot_client_t *c, client_conn_t *conn, uint32_t events) {
+    if(conn->state == CONN_CONNECTING) {
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        if(getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0) {
+            err = errno;
+        }
+        if(err != 0) {
+            conn_fail(c, conn, IOT_CLIENT_ECONN, err);
+            return;
+        }
+        if(!(events & EPOLLOUT)) {
+            return;
+        }
+        conn_connected(c, conn);
+    }
+    if((events & EPOLLOUT) && conn_flush(c, conn) < 0) {
+        return;
+    }
+    if(events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        conn_read(c, conn);
+    }
+}
+
+static int conn_flush(iot_client_t *c, client_conn_t *conn) {
+    int rc = tlv_writer_flush(&conn->tx, conn->fd);
+    if(rc < 0) {
+        conn_fail(c, conn, IOT_CLIENT_ECONN, errno);
+        return -1;
+    }
+    if(rc == 0 && conn_watch(c, conn, EPOLLIN) < 0) {
+        conn_fail(c, conn, IOT_CLIENT_ECONN, errno);
+        return -1;
+    }
+    return 0;
+}
+
+// One read per event; level-triggered epoll reports the rest next poll.
+static void conn_read(iot_client_t *c, client_conn_t *conn) {
+    ssize_t n = tlv_reader_fill(&conn->rx, conn->fd);
+    if(n == 0) {
+        conn_fail(c, conn, IOT_CLIENT_ECONN, 0);
+        return;
+    }
+    if(n < 0) {
+        if(errno != EAGAIN && errno != EWOULDBLOCK) {
+            conn_fail(c, conn, errno == EMSGSIZE ? IOT_CLIENT_EPROTO : IOT_CLIENT_ECONN, errno);
+        }
+        return;
+    }
+
+    uint16_t type = 0, len = 0;
+    const uint8_t *value = NULL;
+    int rc;
+    while((rc = tlv_reader_next(&conn->rx, &type, &value, &len)) == 1) {
+        if(conn_dispatch(c, conn, type, value, len) < 0) {
+            conn_fail(c, conn, IOT_CLIENT_EPROTO, EPROTO);
+            return;
+        }
+    }
+    if(rc < 0) {
+        conn_fail(c, conn, IOT_CLIENT_EPROTO, EMSGSIZE);
+    }
+}
+
+// Matches a reply to the oldest outstanding request; -1 if it cannot be.
+static int conn_dispatch(iot_client_t *c, client_conn_t *conn, uint16_t type, const uint8_t *value, uint16_t len) {
+    if(type == TLV_TYPE_STATUS_UPDATE) {
+        if(len % sizeof(device_status_t) != 0) {
+            return -1;
+        }
+        if(c->on_update) {
+            c->on_update(c->update_arg, (const device_status_t *)value, len / sizeof(device_status_t));
+            c->calls++;
+        }
+        return 0;
+    }
+    if(conn->count == 0) {
+        return -1;
+    }
+
+    pending_t p = conn->pending[conn->head];
+    int more = (p.response == TLV_TYPE_LIST_END && type == TLV_TYPE_LIST_CHUNK);
+    if(!more && type != p.response) {
+        return -1;
+    }
+    conn->progress_ns = c->now_ns;
+    if(!more) {
+        conn->head = (conn->head + 1) % conn->slots;
+        conn->count--;
+        c->pending--;
+    }
+
+    if(p.flags & PENDING_SUBSCRIBE) {
+        c->subscribed = c->sub_wanted && len == 1 && value[0] == 0;
+    } else if((p.flags & PENDING_UNSUBSCRIBE) && !c->sub_wanted) {
+        // Updates sent before the unsubscribe have all arrived.
+        c->on_update = NULL;
+        c->update_arg = NULL;
+    }
+    if(p.cb) {
+        iot_response_t resp = { .status = IOT_CLIENT_OK, .type = type, .len = len, .value = value, .more = more };
+        p.cb(p.arg, &resp);
+        c->calls++;
+    }
+    return 0;
+}
+
+// Never does I/O, so callbacks can submit while a connection is being read.
+static int conn_queue(iot_client_t *c, client_conn_t *conn, uint16_t type, const void *value, uint16_t len,
+                      uint16_t flags, iot_response_cb_t cb, void *arg) {
+    if(conn->state == CONN_UP && tlv_writer_pending(&conn->tx) == 0 && conn_watch(c, conn, EPOLLIN | EPOLLOUT) < 0) {
+        return -1;
+    }
+    if(tlv_writer_put(&conn->tx, type, value, len) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if(conn->count == 0 && c->cfg.timeout_ms) {
+        conn->progress_ns = now_ns();
+    }
+    pending_t *p = &conn->pending[(conn->head + conn->count) % conn->slots];
+    p->response = response_type(type);
+    p->flags = flags;
+    p->cb = cb;
+    p->arg = arg;
+    conn->count++;
+    c->pending++;
+    return 0;
+}
+
+// The least busy connection that is up, else one still connecting.
+static client_conn_t *pick_conn(iot_client_t *c) {
+    client_conn_t *best = NULL;
+    int full = 0;
+    if(c->closing) {
+        errno = ECANCELED;
+        return NULL;
+    }
+    for(unsigned i = 0; i < c->cfg.connections; i++) {
+        client_conn_t *conn = &c->conns[(c->next + i) % c->cfg.connections];
+        if(conn->state == CONN_DOWN) {
+            continue;
+        }
+        if(conn->count >= c->cfg.max_inflight) {
+            full = 1;
+            continue;
+        }
+        if(!best || (conn->state == CONN_UP && best->state != CONN_UP) ||
+           (conn->state == best->state && conn->count < best->count)) {
+            best = conn;
+        }
+    }
+    if(!best) {
+        errno = full ? EAGAIN : ENOTCONN;
+        return NULL;
+    }
+    c->next = (best->index + 1) % c->cfg.connections;
+    return best;
+}
+
+// Requests queued by callbacks may be stamped later than the start of the
+// poll, so the clock is read again here.
+static void run_timers(iot_client_t *c) {
+    uint64_t now = now_ns();
+    c->now_ns = now;
+    for(unsigned i = 0; i < c->cfg.connections; i++) {
+        client_conn_t *conn = &c->conns[i];
+        if(conn->state == CONN_DOWN) {
+            if(now >= conn->retry_ns) {
+                conn_open(c, conn);
+            }
+        } else if(conn->state == CONN_CONNECTING) {
+            if(now >= conn->progress_ns + (uint64_t)c->cfg.connect_timeout_ms * 1000000ull) {
+                conn_fail(c, conn, IOT_CLIENT_ECONN, ETIMEDOUT);
+            }
+        } else if(conn->count > 0 && c->cfg.timeout_ms) {
+            // Later replies could no longer be matched, so the connection goes.
+            if(now >= conn->progress_ns + (uint64_t)c->cfg.timeout_ms * 1000000ull) {
+                conn_fail(c, conn, IOT_CLIENT_ETIMEDOUT, ETIMEDOUT);
+            }
+        }
+    }
+}
+
+// Points the timerfd at the earliest reconnect or timeout.
+static void arm_timer(iot_client_t *c) {
+    uint64_t next = 0;
+    for(unsigned i = 0; i < c->cfg.connections; i++) {
+        const client_conn_t *conn = &c->conns[i];
+        uint64_t due = 0;
+        if(conn->state == CONN_DOWN) {
+            due = conn->retry_ns;
+        } else if(conn->state == CONN_CONNECTING) {
+            due = conn->progress_ns + (uint64_t)c->cfg.connect_timeout_ms * 1000000ull;
+        } else if(conn->count > 0 && c->cfg.timeout_ms) {
+            due = conn->progress_ns + (uint64_t)c->cfg.timeout_ms * 1000000ull;
+        }
+        if(due && (!next || due < next)) {
+            next = due;
+        }
+    }
+    if(next == c->timer_ns) {
+        return;
+    }
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t)(next / 1000000000ull);
+    its.it_value.tv_nsec = (long)(next % 1000000000ull);
+    if(next && its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+        its.it_value.tv_nsec = 1;
+    }
+    if(timerfd_settime(c->timerfd, TFD_TIMER_ABSTIME, &its, NULL) == 0) {
+        c->timer_ns = next;
+    }
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+// Asynchronous client for the device monitor protocol. A client keeps a
+// pool of connections to one server; requests are queued on the least busy
+// one and pipelined, and each completes through its callback once the reply
+// arrives. Replies come back in order per connection but not across the
+// pool, so requests whose order matters need a pool of one.
+//
+// Nothing blocks except iot_client_poll() with a timeout, the name lookup
+// in iot_client_create() and iot_client_discover(). Drive a client either by
+// calling iot_client_poll() in a loop, or by watching iot_client_fd() in an
+// existing event loop and calling iot_client_poll(c, 0) whenever it is
+// readable. Lost connections are
+// reopened with exponential backoff; requests in flight on them fail with
+// IOT_CLIENT_ECONN and are not retried. A client is not thread-safe.
+
+#include "protocol.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define IOT_CLIENT_DEFAULT_CONNECTIONS 1
+#define IOT_CLIENT_DEFAULT_MAX_INFLIGHT 256
+#define IOT_CLIENT_DEFAULT_CONNECT_TIMEOUT_MS 5000
+#define IOT_CLIENT_DEFAULT_RECONNECT_MIN_MS 100
+#define IOT_CLIENT_DEFAULT_RECONNECT_MAX_MS 5000
+// How long discovery keeps listening after the first answer.
+#define IOT_CLIENT_DISCOVER_WINDOW_MS 200
+#define IOT_CLIENT_HOST_LEN 16 // dotted IPv4 and its NUL
+
+// iot_response_t.status
+enum {
+    IOT_CLIENT_OK = 0,
+    IOT_CLIENT_ECONN = -1,     // connection lost or not established
+    IOT_CLIENT_ETIMEDOUT = -2, // no reply in time; the connection is reopened
+    IOT_CLIENT_EPROTO = -3,    // unexpected reply; the connection is reopened
+    IOT_CLIENT_ECANCELED = -4, // the client was destroyed
+};
+
+typedef struct iot_client iot_client_t;
+
+typedef struct {
+    const char *host;
+    uint16_t port;
+    unsigned connections;        // pool size, 0 = IOT_CLIENT_DEFAULT_CONNECTIONS
+    unsigned max_inflight;       // per connection, 0 = default
+    unsigned timeout_ms;         // per reply, 0 = wait forever
+    unsigned connect_timeout_ms; // 0 = default
+    unsigned reconnect_min_ms;   // first retry delay, 0 = default
+    unsigned reconnect_max_ms;   // backoff cap, 0 = default
+} iot_client_config_t;
+
+typedef struct {
+    int status;           // IOT_CLIENT_OK or an IOT_CLIENT_E* code
+    uint16_t type;        // response TLV type, 0 on error
+    uint16_t len;
+    const uint8_t *value; // valid only during the callback
+    int more;             // a LIST_CHUNK: the callback runs again for the rest
+} iot_response_t;
+
+// Runs from iot_client_poll() or iot_client_destroy(). It may submit new
+// requests but must not destroy the client.
+typedef void (*iot_response_cb_t)(void *arg, const iot_response_t *resp);
+// STATUS_UPDATE frames pushed for the subscription.
+typedef void (*iot_update_cb_t)(void *arg, const device_status_t *devs, size_t count);
+// Connection 'index' of the pool came up, or went down or failed to connect
+// with 'err' (an errno, 0 when the server closed it).
+typedef void (*iot_connection_cb_t)(void *arg, unsigned index, int up, int err);
+
+// Resolves 'host' and starts connecting; NULL with errno set on failure.
+iot_client_t *iot_client_create(const iot_client_config_t *cfg);
+// Closes every connection; pending requests complete with IOT_CLIENT_ECANCELED.
+void iot_client_destroy(iot_client_t *c);
+
+void iot_client_on_connection(iot_client_t *c, iot_connection_cb_t cb, void *arg);
+
+// Readable whenever iot_client_poll() has work: replies, writable sockets,
+// timeouts or reconnects that are due.
+int iot_client_fd(const iot_client_t *c);
+// Handles whatever is ready, waiting up to 'timeout_ms' (-1 = forever) for
+// something to be. Number of callbacks run, or -1 with errno set.
+int iot_client_poll(iot_client_t *c, int timeout_ms);
+
+// Requests submitted and not yet completed.
+size_t iot_client_pending(const iot_client_t *c);
+// Connections that are currently up.
+unsigned iot_client_connected(const iot_client_t *c);
+
+// Queue a request; it is sent on the next iot_client_poll(). -1 with errno
+// EAGAIN when every connection has max_inflight requests outstanding (poll
+// and retry), ENOTCONN when none is up or connecting, EINVAL for a request
+// type the server does not answer or a (un)subscribe, which have their own
+// calls below.
+int iot_client_submit(iot_client_t *c, uint16_t type, const void *value, uint16_t len,
+                      iot_response_cb_t cb, void *arg);
+
+// Helpers that encode the request values described in protocol.h.
+int iot_client_get(iot_client_t *c, uint32_t device_id, iot_response_cb_t cb, void *arg);
+int iot_client_set(iot_client_t *c, uint32_t device_id, float temperature, iot_response_cb_t cb, void *arg);
+int iot_client_multi_get(iot_client_t *c, const uint32_t *ids, size_t count, iot_response_cb_t cb, void *arg);
+int iot_client_multi_set(iot_client_t *c, const uint32_t *ids, const float *temps, size_t count,
+                         iot_response_cb_t cb, void *arg);
+int iot_client_list(iot_client_t *c, iot_response_cb_t cb, void *arg);
+int iot_client_list_since(iot_client_t *c, uint64_t generation, iot_response_cb_t cb, void *arg);
+int iot_client_list_filter(iot_client_t *c, uint8_t status_mask, uint8_t battery_min, uint8_t battery_max,
+                           float temp_min, float temp_max, iot_response_cb_t cb, void *arg);
+int iot_client_history(iot_client_t *c, uint32_t device_id, int64_t from_ms, uint32_t skip, int64_t to_ms,
+                       uint32_t bucket_ms, iot_response_cb_t cb, void *arg);
+// 'filter' NULL aggregates every device; otherwise TLV_AGGREGATE_REQUEST_LEN
+// bytes as built by iot_client_aggregate_request().
+int iot_client_aggregate(iot_client_t *c, const uint8_t *filter, iot_response_cb_t cb, void *arg);
+void iot_client_aggregate_request(uint8_t out[TLV_AGGREGATE_REQUEST_LEN], uint8_t status_mask,
+                                  uint8_t battery_min, uint8_t battery_max, float temp_min, float temp_max,
+                                  float hist_lo, float hist_hi);
+int iot_client_stats(iot_client_t *c, iot_response_cb_t cb, void *arg);
+
+// Follow 'count' devices (0 = all) through 'update', on the first connection
+// of the pool. The subscription is renewed whenever that connection is
+// reopened; 'cb' gets the SUBSCRIBE_RESPONSE.
+int iot_client_subscribe(iot_client_t *c, const uint32_t *ids, size_t count, iot_update_cb_t update,
+                         void *update_arg, iot_response_cb_t cb, void *arg);
+// Updates stop once 'cb' has run. With the connection down (ENOTCONN) the
+// subscription is dropped right away and not renewed.
+int iot_client_unsubscribe(iot_client_t *c, iot_response_cb_t cb, void *arg);
+
+// One DISCOVER_RESPONSE. Servers that send only their port leave the rest 0.
+typedef struct {
+    char host[IOT_CLIENT_HOST_LEN];
+    uint16_t port;
+    uint32_t server_id;
+    unsigned workers;
+    uint32_t connections;  // open client connections
+    uint32_t request_rate; // requests handled in the last second
+    uint32_t shards;
+    uint32_t devices;
+} iot_server_info_t;
+
+// Multicast a DISCOVER_REQUEST, wait up to 'timeout_ms' for the first
+// answer and 'window_ms' more for the others. Fills 'out' with up to 'max'
+// servers, each once, and returns how many answered, or -1 with errno set
+// (ETIMEDOUT if none did).
+int iot_client_discover_all(iot_server_info_t *out, size_t max, unsigned timeout_ms, unsigned window_ms);
+// Index of the server to use: the less loaded, per worker, of two drawn at
+// random. Clients that discover together thus spread over the servers
+// instead of all picking the one that looked idlest, while still favouring
+// it. Open connections break ties in requests per second.
+size_t iot_client_pick_server(const iot_server_info_t *servers, size_t count);
+// iot_client_discover_all() with IOT_CLIENT_DISCOVER_WINDOW_MS, then
+// iot_client_pick_server(); -1 with errno set if no server answered.
+int iot_client_discover(char *out_host, size_t host_size, uint16_t *out_port, unsigned timeout_ms);
@@ -3,10 +3,16 @@
 #include <asm-generic/errno-base.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define TLV_WRITER_INITIAL_CAP 1024
+#define TLV_WRITER_KEEP_CAP (16 * 1024)
 
 static ssize_t read_all(int fd, void *buf, size_t count) {
     uint8_t *ptr = buf;
@@ -52,12 +58,32 @@ int send_tlv(int fd, uint16_t type, const void *value, uint16_t length) {
     hdr.type = htons(type);
     hdr.length = htons(length);
 
-    if(write_all(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr)) {
+    // Header and payload leave in one writev so they share a segment.
+    struct iovec iov[2] = {
+        { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = (void *)value, .iov_len = (value != NULL) ? length : 0 },
+    };
+    size_t total = iov[0].iov_len + iov[1].iov_len;
+
+    ssize_t n;
+    do {
+        n = writev(fd, iov, 2);
+    } while(n < 0 && errno == EINTR);
+    if(n < 0) {
         return -1;
     }
 
-    if(length > 0 && value != NULL) {
-        if(write_all(fd, value, length) != (ssize_t)length) {
+    if((size_t)n < total) {
+        // Short write: push the remainder out the slow way.
+        size_t done = (size_t)n;
+        if(done < sizeof(hdr)) {
+            if(write_all(fd, (uint8_t *)&hdr + done, sizeof(hdr) - done) < 0) {
+                return -1;
+            }
+            done = sizeof(hdr);
+        }
+        size_t sent = done - sizeof(hdr);
+        if(write_all(fd, (const uint8_t *)value + sent, iov[1].iov_len - sent) < 0) {
             return -1;
         }
     }
@@ -150,4 +176,208 @@ int tlv_decode_buf(const uint8_t *in, size_t in_size, uint16_t *out_type, const
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+int tlv_reader_init(tlv_reader_t *r, size_t initial_cap, size_t max_cap) {
+    memset(r, 0, sizeof(*r));
+    if(initial_cap < sizeof(tlv_header_t) || max_cap < initial_cap) {
+        errno = EINVAL;
+        return -1;
+    }
+    r->initial_cap = initial_cap;
+    r->max_cap = max_cap;
+    return 0;
+}
+
+void tlv_reader_free(tlv_reader_t *r) {
+    free(r->buf);
+    memset(r, 0, sizeof(*r));
+}
+
+// Make room past r->tail: start over when empty, compact, or grow.
+static int reader_reserve(tlv_reader_t *r) {
+    if(r->head == r->tail) {
+        r->head = r->tail = 0;
+        if(r->cap > r->initial_cap) {
+            // Idle again after a large frame: give the memory back.
+            free(r->buf);
+            r->buf = NULL;
+            r->cap = 0;
+        }
+    }
+
+    if(r->buf == NULL) {
+        r->buf = malloc(r->initial_cap);
+        if(!r->buf) {
+            return -1;
+        }
+        r->cap = r->initial_cap;
+    }
+
+    if(r->tail == r->cap) {
+        if(r->head > 0) {
+            memmove(r->buf, r->buf + r->head, r->tail - r->head);
+            r->tail -= r->head;
+            r->head = 0;
+        } else if(r->cap < r->max_cap) {
+            size_t cap = r->cap * 2;
+            if(cap > r->max_cap) {
+                cap = r->max_cap;
+            }
+            uint8_t *buf = realloc(r->buf, cap);
+            if(!buf) {
+                return -1;
+            }
+            r->buf = buf;
+            r->cap = cap;
+        } else {
+            errno = EMSGSIZE;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+ssize_t tlv_reader_fill(tlv_reader_t *r, int fd) {
+    if(reader_reserve(r) < 0) {
+        return -1;
+    }
+
+    ssize_t n;
+    do {
+        n = read(fd, r->buf + r->tail, r->cap - r->tail);
+    } while(n < 0 && errno == EINTR);
+
+    if(n > 0) {
+        r->tail += (size_t)n;
+    }
+    return n;
+}
+
+size_t tlv_reader_append(tlv_reader_t *r, const void *data, size_t len) {
+    const uint8_t *p = data;
+    size_t done = 0;
+    while(done < len && reader_reserve(r) == 0) {
+        size_t take = r->cap - r->tail;
+        take = (take < len - done) ? take : len - done;
+        memcpy(r->buf + r->tail, p + done, take);
+        r->tail += take;
+        done += take;
+    }
+    return done;
+}
+
+int tlv_reader_next(tlv_reader_t *r, uint16_t *type, const uint8_t **value, uint16_t *len) {
+    size_t avail = r->tail - r->head;
+    if(avail < sizeof(tlv_header_t)) {
+        return 0;
+    }
+
+    tlv_header_t hdr;
+    memcpy(&hdr, r->buf + r->head, sizeof(hdr));
+    size_t frame = sizeof(hdr) + ntohs(hdr.length);
+    if(frame > r->max_cap) {
+        return -1;
+    }
+    if(avail < frame) {
+        return 0;
+    }
+
+    if(type) *type = ntohs(hdr.type);
+    if(len) *len = ntohs(hdr.length);
+    if(value) *value = r->buf + r->head + sizeof(hdr);
+    r->head += frame;
+    return 1;
+}
+
+size_t tlv_reader_buffered(const tlv_reader_t *r) {
+    return r->tail - r->head;
+}
+
+int tlv_reader_ready(const tlv_reader_t *r) {
+    size_t avail = r->tail - r->head;
+    if(avail < sizeof(tlv_header_t)) {
+        return 0;
+    }
+    tlv_header_t hdr;
+    memcpy(&hdr, r->buf + r->head, sizeof(hdr));
+    return avail >= sizeof(hdr) + ntohs(hdr.length);
+}
+
+void tlv_writer_init(tlv_writer_t *w) {
+    memset(w, 0, sizeof(*w));
+}
+
+void tlv_writer_free(tlv_writer_t *w) {
+    free(w->buf);
+    memset(w, 0, sizeof(*w));
+}
+
+int tlv_writer_put(tlv_writer_t *w, uint16_t type, const void *value, uint16_t len) {
+    size_t need = sizeof(tlv_header_t) + len;
+
+    if(w->off > 0 && w->off == w->len) {
+        w->off = w->len = 0;
+    }
+
+    if(w->cap - w->len < need) {
+        if(w->off > 0) {
+            memmove(w->buf, w->buf + w->off, w->len - w->off);
+            w->len -= w->off;
+            w->off = 0;
+        }
+        size_t cap = w->cap ? w->cap : TLV_WRITER_INITIAL_CAP;
+        while(cap - w->len < need) {
+            cap *= 2;
+        }
+        if(cap != w->cap) {
+            uint8_t *buf = realloc(w->buf, cap);
+            if(!buf) {
+                return -1;
+            }
+            w->buf = buf;
+            w->cap = cap;
+        }
+    }
+
+    size_t written = 0;
+    if(tlv_encode_buf(w->buf + w->len, w->cap - w->len, type, value, len, &written) < 0) {
+        return -1;
+    }
+    w->len += written;
+    return 0;
+}
+
+size_t tlv_writer_pending(const tlv_writer_t *w) {
+    return w->len - w->off;
+}
+
+int tlv_writer_flush(tlv_writer_t *w, int fd) {
+    while(w->off < w->len) {
+        ssize_t n = send(fd, w->buf + w->off, w->len - w->off, MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            return -1;
+        }
+        tlv_writer_consumed(w, (size_t)n);
+    }
+    return 0;
+}
+
+void tlv_writer_consumed(tlv_writer_t *w, size_t n) {
+    w->off += n;
+    if(w->off < w->len) {
+        return;
+    }
+    w->off = w->len = 0;
+    if(w->cap > TLV_WRITER_KEEP_CAP) {
+        free(w->buf);
+        w->buf = NULL;
+        w->cap = 0;
+    }
+}
@@ -2,15 +2,123 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #define TLV_TYPE_DISCOVER_REQUEST   0x01
 #define TLV_TYPE_DISCOVER_RESPONSE  0x02
 #define TLV_TYPE_LIST_REQUEST       0x10
-#define TLV_TYPE_LIST_RESPONSE      0x11
+#define TLV_TYPE_LIST_RESPONSE      0x11 // superseded by LIST_CHUNK/LIST_END
 #define TLV_TYPE_GET_REQUEST        0x13
 #define TLV_TYPE_GET_RESPONSE       0x14
 #define TLV_TYPE_SET_REQUEST        0x15
 #define TLV_TYPE_SET_RESPONSE       0x16
+#define TLV_TYPE_MULTI_GET_REQUEST  0x17
+#define TLV_TYPE_MULTI_GET_RESPONSE 0x18
+#define TLV_TYPE_MULTI_SET_REQUEST  0x19
+#define TLV_TYPE_MULTI_SET_RESPONSE 0x1A
+
+// DISCOVER_REQUEST:  empty, multicast to the discovery group
+// DISCOVER_RESPONSE: uint16 TCP port, then uint32 server_id (random per run),
+//                    uint16 worker threads, uint32 open connections, uint32
+//                    requests handled in the last second, uint32 registry
+//                    shards, uint32 devices, all network order. Old servers
+//                    send the port only.
+#define TLV_DISCOVER_RESPONSE_LEN 24
+
+// MULTI_GET_REQUEST:  N x uint32 device_id (network order)
+// MULTI_GET_RESPONSE: N result bytes (0 = found, 1 = not found), then one
+//                     device_status_t per found device, in request order
+// MULTI_SET_REQUEST:  N x { uint32 device_id, uint32 temperature bits } (network order)
+// MULTI_SET_RESPONSE: N result bytes with the SET_RESPONSE codes
+// A malformed batch or one larger than TLV_MULTI_MAX_ITEMS gets an empty response.
+#define TLV_MULTI_MAX_ITEMS 4096
+
+#define TLV_TYPE_LIST_CHUNK         0x1B
+#define TLV_TYPE_LIST_END           0x1C
+#define TLV_TYPE_LIST_SINCE_REQUEST 0x1D
+#define TLV_TYPE_LIST_FILTER_REQUEST 0x1E
+
+// LIST_REQUEST:       empty, or a uint32 cursor (network order) to resume from
+// LIST_SINCE_REQUEST: uint64 generation (network order); only devices changed
+//                     after it are streamed
+// LIST_FILTER_REQUEST: uint8 status_mask (bit s admits status s, 0 = any),
+//                     uint8 battery_min, uint8 battery_max, uint8 reserved, then
+//                     temp_min, temp_max as float bits (network order); only
+//                     matching devices are streamed, a malformed filter matches none
+// LIST_CHUNK:         uint32 cursor to resume after this chunk (network order),
+//                     then up to TLV_LIST_CHUNK_MAX_DEVICES device_status_t.
+//                     LIST_SINCE and LIST_FILTER streams cannot be resumed and
+//                     carry cursor 0.
+// LIST_END:           uint32 number of devices streamed, then the uint64
+//                     generation the listing is complete up to (network order);
+//                     pass it to the next LIST_SINCE_REQUEST
+#define TLV_LIST_CHUNK_MAX_DEVICES 4096
+#define TLV_LIST_FILTER_REQUEST_LEN 12
+
+#define TLV_TYPE_SUBSCRIBE_REQUEST   0x20
+#define TLV_TYPE_SUBSCRIBE_RESPONSE  0x21
+#define TLV_TYPE_STATUS_UPDATE       0x22
+#define TLV_TYPE_UNSUBSCRIBE_REQUEST 0x23
+
+// SUBSCRIBE_REQUEST:   empty to follow every device, or N x uint32 device_id
+//                      (network order); replaces any earlier subscription
+// UNSUBSCRIBE_REQUEST: empty
+// SUBSCRIBE_RESPONSE:  uint8 result, 0 = ok, 1 = rejected
+// STATUS_UPDATE:       pushed unrequested between responses, up to
+//                      TLV_STATUS_UPDATE_MAX_DEVICES device_status_t with the
+//                      current state of changed devices. A device that changes
+//                      again before it is sent is reported once.
+#define TLV_STATUS_UPDATE_MAX_DEVICES 256
+
+#define TLV_TYPE_HISTORY_REQUEST    0x30
+#define TLV_TYPE_HISTORY_RESPONSE   0x31
+
+// HISTORY_REQUEST:  uint32 device_id, uint64 from_ms, uint64 to_ms, uint32 bucket_ms
+//                   (network order, milliseconds since the epoch), optionally
+//                   uint32 skip; bucket_ms 0 asks for the raw samples, of which
+//                   the first 'skip' at from_ms are left out
+// HISTORY_RESPONSE: uint8 result (0 = ok, 1 = no history, 2 = bad request),
+//                   uint8 kind (0 = samples, 1 = buckets), uint64 resume_ms
+//                   (network order; 0 when the range is complete, otherwise the
+//                   from_ms of the follow-up request), uint32 resume_skip (its
+//                   skip: samples at resume_ms already sent), then
+//                   history_sample_t or history_bucket_t records
+#define TLV_HISTORY_REQUEST_LEN (2 * sizeof(uint32_t) + 2 * sizeof(uint64_t))
+#define TLV_HISTORY_HEADER_LEN (2 + sizeof(uint64_t) + sizeof(uint32_t))
+
+#define TLV_TYPE_AGGREGATE_REQUEST  0x32
+#define TLV_TYPE_AGGREGATE_RESPONSE 0x33
+
+// AGGREGATE_REQUEST:  empty to aggregate every device, or uint8 status_mask
+//                     (bit s admits status s, 0 = any), uint8 battery_min,
+//                     uint8 battery_max, uint8 reserved, then temp_min, temp_max,
+//                     hist_lo, hist_hi as float bits (network order). Devices
+//                     outside the battery or temperature bounds are skipped.
+// AGGREGATE_RESPONSE: one aggregate_stats_t, or empty for a malformed request
+#define TLV_AGGREGATE_REQUEST_LEN 20
+#define TLV_AGGREGATE_TEMP_BINS 16
+#define TLV_AGGREGATE_BATTERY_BINS 10
+#define TLV_AGGREGATE_DEFAULT_HIST_LO (-20.0f)
+#define TLV_AGGREGATE_DEFAULT_HIST_HI 60.0f
+
+#define TLV_TYPE_TELEMETRY          0x40
+
+// TELEMETRY: sent by devices to the UDP ingest port, never answered. uint32
+//            device_id, temperature float bits (network order), uint8 battery
+//            (0-100), uint8 status (0-7, one bit of a status_mask). A datagram
+//            may carry several back to back; parsing stops at the first
+//            malformed one.
+#define TLV_TELEMETRY_LEN 10
+
+#define TLV_TYPE_STATS_REQUEST      0x50
+#define TLV_TYPE_STATS_RESPONSE     0x51
+
+// STATS_REQUEST:  empty
+// STATS_RESPONSE: one stats_header_t, then a stats_request_t for every request
+//                 type the server has handled (type 0 sums unknown types),
+//                 or empty for a malformed request. Latencies are the time
+//                 spent handling a request, as upper bounds accurate to 1/16
+//                 of their magnitude.
 
 typedef struct {
     uint16_t type;
@@ -26,9 +134,110 @@ typedef struct {
     uint8_t status; // 0=OFFLINE, 1=ONLINE, 2=ERROR
 } __attribute__((packed)) device_status_t;
 
+typedef struct {
+    int64_t ts_ms;
+    float value;
+} __attribute__((packed)) history_sample_t;
+
+typedef struct {
+    int64_t start_ms;
+    float min;
+    float max;
+    float avg;
+    uint32_t count;
+} __attribute__((packed)) history_bucket_t;
+
+typedef struct {
+    uint32_t count;
+    double temp_sum;
+    float temp_min; // min, max and the means are 0 when count is 0
+    float temp_max;
+    float temp_mean;
+    float battery_mean;
+    // hist_lo..hist_hi in equal bins; colder and warmer devices land in the end bins
+    uint32_t temp_hist[TLV_AGGREGATE_TEMP_BINS];
+    // 0-9 %, 10-19 %, ..., 90-100 %
+    uint32_t battery_hist[TLV_AGGREGATE_BATTERY_BINS];
+} __attribute__((packed)) aggregate_stats_t;
+
+typedef struct {
+    uint64_t uptime_ms;
+    uint64_t connections_active;
+    uint64_t connections_accepted;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t lock_acquired;  // registry shard lock acquisitions
+    uint64_t lock_contended; // ... that had to wait
+    uint64_t lock_wait_ns;   // total time spent waiting
+    uint64_t list_cache_hits;     // LISTs served from the current encoded frame
+    uint64_t list_cache_misses;   // ... that found it stale
+    uint64_t list_cache_rebuilds; // frames encoded
+    uint32_t type_count;     // stats_request_t records that follow
+} __attribute__((packed)) stats_header_t;
+
+typedef struct {
+    uint16_t type;
+    uint64_t count;
+    uint64_t failed; // handling failed and the connection was closed
+    uint64_t mean_ns;
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+} __attribute__((packed)) stats_request_t;
+
 
 int send_tlv(int fd, uint16_t type, const void *value, uint16_t length);
 int recv_tlv(int fd, uint16_t *type, void *buf, uint16_t bufsize, uint16_t *out_length);
 
 int tlv_encode_buf(uint8_t *out, size_t out_size, uint16_t type, const void *value, uint16_t len, size_t *out_len);
-int tlv_decode_buf(const uint8_t *in, size_t in_size, uint16_t *out_type, const uint8_t **out_value, uint16_t *out_len);
\ No newline at end of file
+int tlv_decode_buf(const uint8_t *in, size_t in_size, uint16_t *out_type, const uint8_t **out_value, uint16_t *out_len);
+
+
+#define TLV_MAX_FRAME (sizeof(tlv_header_t) + UINT16_MAX)
+
+// Buffered frame reader: each fill() pulls in as much as the socket has
+// ready and next() hands out every complete TLV without further syscalls.
+// The buffer grows on demand up to max_cap and shrinks back when idle.
+typedef struct {
+    uint8_t *buf;
+    size_t cap;
+    size_t initial_cap;
+    size_t max_cap;
+    size_t head; // first unparsed byte
+    size_t tail; // end of received data
+} tlv_reader_t;
+
+int tlv_reader_init(tlv_reader_t *r, size_t initial_cap, size_t max_cap);
+void tlv_reader_free(tlv_reader_t *r);
+// One read() into the free space: bytes read, 0 on EOF, -1 on error (errno
+// is EAGAIN on an empty non-blocking socket, EMSGSIZE if a frame exceeds max_cap).
+ssize_t tlv_reader_fill(tlv_reader_t *r, int fd);
+// Copy bytes received by other means into the buffer; returns how many fit
+// before it reached max_cap with no frame consumed.
+size_t tlv_reader_append(tlv_reader_t *r, const void *data, size_t len);
+// 1 with the next frame (value stays valid until the next fill), 0 if no
+// complete frame is buffered, -1 if the pending frame can never fit.
+int tlv_reader_next(tlv_reader_t *r, uint16_t *type, const uint8_t **value, uint16_t *len);
+size_t tlv_reader_buffered(const tlv_reader_t *r);
+// 1 if next() would hand out a frame without another fill.
+int tlv_reader_ready(const tlv_reader_t *r);
+
+// Buffered frame writer: frames are encoded back to back and a flush
+// writes the whole batch with a single send() where the socket allows.
+typedef struct {
+    uint8_t *buf;
+    size_t cap;
+    size_t len;
+    size_t off;
+} tlv_writer_t;
+
+void tlv_writer_init(tlv_writer_t *w);
+void tlv_writer_free(tlv_writer_t *w);
+int tlv_writer_put(tlv_writer_t *w, uint16_t type, const void *value, uint16_t len);
+size_t tlv_writer_pending(const tlv_writer_t *w);
+// 0 once everything is written, 1 if the socket would block, -1 on error.
+int tlv_writer_flush(tlv_writer_t *w, int fd);
+// Mark 'n' pending bytes as sent by other means.
+void tlv_writer_consumed(tlv_writer_t *w, size_t n);
\ No newline at end of file
@@ -0,0 +1,356 @@
+#include "aggregate.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <immintrin.h>
+
+typedef void (*aggregate_kernel_t)(aggregate_t *agg, const aggregate_filter_t *f,
+                                   const float *temperature, const uint8_t *battery, const uint8_t *status, size_t n);
+
+typedef struct {
+    const char *name;
+    aggregate_kernel_t kernel;
+    int (*supported)(void);
+} aggregate_impl_t;
+
+static int cpu_has_avx2(void);
+static int cpu_has_sse41(void);
+static int cpu_any(void);
+static void select_kernel(void);
+static float hist_scale(const aggregate_filter_t *f);
+static int record_matches(const aggregate_filter_t *f, float t, uint8_t battery, uint8_t status);
+static void record_add(aggregate_t *agg, const aggregate_filter_t *f, float scale, float t, uint8_t battery);
+static void merge_hist(aggregate_t *agg, uint32_t (*temp_hist)[TLV_AGGREGATE_TEMP_BINS],
+                       uint32_t (*battery_hist)[TLV_AGGREGATE_BATTERY_BINS], int copies);
+static void kernel_scalar(aggregate_t *agg, const aggregate_filter_t *f,
+                          const float *temperature, const uint8_t *battery, const uint8_t *status, size_t n);
+static void kernel_sse41(aggregate_t *agg, const aggregate_filter_t *f,
+                         const float *temperature, const uint8_t *battery, const uint8_t *status, size_t n);
+static void kernel_avx2(aggregate_t *agg, const aggregate_filter_t *f,
+                        const float *temperature, const uint8_t *battery, const uint8_t *status, size_t n);
+
+// Widest first; the first one the CPU supports is used by default.
+static const aggregate_impl_t g_impls[] = {
+    { "avx2",   kernel_avx2,   cpu_has_avx2 },
+    { "sse4.1", kernel_sse41,  cpu_has_sse41 },
+    { "scalar", kernel_scalar, cpu_any },
+};
+
+static pthread_once_t g_select_once = PTHREAD_ONCE_INIT;
+static const aggregate_impl_t *g_impl;
+
+void aggregate_filter_all(aggregate_filter_t *f) {
+    f->status_mask = 0xff;
+    f->battery_min = 0;
+    f->battery_max = UINT8_MAX;
+    f->temp_min = -INFINITY;
+    f->temp_max = INFINITY;
+    f->hist_lo = TLV_AGGREGATE_DEFAULT_HIST_LO;
+    f->hist_hi = TLV_AGGREGATE_DEFAULT_HIST_HI;
+}
+
+void aggregate_init(aggregate_t *agg) {
+    memset(agg, 0, sizeof(*agg));
+    agg->temp_min = INFINITY;
+    agg->temp_max = -INFINITY;
+}
+
+void aggregate_columns(aggregate_t *agg, const aggregate_filter_t *f,
+                       const float *temperature, const uint8_t *battery, const uint8_t *status, size_t n) {
+    pthread_once(&g_select_once, select_kernel);
+    g_impl->kernel(agg, f, temperature, battery, status, n);
+}
+
+void aggregate_finish(const aggregate_t *agg, aggregate_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+    out->count = (uint32_t)agg->count;
+    out->temp_sum = agg->temp_sum;
+    if(agg->count > 0) {
+        out->temp_min = agg->temp_min;
+        out->temp_max = agg->temp_max;
+        out->temp_mean = (float)(agg->temp_sum / (double)agg->count);
+        out->battery_mean = (float)((double)agg->battery_sum / (double)agg->count);
+    }
+    for(int i = 0; i < TLV_AGGREGATE_TEMP_BINS; i++) {
+        out->temp_hist[i] = (uint32_t)agg->temp_hist[i];
+    }
+    for(int i = 0; i < TLV_AGGREGATE_BATTERY_BINS; i++) {
+        out->battery_hist[i] = (uint32_t)agg->battery_hist[i];
+    }
+}
+
+const char *aggregate_kernel_name(void) {
+    pthread_once(&g_select_once, select_kernel);
+    return g_impl->name;
+}
+
+int aggregate_use_kernel(const char *name) {
+    pthread_once(&g_select_once, select_kernel);
+    for(size_t i = 0; i < sizeof(g_impls) / sizeof(g_impls[0]); i++) {
+        if(strcmp(g_impls[i].name, name) == 0 && g_impls[i].supported()) {
+            g_impl = &g_impls[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int cpu_has_avx2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+
+static int cpu_has_sse41(void) {
+    return __builtin_cpu_supports("sse4.1");
+}
+
+static int cpu_any(void) {
+    return 1;
+}
+
+static void select_kernel(void) {
+    __builtin_cpu_init();
+    for(size_t i = 0; i < sizeof(g_impls) / sizeof(g_impls[0]); i++) {
+        if(g_impls[i].supported()) {
+            g_impl = &g_impls[i];
+            return;
+        }
+    }
+}
+
+static float hist_scale(const aggregate_filter_t *f) {
+    return (f->hist_hi > f->hist_lo) ? TLV_AGGREGATE_TEMP_BINS / (f->hist_hi - f->hist_lo) : 0.0f;
+}
+
+static int record_matches(const aggregate_filter_t *f, float t, uint8_t battery, uint8_t status) {
+    return status < 8 && ((f->status_mask >> status) & 1) &&
+           battery >= f->battery_min && battery <= f->battery_max &&
+           t >= f->temp_min && t <= f->temp_max;
+}
+
+// Shared by every kernel, so the SIMD paths bin exactly like the scalar one.
+static void record_add(aggregate_t *agg, const aggregate_filter_t *f, float scale, float t, uint8_t battery) {
+    agg->count++;
+    if(t < agg->temp_min) agg->temp_min = t;
+    if(t > agg->temp_max) agg->temp_max = t;
+    agg->temp_sum += t;
+    agg->battery_sum += battery;
+
+    float bin = (t - f->hist_lo) * scale;
+    bin = (bin > 0.0f) ? bin : 0.0f;
+    bin = (bin < TLV_AGGREGATE_TEMP_BINS - 1) ? bin : TLV_AGGREGATE_TEMP_BINS - 1;
+    agg->temp_hist[(int)bin]++;
+    agg->battery_hist[(battery < 90) ? battery / 10 : TLV_AGGREGATE_BATTERY_BINS - 1]++;
+}
+
+static void kernel_scalar(aggregate_t *agg, const aggregate_filter_t *f,
+                          const float *temperature, const uint8_t *battery, const uint8_t *status, size_t n) {
+    float scale = hist_scale(f);
+    for(size_t i = 0; i < n; i++) {
+        if(record_matches(f, temperature[i], battery[i], status[i])) {
+            record_add(agg, f, scale, temperature[i], battery[i]);
+        }
+    }
+}
+
+static void merge_hist(aggregate_t *agg, uint32_t (*temp_hist)[TLV_AGGREGATE_TEMP_BINS],
+                       uint32_t (*battery_hist)[TLV_AGGREGATE_BATTERY_BINS], int copies) {
+    for(int c = 0; c < copies; c++) {
+        for(int k = 0; k < TLV_AGGREGATE_TEMP_BINS; k++) {
+            agg->temp_hist[k] += temp_hist[c][k];
+        }
+        for(int k = 0; k < TLV_AGGREGATE_BATTERY_BINS; k++) {
+            agg->battery_hist[k] += battery_hist[c][k];
+        }
+    }
+}
+
+// SIMD kernels: the filter is evaluated on byte lanes for status and battery
+// (status admission is a pshufb lookup of the mask) and widened to the float
+// lanes of the temperature test. Count, min, max and the sums stay in vector
+// accumulators; histogram bins are computed in vector form and only the
+// increments of admitted lanes are done one by one, into a histogram per
+// lane so that runs of equal bins do not serialize on one counter.
+// battery / 10 is (battery * 205) >> 11 for every uint8_t.
+
+__attribute__((target("sse4.1")))
+static void kernel_sse41(aggregate_t *agg, const aggregate_filter_t *f,
+                         const float *temperature, const uint8_t *battery, const uint8_t *status, size_t n) {
+    int8_t lut_bytes[16] = { 0 };
+    for(int s = 0; s < 8; s++) {
+        lut_bytes[s] = ((f->status_mask >> s) & 1) ? -1 : 0;
+    }
+    const __m128i lut = _mm_loadu_si128((const __m128i *)lut_bytes);
+    const __m128i seven = _mm_set1_epi8(7);
+    const __m128i bmin = _mm_set1_epi8((char)f->battery_min);
+    const __m128i bmax = _mm_set1_epi8((char)f->battery_max);
+    const __m128 tmin = _mm_set1_ps(f->temp_min);
+    const __m128 tmax = _mm_set1_ps(f->temp_max);
+    const __m128 lo = _mm_set1_ps(f->hist_lo);
+    const __m128 scale = _mm_set1_ps(hist_scale(f));
+    const __m128 last_bin = _mm_set1_ps(TLV_AGGREGATE_TEMP_BINS - 1);
+    const __m128 pos_inf = _mm_set1_ps(INFINITY);
+    const __m128 neg_inf = _mm_set1_ps(-INFINITY);
+    const __m128i div10 = _mm_set1_epi16(205);
+    const __m128i last_battery_bin = _mm_set1_epi16(TLV_AGGREGATE_BATTERY_BINS - 1);
+    uint32_t temp_hist[4][TLV_AGGREGATE_TEMP_BINS] = { 0 };
+    uint32_t battery_hist[4][TLV_AGGREGATE_BATTERY_BINS] = { 0 };
+
+    __m128 vmin = pos_inf, vmax = neg_inf;
+    __m128d sum = _mm_setzero_pd();
+    __m128i bsum = _mm_setzero_si128();
+    uint64_t count = 0;
+    size_t i = 0;
+
+    for(; i + 4 <= n; i += 4) {
+        int32_t s_word, b_word;
+        memcpy(&s_word, status + i, sizeof(s_word));
+        memcpy(&b_word, battery + i, sizeof(b_word));
+        __m128i s = _mm_cvtsi32_si128(s_word);
+        __m128i b = _mm_cvtsi32_si128(b_word);
+
+        __m128i ok = _mm_and_si128(_mm_shuffle_epi8(lut, s), _mm_cmpeq_epi8(_mm_min_epu8(s, seven), s));
+        ok = _mm_and_si128(ok, _mm_cmpeq_epi8(_mm_max_epu8(b, bmin), b));
+        ok = _mm_and_si128(ok, _mm_cmpeq_epi8(_mm_min_epu8(b, bmax), b));
+
+        __m128 t = _mm_loadu_ps(temperature + i);
+        __m128 m = _mm_castsi128_ps(_mm_cvtepi8_epi32(ok));
+        m = _mm_and_ps(m, _mm_cmpge_ps(t, tmin));
+        m = _mm_and_ps(m, _mm_cmple_ps(t, tmax));
+        int bits = _mm_movemask_ps(m);
+        if(bits == 0) {
+            continue;
+        }
+
+        count += (uint64_t)__builtin_popcount((unsigned)bits);
+        vmin = _mm_min_ps(vmin, _mm_blendv_ps(pos_inf, t, m));
+        vmax = _mm_max_ps(vmax, _mm_blendv_ps(neg_inf, t, m));
+        __m128 tz = _mm_and_ps(t, m);
+        sum = _mm_add_pd(sum, _mm_cvtps_pd(tz));
+        sum = _mm_add_pd(sum, _mm_cvtps_pd(_mm_movehl_ps(tz, tz)));
+        bsum = _mm_add_epi32(bsum, _mm_and_si128(_mm_cvtepu8_epi32(b), _mm_castps_si128(m)));
+
+        __m128 fb = _mm_mul_ps(_mm_sub_ps(t, lo), scale);
+        fb = _mm_min_ps(_mm_max_ps(fb, _mm_setzero_ps()), last_bin);
+        __m128i bb = _mm_srli_epi16(_mm_mullo_epi16(_mm_cvtepu8_epi16(b), div10), 11);
+        bb = _mm_min_epu16(bb, last_battery_bin);
+        int32_t bins[4];
+        uint16_t battery_bins[8];
+        _mm_storeu_si128((__m128i *)bins, _mm_cvttps_epi32(fb));
+        _mm_storeu_si128((__m128i *)battery_bins, bb);
+        while(bits) {
+            int k = __builtin_ctz((unsigned)bits);
+            bits &= bits - 1;
+            temp_hist[k][bins[k]]++;
+            battery_hist[k][battery_bins[k]]++;
+        }
+    }
+    merge_hist(agg, temp_hist, battery_hist, 4);
+
+    float mins[4], maxs[4];
+    double sums[2];
+    uint32_t bsums[4];
+    _mm_storeu_ps(mins, vmin);
+    _mm_storeu_ps(maxs, vmax);
+    _mm_storeu_pd(sums, sum);
+    _mm_storeu_si128((__m128i *)bsums, bsum);
+    for(int k = 0; k < 4; k++) {
+        if(mins[k] < agg->temp_min) agg->temp_min = mins[k];
+        if(maxs[k] > agg->temp_max) agg->temp_max = maxs[k];
+        agg->battery_sum += bsums[k];
+    }
+    agg->temp_sum += sums[0] + sums[1];
+    agg->count += count;
+
+    kernel_scalar(agg, f, temperature + i, battery + i, status + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void kernel_avx2(aggregate_t *agg, const aggregate_filter_t *f,
+                        const float *temperature, const uint8_t *battery, const uint8_t *status, size_t n) {
+    int8_t lut_bytes[16] = { 0 };
+    for(int s = 0; s < 8; s++) {
+        lut_bytes[s] = ((f->status_mask >> s) & 1) ? -1 : 0;
+    }
+    const __m128i lut = _mm_loadu_si128((const __m128i *)lut_bytes);
+    const __m128i seven = _mm_set1_epi8(7);
+    const __m128i bmin = _mm_set1_epi8((char)f->battery_min);
+    const __m128i bmax = _mm_set1_epi8((char)f->battery_max);
+    const __m256 tmin = _mm256_set1_ps(f->temp_min);
+    const __m256 tmax = _mm256_set1_ps(f->temp_max);
+    const __m256 lo = _mm256_set1_ps(f->hist_lo);
+    const __m256 scale = _mm256_set1_ps(hist_scale(f));
+    const __m256 last_bin = _mm256_set1_ps(TLV_AGGREGATE_TEMP_BINS - 1);
+    const __m256 pos_inf = _mm256_set1_ps(INFINITY);
+    const __m256 neg_inf = _mm256_set1_ps(-INFINITY);
+    const __m128i div10 = _mm_set1_epi16(205);
+    const __m128i last_battery_bin = _mm_set1_epi16(TLV_AGGREGATE_BATTERY_BINS - 1);
+    uint32_t temp_hist[8][TLV_AGGREGATE_TEMP_BINS] = { 0 };
+    uint32_t battery_hist[8][TLV_AGGREGATE_BATTERY_BINS] = { 0 };
+
+    __m256 vmin = pos_inf, vmax = neg_inf;
+    __m256d sum_lo = _mm256_setzero_pd(), sum_hi = _mm256_setzero_pd();
+    __m256i bsum = _mm256_setzero_si256();
+    uint64_t count = 0;
+    size_t i = 0;
+
+    for(; i + 8 <= n; i += 8) {
+        __m128i s = _mm_loadl_epi64((const __m128i *)(status + i));
+        __m128i b = _mm_loadl_epi64((const __m128i *)(battery + i));
+
+        __m128i ok = _mm_and_si128(_mm_shuffle_epi8(lut, s), _mm_cmpeq_epi8(_mm_min_epu8(s, seven), s));
+        ok = _mm_and_si128(ok, _mm_cmpeq_epi8(_mm_max_epu8(b, bmin), b));
+        ok = _mm_and_si128(ok, _mm_cmpeq_epi8(_mm_min_epu8(b, bmax), b));
+
+        __m256 t = _mm256_loadu_ps(temperature + i);
+        __m256 m = _mm256_castsi256_ps(_mm256_cvtepi8_epi32(ok));
+        m = _mm256_and_ps(m, _mm256_cmp_ps(t, tmin, _CMP_GE_OQ));
+        m = _mm256_and_ps(m, _mm256_cmp_ps(t, tmax, _CMP_LE_OQ));
+        int bits = _mm256_movemask_ps(m);
+        if(bits == 0) {
+            continue;
+        }
+
+        count += (uint64_t)__builtin_popcount((unsigned)bits);
+        vmin = _mm256_min_ps(vmin, _mm256_blendv_ps(pos_inf, t, m));
+        vmax = _mm256_max_ps(vmax, _mm256_blendv_ps(neg_inf, t, m));
+        __m256 tz = _mm256_and_ps(t, m);
+        sum_lo = _mm256_add_pd(sum_lo, _mm256_cvtps_pd(_mm256_castps256_ps128(tz)));
+        sum_hi = _mm256_add_pd(sum_hi, _mm256_cvtps_pd(_mm256_extractf128_ps(tz, 1)));
+        bsum = _mm256_add_epi32(bsum, _mm256_and_si256(_mm256_cvtepu8_epi32(b), _mm256_castps_si256(m)));
+
+        __m256 fb = _mm256_mul_ps(_mm256_sub_ps(t, lo), scale);
+        fb = _mm256_min_ps(_mm256_max_ps(fb, _mm256_setzero_ps()), last_bin);
+        __m128i bb = _mm_srli_epi16(_mm_mullo_epi16(_mm_cvtepu8_epi16(b), div10), 11);
+        bb = _mm_min_epu16(bb, last_battery_bin);
+        int32_t bins[8];
+        uint16_t battery_bins[8];
+        _mm256_storeu_si256((__m256i *)bins, _mm256_cvttps_epi32(fb));
+        _mm_storeu_si128((__m128i *)battery_bins, bb);
+        while(bits) {
+            int k = __builtin_ctz((unsigned)bits);
+            bits &= bits - 1;
+            temp_hist[k][bins[k]]++;
+            battery_hist[k][battery_bins[k]]++;
+        }
+    }
+    merge_hist(agg, temp_hist, battery_hist, 8);
+
+    float mins[8], maxs[8];
+    double sums[4];
+    uint32_t bsums[8];
+    _mm256_storeu_ps(mins, vmin);
+    _mm256_storeu_ps(maxs, vmax);
+    _mm256_storeu_pd(sums, _mm256_add_pd(sum_lo, sum_hi));
+    _mm256_storeu_si256((__m256i *)bsums, bsum);
+    for(int k = 0; k < 8; k++) {
+        if(mins[k] < agg->temp_min) agg->temp_min = mins[k];
+        if(maxs[k] > agg->temp_max) agg->temp_max = maxs[k];
+        agg->battery_sum += bsums[k];
+    }
+    agg->temp_sum += sums[0] + sums[1] + sums[2] + sums[3];
+    agg->count += count;
+
+    kernel_scalar(agg, f, temperature + i, battery + i, status + i, n - i);
+}
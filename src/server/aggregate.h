@@ -0,0 +1,41 @@
+#pragma once
+
+#include "protocol.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    uint8_t status_mask; // bit s admits status s; statuses above 7 never match
+    uint8_t battery_min;
+    uint8_t battery_max;
+    float temp_min;
+    float temp_max;
+    float hist_lo; // temperature histogram range
+    float hist_hi;
+} aggregate_filter_t;
+
+typedef struct {
+    uint64_t count;
+    float temp_min;
+    float temp_max;
+    double temp_sum;
+    uint64_t battery_sum;
+    uint64_t temp_hist[TLV_AGGREGATE_TEMP_BINS];
+    uint64_t battery_hist[TLV_AGGREGATE_BATTERY_BINS];
+} aggregate_t;
+
+// A filter that admits every device, with the default histogram range.
+void aggregate_filter_all(aggregate_filter_t *f);
+void aggregate_init(aggregate_t *agg);
+
+// Fold 'n' records given as columns into 'agg', using the widest kernel
+// the CPU supports.
+void aggregate_columns(aggregate_t *agg, const aggregate_filter_t *f,
+                       const float *temperature, const uint8_t *battery, const uint8_t *status, size_t n);
+void aggregate_finish(const aggregate_t *agg, aggregate_stats_t *out);
+
+// "avx2", "sse4.1" or "scalar".
+const char *aggregate_kernel_name(void);
+// Pin a kernel by name, e.g. to compare them; -1 if unknown or unsupported.
+int aggregate_use_kernel(const char *name);
@@ -0,0 +1,192 @@
+#include "conn.h"
+#include "list_cache.h"
+#include "metrics.h"
+#include "reactor.h"
+#include "server.h"
+#include "subscription.h"
+#include "wal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+static int conn_process(conn_t *c);
+static size_t conn_tx_pending(const conn_t *c);
+
+conn_t *conn_new(int fd, struct reactor *r) {
+    conn_t *c = calloc(1, sizeof(*c));
+    if(!c) {
+        return NULL;
+    }
+    if(tlv_reader_init(&c->rx, CONN_RX_INITIAL_SIZE, TLV_MAX_FRAME) < 0) {
+        free(c);
+        return NULL;
+    }
+    tlv_writer_init(&c->tx);
+    tlv_writer_init(&c->tx_flight);
+    c->fd = fd;
+    c->reactor = r;
+    c->rx_ready = 1;
+    return c;
+}
+
+void conn_free(conn_t *c) {
+    if(!c) {
+        return;
+    }
+    close(c->fd);
+    tlv_reader_free(&c->rx);
+    tlv_writer_free(&c->tx);
+    tlv_writer_free(&c->tx_flight);
+    free(c->rx_backlog);
+    list_frame_release(c->stream.frame);
+    free(c);
+}
+
+int conn_send_tlv(conn_t *c, uint16_t type, const void *value, uint16_t length) {
+    return tlv_writer_put(&c->tx, type, value, length);
+}
+
+void conn_frame_sent(conn_t *c) {
+    list_frame_release(c->stream.frame);
+    c->stream.frame = NULL;
+    c->stream.frame_off = 0;
+    c->stream.active = 0;
+}
+
+int conn_service(conn_t *c, int readable) {
+    if(readable) {
+        c->rx_ready = 1;
+    }
+
+    while(1) {
+        if(conn_process(c) < 0) {
+            return -1;
+        }
+        if(c->wal_lsn > wal_durable_lsn()) {
+            if(wal_failed()) {
+                return -1; // its SETs can never be acknowledged as durable
+            }
+            reactor_wait_durable(c->reactor, c);
+            return 0; // resumed once the WAL group holding its SETs is durable
+        }
+
+        // A cached LIST frame ends inside the flush.
+        int streaming = c->stream.active;
+        int frc = reactor_flush(c->reactor, c);
+        if(frc < 0) {
+            return -1;
+        }
+        if(frc > 0 && conn_tx_pending(c) >= CONN_TX_HIGH_WATER) {
+            return 0; // resumed once the socket drains
+        }
+        if(frc == 0 && (streaming || subscription_pending(c) > 0)) {
+            continue; // socket drained: produce the next frames
+        }
+        if(c->stream.active || tlv_reader_ready(&c->rx)) {
+            // Input already waits behind the stream or queued requests; read
+            // no more so a pipelining client is held back by TCP instead of
+            // overrunning rx.
+            if(frc == 0) {
+                continue;
+            }
+            return 0; // resumed once the socket drains
+        }
+        if(c->peer_closed) {
+            // Everything received has been answered; close once it is sent.
+            return (frc == 0) ? -1 : 0;
+        }
+        if(!c->rx_ready) {
+            return 0;
+        }
+
+        size_t before = c->rx.cap - c->rx.tail;
+        ssize_t n = tlv_reader_fill(&c->rx, c->fd);
+        if(n > 0) {
+            metrics_bytes_in((size_t)n);
+            // A short read drained the socket; the next arrival raises a new edge.
+            if((size_t)n < before) {
+                c->rx_ready = 0;
+            }
+            continue;
+        }
+        if(n == 0) {
+            // Peer closed; answer what was already received, held like any
+            // other output until its SETs are durable, then close.
+            c->peer_closed = 1;
+            c->rx_ready = 0;
+            continue;
+        }
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            c->rx_ready = 0;
+            return 0;
+        }
+        if(errno == EMSGSIZE) {
+            LOGE("request exceeds %zu byte frame limit", c->rx.max_cap);
+        }
+        return -1;
+    }
+}
+
+static int conn_process(conn_t *c) {
+    // Back-to-back requests share a clock read: one's end is the next's start.
+    uint64_t started = 0;
+
+    while(conn_tx_pending(c) < CONN_TX_HIGH_WATER) {
+        if(c->stream.active) {
+            if(c->stream.mode == CONN_STREAM_CACHED) {
+                break; // nothing to produce: the reactor sends the frame
+            }
+            if(dispatch_stream(c) < 0) {
+                return -1;
+            }
+            started = 0;
+            continue;
+        }
+
+        uint16_t type = 0, len = 0;
+        const uint8_t *payload = NULL;
+
+        int rc = tlv_reader_next(&c->rx, &type, &payload, &len);
+        if(rc == 0) {
+            // Requests are answered first; pushed updates fill the idle time.
+            int drc = subscription_drain(c);
+            if(drc < 0) {
+                return -1;
+            }
+            if(drc == 0) {
+                break;
+            }
+            started = 0;
+            continue;
+        }
+        if(rc < 0) {
+            LOGE("malformed request frame");
+            return -1;
+        }
+
+        atomic_fetch_add_explicit(&c->reactor->stats.requests, 1, memory_order_relaxed);
+        if(started == 0) {
+            started = metrics_now_ns();
+        }
+        int hrc = dispatch_request(c, type, payload, len);
+        uint64_t finished = metrics_now_ns();
+        metrics_request(type, finished - started, hrc < 0);
+        if(hrc < 0) {
+            return -1;
+        }
+        started = finished;
+    }
+    return 0;
+}
+
+// Queued output, counting what is left of a cached LIST frame.
+static size_t conn_tx_pending(const conn_t *c) {
+    size_t pending = tlv_writer_pending(&c->tx);
+    if(c->stream.frame) {
+        pending += c->stream.frame->len - c->stream.frame_off;
+    }
+    return pending;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "protocol.h"
+#include "registry.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Receive buffer for an idle connection; it grows up to TLV_MAX_FRAME on demand.
+#define CONN_RX_INITIAL_SIZE 1024
+// Stop parsing new requests while this much output is still queued.
+#define CONN_TX_HIGH_WATER (64 * 1024)
+
+struct reactor;
+
+struct list_frame;
+
+// What drives a stream: the scan cursor (LIST), 'changes' (LIST_SINCE),
+// 'filter' (LIST_FILTER) or the shared encoded 'frame' (cached LIST), which
+// the reactor sends from frame_off on once tx is empty.
+enum {
+    CONN_STREAM_CURSOR = 0,
+    CONN_STREAM_SINCE,
+    CONN_STREAM_FILTER,
+    CONN_STREAM_CACHED,
+};
+
+// Multi-frame response in progress. It is produced a frame at a time as
+// the socket drains, and later requests wait until it has finished.
+typedef struct {
+    int active;
+    uint32_t cursor;
+    uint32_t sent;
+    uint64_t generation; // reported in LIST_END
+    int mode;
+    registry_delta_t changes;
+    registry_filter_t filter;
+    struct list_frame *frame;
+    size_t frame_off;
+} conn_stream_t;
+
+typedef struct conn {
+    int fd;
+    struct reactor *reactor;
+
+    tlv_reader_t rx; // incremental parse state: received, not yet dispatched
+    tlv_writer_t tx; // encoded responses waiting for the socket
+    int rx_ready;    // socket may hold unread bytes (epoll backend)
+    conn_stream_t stream;
+    struct subscription *sub; // NULL unless the peer subscribed
+
+    // Pending-wakeup list of the owning reactor, guarded by its wake_lock.
+    struct conn *wake_next;
+    int wake_queued;
+
+    // Strict durability: queued output is held until the WAL record of the
+    // last SET is durable; meanwhile the conn is on its reactor's durable list.
+    uint64_t wal_lsn;
+    struct conn *durable_next;
+    int durable_queued;
+
+    // io_uring backend: tx is swapped in here while the kernel sends it.
+    tlv_writer_t tx_flight;
+    // Received while rx was full; receiving pauses until it is consumed.
+    uint8_t *rx_backlog;
+    size_t rx_backlog_len;
+    int recv_armed;
+    int recv_paused;
+    int send_inflight;
+    int rx_eof;      // the receive saw EOF
+    int peer_closed; // ... and all input has reached rx
+    int closing;     // closed, freed once no operation refers to it
+
+    struct conn *prev;
+    struct conn *next;
+} conn_t;
+
+conn_t *conn_new(int fd, struct reactor *r);
+void conn_free(conn_t *c);
+
+// Queue a response frame; it is written by the next conn_service().
+int conn_send_tlv(conn_t *c, uint16_t type, const void *value, uint16_t length);
+
+// Done sending the cached LIST frame: drop the reference, end the stream.
+void conn_frame_sent(conn_t *c);
+
+// Drain the socket, dispatch every complete frame and flush the responses
+// with one send. 'readable' reports an EPOLLIN edge. Returns 0 while the
+// connection stays open, -1 when it must be closed.
+int conn_service(conn_t *c, int readable);
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+
+// murmur3 finalizer over a device id. The registry, history and
+// subscription tables all index by it: the top bits pick a shard or
+// stripe, the low bits the home bucket.
+static inline uint32_t hash_device_id(uint32_t id) {
+    id ^= id >> 16;
+    id *= 0x85ebca6bu;
+    id ^= id >> 13;
+    id *= 0xc2b2ae35u;
+    id ^= id >> 16;
+    return id;
+}
@@ -0,0 +1,657 @@
+#include "history.h"
+#include "hash.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+#define HISTORY_STRIPES 64
+#define HISTORY_STRIPE_BITS 6
+#define HISTORY_NOT_FOUND UINT32_MAX
+#define HISTORY_ALIGN 64
+// Worst case for one sample: 4 + 32 timestamp bits and 2 + 5 + 5 + 32 value bits.
+#define HISTORY_MAX_SAMPLE_BITS 80
+// Decoding loads 8 bytes at a time, so copied blocks carry this much slack.
+#define HISTORY_READ_SLACK 8
+#define HISTORY_NO_WINDOW 0xff
+
+// Gorilla-style block: the first sample is stored raw in the header, every
+// later one as a delta-of-delta timestamp and the XOR of the value with the
+// previous one, in a big-endian bit stream filling the rest of the block.
+typedef struct {
+    int64_t first_ts;
+    int64_t last_ts;
+    uint32_t first_value; // float bits
+    uint32_t count;
+    uint32_t bits;        // payload bits in use
+    uint32_t reserved;
+} history_block_header_t;
+
+#define HISTORY_PAYLOAD_BITS ((uint32_t)(HISTORY_BLOCK_SIZE - sizeof(history_block_header_t)) * 8)
+
+// series_ref is the series + 1 so that a zero-filled page is an empty table.
+typedef struct {
+    uint32_t device_id;
+    uint32_t series_ref;
+} history_entry_t;
+
+// Encoder state of one device. Its blocks form a ring in the stripe's pool.
+typedef struct {
+    uint32_t head; // block being appended to
+    uint32_t used; // blocks holding samples, up to the depth
+    int64_t last_ts;
+    int64_t last_delta;
+    uint32_t last_value;
+    uint8_t leading; // XOR window of the last value, HISTORY_NO_WINDOW at block start
+    uint8_t trailing;
+} history_series_t;
+
+// Devices are partitioned by hash; each stripe has its own lock, index and pool.
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;
+    history_entry_t *index;
+    uint32_t index_mask;
+    uint32_t count;
+    uint32_t capacity;
+    history_series_t *series;
+    uint8_t *blocks; // series k owns blocks [k * depth, (k + 1) * depth)
+} history_stripe_t;
+
+typedef struct {
+    history_stripe_t *stripes;
+    size_t depth;
+    void *region;
+    size_t region_size;
+    _Atomic uint64_t dropped; // samples of devices that found every stripe slot taken
+} history_t;
+
+typedef struct {
+    const uint8_t *payload;
+    uint32_t pos;
+    uint32_t left;
+    int started;
+    int64_t ts;
+    int64_t delta;
+    uint32_t value;
+    uint8_t leading;
+    uint8_t trailing;
+} history_decoder_t;
+
+static history_t g_history;
+
+static size_t round_pow2(size_t v);
+static size_t align_up(size_t v);
+static uint32_t stripe_find(history_stripe_t *st, uint32_t hash, uint32_t device_id, int create);
+static uint8_t *series_block(const history_stripe_t *st, uint32_t series, uint32_t block);
+static void group_by_stripe(const uint32_t *hashes, size_t count, uint32_t *order, uint32_t *starts);
+static void series_append(history_stripe_t *st, uint32_t series, int64_t ts, float value);
+static int series_copy(uint32_t device_id, int64_t from_ms, int64_t to_ms, uint8_t **out, size_t *blocks);
+static void bits_put(uint8_t *buf, uint32_t *pos, uint32_t value, unsigned n);
+static uint32_t bits_get(const uint8_t *buf, uint32_t *pos, unsigned n);
+static void put_timestamp(uint8_t *buf, uint32_t *pos, int64_t dod);
+static int64_t get_timestamp(const uint8_t *buf, uint32_t *pos);
+static void put_value(history_series_t *s, uint8_t *buf, uint32_t *pos, uint32_t value);
+static void decoder_init(history_decoder_t *d, const uint8_t *block);
+static int decoder_next(history_decoder_t *d, int64_t *ts, float *value);
+
+int history_init(size_t capacity, size_t depth) {
+    memset(&g_history, 0, sizeof(g_history));
+    if(depth == 0) {
+        return 0;
+    }
+    if(capacity == 0 || depth > HISTORY_MAX_DEPTH) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t per_stripe = (capacity + HISTORY_STRIPES - 1) / HISTORY_STRIPES;
+    per_stripe += per_stripe / 4 + 16;
+    size_t index_size = round_pow2(per_stripe * 2);
+
+    // Per-stripe layout: index | series | block pool
+    size_t index_bytes = align_up(index_size * sizeof(history_entry_t));
+    size_t series_bytes = align_up(per_stripe * sizeof(history_series_t));
+    size_t pool_bytes = per_stripe * depth * HISTORY_BLOCK_SIZE;
+    size_t stripe_bytes = index_bytes + series_bytes + pool_bytes;
+    size_t region_size = stripe_bytes * HISTORY_STRIPES;
+
+    // Sized for the worst case, but pages are only touched by devices that report.
+    void *region = mmap(NULL, region_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(region == MAP_FAILED) {
+        return -1;
+    }
+
+    history_stripe_t *stripes = aligned_alloc(64, HISTORY_STRIPES * sizeof(*stripes));
+    if(!stripes) {
+        munmap(region, region_size);
+        return -1;
+    }
+
+    for(size_t i = 0; i < HISTORY_STRIPES; i++) {
+        history_stripe_t *st = &stripes[i];
+        uint8_t *base = (uint8_t *)region + i * stripe_bytes;
+
+        memset(st, 0, sizeof(*st));
+        pthread_mutex_init(&st->lock, NULL);
+        st->index = (history_entry_t *)base;
+        st->index_mask = (uint32_t)(index_size - 1);
+        base += index_bytes;
+        st->series = (history_series_t *)base;
+        base += series_bytes;
+        st->blocks = base;
+        st->capacity = (uint32_t)per_stripe;
+    }
+
+    g_history.stripes = stripes;
+    g_history.depth = depth;
+    g_history.region = region;
+    g_history.region_size = region_size;
+    return 0;
+}
+
+void history_destroy(void) {
+    if(!g_history.stripes) {
+        return;
+    }
+    for(size_t i = 0; i < HISTORY_STRIPES; i++) {
+        pthread_mutex_destroy(&g_history.stripes[i].lock);
+    }
+    free(g_history.stripes);
+    munmap(g_history.region, g_history.region_size);
+    memset(&g_history, 0, sizeof(g_history));
+}
+
+int64_t history_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void history_record(uint32_t device_id, int64_t ts_ms, float value) {
+    if(!g_history.stripes) {
+        return;
+    }
+
+    uint32_t h = hash_device_id(device_id);
+    history_stripe_t *st = &g_history.stripes[h >> (32 - HISTORY_STRIPE_BITS)];
+
+    pthread_mutex_lock(&st->lock);
+    uint32_t series = stripe_find(st, h, device_id, 1);
+    if(series != HISTORY_NOT_FOUND) {
+        series_append(st, series, ts_ms, value);
+    } else {
+        atomic_fetch_add_explicit(&g_history.dropped, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&st->lock);
+}
+
+int history_record_many(const uint32_t *ids, const float *values, size_t count, int64_t ts_ms) {
+    if(!g_history.stripes || count == 0) {
+        return 0;
+    }
+    uint32_t *hashes = malloc(count * sizeof(*hashes));
+    uint32_t *order = malloc(count * sizeof(*order));
+    uint32_t *series = malloc(count * sizeof(*series));
+    if(!hashes || !order || !series) {
+        free(hashes);
+        free(order);
+        free(series);
+        return -1;
+    }
+
+    // With many devices every append misses on the index entry, the series
+    // and the head block, one after the other. Taking the batch in stages,
+    // each over every record, lets one stage's prefetches arrive while the
+    // rest of the stage runs.
+    for(size_t i = 0; i < count; i++) {
+        hashes[i] = hash_device_id(ids[i]);
+        const history_stripe_t *st = &g_history.stripes[hashes[i] >> (32 - HISTORY_STRIPE_BITS)];
+        __builtin_prefetch(&st->index[hashes[i] & st->index_mask]);
+    }
+    uint32_t starts[HISTORY_STRIPES + 1];
+    group_by_stripe(hashes, count, order, starts);
+
+    for(uint32_t s = 0; s < HISTORY_STRIPES; s++) {
+        history_stripe_t *st = &g_history.stripes[s];
+        if(starts[s] == starts[s + 1]) {
+            continue;
+        }
+        pthread_mutex_lock(&st->lock);
+        for(uint32_t k = starts[s]; k < starts[s + 1]; k++) {
+            uint32_t i = order[k];
+            series[i] = stripe_find(st, hashes[i], ids[i], 1);
+            if(series[i] != HISTORY_NOT_FOUND) {
+                __builtin_prefetch(&st->series[series[i]], 1);
+            }
+        }
+        pthread_mutex_unlock(&st->lock);
+    }
+    for(uint32_t s = 0; s < HISTORY_STRIPES; s++) {
+        history_stripe_t *st = &g_history.stripes[s];
+        if(starts[s] == starts[s + 1]) {
+            continue;
+        }
+        pthread_mutex_lock(&st->lock);
+        for(uint32_t k = starts[s]; k < starts[s + 1]; k++) {
+            uint32_t i = order[k];
+            if(series[i] != HISTORY_NOT_FOUND) {
+                __builtin_prefetch(series_block(st, series[i], st->series[series[i]].head), 1);
+            }
+        }
+        pthread_mutex_unlock(&st->lock);
+    }
+    for(uint32_t s = 0; s < HISTORY_STRIPES; s++) {
+        history_stripe_t *st = &g_history.stripes[s];
+        if(starts[s] == starts[s + 1]) {
+            continue;
+        }
+        pthread_mutex_lock(&st->lock);
+        for(uint32_t k = starts[s]; k < starts[s + 1]; k++) {
+            uint32_t i = order[k];
+            if(series[i] != HISTORY_NOT_FOUND) {
+                series_append(st, series[i], ts_ms, values[i]);
+            } else {
+                atomic_fetch_add_explicit(&g_history.dropped, 1, memory_order_relaxed);
+            }
+        }
+        pthread_mutex_unlock(&st->lock);
+    }
+
+    free(hashes);
+    free(order);
+    free(series);
+    return 0;
+}
+
+int history_query(uint32_t device_id, int64_t from_ms, uint32_t skip, int64_t to_ms,
+                  history_sample_t *out, size_t max, size_t *count, int64_t *resume_ms, uint32_t *resume_skip) {
+    *count = 0;
+    *resume_ms = 0;
+    *resume_skip = 0;
+
+    uint8_t *blocks = NULL;
+    size_t block_count = 0;
+    int rc = series_copy(device_id, from_ms, to_ms, &blocks, &block_count);
+    if(rc != 0) {
+        return rc;
+    }
+
+    size_t n = 0;
+    uint32_t skipped = 0;
+    for(size_t b = 0; b < block_count; b++) {
+        history_decoder_t d;
+        int64_t ts;
+        float value;
+        decoder_init(&d, blocks + b * HISTORY_BLOCK_SIZE);
+        while(decoder_next(&d, &ts, &value)) {
+            if(ts < from_ms) {
+                continue;
+            }
+            if(ts == from_ms && skipped < skip) {
+                skipped++;
+                continue;
+            }
+            if(ts > to_ms) {
+                goto done;
+            }
+            if(n == max) {
+                // A batch stamps many samples with one timestamp, so a page
+                // can end inside it; the follow-up skips what was sent.
+                uint32_t sent = (ts == from_ms) ? skipped : 0;
+                for(size_t i = n; i > 0 && out[i - 1].ts_ms == ts; i--) {
+                    sent++;
+                }
+                *resume_ms = ts;
+                *resume_skip = sent;
+                goto done;
+            }
+            out[n].ts_ms = ts;
+            out[n].value = value;
+            n++;
+        }
+    }
+
+done:
+    free(blocks);
+    *count = n;
+    return 0;
+}
+
+int history_query_buckets(uint32_t device_id, int64_t from_ms, int64_t to_ms, int64_t bucket_ms,
+                          history_bucket_t *out, size_t max, size_t *count, int64_t *resume_ms) {
+    *count = 0;
+    *resume_ms = 0;
+
+    uint8_t *blocks = NULL;
+    size_t block_count = 0;
+    int rc = series_copy(device_id, from_ms, to_ms, &blocks, &block_count);
+    if(rc != 0) {
+        return rc;
+    }
+
+    size_t n = 0;
+    int open = 0;
+    int64_t current = 0;
+    double sum = 0.0;
+    history_bucket_t bucket;
+
+    for(size_t b = 0; b < block_count; b++) {
+        history_decoder_t d;
+        int64_t ts;
+        float value;
+        decoder_init(&d, blocks + b * HISTORY_BLOCK_SIZE);
+        while(decoder_next(&d, &ts, &value)) {
+            if(ts < from_ms) {
+                continue;
+            }
+            if(ts > to_ms) {
+                goto done;
+            }
+
+            int64_t idx = (ts - from_ms) / bucket_ms;
+            if(!open || idx != current) {
+                if(open) {
+                    if(n == max) {
+                        *resume_ms = bucket.start_ms;
+                        open = 0;
+                        goto done;
+                    }
+                    bucket.avg = (float)(sum / bucket.count);
+                    out[n++] = bucket;
+                }
+                open = 1;
+                current = idx;
+                sum = 0.0;
+                bucket = (history_bucket_t){ .start_ms = from_ms + idx * bucket_ms, .min = value, .max = value };
+            }
+            if(value < bucket.min) bucket.min = value;
+            if(value > bucket.max) bucket.max = value;
+            sum += value;
+            bucket.count++;
+        }
+    }
+
+done:
+    if(open) {
+        if(n < max) {
+            bucket.avg = (float)(sum / bucket.count);
+            out[n++] = bucket;
+        } else {
+            *resume_ms = bucket.start_ms;
+        }
+    }
+    free(blocks);
+    *count = n;
+    return 0;
+}
+
+// Caller holds st->lock. With 'create', an unknown device gets a series
+// while the stripe has room.
+static uint32_t stripe_find(history_stripe_t *st, uint32_t hash, uint32_t device_id, int create) {
+    uint32_t pos = hash & st->index_mask;
+    while(st->index[pos].series_ref != 0) {
+        if(st->index[pos].device_id == device_id) {
+            return st->index[pos].series_ref - 1;
+        }
+        pos = (pos + 1) & st->index_mask;
+    }
+    if(!create || st->count == st->capacity) {
+        return HISTORY_NOT_FOUND;
+    }
+    st->index[pos].device_id = device_id;
+    st->index[pos].series_ref = st->count + 1;
+    return st->count++;
+}
+
+// Counting sort of a batch by stripe: the batch indexes of stripe s end up
+// in order[starts[s] .. starts[s + 1]).
+static void group_by_stripe(const uint32_t *hashes, size_t count, uint32_t *order, uint32_t *starts) {
+    memset(starts, 0, (HISTORY_STRIPES + 1) * sizeof(*starts));
+    for(size_t i = 0; i < count; i++) {
+        starts[(hashes[i] >> (32 - HISTORY_STRIPE_BITS)) + 1]++;
+    }
+    for(uint32_t s = 0; s < HISTORY_STRIPES; s++) {
+        starts[s + 1] += starts[s];
+    }
+    uint32_t fill[HISTORY_STRIPES];
+    memcpy(fill, starts, sizeof(fill));
+    for(size_t i = 0; i < count; i++) {
+        order[fill[hashes[i] >> (32 - HISTORY_STRIPE_BITS)]++] = (uint32_t)i;
+    }
+}
+
+static uint8_t *series_block(const history_stripe_t *st, uint32_t series, uint32_t block) {
+    return st->blocks + ((size_t)series * g_history.depth + block) * HISTORY_BLOCK_SIZE;
+}
+
+// Caller holds st->lock.
+static void series_append(history_stripe_t *st, uint32_t series, int64_t ts, float value) {
+    history_series_t *s = &st->series[series];
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    if(s->used > 0) {
+        if(ts < s->last_ts) {
+            ts = s->last_ts;
+        }
+        uint8_t *block = series_block(st, series, s->head);
+        history_block_header_t *hdr = (history_block_header_t *)block;
+        int64_t delta = ts - s->last_ts;
+        int64_t dod = delta - s->last_delta;
+
+        if(hdr->bits + HISTORY_MAX_SAMPLE_BITS <= HISTORY_PAYLOAD_BITS && dod > INT32_MIN && dod <= INT32_MAX) {
+            uint8_t *payload = block + sizeof(*hdr);
+            put_timestamp(payload, &hdr->bits, dod);
+            put_value(s, payload, &hdr->bits, bits);
+            hdr->count++;
+            hdr->last_ts = ts;
+            s->last_ts = ts;
+            s->last_delta = delta;
+            s->last_value = bits;
+            return;
+        }
+        s->head = (s->head + 1) % (uint32_t)g_history.depth;
+    }
+
+    // Start a new block, recycling the oldest once the ring is full.
+    uint8_t *block = series_block(st, series, s->head);
+    memset(block, 0, HISTORY_BLOCK_SIZE);
+    history_block_header_t *hdr = (history_block_header_t *)block;
+    hdr->first_ts = ts;
+    hdr->last_ts = ts;
+    hdr->first_value = bits;
+    hdr->count = 1;
+    if(s->used < g_history.depth) {
+        s->used++;
+    }
+    s->last_ts = ts;
+    s->last_delta = 0;
+    s->last_value = bits;
+    s->leading = HISTORY_NO_WINDOW;
+    s->trailing = 0;
+}
+
+// Copy the device's blocks that overlap [from_ms, to_ms], oldest first, into
+// a buffer the caller frees, so decoding runs without the stripe lock.
+// 0 on success, 1 if the device has no history (or the copy failed).
+static int series_copy(uint32_t device_id, int64_t from_ms, int64_t to_ms, uint8_t **out, size_t *blocks) {
+    *out = NULL;
+    *blocks = 0;
+    if(!g_history.stripes) {
+        return 1;
+    }
+
+    uint8_t *buf = malloc(g_history.depth * HISTORY_BLOCK_SIZE + HISTORY_READ_SLACK);
+    if(!buf) {
+        return 1;
+    }
+
+    uint32_t h = hash_device_id(device_id);
+    history_stripe_t *st = &g_history.stripes[h >> (32 - HISTORY_STRIPE_BITS)];
+    size_t n = 0;
+
+    pthread_mutex_lock(&st->lock);
+    uint32_t series = stripe_find(st, h, device_id, 0);
+    if(series == HISTORY_NOT_FOUND) {
+        pthread_mutex_unlock(&st->lock);
+        free(buf);
+        return 1;
+    }
+    const history_series_t *s = &st->series[series];
+    uint32_t depth = (uint32_t)g_history.depth;
+    uint32_t oldest = (s->head + depth - s->used + 1) % depth;
+    for(uint32_t i = 0; i < s->used; i++) {
+        const uint8_t *block = series_block(st, series, (oldest + i) % depth);
+        const history_block_header_t *hdr = (const history_block_header_t *)block;
+        if(hdr->last_ts < from_ms) {
+            continue;
+        }
+        if(hdr->first_ts > to_ms) {
+            break;
+        }
+        memcpy(buf + n * HISTORY_BLOCK_SIZE, block, HISTORY_BLOCK_SIZE);
+        n++;
+    }
+    pthread_mutex_unlock(&st->lock);
+
+    memset(buf + n * HISTORY_BLOCK_SIZE, 0, HISTORY_READ_SLACK);
+    *out = buf;
+    *blocks = n;
+    return 0;
+}
+
+// Append the low 'n' bits of 'value' (n <= 32) to a zero-filled stream.
+static void bits_put(uint8_t *buf, uint32_t *pos, uint32_t value, unsigned n) {
+    while(n > 0) {
+        unsigned room = 8 - (*pos & 7);
+        unsigned take = (n < room) ? n : room;
+        uint32_t chunk = (value >> (n - take)) & ((1u << take) - 1);
+        buf[*pos >> 3] |= (uint8_t)(chunk << (room - take));
+        *pos += take;
+        n -= take;
+    }
+}
+
+// Read 'n' bits (1..32); relies on HISTORY_READ_SLACK past the block end.
+static uint32_t bits_get(const uint8_t *buf, uint32_t *pos, unsigned n) {
+    uint64_t window;
+    memcpy(&window, buf + (*pos >> 3), sizeof(window));
+    window = __builtin_bswap64(window) << (*pos & 7);
+    *pos += n;
+    return (uint32_t)(window >> (64 - n));
+}
+
+// Delta-of-delta buckets: '0' | '10'+7 | '110'+9 | '1110'+12 | '1111'+32 bits.
+static void put_timestamp(uint8_t *buf, uint32_t *pos, int64_t dod) {
+    if(dod == 0) {
+        bits_put(buf, pos, 0x0, 1);
+    } else if(dod >= -63 && dod <= 64) {
+        bits_put(buf, pos, 0x2, 2);
+        bits_put(buf, pos, (uint32_t)(dod + 63), 7);
+    } else if(dod >= -255 && dod <= 256) {
+        bits_put(buf, pos, 0x6, 3);
+        bits_put(buf, pos, (uint32_t)(dod + 255), 9);
+    } else if(dod >= -2047 && dod <= 2048) {
+        bits_put(buf, pos, 0xe, 4);
+        bits_put(buf, pos, (uint32_t)(dod + 2047), 12);
+    } else {
+        bits_put(buf, pos, 0xf, 4);
+        bits_put(buf, pos, (uint32_t)(int32_t)dod, 32);
+    }
+}
+
+static int64_t get_timestamp(const uint8_t *buf, uint32_t *pos) {
+    if(bits_get(buf, pos, 1) == 0) {
+        return 0;
+    }
+    if(bits_get(buf, pos, 1) == 0) {
+        return (int64_t)bits_get(buf, pos, 7) - 63;
+    }
+    if(bits_get(buf, pos, 1) == 0) {
+        return (int64_t)bits_get(buf, pos, 9) - 255;
+    }
+    if(bits_get(buf, pos, 1) == 0) {
+        return (int64_t)bits_get(buf, pos, 12) - 2047;
+    }
+    return (int32_t)bits_get(buf, pos, 32);
+}
+
+// XOR with the previous value: '0' if equal, '10' + the bits inside the
+// previous leading/trailing-zero window, or '11' + 5-bit leading zeros +
+// 5-bit length - 1 + the meaningful bits, which opens a new window.
+static void put_value(history_series_t *s, uint8_t *buf, uint32_t *pos, uint32_t value) {
+    uint32_t x = value ^ s->last_value;
+    if(x == 0) {
+        bits_put(buf, pos, 0x0, 1);
+        return;
+    }
+
+    unsigned leading = (unsigned)__builtin_clz(x);
+    unsigned trailing = (unsigned)__builtin_ctz(x);
+    if(s->leading != HISTORY_NO_WINDOW && leading >= s->leading && trailing >= s->trailing) {
+        bits_put(buf, pos, 0x2, 2);
+        bits_put(buf, pos, x >> s->trailing, 32 - s->leading - s->trailing);
+        return;
+    }
+
+    unsigned meaningful = 32 - leading - trailing;
+    bits_put(buf, pos, 0x3, 2);
+    bits_put(buf, pos, leading, 5);
+    bits_put(buf, pos, meaningful - 1, 5);
+    bits_put(buf, pos, x >> trailing, meaningful);
+    s->leading = (uint8_t)leading;
+    s->trailing = (uint8_t)trailing;
+}
+
+static void decoder_init(history_decoder_t *d, const uint8_t *block) {
+    const history_block_header_t *hdr = (const history_block_header_t *)block;
+    memset(d, 0, sizeof(*d));
+    d->payload = block + sizeof(*hdr);
+    d->left = hdr->count;
+    d->ts = hdr->first_ts;
+    d->value = hdr->first_value;
+    d->leading = HISTORY_NO_WINDOW;
+}
+
+static int decoder_next(history_decoder_t *d, int64_t *ts, float *value) {
+    if(d->left == 0) {
+        return 0;
+    }
+
+    if(d->started) {
+        d->delta += get_timestamp(d->payload, &d->pos);
+        d->ts += d->delta;
+
+        if(bits_get(d->payload, &d->pos, 1) != 0) {
+            if(bits_get(d->payload, &d->pos, 1) != 0) {
+                d->leading = (uint8_t)bits_get(d->payload, &d->pos, 5);
+                unsigned meaningful = bits_get(d->payload, &d->pos, 5) + 1;
+                d->trailing = (uint8_t)(32 - d->leading - meaningful);
+            }
+            unsigned meaningful = 32u - d->leading - d->trailing;
+            d->value ^= bits_get(d->payload, &d->pos, meaningful) << d->trailing;
+        }
+    }
+    d->started = 1;
+    d->left--;
+
+    *ts = d->ts;
+    memcpy(value, &d->value, sizeof(*value));
+    return 1;
+}
+
+static size_t align_up(size_t v) {
+    return (v + HISTORY_ALIGN - 1) & ~(size_t)(HISTORY_ALIGN - 1);
+}
+
+static size_t round_pow2(size_t v) {
+    size_t p = 1;
+    while(p < v) p <<= 1;
+    return p;
+}
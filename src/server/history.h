@@ -0,0 +1,35 @@
+#pragma once
+
+#include "protocol.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Compressed blocks kept per device; the oldest block is recycled when full.
+#define HISTORY_DEFAULT_DEPTH 8
+#define HISTORY_MAX_DEPTH 4096
+#define HISTORY_BLOCK_SIZE 512
+
+// Room for 'capacity' devices with 'depth' blocks each. Memory is reserved
+// up front but only touched as devices report. depth == 0 disables history.
+int history_init(size_t capacity, size_t depth);
+void history_destroy(void);
+
+// Append a sample; timestamps are milliseconds since the epoch. Samples of
+// a device older than its latest one are stored at the latest timestamp.
+void history_record(uint32_t device_id, int64_t ts_ms, float value);
+// Append one sample for each of 'count' devices, all at ts_ms. Returns 0,
+// or -1 if scratch memory could not be allocated.
+int history_record_many(const uint32_t *ids, const float *values, size_t count, int64_t ts_ms);
+int64_t history_now_ms(void);
+
+// Samples of a device in [from_ms, to_ms], oldest first, up to 'max',
+// leaving out the first 'skip' at from_ms. When more samples matched,
+// *resume_ms and *resume_skip are the from_ms and skip to continue with;
+// *resume_ms is 0 otherwise. Returns 0, or 1 if the device has no history.
+int history_query(uint32_t device_id, int64_t from_ms, uint32_t skip, int64_t to_ms,
+                  history_sample_t *out, size_t max, size_t *count, int64_t *resume_ms, uint32_t *resume_skip);
+// The same range folded into buckets of 'bucket_ms' starting at from_ms;
+// buckets without samples are omitted.
+int history_query_buckets(uint32_t device_id, int64_t from_ms, int64_t to_ms, int64_t bucket_ms,
+                          history_bucket_t *out, size_t max, size_t *count, int64_t *resume_ms);
@@ -0,0 +1,290 @@
+#include "ingest.h"
+#include "history.h"
+#include "protocol.h"
+#include "registry.h"
+#include "server.h"
+#include "subscription.h"
+#include "wal.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// Upper bound of TELEMETRY records in one batch.
+#define INGEST_MAX_RECORDS (INGEST_BATCH * (INGEST_DATAGRAM_MAX / (sizeof(tlv_header_t) + TLV_TELEMETRY_LEN)))
+// How often a blocked receiver checks for ingest_stop().
+#define INGEST_POLL_MS 200
+
+typedef struct {
+    int fd;
+    pthread_t thread;
+    uint8_t *buf;            // INGEST_BATCH datagrams of INGEST_DATAGRAM_MAX bytes
+    device_status_t *devs;   // decoded records of the current batch
+    uint8_t *results;
+    uint32_t *ids;           // applied records, split for the history
+    float *temps;
+    _Atomic uint64_t datagrams;
+    _Atomic uint64_t updates;
+    _Atomic uint64_t unknown;   // records for devices that are not registered
+    _Atomic uint64_t malformed; // datagrams, or their tails, that failed to parse
+    _Atomic uint64_t dropped;   // SO_RXQ_OVFL: lost to a full socket buffer
+} ingest_worker_t;
+
+static ingest_worker_t *g_workers;
+static int g_worker_count;
+static atomic_int g_stopping;
+
+static int open_ingest_socket(struct in_addr bind_addr);
+static void *ingest_thread(void *arg);
+static size_t decode_datagram(ingest_worker_t *w, const uint8_t *p, size_t len, device_status_t *out);
+static void apply_batch(ingest_worker_t *w, size_t count);
+static void worker_free(ingest_worker_t *w);
+
+int ingest_start(int threads, const char *bind_addr) {
+    struct in_addr addr = { .s_addr = htonl(INADDR_ANY) };
+    if(bind_addr && inet_pton(AF_INET, bind_addr, &addr) != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    g_workers = calloc((size_t)threads, sizeof(*g_workers));
+    if(!g_workers) {
+        return -1;
+    }
+    atomic_store(&g_stopping, 0);
+
+    int started = 0;
+    for(; started < threads; started++) {
+        ingest_worker_t *w = &g_workers[started];
+        w->fd = open_ingest_socket(addr);
+        w->buf = malloc((size_t)INGEST_BATCH * INGEST_DATAGRAM_MAX);
+        w->devs = malloc(INGEST_MAX_RECORDS * sizeof(*w->devs));
+        w->results = malloc(INGEST_MAX_RECORDS);
+        w->ids = malloc(INGEST_MAX_RECORDS * sizeof(*w->ids));
+        w->temps = malloc(INGEST_MAX_RECORDS * sizeof(*w->temps));
+        if(w->fd < 0 || !w->buf || !w->devs || !w->results || !w->ids || !w->temps) {
+            break;
+        }
+        int rc = pthread_create(&w->thread, NULL, ingest_thread, w);
+        if(rc != 0) {
+            errno = rc;
+            break;
+        }
+    }
+    if(started < threads) {
+        int saved = errno;
+        worker_free(&g_workers[started]);
+        g_worker_count = started;
+        ingest_stop();
+        errno = saved;
+        return -1;
+    }
+
+    g_worker_count = threads;
+    LOGI("telemetry ingest on UDP %s:%d with %d thread%s", bind_addr ? bind_addr : "0.0.0.0", INGEST_PORT, threads,
+         threads == 1 ? "" : "s");
+    return 0;
+}
+
+void ingest_stop(void) {
+    atomic_store(&g_stopping, 1);
+    for(int i = 0; i < g_worker_count; i++) {
+        pthread_join(g_workers[i].thread, NULL);
+        worker_free(&g_workers[i]);
+    }
+    free(g_workers);
+    g_workers = NULL;
+    g_worker_count = 0;
+}
+
+void ingest_log_stats(void) {
+    uint64_t datagrams = 0, updates = 0, unknown = 0, malformed = 0, dropped = 0;
+    for(int i = 0; i < g_worker_count; i++) {
+        ingest_worker_t *w = &g_workers[i];
+        datagrams += atomic_load_explicit(&w->datagrams, memory_order_relaxed);
+        updates += atomic_load_explicit(&w->updates, memory_order_relaxed);
+        unknown += atomic_load_explicit(&w->unknown, memory_order_relaxed);
+        malformed += atomic_load_explicit(&w->malformed, memory_order_relaxed);
+        dropped += atomic_load_explicit(&w->dropped, memory_order_relaxed);
+    }
+    if(g_worker_count > 0) {
+        LOGI("ingest datagrams=%llu updates=%llu unknown=%llu malformed=%llu dropped=%llu",
+             (unsigned long long)datagrams, (unsigned long long)updates, (unsigned long long)unknown,
+             (unsigned long long)malformed, (unsigned long long)dropped);
+    }
+}
+
+static int open_ingest_socket(struct in_addr bind_addr) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        LOGE("ingest socket creation failed: %s", strerror(errno));
+        return -1;
+    }
+
+    int opt = 1;
+    int size = INGEST_SOCKET_BUFFER;
+    struct timeval tv = { .tv_sec = 0, .tv_usec = INGEST_POLL_MS * 1000 };
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0 ||
+       setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &opt, sizeof(opt)) < 0 ||
+       setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        LOGE("ingest setsockopt failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    // Without CAP_NET_ADMIN the size is capped by net.core.rmem_max; a
+    // smaller buffer only means earlier drops.
+    if(setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0 &&
+       setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+        LOGE("ingest SO_RCVBUF failed: %s", strerror(errno));
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr = bind_addr;
+    addr.sin_port = htons(INGEST_PORT);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        LOGE("ingest bind failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void *ingest_thread(void *arg) {
+    ingest_worker_t *w = arg;
+
+    struct mmsghdr msgs[INGEST_BATCH];
+    struct iovec iovs[INGEST_BATCH];
+    // The drop counter rides along as ancillary data on every datagram.
+    _Alignas(struct cmsghdr) char ctrl[INGEST_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+
+    while(!atomic_load(&g_stopping)) {
+        for(int i = 0; i < INGEST_BATCH; i++) {
+            iovs[i].iov_base = w->buf + (size_t)i * INGEST_DATAGRAM_MAX;
+            iovs[i].iov_len = INGEST_DATAGRAM_MAX;
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = ctrl[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+        }
+
+        // Block for the first datagram, then take whatever else is queued.
+        int n = recvmmsg(w->fd, msgs, INGEST_BATCH, MSG_WAITFORONE, NULL);
+        if(n < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                LOGE("ingest recvmmsg failed: %s", strerror(errno));
+            }
+            continue;
+        }
+
+        size_t records = 0;
+        for(int i = 0; i < n; i++) {
+            struct msghdr *h = &msgs[i].msg_hdr;
+            if(h->msg_flags & MSG_TRUNC) {
+                atomic_fetch_add_explicit(&w->malformed, 1, memory_order_relaxed);
+            } else {
+                records += decode_datagram(w, iovs[i].iov_base, msgs[i].msg_len, &w->devs[records]);
+            }
+            if(i == n - 1) {
+                for(struct cmsghdr *cm = CMSG_FIRSTHDR(h); cm; cm = CMSG_NXTHDR(h, cm)) {
+                    if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL) {
+                        uint32_t drops;
+                        memcpy(&drops, CMSG_DATA(cm), sizeof(drops));
+                        atomic_store_explicit(&w->dropped, drops, memory_order_relaxed);
+                    }
+                }
+            }
+        }
+        atomic_fetch_add_explicit(&w->datagrams, (uint64_t)n, memory_order_relaxed);
+        apply_batch(w, records);
+    }
+    return NULL;
+}
+
+// Decode the TELEMETRY records of one datagram into 'out' and return how
+// many there were.
+static size_t decode_datagram(ingest_worker_t *w, const uint8_t *p, size_t len, device_status_t *out) {
+    size_t count = 0;
+    size_t off = 0;
+    while(off < len) {
+        uint16_t type, vlen;
+        const uint8_t *v;
+        if(tlv_decode_buf(p + off, len - off, &type, &v, &vlen) < 0 ||
+           type != TLV_TYPE_TELEMETRY || vlen != TLV_TELEMETRY_LEN || v[8] > 100 ||
+           v[9] >= REGISTRY_STATUS_VALUES) {
+            atomic_fetch_add_explicit(&w->malformed, 1, memory_order_relaxed);
+            break;
+        }
+        uint32_t id_net, temp_net;
+        memcpy(&id_net, v, sizeof(id_net));
+        memcpy(&temp_net, v + 4, sizeof(temp_net));
+        temp_net = ntohl(temp_net);
+        out[count].device_id = ntohl(id_net);
+        memcpy(&out[count].temperature, &temp_net, sizeof(out[count].temperature));
+        out[count].battery = v[8];
+        out[count].status = v[9];
+        count++;
+        off += sizeof(tlv_header_t) + vlen;
+    }
+    return count;
+}
+
+// One registry and one history pass for the whole batch, then the same
+// follow-up as a SET.
+static void apply_batch(ingest_worker_t *w, size_t count) {
+    if(count == 0) {
+        return;
+    }
+    if(registry_update_many(w->devs, count, w->results) < 0) {
+        for(size_t i = 0; i < count; i++) {
+            w->results[i] = (uint8_t)registry_update(&w->devs[i]);
+        }
+    }
+
+    int64_t now_ms = history_now_ms();
+    size_t applied = 0;
+    for(size_t i = 0; i < count; i++) {
+        if(w->results[i] != 0) {
+            continue;
+        }
+        w->ids[applied] = w->devs[i].device_id;
+        w->temps[applied] = w->devs[i].temperature;
+        w->devs[applied++] = w->devs[i];
+        subscription_notify(w->devs[i].device_id);
+    }
+    if(history_record_many(w->ids, w->temps, applied, now_ms) < 0) {
+        for(size_t i = 0; i < applied; i++) {
+            history_record(w->ids[i], now_ms, w->temps[i]);
+        }
+    }
+    // Nobody waits for telemetry, so durability is whatever the log thread provides.
+    wal_append_status(w->devs, applied, now_ms);
+
+    atomic_fetch_add_explicit(&w->updates, applied, memory_order_relaxed);
+    atomic_fetch_add_explicit(&w->unknown, count - applied, memory_order_relaxed);
+}
+
+static void worker_free(ingest_worker_t *w) {
+    if(w->fd >= 0) {
+        close(w->fd);
+    }
+    free(w->buf);
+    free(w->devs);
+    free(w->results);
+    free(w->ids);
+    free(w->temps);
+    w->fd = -1;
+    w->buf = NULL;
+    w->devs = NULL;
+    w->results = NULL;
+    w->ids = NULL;
+    w->temps = NULL;
+}
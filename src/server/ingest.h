@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+
+#define INGEST_PORT 5002
+// Datagrams drained per recvmmsg() call and applied to the registry together.
+#define INGEST_BATCH 256
+// Larger datagrams are counted as malformed.
+#define INGEST_DATAGRAM_MAX 1472
+#define INGEST_SOCKET_BUFFER (8 << 20)
+
+// Start 'threads' receivers, each on its own SO_REUSEPORT socket bound to
+// INGEST_PORT on the IPv4 address 'bind_addr' (NULL = all interfaces), so the
+// kernel spreads devices across them. -1 with errno set if the address is
+// invalid or a socket or thread cannot be created; nothing is left running then.
+int ingest_start(int threads, const char *bind_addr);
+// Stop and join the receivers; they notice within a receive timeout.
+void ingest_stop(void);
+// Log datagram, update, unknown-device, malformed and kernel-drop counters.
+void ingest_log_stats(void);
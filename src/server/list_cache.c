@@ -0,0 +1,204 @@
+#include "list_cache.h"
+#include "metrics.h"
+#include "registry.h"
+#include "server.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <endian.h>
+
+#define LIST_CHUNK_FRAME_MAX \
+    (sizeof(tlv_header_t) + sizeof(uint32_t) + TLV_LIST_CHUNK_MAX_DEVICES * sizeof(device_status_t))
+#define LIST_END_FRAME_LEN (sizeof(tlv_header_t) + sizeof(uint32_t) + sizeof(uint64_t))
+
+// g_lock only guards swapping g_current, taking a reference and the
+// builder's flags, so no request ever waits for a build. Requests that find
+// the frame stale while a rebuild runs just ask for another one; the builder
+// coalesces them into a single pass.
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_wake = PTHREAD_COND_INITIALIZER;
+static list_frame_t *g_current;
+static uint64_t g_window_ns;
+static pthread_t g_builder;
+static int g_builder_running;
+static int g_wanted;
+static int g_stopping;
+
+static _Atomic uint64_t g_hits;
+static _Atomic uint64_t g_misses;
+static _Atomic uint64_t g_rebuilds;
+
+static void *builder_thread(void *arg);
+static int frame_fresh(const list_frame_t *f, uint64_t now);
+static list_frame_t *frame_build(void);
+
+int list_cache_init(unsigned window_ms) {
+    g_window_ns = (uint64_t)window_ms * 1000000ull;
+    g_wanted = 0;
+    g_stopping = 0;
+    int rc = pthread_create(&g_builder, NULL, builder_thread, NULL);
+    if(rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    g_builder_running = 1;
+    return 0;
+}
+
+void list_cache_shutdown(void) {
+    if(g_builder_running) {
+        pthread_mutex_lock(&g_lock);
+        g_stopping = 1;
+        pthread_cond_signal(&g_wake);
+        pthread_mutex_unlock(&g_lock);
+        pthread_join(g_builder, NULL);
+        g_builder_running = 0;
+    }
+    pthread_mutex_lock(&g_lock);
+    list_frame_t *f = g_current;
+    g_current = NULL;
+    pthread_mutex_unlock(&g_lock);
+    list_frame_release(f);
+}
+
+list_frame_t *list_cache_acquire(void) {
+    pthread_mutex_lock(&g_lock);
+    list_frame_t *f = g_current;
+    if(f && frame_fresh(f, metrics_now_ns())) {
+        atomic_fetch_add_explicit(&f->refs, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&g_lock);
+        atomic_fetch_add_explicit(&g_hits, 1, memory_order_relaxed);
+        return f;
+    }
+    if(!g_wanted) {
+        g_wanted = 1;
+        pthread_cond_signal(&g_wake);
+    }
+    pthread_mutex_unlock(&g_lock);
+    atomic_fetch_add_explicit(&g_misses, 1, memory_order_relaxed);
+    return NULL;
+}
+
+void list_frame_release(list_frame_t *f) {
+    if(f && atomic_fetch_sub_explicit(&f->refs, 1, memory_order_acq_rel) == 1) {
+        free(f);
+    }
+}
+
+void list_cache_stats(list_cache_stats_t *out) {
+    out->hits = atomic_load_explicit(&g_hits, memory_order_relaxed);
+    out->misses = atomic_load_explicit(&g_misses, memory_order_relaxed);
+    out->rebuilds = atomic_load_explicit(&g_rebuilds, memory_order_relaxed);
+}
+
+// One rebuild at a time, for all the requests that asked while it ran.
+static void *builder_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_lock);
+    while(1) {
+        while(!g_wanted && !g_stopping) {
+            pthread_cond_wait(&g_wake, &g_lock);
+        }
+        if(g_stopping) {
+            break;
+        }
+        g_wanted = 0;
+        if(g_current && frame_fresh(g_current, metrics_now_ns())) {
+            continue;
+        }
+        pthread_mutex_unlock(&g_lock);
+
+        list_frame_t *f = frame_build();
+        list_frame_t *old = NULL;
+        pthread_mutex_lock(&g_lock);
+        if(f) {
+            old = g_current;
+            g_current = f;
+            atomic_fetch_add_explicit(&g_rebuilds, 1, memory_order_relaxed);
+        } else {
+            LOGE("LIST frame build failed: %s", strerror(errno));
+        }
+        pthread_mutex_unlock(&g_lock);
+        list_frame_release(old);
+        pthread_mutex_lock(&g_lock);
+    }
+    pthread_mutex_unlock(&g_lock);
+    return NULL;
+}
+
+static int frame_fresh(const list_frame_t *f, uint64_t now) {
+    if(f->generation == registry_generation()) {
+        return 1;
+    }
+    return g_window_ns > 0 && now - f->built_ns < g_window_ns;
+}
+
+// The same frames dispatch_stream() produces for a LIST from the start,
+// scanned straight into place behind their headers.
+static list_frame_t *frame_build(void) {
+    // Read before the scan, so the frame never claims a change it missed.
+    uint64_t generation = registry_generation();
+    uint64_t started = metrics_now_ns();
+
+    size_t chunks = registry_count() / TLV_LIST_CHUNK_MAX_DEVICES + 2;
+    size_t cap = chunks * LIST_CHUNK_FRAME_MAX + LIST_END_FRAME_LEN;
+    list_frame_t *f = malloc(sizeof(*f) + cap);
+    if(!f) {
+        return NULL;
+    }
+
+    size_t len = 0;
+    uint32_t devices = 0;
+    uint32_t cursor = REGISTRY_CURSOR_START;
+    while(cursor != REGISTRY_CURSOR_END) {
+        // Devices added since the estimate need more room.
+        if(cap - len < LIST_CHUNK_FRAME_MAX + LIST_END_FRAME_LEN) {
+            size_t grown = cap * 2;
+            list_frame_t *nf = realloc(f, sizeof(*f) + grown);
+            if(!nf) {
+                free(f);
+                return NULL;
+            }
+            f = nf;
+            cap = grown;
+        }
+
+        uint8_t *frame = f->data + len;
+        uint8_t *value = frame + sizeof(tlv_header_t);
+        device_status_t *devs = (device_status_t *)(value + sizeof(uint32_t));
+        uint32_t next = REGISTRY_CURSOR_END;
+        size_t count = registry_scan(cursor, devs, TLV_LIST_CHUNK_MAX_DEVICES, &next);
+        if(count > 0) {
+            uint16_t value_len = (uint16_t)(sizeof(uint32_t) + count * sizeof(device_status_t));
+            tlv_header_t hdr = { .type = htons(TLV_TYPE_LIST_CHUNK), .length = htons(value_len) };
+            uint32_t next_net = htonl(next);
+            memcpy(frame, &hdr, sizeof(hdr));
+            memcpy(value, &next_net, sizeof(next_net));
+            len += sizeof(hdr) + value_len;
+            devices += (uint32_t)count;
+        }
+        cursor = next;
+    }
+
+    uint8_t end[sizeof(uint32_t) + sizeof(uint64_t)];
+    uint32_t devices_net = htonl(devices);
+    uint64_t generation_net = htobe64(generation);
+    memcpy(end, &devices_net, sizeof(devices_net));
+    memcpy(end + sizeof(devices_net), &generation_net, sizeof(generation_net));
+    size_t written = 0;
+    tlv_encode_buf(f->data + len, cap - len, TLV_TYPE_LIST_END, end, sizeof(end), &written);
+    len += written;
+
+    atomic_init(&f->refs, 1); // the cache's
+    f->generation = generation;
+    f->built_ns = started;
+    f->devices = devices;
+    f->len = len;
+    LOGD("LIST frame rebuilt: %u devices, %zu bytes, generation %llu in %.2f ms", devices, len,
+         (unsigned long long)generation, (double)(metrics_now_ns() - started) / 1e6);
+    return f;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+// Encoded reply to a full LIST. The LIST_CHUNK frames and the closing
+// LIST_END are built once, with their TLV headers in place, and the same
+// immutable buffer is sent to every connection that asks until the
+// registry changes. Connections hold a reference while the socket drains.
+// Rebuilds run on a builder thread of their own, never on a worker.
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct list_frame {
+    atomic_uint refs;
+    uint64_t generation; // registry generation the listing is complete up to
+    uint64_t built_ns;
+    uint32_t devices;
+    size_t len;
+    uint8_t data[];
+} list_frame_t;
+
+typedef struct {
+    uint64_t hits;     // served from the current frame
+    uint64_t misses;   // found it stale or missing and were streamed instead
+    uint64_t rebuilds; // frames built
+} list_cache_stats_t;
+
+// A frame stays current until the registry changes; with 'window_ms' > 0 a
+// stale frame is still served until it is that old, so a burst of changes
+// costs one rebuild per window. Starts the builder thread; -1 with errno
+// set if it cannot be created.
+int list_cache_init(unsigned window_ms);
+// Join the builder and drop the current frame.
+void list_cache_shutdown(void);
+
+// A reference to the current frame, or NULL if there is none or it is
+// stale; a rebuild is then queued and the caller streams from the registry.
+list_frame_t *list_cache_acquire(void);
+void list_frame_release(list_frame_t *f);
+
+void list_cache_stats(list_cache_stats_t *out);
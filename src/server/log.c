@@ -0,0 +1,558 @@
+#include "log.h"
+#include "server.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <syslog.h>
+#include <time.h>
+
+// How long the drain thread sleeps when every ring is empty.
+#define LOG_DRAIN_INTERVAL_MS 10
+// Rate limit slots per thread, direct-mapped by call site.
+#define LOG_LIMIT_SLOTS 64
+// Marks the unused end of a ring; the next record starts at offset 0.
+#define LOG_LEVEL_SKIP 0xff
+
+// Arguments follow in 8-byte slots in format order: integers widened to
+// 64 bits, doubles, pointers, and strings as a length slot plus the bytes
+// padded to 8.
+typedef struct {
+    uint32_t size;       // whole record, a multiple of 8
+    uint8_t level;
+    uint8_t truncated;   // not every argument fit
+    uint16_t reserved;
+    uint32_t suppressed; // messages from this call site the rate limit dropped
+    uint32_t reserved2;
+    uint64_t ts_ns;      // merge order across threads
+    const char *fmt;
+} log_record_t;
+
+// Single producer (the owning thread), single consumer (the drain thread).
+typedef struct log_ring {
+    _Alignas(64) _Atomic uint64_t head;
+    _Alignas(64) _Atomic uint64_t tail;
+    _Atomic uint64_t dropped;
+    uint64_t reported; // drops already logged, drain thread only
+    struct log_ring *next;
+    _Alignas(8) uint8_t buf[LOG_RING_SIZE];
+} log_ring_t;
+
+typedef struct {
+    const char *fmt;
+    uint64_t window; // second the counts belong to
+    uint32_t count;
+    uint32_t suppressed;
+} log_limit_t;
+
+// One conversion of a printf format.
+typedef struct {
+    const char *start; // the '%'
+    const char *end;   // past the conversion character
+    int star_width;
+    int star_precision;
+    char length;       // 'H' hh, 'h', 'l', 'q' ll, 'z', 'j', 't', 'L' or 0
+    char conv;
+} log_spec_t;
+
+int g_log_level = LOG_LEVEL_INFO;
+
+// Rings are never freed: a thread may still hold its pointer at exit.
+static _Atomic(log_ring_t *) g_rings;
+static pthread_mutex_t g_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int g_async;
+static atomic_int g_draining;
+static pthread_t g_drain_thread;
+
+static _Thread_local log_ring_t *t_ring;
+static _Thread_local log_limit_t t_limits[LOG_LIMIT_SLOTS];
+
+static uint64_t log_now_ns(void);
+static int rate_allow(const char *fmt, uint64_t now_ns, uint32_t *suppressed);
+static const char *parse_spec(const char *p, log_spec_t *spec);
+static size_t encode_record(uint8_t *rec, int level, const char *fmt, uint32_t suppressed, uint64_t ts_ns, va_list ap);
+static size_t format_record(const log_record_t *rec, char *out, size_t cap);
+static void emit_line(int level, const char *msg, uint32_t suppressed);
+static log_ring_t *ring_register(void);
+static void ring_push(const uint8_t *rec, size_t size);
+static const log_record_t *ring_peek(log_ring_t *r);
+static size_t drain_once(void);
+static void *drain_thread(void *arg);
+
+void log_write(int level, const char *fmt, ...) {
+    uint64_t now = log_now_ns();
+    uint32_t suppressed = 0;
+    if(!rate_allow(fmt, now, &suppressed)) {
+        return;
+    }
+
+    va_list ap;
+    va_start(ap, fmt);
+    if(!atomic_load_explicit(&g_async, memory_order_acquire)) {
+        char msg[LOG_RECORD_MAX];
+        vsnprintf(msg, sizeof(msg), fmt, ap);
+        va_end(ap);
+        emit_line(level, msg, suppressed);
+        return;
+    }
+    _Alignas(8) uint8_t rec[LOG_RECORD_MAX];
+    size_t size = encode_record(rec, level, fmt, suppressed, now, ap);
+    va_end(ap);
+    ring_push(rec, size);
+}
+
+int log_parse_level(const char *name) {
+    if(strcmp(name, "debug") == 0) {
+        return LOG_LEVEL_DEBUG;
+    }
+    if(strcmp(name, "info") == 0) {
+        return LOG_LEVEL_INFO;
+    }
+    if(strcmp(name, "error") == 0) {
+        return LOG_LEVEL_ERROR;
+    }
+    return -1;
+}
+
+int log_start(void) {
+    atomic_store(&g_draining, 1);
+    int rc = pthread_create(&g_drain_thread, NULL, drain_thread, NULL);
+    if(rc != 0) {
+        atomic_store(&g_draining, 0);
+        errno = rc;
+        return -1;
+    }
+    atomic_store_explicit(&g_async, 1, memory_order_release);
+    return 0;
+}
+
+void log_stop(void) {
+    if(!atomic_load(&g_async)) {
+        return;
+    }
+    // New messages are written directly; the drain thread empties the
+    // rings one last time before it exits.
+    atomic_store(&g_async, 0);
+    atomic_store(&g_draining, 0);
+    pthread_join(g_drain_thread, NULL);
+}
+
+static uint64_t log_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int rate_allow(const char *fmt, uint64_t now_ns, uint32_t *suppressed) {
+    log_limit_t *l = &t_limits[((uintptr_t)fmt >> 3) % LOG_LIMIT_SLOTS];
+    uint64_t window = now_ns / 1000000000ull;
+    if(l->fmt != fmt || l->window != window) {
+        if(l->fmt == fmt) {
+            *suppressed = l->suppressed;
+        }
+        l->fmt = fmt;
+        l->window = window;
+        l->count = 0;
+        l->suppressed = 0;
+    }
+    if(l->count >= LOG_RATE_LIMIT) {
+        l->suppressed++;
+        return 0;
+    }
+    l->count++;
+    return 1;
+}
+
+// Parse the conversion starting at the '%' in 'p'. Returns NULL for "%%"
+// (nothing to convert) with spec->end set past it.
+static const char *parse_spec(const char *p, log_spec_t *spec) {
+    memset(spec, 0, sizeof(*spec));
+    spec->start = p++;
+    if(*p == '%') {
+        spec->end = p + 1;
+        return NULL;
+    }
+    while(*p && strchr("-+ #0'", *p)) {
+        p++;
+    }
+    if(*p == '*') {
+        spec->star_width = 1;
+        p++;
+    }
+    while(*p >= '0' && *p <= '9') {
+        p++;
+    }
+    if(*p == '.') {
+        p++;
+        if(*p == '*') {
+            spec->star_precision = 1;
+            p++;
+        }
+        while(*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+    if(*p == 'h' || *p == 'l') {
+        spec->length = *p++;
+        if(*p == spec->length) {
+            spec->length = (spec->length == 'h') ? 'H' : 'q';
+            p++;
+        }
+    } else if(*p && strchr("zjtL", *p)) {
+        spec->length = *p++;
+    }
+    spec->conv = *p;
+    spec->end = *p ? p + 1 : p;
+    return spec->end;
+}
+
+static size_t encode_record(uint8_t *rec, int level, const char *fmt, uint32_t suppressed, uint64_t ts_ns, va_list ap) {
+    log_record_t *h = (log_record_t *)rec;
+    memset(h, 0, sizeof(*h));
+    h->level = (uint8_t)level;
+    h->suppressed = suppressed;
+    h->ts_ns = ts_ns;
+    h->fmt = fmt;
+
+    size_t off = sizeof(*h);
+    const char *p = fmt;
+    while((p = strchr(p, '%')) != NULL) {
+        log_spec_t spec;
+        if(!parse_spec(p, &spec)) {
+            p = spec.end;
+            continue;
+        }
+        p = spec.end;
+
+        uint64_t slots[3];
+        int n = 0;
+        if(spec.star_width) {
+            slots[n++] = (uint64_t)(int64_t)va_arg(ap, int);
+        }
+        if(spec.star_precision) {
+            slots[n++] = (uint64_t)(int64_t)va_arg(ap, int);
+        }
+        const char *str = NULL;
+        switch(spec.conv) {
+            case 'd':
+            case 'i': {
+                int64_t v;
+                switch(spec.length) {
+                    case 'l': v = va_arg(ap, long); break;
+                    case 'q': v = va_arg(ap, long long); break;
+                    case 'z': v = va_arg(ap, ssize_t); break;
+                    case 'j': v = va_arg(ap, intmax_t); break;
+                    case 't': v = va_arg(ap, ptrdiff_t); break;
+                    default: v = va_arg(ap, int); break;
+                }
+                slots[n++] = (uint64_t)v;
+                break;
+            }
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+            case 'c': {
+                uint64_t v;
+                switch(spec.length) {
+                    case 'l': v = va_arg(ap, unsigned long); break;
+                    case 'q': v = va_arg(ap, unsigned long long); break;
+                    case 'z': v = va_arg(ap, size_t); break;
+                    case 'j': v = va_arg(ap, uintmax_t); break;
+                    case 't': v = (uint64_t)va_arg(ap, ptrdiff_t); break;
+                    default: v = va_arg(ap, unsigned int); break;
+                }
+                slots[n++] = v;
+                break;
+            }
+            case 'f': case 'F': case 'e': case 'E':
+            case 'g': case 'G': case 'a': case 'A': {
+                double v = (spec.length == 'L') ? (double)va_arg(ap, long double) : va_arg(ap, double);
+                memcpy(&slots[n++], &v, sizeof(v));
+                break;
+            }
+            case 'p':
+                slots[n++] = (uint64_t)(uintptr_t)va_arg(ap, void *);
+                break;
+            case 's':
+                str = va_arg(ap, const char *);
+                if(!str) {
+                    str = "(null)";
+                }
+                break;
+            default:
+                // Unknown conversion: its argument type is unknown too.
+                h->truncated = 1;
+                break;
+        }
+        if(h->truncated) {
+            break;
+        }
+
+        size_t need = (size_t)n * 8 + (str ? 8 : 0);
+        if(off + need > LOG_RECORD_MAX) {
+            h->truncated = 1;
+            break;
+        }
+        memcpy(rec + off, slots, (size_t)n * 8);
+        off += (size_t)n * 8;
+        if(str) {
+            uint64_t len = strlen(str);
+            size_t room = LOG_RECORD_MAX - off - 8;
+            if(len > room) {
+                len = room;
+                h->truncated = 1;
+            }
+            memcpy(rec + off, &len, sizeof(len));
+            memcpy(rec + off + 8, str, len);
+            off += 8 + ((len + 7) & ~(size_t)7);
+            if(h->truncated) {
+                break;
+            }
+        }
+    }
+
+    h->size = (uint32_t)off;
+    return off;
+}
+
+// Produce the message text of 'rec' into 'out' (always terminated).
+static size_t format_record(const log_record_t *rec, char *out, size_t cap) {
+    const uint8_t *args = (const uint8_t *)rec + sizeof(*rec);
+    const uint8_t *args_end = (const uint8_t *)rec + rec->size;
+    size_t len = 0;
+    out[0] = '\0';
+
+    const char *p = rec->fmt;
+    while(*p && len + 1 < cap) {
+        const char *pct = strchr(p, '%');
+        size_t lit = pct ? (size_t)(pct - p) : strlen(p);
+        if(lit > cap - 1 - len) {
+            lit = cap - 1 - len;
+        }
+        memcpy(out + len, p, lit);
+        len += lit;
+        out[len] = '\0';
+        if(!pct) {
+            break;
+        }
+
+        log_spec_t spec;
+        if(!parse_spec(pct, &spec)) {
+            if(len + 1 < cap) {
+                out[len++] = '%';
+                out[len] = '\0';
+            }
+            p = spec.end;
+            continue;
+        }
+        p = spec.end;
+
+        // Rebuild the conversion with '*' replaced by the recorded values.
+        char conv[64];
+        size_t cl = 0;
+        int slots = spec.star_width + spec.star_precision + 1; // a string's bytes follow its length
+        if(args + (size_t)slots * 8 > args_end) {
+            break; // truncated record
+        }
+        for(const char *q = spec.start; q < spec.end && cl < sizeof(conv) - 12; q++) {
+            if(*q == '*') {
+                int64_t v;
+                memcpy(&v, args, sizeof(v));
+                args += 8;
+                cl += (size_t)snprintf(conv + cl, sizeof(conv) - cl, "%d", (int)v);
+            } else {
+                conv[cl++] = *q;
+            }
+        }
+        conv[cl] = '\0';
+
+        uint64_t raw;
+        memcpy(&raw, args, sizeof(raw));
+        args += 8;
+        int w = 0;
+        switch(spec.conv) {
+            case 'd':
+            case 'i':
+                switch(spec.length) {
+                    case 'l': w = snprintf(out + len, cap - len, conv, (long)raw); break;
+                    case 'q': w = snprintf(out + len, cap - len, conv, (long long)raw); break;
+                    case 'z': w = snprintf(out + len, cap - len, conv, (ssize_t)raw); break;
+                    case 'j': w = snprintf(out + len, cap - len, conv, (intmax_t)raw); break;
+                    case 't': w = snprintf(out + len, cap - len, conv, (ptrdiff_t)raw); break;
+                    default: w = snprintf(out + len, cap - len, conv, (int)raw); break;
+                }
+                break;
+            case 'u': case 'x': case 'X': case 'o': case 'c':
+                switch(spec.length) {
+                    case 'l': w = snprintf(out + len, cap - len, conv, (unsigned long)raw); break;
+                    case 'q': w = snprintf(out + len, cap - len, conv, (unsigned long long)raw); break;
+                    case 'z': w = snprintf(out + len, cap - len, conv, (size_t)raw); break;
+                    case 'j': w = snprintf(out + len, cap - len, conv, (uintmax_t)raw); break;
+                    case 't': w = snprintf(out + len, cap - len, conv, (ptrdiff_t)raw); break;
+                    default: w = snprintf(out + len, cap - len, conv, (unsigned int)raw); break;
+                }
+                break;
+            case 'p':
+                w = snprintf(out + len, cap - len, conv, (void *)(uintptr_t)raw);
+                break;
+            case 's': {
+                char str[LOG_RECORD_MAX];
+                size_t n = (raw < sizeof(str)) ? (size_t)raw : sizeof(str) - 1;
+                memcpy(str, args, n);
+                str[n] = '\0';
+                args += (raw + 7) & ~(uint64_t)7;
+                w = snprintf(out + len, cap - len, conv, str);
+                break;
+            }
+            default: {
+                double v;
+                memcpy(&v, &raw, sizeof(v));
+                if(spec.length == 'L') {
+                    w = snprintf(out + len, cap - len, conv, (long double)v);
+                } else {
+                    w = snprintf(out + len, cap - len, conv, v);
+                }
+                break;
+            }
+        }
+        if(w > 0) {
+            len += ((size_t)w < cap - len) ? (size_t)w : cap - 1 - len;
+        }
+    }
+    if(rec->truncated && len + 4 < cap) {
+        memcpy(out + len, "...", 4);
+        len += 3;
+    }
+    return len;
+}
+
+static void emit_line(int level, const char *msg, uint32_t suppressed) {
+    if(g_use_syslog) {
+        int prio = (level == LOG_LEVEL_ERROR) ? LOG_ERR : (level == LOG_LEVEL_INFO) ? LOG_INFO : LOG_DEBUG;
+        if(suppressed > 0) {
+            syslog(prio, "%s (%u similar messages suppressed)", msg, suppressed);
+        } else {
+            syslog(prio, "%s", msg);
+        }
+        return;
+    }
+    FILE *out = (level == LOG_LEVEL_ERROR) ? stderr : stdout;
+    if(suppressed > 0) {
+        fprintf(out, "[server] %s (%u similar messages suppressed)\n", msg, suppressed);
+    } else {
+        fprintf(out, "[server] %s\n", msg);
+    }
+}
+
+static log_ring_t *ring_register(void) {
+    log_ring_t *r = aligned_alloc(64, sizeof(*r));
+    if(!r) {
+        return NULL;
+    }
+    memset(r, 0, sizeof(*r));
+    pthread_mutex_lock(&g_rings_lock);
+    r->next = atomic_load(&g_rings);
+    atomic_store_explicit(&g_rings, r, memory_order_release);
+    pthread_mutex_unlock(&g_rings_lock);
+    t_ring = r;
+    return r;
+}
+
+// Never blocks: a full ring drops the record.
+static void ring_push(const uint8_t *rec, size_t size) {
+    log_ring_t *r = t_ring ? t_ring : ring_register();
+    if(!r) {
+        return;
+    }
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    size_t pos = (size_t)(tail % LOG_RING_SIZE);
+    size_t contig = LOG_RING_SIZE - pos;
+    size_t need = size + ((size > contig) ? contig : 0);
+    if(tail + need - head > LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    if(size > contig) {
+        log_record_t skip = { .size = (uint32_t)contig, .level = LOG_LEVEL_SKIP };
+        memcpy(r->buf + pos, &skip, 8); // contig is at least 8
+        tail += contig;
+        pos = 0;
+    }
+    memcpy(r->buf + pos, rec, size);
+    atomic_store_explicit(&r->tail, tail + size, memory_order_release);
+}
+
+// Oldest record of 'r', or NULL if it is empty.
+static const log_record_t *ring_peek(log_ring_t *r) {
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    while(head != tail) {
+        const log_record_t *rec = (const log_record_t *)(r->buf + head % LOG_RING_SIZE);
+        if(rec->level != LOG_LEVEL_SKIP) {
+            return rec;
+        }
+        head += rec->size;
+        atomic_store_explicit(&r->head, head, memory_order_release);
+    }
+    return NULL;
+}
+
+// Write out everything queued, oldest first across the rings.
+static size_t drain_once(void) {
+    size_t written = 0;
+    while(1) {
+        log_ring_t *oldest = NULL;
+        const log_record_t *rec = NULL;
+        for(log_ring_t *r = atomic_load_explicit(&g_rings, memory_order_acquire); r; r = r->next) {
+            const log_record_t *head = ring_peek(r);
+            if(head && (!rec || head->ts_ns < rec->ts_ns)) {
+                oldest = r;
+                rec = head;
+            }
+        }
+        if(!rec) {
+            break;
+        }
+        char msg[2 * LOG_RECORD_MAX];
+        format_record(rec, msg, sizeof(msg));
+        emit_line(rec->level, msg, rec->suppressed);
+        atomic_fetch_add_explicit(&oldest->head, rec->size, memory_order_release);
+        written++;
+    }
+
+    for(log_ring_t *r = atomic_load_explicit(&g_rings, memory_order_acquire); r; r = r->next) {
+        uint64_t dropped = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+        if(dropped != r->reported) {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "%llu log messages dropped, ring full",
+                     (unsigned long long)(dropped - r->reported));
+            emit_line(LOG_LEVEL_ERROR, msg, 0);
+            r->reported = dropped;
+        }
+    }
+    if(written > 0 && !g_use_syslog) {
+        fflush(stdout);
+    }
+    return written;
+}
+
+static void *drain_thread(void *arg) {
+    (void)arg;
+    while(atomic_load(&g_draining)) {
+        if(drain_once() == 0) {
+            struct timespec nap = { .tv_sec = 0, .tv_nsec = LOG_DRAIN_INTERVAL_MS * 1000000L };
+            nanosleep(&nap, NULL);
+        }
+    }
+    drain_once();
+    return NULL;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+// Asynchronous logging. A LOGx() call checks the level, then encodes the
+// format pointer and the raw arguments into a ring owned by the calling
+// thread; a drain thread formats the records and writes them to stdout,
+// stderr or syslog. Before log_start() and after log_stop() messages are
+// written directly.
+
+#include <stdint.h>
+
+enum {
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_ERROR,
+};
+
+// Levels below this are compiled out (-DLOG_COMPILED_LEVEL=...).
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// Per-thread ring size; records that do not fit are dropped and counted.
+#define LOG_RING_SIZE (256 * 1024)
+// Longest encoded record; longer string arguments are truncated.
+#define LOG_RECORD_MAX 512
+// Messages per call site, per thread and second; the rest are counted and
+// reported with the next one that gets through.
+#define LOG_RATE_LIMIT 100
+
+// Runtime threshold, LOG_LEVEL_INFO unless changed at startup.
+extern int g_log_level;
+
+// 'fmt' must be a string literal: records keep only the pointer.
+#define LOG_AT(level, fmt, ...) do { \
+  if ((level) >= LOG_COMPILED_LEVEL && (level) >= g_log_level) \
+    log_write((level), "" fmt __VA_OPT__(,) __VA_ARGS__); \
+} while(0)
+
+#define LOGD(fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, fmt __VA_OPT__(,) __VA_ARGS__)
+#define LOGI(fmt, ...) LOG_AT(LOG_LEVEL_INFO, fmt __VA_OPT__(,) __VA_ARGS__)
+#define LOGE(fmt, ...) LOG_AT(LOG_LEVEL_ERROR, fmt __VA_OPT__(,) __VA_ARGS__)
+
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// LOG_LEVEL_* for "debug", "info" or "error", -1 if unknown.
+int log_parse_level(const char *name);
+
+// Start the drain thread; call after any fork(). -1 with errno set.
+int log_start(void);
+// Write out everything queued and stop the drain thread.
+void log_stop(void);
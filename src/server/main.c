@@ -1,5 +1,12 @@
 #include "server.h"
+#include "history.h"
+#include "ingest.h"
+#include "reactor.h"
+#include "registry.h"
+#include "wal.h"
 
+#include <arpa/inet.h>
+#include <getopt.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,13 +17,46 @@
 #include <syslog.h>
 #include <errno.h>
 
+// Seconds between writebacks of the store's dirty pages.
+#define SERVER_DEFAULT_FLUSH_INTERVAL 5
+// Seconds between rewrites of the --metrics-file.
+#define SERVER_DEFAULT_METRICS_INTERVAL 10
+
 static int daemonize_process(void);
 static void handle_sigterm(int sig);
 static int install_signal_handlers(void);
+static int parse_args(int argc, char *argv[], int *daemon_mode, server_config_t *cfg);
+static void print_usage(const char *prog);
+static const char *absolute_path(const char *path, char *buf, size_t len);
 
 int main(int argc, char *argv[]) {
 
-    int daemon_mode = (argc >= 2 && strcmp(argv[1], "--daemon") == 0);
+    int daemon_mode = 0;
+    server_config_t cfg = {
+        .workers = 1,
+        .io_backend = REACTOR_BACKEND_EPOLL,
+        .stats_interval = 0,
+        .capacity = REGISTRY_DEFAULT_CAPACITY,
+        .shards = REGISTRY_DEFAULT_SHARDS,
+        .devices = 5,
+        .history_depth = HISTORY_DEFAULT_DEPTH,
+        .store_path = NULL,
+        .flush_interval = SERVER_DEFAULT_FLUSH_INTERVAL,
+        .wal_path = NULL,
+        .durability = WAL_DURABILITY_STRICT,
+        .ingest_threads = 0,
+        .ingest_bind = NULL,
+        .metrics_path = NULL,
+        .metrics_interval = SERVER_DEFAULT_METRICS_INTERVAL,
+        .list_cache = 1,
+        .list_cache_ms = 0,
+    };
+
+    int prc = parse_args(argc, argv, &daemon_mode, &cfg);
+    if(prc != 0) {
+        print_usage(argv[0]);
+        return (prc > 0) ? 0 : 1;
+    }
 
     if(daemon_mode){
         openlog("iot-monitor-server", LOG_PID | LOG_NDELAY, LOG_DAEMON);
@@ -37,19 +77,250 @@ int main(int argc, char *argv[]) {
         if(g_use_syslog) closelog();
         return 1;
     }
+    // After daemonizing: the drain thread would not survive the fork.
+    if(log_start() < 0) {
+        LOGE("log thread start failed, logging synchronously: %s", strerror(errno));
+    }
 
     LOGI("Starting server%s", daemon_mode ? " in daemon mode" : "");
 
-    int rc = server_run();
+    int rc = server_run(&cfg);
 
     if(daemon_mode){
         LOGI("Daemon stopping");
+    }
+    log_stop();
+    if(daemon_mode){
         closelog();
     }
 
     return rc;
 }
 
+// Returns 0 to continue, 1 after --help, -1 on invalid arguments.
+static int parse_args(int argc, char *argv[], int *daemon_mode, server_config_t *cfg) {
+    static const struct option long_opts[] = {
+        { "daemon",         no_argument,       NULL, 'd' },
+        { "workers",        required_argument, NULL, 'w' },
+        { "io-backend",     required_argument, NULL, 'B' },
+        { "stats-interval", required_argument, NULL, 's' },
+        { "capacity",       required_argument, NULL, 'c' },
+        { "shards",         required_argument, NULL, 'S' },
+        { "devices",        required_argument, NULL, 'n' },
+        { "history-depth",  required_argument, NULL, 'H' },
+        { "store",          required_argument, NULL, 'f' },
+        { "flush-interval", required_argument, NULL, 'F' },
+        { "wal",            required_argument, NULL, 'W' },
+        { "durability",     required_argument, NULL, 'D' },
+        { "ingest-threads", required_argument, NULL, 'I' },
+        { "ingest-bind",    required_argument, NULL, 'i' },
+        { "log-level",      required_argument, NULL, 'L' },
+        { "metrics-file",   required_argument, NULL, 'M' },
+        { "metrics-interval", required_argument, NULL, 'm' },
+        { "list-cache",     required_argument, NULL, 'C' },
+        { "help",           no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    char *end = NULL;
+    while((opt = getopt_long(argc, argv, "dw:B:s:c:S:n:H:f:F:W:D:I:i:L:M:m:C:h", long_opts, NULL)) != -1) {
+        switch(opt) {
+            case 'd':
+                *daemon_mode = 1;
+                break;
+            case 'w': {
+                long v = strtol(optarg, &end, 10);
+                if(*end != '\0' || v < 1 || v > 1024) {
+                    fprintf(stderr, "invalid worker count: %s\n", optarg);
+                    return -1;
+                }
+                cfg->workers = (int)v;
+                break;
+            }
+            case 'B':
+                cfg->io_backend = reactor_parse_backend(optarg);
+                if(cfg->io_backend < 0) {
+                    fprintf(stderr, "invalid I/O backend: %s\n", optarg);
+                    return -1;
+                }
+                if(!reactor_backend_available(cfg->io_backend)) {
+                    fprintf(stderr, "this build has no %s support\n", optarg);
+                    return -1;
+                }
+                break;
+            case 's': {
+                long v = strtol(optarg, &end, 10);
+                if(*end != '\0' || v < 0) {
+                    fprintf(stderr, "invalid stats interval: %s\n", optarg);
+                    return -1;
+                }
+                cfg->stats_interval = (unsigned)v;
+                break;
+            }
+            case 'c':
+            case 'S':
+            case 'n': {
+                unsigned long long v = strtoull(optarg, &end, 10);
+                if(*end != '\0' || optarg[0] == '-' || (opt != 'n' && v == 0)) {
+                    fprintf(stderr, "invalid value for -%c: %s\n", opt, optarg);
+                    return -1;
+                }
+                if(opt == 'c') cfg->capacity = (size_t)v;
+                else if(opt == 'S') cfg->shards = (size_t)v;
+                else cfg->devices = (size_t)v;
+                break;
+            }
+            case 'H': {
+                long v = strtol(optarg, &end, 10);
+                if(*end != '\0' || v < 0 || v > HISTORY_MAX_DEPTH) {
+                    fprintf(stderr, "invalid history depth: %s\n", optarg);
+                    return -1;
+                }
+                cfg->history_depth = (size_t)v;
+                break;
+            }
+            case 'f': {
+                static char store_path[4096];
+                cfg->store_path = absolute_path(optarg, store_path, sizeof(store_path));
+                break;
+            }
+            case 'F': {
+                long v = strtol(optarg, &end, 10);
+                if(*end != '\0' || v < 0) {
+                    fprintf(stderr, "invalid flush interval: %s\n", optarg);
+                    return -1;
+                }
+                cfg->flush_interval = (unsigned)v;
+                break;
+            }
+            case 'W': {
+                static char wal_path[4096];
+                cfg->wal_path = absolute_path(optarg, wal_path, sizeof(wal_path));
+                break;
+            }
+            case 'D':
+                cfg->durability = wal_parse_durability(optarg);
+                if(cfg->durability < 0) {
+                    fprintf(stderr, "invalid durability: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'I': {
+                long v = strtol(optarg, &end, 10);
+                if(*end != '\0' || v < 0 || v > 256) {
+                    fprintf(stderr, "invalid ingest thread count: %s\n", optarg);
+                    return -1;
+                }
+                cfg->ingest_threads = (int)v;
+                break;
+            }
+            case 'i': {
+                struct in_addr addr;
+                if(inet_pton(AF_INET, optarg, &addr) != 1) {
+                    fprintf(stderr, "invalid ingest bind address: %s\n", optarg);
+                    return -1;
+                }
+                cfg->ingest_bind = optarg;
+                break;
+            }
+            case 'L':
+                g_log_level = log_parse_level(optarg);
+                if(g_log_level < 0) {
+                    fprintf(stderr, "invalid log level: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'M': {
+                static char metrics_path[4096];
+                cfg->metrics_path = absolute_path(optarg, metrics_path, sizeof(metrics_path));
+                break;
+            }
+            case 'm': {
+                long v = strtol(optarg, &end, 10);
+                if(*end != '\0' || v < 0) {
+                    fprintf(stderr, "invalid metrics interval: %s\n", optarg);
+                    return -1;
+                }
+                cfg->metrics_interval = (unsigned)v;
+                break;
+            }
+            case 'C': {
+                if(strcmp(optarg, "off") == 0) {
+                    cfg->list_cache = 0;
+                    break;
+                }
+                long v = strtol(optarg, &end, 10);
+                if(*end != '\0' || v < 0 || v > 60000) {
+                    fprintf(stderr, "invalid list cache window: %s\n", optarg);
+                    return -1;
+                }
+                cfg->list_cache = 1;
+                cfg->list_cache_ms = (unsigned)v;
+                break;
+            }
+            case 'h':
+                return 1;
+            default:
+                return -1;
+        }
+    }
+    if(cfg->shards > REGISTRY_MAX_SHARDS) {
+        fprintf(stderr, "at most %d shards\n", REGISTRY_MAX_SHARDS);
+        return -1;
+    }
+    if(cfg->devices > cfg->capacity) {
+        fprintf(stderr, "--devices exceeds --capacity\n");
+        return -1;
+    }
+    if(optind < argc) {
+        fprintf(stderr, "unexpected argument: %s\n", argv[optind]);
+        return -1;
+    }
+    return 0;
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "usage: %s [options]\n", prog);
+    fprintf(stderr, "  -d, --daemon               run in the background, log to syslog\n");
+    fprintf(stderr, "  -w, --workers N            event loop threads (default 1)\n");
+    fprintf(stderr, "  -B, --io-backend NAME      socket I/O: epoll or io_uring (default epoll)\n");
+    fprintf(stderr, "  -s, --stats-interval SEC   log per-worker counters every SEC seconds\n");
+    fprintf(stderr, "  -c, --capacity N           maximum number of devices (default %u)\n", REGISTRY_DEFAULT_CAPACITY);
+    fprintf(stderr, "  -S, --shards N             registry lock stripes (default %d)\n", REGISTRY_DEFAULT_SHARDS);
+    fprintf(stderr, "  -n, --devices N            devices registered at startup (default 5)\n");
+    fprintf(stderr, "  -H, --history-depth N      %d-byte history blocks kept per device, 0 = off (default %d)\n",
+            HISTORY_BLOCK_SIZE, HISTORY_DEFAULT_DEPTH);
+    fprintf(stderr, "  -f, --store PATH           keep the registry in a memory-mapped file; an existing\n");
+    fprintf(stderr, "                             store is served as is, with its own capacity and shards\n");
+    fprintf(stderr, "  -F, --flush-interval SEC   start writing dirty store pages back every SEC seconds,\n");
+    fprintf(stderr, "                             0 = leave it to the kernel (default %d)\n", SERVER_DEFAULT_FLUSH_INTERVAL);
+    fprintf(stderr, "  -W, --wal PATH             log every SET to PATH and replay it at startup\n");
+    fprintf(stderr, "  -D, --durability MODE      WAL syncing: none, batched or strict (default strict)\n");
+    fprintf(stderr, "  -I, --ingest-threads N     unauthenticated UDP telemetry receivers on port %d,\n", INGEST_PORT);
+    fprintf(stderr, "                             0 = off (default 0)\n");
+    fprintf(stderr, "  -i, --ingest-bind ADDR     IPv4 address the telemetry port listens on (default all)\n");
+    fprintf(stderr, "  -L, --log-level LEVEL      debug, info or error (default info)\n");
+    fprintf(stderr, "  -M, --metrics-file PATH    write request metrics to PATH in the Prometheus text format\n");
+    fprintf(stderr, "  -m, --metrics-interval SEC rewrite the metrics file every SEC seconds,\n");
+    fprintf(stderr, "                             0 = on exit only (default %d)\n", SERVER_DEFAULT_METRICS_INTERVAL);
+    fprintf(stderr, "  -C, --list-cache off|MS    answer LIST from a shared encoded copy, rebuilt in the\n");
+    fprintf(stderr, "                             background after changes; MS > 0 serves it stale\n");
+    fprintf(stderr, "                             for up to MS ms (default 0)\n");
+    fprintf(stderr, "  -h, --help                 show this help\n");
+}
+
+// The daemon changes to /, so keep relative paths valid from there.
+static const char *absolute_path(const char *path, char *buf, size_t len) {
+    char cwd[2048];
+    if(path[0] != '/' && getcwd(cwd, sizeof(cwd)) != NULL) {
+        snprintf(buf, len, "%s/%s", cwd, path);
+    } else {
+        snprintf(buf, len, "%s", path);
+    }
+    return buf;
+}
+
 static int daemonize_process(void) {
     pid_t pid = fork();
     if(pid < 0) {
@@ -0,0 +1,334 @@
+#include "metrics.h"
+#include "protocol.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Only the owning thread writes a block, so counters are bumped with a
+// relaxed load and store; readers may see them a little stale, never torn.
+typedef struct metrics_block {
+    struct metrics_block *next;
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+    _Atomic uint64_t lock_acquired;
+    _Atomic uint64_t lock_contended;
+    _Atomic uint64_t lock_wait_ns;
+    struct {
+        _Atomic uint64_t count;
+        _Atomic uint64_t failed;
+        _Atomic uint64_t sum_ns;
+        _Atomic uint64_t buckets[METRICS_BUCKETS];
+    } requests[METRICS_REQ_KINDS];
+} metrics_block_t;
+
+typedef struct {
+    uint16_t type;
+    const char *name;
+} metrics_kind_t;
+
+static const metrics_kind_t g_kinds[METRICS_REQ_KINDS] = {
+    [METRICS_REQ_LIST]        = { TLV_TYPE_LIST_REQUEST, "list" },
+    [METRICS_REQ_LIST_SINCE]  = { TLV_TYPE_LIST_SINCE_REQUEST, "list_since" },
+    [METRICS_REQ_LIST_FILTER] = { TLV_TYPE_LIST_FILTER_REQUEST, "list_filter" },
+    [METRICS_REQ_GET]         = { TLV_TYPE_GET_REQUEST, "get" },
+    [METRICS_REQ_SET]         = { TLV_TYPE_SET_REQUEST, "set" },
+    [METRICS_REQ_MULTI_GET]   = { TLV_TYPE_MULTI_GET_REQUEST, "multi_get" },
+    [METRICS_REQ_MULTI_SET]   = { TLV_TYPE_MULTI_SET_REQUEST, "multi_set" },
+    [METRICS_REQ_SUBSCRIBE]   = { TLV_TYPE_SUBSCRIBE_REQUEST, "subscribe" },
+    [METRICS_REQ_UNSUBSCRIBE] = { TLV_TYPE_UNSUBSCRIBE_REQUEST, "unsubscribe" },
+    [METRICS_REQ_HISTORY]     = { TLV_TYPE_HISTORY_REQUEST, "history" },
+    [METRICS_REQ_AGGREGATE]   = { TLV_TYPE_AGGREGATE_REQUEST, "aggregate" },
+    [METRICS_REQ_STATS]       = { TLV_TYPE_STATS_REQUEST, "stats" },
+    [METRICS_REQ_OTHER]       = { 0, "other" },
+};
+
+// Bucket bounds of the Prometheus histograms, in seconds.
+static const double g_prom_bounds[] = {
+    1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4,
+    1e-3, 2.5e-3, 5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1.0,
+};
+
+static _Atomic(metrics_block_t *) g_blocks;
+static pthread_mutex_t g_blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local metrics_block_t *t_block;
+
+static metrics_block_t *block_register(void);
+static void counter_add(_Atomic uint64_t *c, uint64_t v);
+static unsigned bucket_of(uint64_t ns);
+static uint64_t bucket_upper(unsigned bucket);
+static uint64_t load(_Atomic uint64_t *c);
+
+uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void metrics_request(uint16_t type, uint64_t ns, int failed) {
+    metrics_block_t *b = t_block ? t_block : block_register();
+    if(!b) {
+        return;
+    }
+    int kind = metrics_request_kind(type);
+    counter_add(&b->requests[kind].count, 1);
+    counter_add(&b->requests[kind].sum_ns, ns);
+    counter_add(&b->requests[kind].buckets[bucket_of(ns)], 1);
+    if(failed) {
+        counter_add(&b->requests[kind].failed, 1);
+    }
+}
+
+void metrics_bytes_in(size_t n) {
+    metrics_block_t *b = t_block ? t_block : block_register();
+    if(b) {
+        counter_add(&b->bytes_in, n);
+    }
+}
+
+void metrics_bytes_out(size_t n) {
+    metrics_block_t *b = t_block ? t_block : block_register();
+    if(b) {
+        counter_add(&b->bytes_out, n);
+    }
+}
+
+void metrics_lock_acquired(int contended, uint64_t wait_ns) {
+    metrics_block_t *b = t_block ? t_block : block_register();
+    if(!b) {
+        return;
+    }
+    counter_add(&b->lock_acquired, 1);
+    if(contended) {
+        counter_add(&b->lock_contended, 1);
+        counter_add(&b->lock_wait_ns, wait_ns);
+    }
+}
+
+void metrics_collect(metrics_snapshot_t *s) {
+    memset(s, 0, sizeof(*s));
+    for(metrics_block_t *b = atomic_load_explicit(&g_blocks, memory_order_acquire); b; b = b->next) {
+        s->bytes_in += load(&b->bytes_in);
+        s->bytes_out += load(&b->bytes_out);
+        s->lock_acquired += load(&b->lock_acquired);
+        s->lock_contended += load(&b->lock_contended);
+        s->lock_wait_ns += load(&b->lock_wait_ns);
+        for(int k = 0; k < METRICS_REQ_KINDS; k++) {
+            metrics_requests_t *out = &s->requests[k];
+            if(load(&b->requests[k].count) == 0) {
+                continue;
+            }
+            for(unsigned i = 0; i < METRICS_BUCKETS; i++) {
+                out->buckets[i] += load(&b->requests[k].buckets[i]);
+            }
+            out->failed += load(&b->requests[k].failed);
+            out->sum_ns += load(&b->requests[k].sum_ns);
+        }
+    }
+    // Counted from the buckets so percentiles always add up.
+    for(int k = 0; k < METRICS_REQ_KINDS; k++) {
+        for(unsigned i = 0; i < METRICS_BUCKETS; i++) {
+            s->requests[k].count += s->requests[k].buckets[i];
+        }
+    }
+}
+
+int metrics_request_kind(uint16_t type) {
+    switch(type) {
+        case TLV_TYPE_LIST_REQUEST:        return METRICS_REQ_LIST;
+        case TLV_TYPE_LIST_SINCE_REQUEST:  return METRICS_REQ_LIST_SINCE;
+        case TLV_TYPE_LIST_FILTER_REQUEST: return METRICS_REQ_LIST_FILTER;
+        case TLV_TYPE_GET_REQUEST:         return METRICS_REQ_GET;
+        case TLV_TYPE_SET_REQUEST:         return METRICS_REQ_SET;
+        case TLV_TYPE_MULTI_GET_REQUEST:   return METRICS_REQ_MULTI_GET;
+        case TLV_TYPE_MULTI_SET_REQUEST:   return METRICS_REQ_MULTI_SET;
+        case TLV_TYPE_SUBSCRIBE_REQUEST:   return METRICS_REQ_SUBSCRIBE;
+        case TLV_TYPE_UNSUBSCRIBE_REQUEST: return METRICS_REQ_UNSUBSCRIBE;
+        case TLV_TYPE_HISTORY_REQUEST:     return METRICS_REQ_HISTORY;
+        case TLV_TYPE_AGGREGATE_REQUEST:   return METRICS_REQ_AGGREGATE;
+        case TLV_TYPE_STATS_REQUEST:       return METRICS_REQ_STATS;
+        default:                           return METRICS_REQ_OTHER;
+    }
+}
+
+uint16_t metrics_kind_type(int kind) {
+    return g_kinds[kind].type;
+}
+
+const char *metrics_kind_name(int kind) {
+    return g_kinds[kind].name;
+}
+
+uint64_t metrics_percentile(const metrics_requests_t *h, double q) {
+    if(h->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * (double)h->count + 0.5);
+    if(rank == 0) {
+        rank = 1;
+    } else if(rank > h->count) {
+        rank = h->count;
+    }
+    uint64_t seen = 0;
+    for(unsigned i = 0; i < METRICS_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if(seen >= rank) {
+            return bucket_upper(i);
+        }
+    }
+    return bucket_upper(METRICS_BUCKETS - 1);
+}
+
+int metrics_write_prometheus(const char *path, const metrics_snapshot_t *s) {
+    char tmp[4096];
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    FILE *f = fopen(tmp, "w");
+    if(!f) {
+        return -1;
+    }
+
+    fprintf(f, "# HELP iot_uptime_seconds Time since the server started.\n"
+               "# TYPE iot_uptime_seconds gauge\n"
+               "iot_uptime_seconds %.3f\n", (double)s->uptime_ms / 1e3);
+    fprintf(f, "# HELP iot_connections_active Open client connections.\n"
+               "# TYPE iot_connections_active gauge\n"
+               "iot_connections_active %llu\n", (unsigned long long)s->connections_active);
+    fprintf(f, "# HELP iot_connections_accepted_total Client connections accepted.\n"
+               "# TYPE iot_connections_accepted_total counter\n"
+               "iot_connections_accepted_total %llu\n", (unsigned long long)s->connections_accepted);
+    fprintf(f, "# HELP iot_received_bytes_total Bytes received from clients.\n"
+               "# TYPE iot_received_bytes_total counter\n"
+               "iot_received_bytes_total %llu\n", (unsigned long long)s->bytes_in);
+    fprintf(f, "# HELP iot_sent_bytes_total Bytes sent to clients.\n"
+               "# TYPE iot_sent_bytes_total counter\n"
+               "iot_sent_bytes_total %llu\n", (unsigned long long)s->bytes_out);
+    fprintf(f, "# HELP iot_registry_lock_acquisitions_total Registry shard lock acquisitions.\n"
+               "# TYPE iot_registry_lock_acquisitions_total counter\n"
+               "iot_registry_lock_acquisitions_total %llu\n", (unsigned long long)s->lock_acquired);
+    fprintf(f, "# HELP iot_registry_lock_contended_total Registry shard locks that had to wait.\n"
+               "# TYPE iot_registry_lock_contended_total counter\n"
+               "iot_registry_lock_contended_total %llu\n", (unsigned long long)s->lock_contended);
+    fprintf(f, "# HELP iot_registry_lock_wait_seconds_total Time spent waiting for registry shard locks.\n"
+               "# TYPE iot_registry_lock_wait_seconds_total counter\n"
+               "iot_registry_lock_wait_seconds_total %.9f\n", (double)s->lock_wait_ns / 1e9);
+    fprintf(f, "# HELP iot_list_cache_hits_total LIST requests served from the current encoded frame.\n"
+               "# TYPE iot_list_cache_hits_total counter\n"
+               "iot_list_cache_hits_total %llu\n", (unsigned long long)s->list_cache_hits);
+    fprintf(f, "# HELP iot_list_cache_misses_total LIST requests streamed because the encoded frame was stale or missing.\n"
+               "# TYPE iot_list_cache_misses_total counter\n"
+               "iot_list_cache_misses_total %llu\n", (unsigned long long)s->list_cache_misses);
+    fprintf(f, "# HELP iot_list_cache_rebuilds_total Encoded LIST frames built.\n"
+               "# TYPE iot_list_cache_rebuilds_total counter\n"
+               "iot_list_cache_rebuilds_total %llu\n", (unsigned long long)s->list_cache_rebuilds);
+
+    fprintf(f, "# HELP iot_requests_total Requests dispatched, by type.\n"
+               "# TYPE iot_requests_total counter\n");
+    for(int k = 0; k < METRICS_REQ_KINDS; k++) {
+        if(s->requests[k].count > 0) {
+            fprintf(f, "iot_requests_total{type=\"%s\"} %llu\n", g_kinds[k].name,
+                    (unsigned long long)s->requests[k].count);
+        }
+    }
+    fprintf(f, "# HELP iot_request_errors_total Requests whose handling failed and closed the connection.\n"
+               "# TYPE iot_request_errors_total counter\n");
+    for(int k = 0; k < METRICS_REQ_KINDS; k++) {
+        if(s->requests[k].count > 0) {
+            fprintf(f, "iot_request_errors_total{type=\"%s\"} %llu\n", g_kinds[k].name,
+                    (unsigned long long)s->requests[k].failed);
+        }
+    }
+    fprintf(f, "# HELP iot_request_duration_seconds Time spent handling a request.\n"
+               "# TYPE iot_request_duration_seconds histogram\n");
+    for(int k = 0; k < METRICS_REQ_KINDS; k++) {
+        const metrics_requests_t *h = &s->requests[k];
+        if(h->count == 0) {
+            continue;
+        }
+        // A fine bucket is counted under the first bound that covers all of it.
+        uint64_t cumulative = 0;
+        unsigned i = 0;
+        for(size_t b = 0; b < sizeof(g_prom_bounds) / sizeof(g_prom_bounds[0]); b++) {
+            uint64_t bound_ns = (uint64_t)(g_prom_bounds[b] * 1e9 + 0.5);
+            for(; i < METRICS_BUCKETS && bucket_upper(i) <= bound_ns; i++) {
+                cumulative += h->buckets[i];
+            }
+            fprintf(f, "iot_request_duration_seconds_bucket{type=\"%s\",le=\"%g\"} %llu\n", g_kinds[k].name,
+                    g_prom_bounds[b], (unsigned long long)cumulative);
+        }
+        fprintf(f, "iot_request_duration_seconds_bucket{type=\"%s\",le=\"+Inf\"} %llu\n", g_kinds[k].name,
+                (unsigned long long)h->count);
+        fprintf(f, "iot_request_duration_seconds_sum{type=\"%s\"} %.9f\n", g_kinds[k].name,
+                (double)h->sum_ns / 1e9);
+        fprintf(f, "iot_request_duration_seconds_count{type=\"%s\"} %llu\n", g_kinds[k].name,
+                (unsigned long long)h->count);
+    }
+
+    int failed = ferror(f);
+    if(fclose(f) != 0 || failed) {
+        int saved = errno;
+        unlink(tmp);
+        errno = saved ? saved : EIO;
+        return -1;
+    }
+    if(rename(tmp, path) < 0) {
+        int saved = errno;
+        unlink(tmp);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+static metrics_block_t *block_register(void) {
+    metrics_block_t *b = aligned_alloc(64, (sizeof(*b) + 63) & ~(size_t)63);
+    if(!b) {
+        return NULL;
+    }
+    memset(b, 0, sizeof(*b));
+    pthread_mutex_lock(&g_blocks_lock);
+    b->next = atomic_load(&g_blocks);
+    atomic_store_explicit(&g_blocks, b, memory_order_release);
+    pthread_mutex_unlock(&g_blocks_lock);
+    t_block = b;
+    return b;
+}
+
+static void counter_add(_Atomic uint64_t *c, uint64_t v) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + v, memory_order_relaxed);
+}
+
+static uint64_t load(_Atomic uint64_t *c) {
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+// Values below METRICS_SUB_BUCKETS get a bucket each; above, every power of
+// two is split into METRICS_SUB_BUCKETS equal buckets.
+static unsigned bucket_of(uint64_t ns) {
+    if(ns < METRICS_SUB_BUCKETS) {
+        return (unsigned)ns;
+    }
+    unsigned msb = 63u - (unsigned)__builtin_clzll(ns);
+    if(msb >= METRICS_MAX_BITS) {
+        return METRICS_BUCKETS - 1;
+    }
+    unsigned shift = msb - METRICS_SUB_BUCKET_BITS;
+    return (shift + 1) * METRICS_SUB_BUCKETS + (unsigned)((ns >> shift) & (METRICS_SUB_BUCKETS - 1));
+}
+
+// Largest value that lands in 'bucket'.
+static uint64_t bucket_upper(unsigned bucket) {
+    if(bucket < METRICS_SUB_BUCKETS) {
+        return bucket;
+    }
+    unsigned shift = bucket / METRICS_SUB_BUCKETS - 1;
+    uint64_t sub = METRICS_SUB_BUCKETS + bucket % METRICS_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
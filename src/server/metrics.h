@@ -0,0 +1,83 @@
+#pragma once
+
+// Request metrics. Every thread counts into its own block, registered on
+// first use, with plain loads and stores instead of atomic read-modify-write
+// operations; readers sum all blocks. Latencies go into HDR-style
+// histograms with 16 linear sub-buckets per power of two, so each value is
+// kept to within 1/16 of its magnitude.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define METRICS_SUB_BUCKET_BITS 4
+#define METRICS_SUB_BUCKETS (1u << METRICS_SUB_BUCKET_BITS)
+// Latencies from 2^METRICS_MAX_BITS ns (about 69 s) up share the last bucket.
+#define METRICS_MAX_BITS 36
+#define METRICS_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS)
+
+// Request types with their own counters; anything else counts as OTHER.
+enum {
+    METRICS_REQ_LIST = 0,
+    METRICS_REQ_LIST_SINCE,
+    METRICS_REQ_LIST_FILTER,
+    METRICS_REQ_GET,
+    METRICS_REQ_SET,
+    METRICS_REQ_MULTI_GET,
+    METRICS_REQ_MULTI_SET,
+    METRICS_REQ_SUBSCRIBE,
+    METRICS_REQ_UNSUBSCRIBE,
+    METRICS_REQ_HISTORY,
+    METRICS_REQ_AGGREGATE,
+    METRICS_REQ_STATS,
+    METRICS_REQ_OTHER,
+    METRICS_REQ_KINDS
+};
+
+typedef struct {
+    uint64_t count;
+    uint64_t failed; // dispatch errors that closed the connection
+    uint64_t sum_ns;
+    uint64_t buckets[METRICS_BUCKETS];
+} metrics_requests_t;
+
+typedef struct {
+    // Filled in by the caller of metrics_collect().
+    uint64_t uptime_ms;
+    uint64_t connections_active;
+    uint64_t connections_accepted;
+    uint64_t list_cache_hits;
+    uint64_t list_cache_misses;
+    uint64_t list_cache_rebuilds;
+
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t lock_acquired;  // registry shard locks taken
+    uint64_t lock_contended; // ... that had to wait
+    uint64_t lock_wait_ns;
+    metrics_requests_t requests[METRICS_REQ_KINDS];
+} metrics_snapshot_t;
+
+uint64_t metrics_now_ns(void);
+
+// Count a dispatched request of TLV 'type' that took 'ns'.
+void metrics_request(uint16_t type, uint64_t ns, int failed);
+void metrics_bytes_in(size_t n);
+void metrics_bytes_out(size_t n);
+// A registry lock acquisition; 'wait_ns' is 0 unless it was contended.
+void metrics_lock_acquired(int contended, uint64_t wait_ns);
+
+// Sum every thread's counters into 's' (the caller's fields are zeroed).
+void metrics_collect(metrics_snapshot_t *s);
+
+// METRICS_REQ_* of a TLV type, and back (0 for OTHER).
+int metrics_request_kind(uint16_t type);
+uint16_t metrics_kind_type(int kind);
+const char *metrics_kind_name(int kind);
+
+// Smallest latency bound (ns) that at least fraction 'q' of the requests
+// stay below, accurate to the bucket width; 0 without requests.
+uint64_t metrics_percentile(const metrics_requests_t *h, double q);
+
+// Write 's' in the Prometheus text format to 'path' (via a temporary file
+// and rename); -1 with errno set.
+int metrics_write_prometheus(const char *path, const metrics_snapshot_t *s);
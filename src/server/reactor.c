@@ -0,0 +1,428 @@
+#include "reactor.h"
+#include "list_cache.h"
+#include "metrics.h"
+#include "reactor_uring.h"
+#include "server.h"
+#include "subscription.h"
+#include "wal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define REACTOR_MAX_EVENTS 256
+#define REACTOR_WAIT_MS 500
+
+static int set_nonblocking(int fd);
+static void reactor_accept(reactor_t *r);
+static void reactor_drain_wakeups(reactor_t *r);
+static void reactor_kick(reactor_t *r);
+static void reactor_service_durable(reactor_t *r);
+static void *reactor_thread(void *arg);
+
+int reactor_init(reactor_t *r, int id, int listen_fd, int cpu, int backend) {
+    memset(r, 0, sizeof(*r));
+    r->id = id;
+    r->cpu = cpu;
+    r->backend = backend;
+    r->epoll_fd = -1;
+    r->listen_fd = listen_fd;
+
+    if(!reactor_backend_available(backend)) {
+        LOGE("%s backend is not available in this build", reactor_backend_name(backend));
+        return -1;
+    }
+#ifdef IOT_HAVE_IO_URING
+    if(backend == REACTOR_BACKEND_IO_URING) {
+        if(reactor_uring_init(r) < 0) {
+            return -1;
+        }
+        pthread_mutex_init(&r->wake_lock, NULL);
+        return 0;
+    }
+#endif
+
+    r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(r->epoll_fd < 0) {
+        LOGE("epoll_create1 failed: %s", strerror(errno));
+        return -1;
+    }
+
+    if(set_nonblocking(listen_fd) < 0) {
+        LOGE("listen socket O_NONBLOCK failed: %s", strerror(errno));
+        close(r->epoll_fd);
+        return -1;
+    }
+
+    // The listening socket is identified by a NULL data pointer.
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = NULL };
+    if(epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+        LOGE("epoll_ctl listen socket failed: %s", strerror(errno));
+        close(r->epoll_fd);
+        return -1;
+    }
+
+    r->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(r->wake_fd < 0) {
+        LOGE("eventfd failed: %s", strerror(errno));
+        close(r->epoll_fd);
+        return -1;
+    }
+    // The wakeup eventfd is identified by a pointer to its descriptor.
+    ev = (struct epoll_event){ .events = EPOLLIN, .data.ptr = &r->wake_fd };
+    if(epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wake_fd, &ev) < 0) {
+        LOGE("epoll_ctl eventfd failed: %s", strerror(errno));
+        close(r->wake_fd);
+        close(r->epoll_fd);
+        return -1;
+    }
+    pthread_mutex_init(&r->wake_lock, NULL);
+
+    return 0;
+}
+
+void reactor_destroy(reactor_t *r) {
+    while(r->conns) {
+        reactor_close(r, r->conns);
+    }
+#ifdef IOT_HAVE_IO_URING
+    if(r->uring) {
+        reactor_uring_destroy(r);
+    }
+#endif
+    close(r->wake_fd);
+    if(r->epoll_fd >= 0) {
+        close(r->epoll_fd);
+    }
+    pthread_mutex_destroy(&r->wake_lock);
+}
+
+int reactor_run(reactor_t *r) {
+#ifdef IOT_HAVE_IO_URING
+    if(r->uring) {
+        return reactor_uring_run(r);
+    }
+#endif
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while(g_running) {
+        int n = epoll_wait(r->epoll_fd, events, REACTOR_MAX_EVENTS, REACTOR_WAIT_MS);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            LOGE("epoll_wait failed: %s", strerror(errno));
+            return -1;
+        }
+
+        int woken = 0;
+        for(int i = 0; i < n; i++) {
+            conn_t *c = events[i].data.ptr;
+            if(c == NULL) {
+                reactor_accept(r);
+                continue;
+            }
+            if(events[i].data.ptr == &r->wake_fd) {
+                woken = 1;
+                continue;
+            }
+
+            if(events[i].events & EPOLLERR) {
+                reactor_close(r, c);
+                continue;
+            }
+            if(conn_service(c, (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) != 0) < 0) {
+                reactor_close(r, c);
+            }
+        }
+        // After the batch: servicing the wake and durable lists may close
+        // conns that later events of this batch still point to.
+        if(woken) {
+            reactor_drain_wakeups(r);
+        }
+    }
+
+    return 0;
+}
+
+void reactor_wake(reactor_t *r, conn_t *c) {
+    int first = 0;
+    pthread_mutex_lock(&r->wake_lock);
+    if(!c->wake_queued) {
+        c->wake_queued = 1;
+        c->wake_next = r->wake_head;
+        first = (r->wake_head == NULL);
+        r->wake_head = c;
+    }
+    pthread_mutex_unlock(&r->wake_lock);
+
+    // A non-empty list already has a wakeup on its way.
+    if(first) {
+        reactor_kick(r);
+    }
+}
+
+void reactor_wait_durable(reactor_t *r, conn_t *c) {
+    if(!c->durable_queued) {
+        c->durable_queued = 1;
+        c->durable_next = r->durable_head;
+        r->durable_head = c;
+    }
+    // Flag first, then re-check: either the WAL thread sees the flag or we
+    // see its commit, so a wakeup cannot be lost in between.
+    atomic_store(&r->durable_waiting, 1);
+    if(wal_durable_lsn() >= c->wal_lsn || wal_failed()) {
+        reactor_kick(r);
+    }
+}
+
+void reactor_notify_durable(reactor_t *r) {
+    if(atomic_load(&r->durable_waiting)) {
+        reactor_kick(r);
+    }
+}
+
+int reactor_parse_backend(const char *name) {
+    if(strcmp(name, "epoll") == 0) {
+        return REACTOR_BACKEND_EPOLL;
+    }
+    if(strcmp(name, "io_uring") == 0 || strcmp(name, "uring") == 0) {
+        return REACTOR_BACKEND_IO_URING;
+    }
+    return -1;
+}
+
+const char *reactor_backend_name(int backend) {
+    return (backend == REACTOR_BACKEND_IO_URING) ? "io_uring" : "epoll";
+}
+
+int reactor_backend_available(int backend) {
+#ifdef IOT_HAVE_IO_URING
+    return backend == REACTOR_BACKEND_EPOLL || backend == REACTOR_BACKEND_IO_URING;
+#else
+    return backend == REACTOR_BACKEND_EPOLL;
+#endif
+}
+
+int reactor_flush(reactor_t *r, conn_t *c) {
+#ifdef IOT_HAVE_IO_URING
+    if(r->uring) {
+        return reactor_uring_flush(r, c);
+    }
+#else
+    (void)r;
+#endif
+    size_t pending = tlv_writer_pending(&c->tx);
+    int rc = tlv_writer_flush(&c->tx, c->fd);
+    metrics_bytes_out(pending - tlv_writer_pending(&c->tx));
+    if(rc != 0 || !c->stream.frame) {
+        return rc;
+    }
+
+    // The cached LIST frame goes out from the shared buffer itself.
+    const list_frame_t *f = c->stream.frame;
+    while(c->stream.frame_off < f->len) {
+        ssize_t n = send(c->fd, f->data + c->stream.frame_off, f->len - c->stream.frame_off, MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+        }
+        c->stream.frame_off += (size_t)n;
+        metrics_bytes_out((size_t)n);
+    }
+    conn_frame_sent(c);
+    return 0;
+}
+
+int reactor_start(reactor_t *r) {
+    int rc = pthread_create(&r->thread, NULL, reactor_thread, r);
+    if(rc != 0) {
+        LOGE("worker %d pthread_create failed: %s", r->id, strerror(rc));
+        return -1;
+    }
+    return 0;
+}
+
+void reactor_join(reactor_t *r) {
+    pthread_join(r->thread, NULL);
+}
+
+static void *reactor_thread(void *arg) {
+    reactor_t *r = arg;
+
+    if(r->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(r->cpu, &set);
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if(rc != 0) {
+            LOGE("worker %d pinning to cpu %d failed: %s", r->id, r->cpu, strerror(rc));
+        }
+    }
+
+    reactor_run(r);
+    return NULL;
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void reactor_accept(reactor_t *r) {
+    while(1) {
+        int client_fd = accept4(r->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(client_fd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOGE("accept failed: %s", strerror(errno));
+            }
+            return;
+        }
+
+        // Each batch of pipelined responses is one send; ship it immediately.
+        int one = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        conn_t *c = conn_new(client_fd, r);
+        if(!c) {
+            close(client_fd);
+            continue;
+        }
+
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = c };
+        if(epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            LOGE("epoll_ctl client socket failed: %s", strerror(errno));
+            conn_free(c);
+            continue;
+        }
+
+        c->next = r->conns;
+        if(r->conns) {
+            r->conns->prev = c;
+        }
+        r->conns = c;
+        atomic_fetch_add_explicit(&r->stats.accepted, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&r->stats.active, 1, memory_order_relaxed);
+    }
+}
+
+void reactor_close(reactor_t *r, conn_t *c) {
+    if(r->epoll_fd >= 0) {
+        epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    }
+
+    if(c->durable_queued) {
+        conn_t **pp = &r->durable_head;
+        while(*pp != c) {
+            pp = &(*pp)->durable_next;
+        }
+        *pp = c->durable_next;
+    }
+
+    // Once unsubscribed no other thread can queue c, so it can be unlinked.
+    subscription_close(c);
+    pthread_mutex_lock(&r->wake_lock);
+    if(c->wake_queued) {
+        conn_t **pp = &r->wake_head;
+        while(*pp != c) {
+            pp = &(*pp)->wake_next;
+        }
+        *pp = c->wake_next;
+    }
+    pthread_mutex_unlock(&r->wake_lock);
+
+    if(c->prev) {
+        c->prev->next = c->next;
+    } else {
+        r->conns = c->next;
+    }
+    if(c->next) {
+        c->next->prev = c->prev;
+    }
+    atomic_fetch_sub_explicit(&r->stats.active, 1, memory_order_relaxed);
+
+#ifdef IOT_HAVE_IO_URING
+    if(r->uring) {
+        reactor_uring_release(r, c);
+        return;
+    }
+#endif
+    conn_free(c);
+}
+
+static void reactor_drain_wakeups(reactor_t *r) {
+    uint64_t value;
+    if(read(r->wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        LOGE("worker %d eventfd read failed: %s", r->id, strerror(errno));
+    }
+    reactor_service_wakeups(r);
+}
+
+void reactor_service_wakeups(reactor_t *r) {
+    pthread_mutex_lock(&r->wake_lock);
+    conn_t *c = r->wake_head;
+    r->wake_head = NULL;
+    pthread_mutex_unlock(&r->wake_lock);
+
+    // Each entry stays marked queued until its turn, so a concurrent
+    // reactor_wake() cannot relink it while this list is being walked.
+    while(c) {
+        pthread_mutex_lock(&r->wake_lock);
+        conn_t *next = c->wake_next;
+        c->wake_queued = 0;
+        pthread_mutex_unlock(&r->wake_lock);
+
+        if(conn_service(c, 0) < 0) {
+            reactor_close(r, c);
+        }
+        c = next;
+    }
+
+    reactor_service_durable(r);
+}
+
+static void reactor_kick(reactor_t *r) {
+    uint64_t one = 1;
+    if(write(r->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        LOGE("worker %d wakeup failed: %s", r->id, strerror(errno));
+    }
+}
+
+// Resume the connections whose WAL records have become durable; the others
+// go back on the list (and re-arm the flag).
+static void reactor_service_durable(reactor_t *r) {
+    conn_t *c = r->durable_head;
+    r->durable_head = NULL;
+    atomic_store(&r->durable_waiting, 0);
+
+    uint64_t durable = wal_durable_lsn();
+    int failed = wal_failed();
+    while(c) {
+        conn_t *next = c->durable_next;
+        c->durable_queued = 0;
+        // After a WAL failure conn_service() closes the ones still waiting.
+        if(c->wal_lsn > durable && !failed) {
+            reactor_wait_durable(r, c);
+        } else if(conn_service(c, 0) < 0) {
+            reactor_close(r, c);
+        }
+        c = next;
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "conn.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+// How a reactor waits for and performs socket I/O.
+enum {
+    REACTOR_BACKEND_EPOLL = 0, // readiness events, non-blocking read()/send()
+    REACTOR_BACKEND_IO_URING,  // completions: multishot accept/recv, async send
+};
+
+// Written by the owning worker, read by the main thread for reporting.
+typedef struct {
+    _Atomic uint64_t accepted;
+    _Atomic uint64_t requests;
+    _Atomic uint64_t active;
+} reactor_stats_t;
+
+typedef struct reactor {
+    int id;
+    int cpu; // -1 leaves the thread unpinned
+    int backend; // REACTOR_BACKEND_*
+    int epoll_fd;
+    struct reactor_uring *uring; // io_uring backend state, NULL otherwise
+    int listen_fd;
+    pthread_t thread;
+    conn_t *conns; // every open connection, released on shutdown
+    reactor_stats_t stats;
+
+    // Connections other threads have handed work to, serviced on the next
+    // wake_fd (eventfd) readiness.
+    int wake_fd;
+    pthread_mutex_t wake_lock;
+    conn_t *wake_head;
+
+    // Connections holding output for the WAL (reactor thread only), and
+    // whether the WAL thread has to wake us after a commit.
+    conn_t *durable_head;
+    _Atomic int durable_waiting;
+} reactor_t;
+
+int reactor_init(reactor_t *r, int id, int listen_fd, int cpu, int backend);
+void reactor_destroy(reactor_t *r);
+
+// Edge-triggered event loop, or the completion loop of the io_uring
+// backend; returns once g_running is cleared.
+int reactor_run(reactor_t *r);
+
+// REACTOR_BACKEND_* for "epoll" or "io_uring", -1 if unknown.
+int reactor_parse_backend(const char *name);
+const char *reactor_backend_name(int backend);
+// Whether this build supports 'backend'.
+int reactor_backend_available(int backend);
+
+// Start sending c->tx. Returns 0 once it is all written, 1 while output is
+// still pending (the connection is serviced again when it drains), -1 on
+// error.
+int reactor_flush(reactor_t *r, conn_t *c);
+
+// Ask the reactor thread to service 'c'; callable from any thread while 'c'
+// is guaranteed to stay open.
+void reactor_wake(reactor_t *r, conn_t *c);
+
+// Hold 'c' until wal_durable_lsn() reaches c->wal_lsn; reactor thread only.
+void reactor_wait_durable(reactor_t *r, conn_t *c);
+// Called by the WAL thread after each commit; wakes the reactor if it has
+// connections waiting.
+void reactor_notify_durable(reactor_t *r);
+
+// Run the event loop on its own thread, pinned to r->cpu.
+int reactor_start(reactor_t *r);
+void reactor_join(reactor_t *r);
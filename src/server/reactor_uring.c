@@ -0,0 +1,510 @@
+#include "reactor_uring.h"
+#include "list_cache.h"
+#include "metrics.h"
+#include "server.h"
+#include "uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define URING_ENTRIES 256
+// Multishot receives post many completions per submission.
+#define URING_CQ_ENTRIES 4096
+// Receive buffers shared by all connections of a worker.
+#define URING_BUFFERS 512
+#define URING_BUFFER_SIZE 4096
+#define URING_BGID 0
+#define URING_WAIT_MS 500
+// How long shutdown waits for cancelled operations to complete.
+#define URING_DRAIN_MS 1000
+
+// user_data is the reactor or conn pointer with the operation in the low bits.
+enum {
+    URING_TAG_CANCEL = 0,
+    URING_TAG_ACCEPT,
+    URING_TAG_WAKE,
+    URING_TAG_RECV,
+    URING_TAG_SEND,
+};
+#define URING_TAG_MASK 7ull
+
+struct reactor_uring {
+    uring_t ring;
+    uring_buf_ring_t bufs;
+    uint64_t wake_value;  // eventfd read target
+    unsigned inflight;    // submitted operations still owed a final completion
+    int accept_armed;
+    int wake_armed;
+    int stopping;         // completions only release resources
+    conn_t *closing;      // closed connections with operations outstanding
+};
+
+static struct io_uring_sqe *uring_next_sqe(reactor_t *r, void *ptr, unsigned tag);
+static int uring_arm_accept(reactor_t *r);
+static int uring_arm_wake(reactor_t *r);
+static int uring_arm_recv(reactor_t *r, conn_t *c);
+static int uring_send(reactor_t *r, conn_t *c);
+static void uring_cancel(reactor_t *r, conn_t *c, unsigned tag);
+static int uring_receive(reactor_t *r, conn_t *c, const uint8_t *data, size_t len);
+static int uring_service(reactor_t *r, conn_t *c);
+static void uring_reap(reactor_t *r);
+static void uring_on_accept(reactor_t *r, const struct io_uring_cqe *cqe);
+static void uring_on_wake(reactor_t *r, const struct io_uring_cqe *cqe);
+static void uring_on_recv(reactor_t *r, conn_t *c, const struct io_uring_cqe *cqe);
+static void uring_on_send(reactor_t *r, conn_t *c, const struct io_uring_cqe *cqe);
+
+int reactor_uring_init(reactor_t *r) {
+    struct reactor_uring *u = calloc(1, sizeof(*u));
+    if(!u) {
+        LOGE("worker %d io_uring allocation failed", r->id);
+        return -1;
+    }
+
+    // The ring stays disabled until the worker thread enables it, making
+    // that thread its single issuer.
+    unsigned flags = IORING_SETUP_R_DISABLED | IORING_SETUP_SUBMIT_ALL |
+                     IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    if(uring_init(&u->ring, URING_ENTRIES, URING_CQ_ENTRIES, flags) < 0) {
+        LOGE("worker %d io_uring setup failed: %s", r->id, strerror(errno));
+        free(u);
+        return -1;
+    }
+    if(uring_buf_ring_init(&u->ring, &u->bufs, URING_BGID, URING_BUFFERS, URING_BUFFER_SIZE) < 0) {
+        LOGE("worker %d io_uring buffer ring failed (Linux 6.0 or later needed): %s", r->id, strerror(errno));
+        uring_free(&u->ring);
+        free(u);
+        return -1;
+    }
+
+    // Read through the ring, so it must block: io_uring returns EAGAIN for
+    // O_NONBLOCK files instead of waiting.
+    r->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if(r->wake_fd < 0) {
+        LOGE("eventfd failed: %s", strerror(errno));
+        uring_buf_ring_free(&u->ring, &u->bufs);
+        uring_free(&u->ring);
+        free(u);
+        return -1;
+    }
+    r->uring = u;
+    return 0;
+}
+
+void reactor_uring_destroy(reactor_t *r) {
+    struct reactor_uring *u = r->uring;
+    uring_buf_ring_free(&u->ring, &u->bufs);
+    uring_free(&u->ring);
+    // Left over only if the shutdown drain timed out; the ring is gone now.
+    while(u->closing) {
+        conn_t *next = u->closing->next;
+        conn_free(u->closing);
+        u->closing = next;
+    }
+    free(u);
+    r->uring = NULL;
+}
+
+int reactor_uring_run(reactor_t *r) {
+    struct reactor_uring *u = r->uring;
+    int rc = 0;
+
+    if(uring_enable(&u->ring) < 0) {
+        LOGE("worker %d io_uring enable failed: %s", r->id, strerror(errno));
+        return -1;
+    }
+    if(uring_arm_accept(r) < 0 || uring_arm_wake(r) < 0) {
+        rc = -1;
+    }
+
+    while(rc == 0 && g_running) {
+        if(uring_submit_and_wait(&u->ring, 1, URING_WAIT_MS) < 0) {
+            LOGE("worker %d io_uring_enter failed: %s", r->id, strerror(errno));
+            rc = -1;
+            break;
+        }
+        uring_reap(r);
+    }
+
+    // Cancel whatever is still in flight and wait for it, so no buffer is
+    // freed while the kernel may still use it.
+    u->stopping = 1;
+    struct io_uring_sqe *sqe = uring_next_sqe(r, NULL, URING_TAG_CANCEL);
+    if(sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    }
+    for(int waited = 0; u->inflight > 0 && waited < URING_DRAIN_MS; waited += 10) {
+        if(uring_submit_and_wait(&u->ring, 1, 10) < 0) {
+            break;
+        }
+        uring_reap(r);
+    }
+    if(u->inflight > 0) {
+        LOGE("worker %d: %u io_uring operations did not complete", r->id, u->inflight);
+    }
+    return rc;
+}
+
+int reactor_uring_flush(reactor_t *r, conn_t *c) {
+    if(c->send_inflight) {
+        return 1;
+    }
+    if(tlv_writer_pending(&c->tx) == 0) {
+        if(c->stream.frame) {
+            // The cached LIST frame is sent from the shared buffer itself.
+            return (uring_send(r, c) < 0) ? -1 : 1;
+        }
+        return 0;
+    }
+    // The kernel reads tx_flight until the send completes; new responses
+    // keep going to tx.
+    tlv_writer_t pending = c->tx;
+    c->tx = c->tx_flight;
+    c->tx_flight = pending;
+    return (uring_send(r, c) < 0) ? -1 : 1;
+}
+
+void reactor_uring_release(reactor_t *r, conn_t *c) {
+    struct reactor_uring *u = r->uring;
+    if(!c->closing) {
+        if(!c->recv_armed && !c->send_inflight) {
+            conn_free(c);
+            return;
+        }
+        c->closing = 1;
+        c->prev = NULL;
+        c->next = u->closing;
+        if(u->closing) {
+            u->closing->prev = c;
+        }
+        u->closing = c;
+        if(c->recv_armed) {
+            uring_cancel(r, c, URING_TAG_RECV);
+        }
+        if(c->send_inflight) {
+            uring_cancel(r, c, URING_TAG_SEND);
+        }
+        return;
+    }
+
+    if(c->recv_armed || c->send_inflight) {
+        return;
+    }
+    if(c->prev) {
+        c->prev->next = c->next;
+    } else {
+        u->closing = c->next;
+    }
+    if(c->next) {
+        c->next->prev = c->prev;
+    }
+    conn_free(c);
+}
+
+static struct io_uring_sqe *uring_next_sqe(reactor_t *r, void *ptr, unsigned tag) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&r->uring->ring);
+    if(!sqe) {
+        LOGE("worker %d io_uring submission failed: %s", r->id, strerror(errno));
+        return NULL;
+    }
+    sqe->user_data = (uint64_t)(uintptr_t)ptr | tag;
+    r->uring->inflight++;
+    return sqe;
+}
+
+static int uring_arm_accept(reactor_t *r) {
+    struct io_uring_sqe *sqe = uring_next_sqe(r, r, URING_TAG_ACCEPT);
+    if(!sqe) {
+        return -1;
+    }
+    // Blocking sockets: the ring does the waiting.
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = r->listen_fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    r->uring->accept_armed = 1;
+    return 0;
+}
+
+static int uring_arm_wake(reactor_t *r) {
+    struct io_uring_sqe *sqe = uring_next_sqe(r, r, URING_TAG_WAKE);
+    if(!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = r->wake_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&r->uring->wake_value;
+    sqe->len = sizeof(r->uring->wake_value);
+    sqe->off = (uint64_t)-1;
+    r->uring->wake_armed = 1;
+    return 0;
+}
+
+// One receive stays armed for the life of the connection, taking a buffer
+// from the ring for each chunk that arrives.
+static int uring_arm_recv(reactor_t *r, conn_t *c) {
+    struct io_uring_sqe *sqe = uring_next_sqe(r, c, URING_TAG_RECV);
+    if(!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    c->recv_armed = 1;
+    return 0;
+}
+
+static int uring_send(reactor_t *r, conn_t *c) {
+    struct io_uring_sqe *sqe = uring_next_sqe(r, c, URING_TAG_SEND);
+    if(!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    // tx_flight first: the frame is only started once tx has drained.
+    if(tlv_writer_pending(&c->tx_flight) > 0) {
+        sqe->addr = (uint64_t)(uintptr_t)(c->tx_flight.buf + c->tx_flight.off);
+        sqe->len = (uint32_t)tlv_writer_pending(&c->tx_flight);
+    } else {
+        const list_frame_t *f = c->stream.frame;
+        size_t left = f->len - c->stream.frame_off;
+        sqe->addr = (uint64_t)(uintptr_t)(f->data + c->stream.frame_off);
+        sqe->len = (uint32_t)(left < UINT32_MAX ? left : UINT32_MAX);
+    }
+    sqe->msg_flags = MSG_NOSIGNAL;
+    c->send_inflight = 1;
+    return 0;
+}
+
+static void uring_cancel(reactor_t *r, conn_t *c, unsigned tag) {
+    struct io_uring_sqe *sqe = uring_next_sqe(r, NULL, URING_TAG_CANCEL);
+    if(sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (uint64_t)(uintptr_t)c | tag;
+    }
+}
+
+static void uring_reap(reactor_t *r) {
+    struct reactor_uring *u = r->uring;
+    struct io_uring_cqe *cqe;
+    while((cqe = uring_peek_cqe(&u->ring)) != NULL) {
+        // Handlers queue new SQEs, so release the slot first.
+        struct io_uring_cqe ev = *cqe;
+        uring_cqe_seen(&u->ring);
+        if(!(ev.flags & IORING_CQE_F_MORE)) {
+            u->inflight--;
+        }
+
+        void *ptr = (void *)(uintptr_t)(ev.user_data & ~URING_TAG_MASK);
+        switch(ev.user_data & URING_TAG_MASK) {
+            case URING_TAG_ACCEPT:
+                uring_on_accept(r, &ev);
+                break;
+            case URING_TAG_WAKE:
+                uring_on_wake(r, &ev);
+                break;
+            case URING_TAG_RECV:
+                uring_on_recv(r, ptr, &ev);
+                break;
+            case URING_TAG_SEND:
+                uring_on_send(r, ptr, &ev);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static void uring_on_accept(reactor_t *r, const struct io_uring_cqe *cqe) {
+    struct reactor_uring *u = r->uring;
+    if(!(cqe->flags & IORING_CQE_F_MORE)) {
+        u->accept_armed = 0;
+    }
+
+    if(cqe->res >= 0) {
+        int client_fd = cqe->res;
+        conn_t *c = u->stopping ? NULL : conn_new(client_fd, r);
+        if(!c) {
+            close(client_fd);
+        } else {
+            int one = 1;
+            setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            // Nothing is read directly; data arrives through the receive.
+            c->rx_ready = 0;
+            c->next = r->conns;
+            if(r->conns) {
+                r->conns->prev = c;
+            }
+            r->conns = c;
+            atomic_fetch_add_explicit(&r->stats.accepted, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&r->stats.active, 1, memory_order_relaxed);
+            if(uring_arm_recv(r, c) < 0) {
+                reactor_close(r, c);
+            }
+        }
+    } else if(cqe->res != -ECANCELED) {
+        LOGE("accept failed: %s", strerror(-cqe->res));
+    }
+
+    if(!u->accept_armed && !u->stopping) {
+        uring_arm_accept(r);
+    }
+}
+
+static void uring_on_wake(reactor_t *r, const struct io_uring_cqe *cqe) {
+    struct reactor_uring *u = r->uring;
+    u->wake_armed = 0;
+    if(u->stopping) {
+        return;
+    }
+    if(cqe->res < 0) {
+        LOGE("worker %d eventfd read failed: %s", r->id, strerror(-cqe->res));
+    }
+    reactor_service_wakeups(r);
+    uring_arm_wake(r);
+}
+
+static void uring_on_recv(reactor_t *r, conn_t *c, const struct io_uring_cqe *cqe) {
+    struct reactor_uring *u = r->uring;
+    if(!(cqe->flags & IORING_CQE_F_MORE)) {
+        c->recv_armed = 0;
+    }
+
+    int rc = 0;
+    if(cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if(cqe->res > 0 && !c->closing && !u->stopping) {
+            metrics_bytes_in((size_t)cqe->res);
+            rc = uring_receive(r, c, uring_buf_ring_buffer(&u->bufs, bid), (size_t)cqe->res);
+        }
+        uring_buf_ring_recycle(&u->bufs, bid);
+    }
+    if(c->closing) {
+        reactor_uring_release(r, c);
+        return;
+    }
+    if(u->stopping) {
+        return;
+    }
+
+    if(cqe->res == 0) {
+        c->rx_eof = 1;
+    } else if(cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        // ENOBUFS: the buffer ring ran dry; it is refilled by now.
+        // ECANCELED: paused by uring_receive().
+        rc = -1;
+    }
+    if(rc == 0 && !c->recv_armed && !c->recv_paused && !c->rx_eof) {
+        rc = uring_arm_recv(r, c);
+    }
+    if(rc < 0 || uring_service(r, c) < 0) {
+        reactor_close(r, c);
+    }
+}
+
+static void uring_on_send(reactor_t *r, conn_t *c, const struct io_uring_cqe *cqe) {
+    c->send_inflight = 0;
+    if(c->closing) {
+        reactor_uring_release(r, c);
+        return;
+    }
+    if(r->uring->stopping) {
+        return;
+    }
+    if(cqe->res < 0) {
+        if(cqe->res != -EPIPE && cqe->res != -ECONNRESET) {
+            LOGE("send failed: %s", strerror(-cqe->res));
+        }
+        reactor_close(r, c);
+        return;
+    }
+
+    metrics_bytes_out((size_t)cqe->res);
+    if(tlv_writer_pending(&c->tx_flight) > 0) {
+        tlv_writer_consumed(&c->tx_flight, (size_t)cqe->res);
+    } else {
+        c->stream.frame_off += (size_t)cqe->res;
+        if(c->stream.frame_off == c->stream.frame->len) {
+            conn_frame_sent(c);
+        }
+    }
+    // Responses queued before the LIST wait in tx; the service loop sends them first.
+    if(tlv_writer_pending(&c->tx_flight) > 0 || (c->stream.frame && tlv_writer_pending(&c->tx) == 0)) {
+        if(uring_send(r, c) < 0) {
+            reactor_close(r, c);
+        }
+        return;
+    }
+    if(uring_service(r, c) < 0) {
+        reactor_close(r, c);
+    }
+}
+
+// Hand received bytes to the parser. What does not fit while responses are
+// backed up is kept aside and receiving pauses, so a pipelining peer is
+// throttled by its own socket window as with the epoll backend.
+static int uring_receive(reactor_t *r, conn_t *c, const uint8_t *data, size_t len) {
+    size_t taken = (c->rx_backlog_len == 0) ? tlv_reader_append(&c->rx, data, len) : 0;
+    if(taken == len) {
+        return 0;
+    }
+
+    uint8_t *backlog = realloc(c->rx_backlog, c->rx_backlog_len + len - taken);
+    if(!backlog) {
+        LOGE("receive backlog allocation failed");
+        return -1;
+    }
+    memcpy(backlog + c->rx_backlog_len, data + taken, len - taken);
+    c->rx_backlog = backlog;
+    c->rx_backlog_len += len - taken;
+    if(c->recv_armed && !c->recv_paused) {
+        c->recv_paused = 1;
+        uring_cancel(r, c, URING_TAG_RECV);
+    }
+    return 0;
+}
+
+// conn_service(), feeding it the backlog as it frees room, and resume
+// receiving once the backlog is gone.
+static int uring_service(reactor_t *r, conn_t *c) {
+    while(1) {
+        if(c->rx_backlog_len > 0) {
+            size_t taken = tlv_reader_append(&c->rx, c->rx_backlog, c->rx_backlog_len);
+            c->rx_backlog_len -= taken;
+            memmove(c->rx_backlog, c->rx_backlog + taken, c->rx_backlog_len);
+            if(c->rx_backlog_len == 0) {
+                free(c->rx_backlog);
+                c->rx_backlog = NULL;
+            }
+        }
+        c->peer_closed = c->rx_eof && c->rx_backlog_len == 0;
+
+        size_t before = c->rx_backlog_len;
+        if(conn_service(c, 0) < 0) {
+            return -1;
+        }
+        // Stop once rx is full again: the connection waits for output.
+        if(before == 0 || c->rx.cap - c->rx.tail + c->rx.head == 0) {
+            break;
+        }
+    }
+
+    if(c->recv_paused && c->rx_backlog_len == 0) {
+        c->recv_paused = 0;
+        // Still armed until the cancellation completes, which re-arms it.
+        if(!c->recv_armed && !c->rx_eof) {
+            return uring_arm_recv(r, c);
+        }
+    }
+    return 0;
+}
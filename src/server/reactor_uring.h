@@ -0,0 +1,17 @@
+#pragma once
+
+// io_uring backend of the reactor, built when IOT_HAVE_IO_URING is defined.
+// Private to reactor.c and reactor_uring.c.
+
+#include "reactor.h"
+
+int reactor_uring_init(reactor_t *r);
+void reactor_uring_destroy(reactor_t *r);
+int reactor_uring_run(reactor_t *r);
+int reactor_uring_flush(reactor_t *r, conn_t *c);
+// Free a closed connection once the kernel holds no operation on it.
+void reactor_uring_release(reactor_t *r, conn_t *c);
+
+// Shared by both backends (reactor.c).
+void reactor_close(reactor_t *r, conn_t *c);
+void reactor_service_wakeups(reactor_t *r);
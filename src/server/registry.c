@@ -0,0 +1,1084 @@
+#include "registry.h"
+#include "hash.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define REGISTRY_NOT_FOUND UINT32_MAX
+// Lock-free readers fall back to the shard lock after this many torn reads.
+#define REGISTRY_READ_RETRIES 64
+// Column alignment: one cache line, enough for 256/512-bit loads.
+#define REGISTRY_ALIGN 64
+// Per-shard change log entries; older changes are found by a column scan.
+#define REGISTRY_CHANGE_LOG_SIZE 4096
+// Slots or log entries visited per lock hold by registry_scan_since() and
+// registry_scan_filter().
+#define REGISTRY_DELTA_WINDOW 4096
+// Store file header; bump the version whenever the region layout changes.
+#define REGISTRY_STORE_MAGIC "IOTSTORE"
+#define REGISTRY_STORE_VERSION 1
+#define REGISTRY_HEADER_SIZE 4096
+
+enum {
+    DELTA_SHARD_START = 0,
+    DELTA_SHARD_LOG,
+    DELTA_SHARD_SCAN,
+};
+
+// Open-addressing index entry. slot_ref is the record slot + 1 so that a
+// zero-filled page is an empty table.
+typedef struct {
+    uint32_t device_id;
+    uint32_t slot_ref;
+} registry_entry_t;
+
+typedef struct {
+    uint64_t generation;
+    uint32_t device_id;
+} registry_change_t;
+
+// First page of the region. The store file is this region as it is in
+// memory (native byte order), so it is served without a load phase.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t shard_count;
+    uint64_t capacity;
+    uint64_t region_size;
+    _Atomic uint64_t generation;
+    uint32_t clean; // set by registry_destroy() after the final flush
+} registry_header_t;
+
+// Per-shard counters that have to survive a restart, at the head of each
+// shard's part of the region (written under the shard lock).
+typedef struct {
+    _Atomic uint32_t count;
+    // Ring of the most recent changes, in generation order. Every change
+    // newer than log_floor is still in the ring.
+    uint64_t log_head; // entries ever appended
+    uint64_t log_floor;
+} registry_shard_state_t;
+
+// Byte sizes of the region's parts for a given capacity and shard count.
+typedef struct {
+    uint32_t shard_count;
+    uint32_t shard_shift;
+    size_t per_shard;
+    size_t index_size;
+    size_t index_bytes;
+    size_t word_col_bytes;
+    size_t byte_col_bytes;
+    size_t gen_col_bytes;
+    size_t log_bytes;
+    size_t map_bytes;
+    size_t shard_bytes;
+    size_t region_size;
+} registry_layout_t;
+
+// Writers serialize on 'lock'. Readers take no lock: 'layout_seq' is a
+// seqlock bumped around inserts and removes (which rewrite the index and
+// move records), and each slot has its own seqlock around value updates.
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;
+    _Atomic uint32_t layout_seq;
+    registry_shard_state_t *state;
+    registry_entry_t *index; // linear probing, 2x oversized, power of two
+    uint32_t index_mask;
+    _Atomic uint32_t *record_seq;
+    // Columnar records, dense: slots [0, count) are live. Wire-format rows
+    // are assembled on demand by shard_load_row().
+    uint32_t *ids;
+    float *temperature;
+    uint8_t *battery;
+    uint8_t *status;
+    uint64_t *generation; // registry generation of the last change
+    uint32_t capacity;
+
+    // Bitmap indexes over slots (under 'lock'): bit i of a map is set when
+    // slot i holds that status value or falls in that battery bucket.
+    uint64_t *status_map;  // REGISTRY_STATUS_VALUES maps of map_words words
+    uint64_t *battery_map; // REGISTRY_BATTERY_BUCKETS maps
+    uint32_t map_words;
+
+    registry_change_t *log; // see registry_shard_state_t
+} registry_shard_t;
+
+typedef struct {
+    registry_shard_t *shards;
+    uint32_t shard_count;
+    uint32_t shard_shift;
+    void *region;
+    size_t region_size;
+    registry_header_t *header;
+    int store_fd; // -1 unless the region maps a store file
+} registry_t;
+
+static registry_t g_registry;
+
+static int layout_for(size_t capacity, size_t shard_count, registry_layout_t *l);
+static void header_init(registry_header_t *h, size_t capacity, const registry_layout_t *l);
+static int registry_attach(void *region, const registry_layout_t *l, int store_fd);
+static void repair_seqlocks(void);
+static registry_shard_t *shard_for(uint32_t hash);
+static uint32_t index_find(const registry_shard_t *sh, uint32_t hash, uint32_t device_id);
+static void index_delete(registry_shard_t *sh, uint32_t pos);
+static size_t round_pow2(size_t v);
+static size_t align_up(size_t v);
+static void shard_load_row(const registry_shard_t *sh, uint32_t slot, device_status_t *out);
+static void shard_store_row(registry_shard_t *sh, uint32_t slot, const device_status_t *dev);
+static void shard_lock(registry_shard_t *sh);
+static void seq_write_begin(_Atomic uint32_t *seq);
+static void seq_write_end(_Atomic uint32_t *seq);
+static uint32_t seq_read_begin(_Atomic uint32_t *seq);
+static int seq_read_retry(_Atomic uint32_t *seq, uint32_t start);
+static int shard_read_record(registry_shard_t *sh, uint32_t slot, device_status_t *out);
+static size_t shard_scan(registry_shard_t *sh, uint32_t start, device_status_t *out, size_t max, int *at_end);
+static int shard_set_temperature(registry_shard_t *sh, uint32_t hash, uint32_t device_id, float temperature);
+static int shard_update(registry_shard_t *sh, uint32_t hash, const device_status_t *dev);
+static void group_by_shard(const uint32_t *hashes, size_t count, uint32_t *order, uint32_t *starts);
+static uint64_t shard_log_change(registry_shard_t *sh, uint32_t device_id);
+static size_t shard_scan_log(registry_shard_t *sh, registry_delta_t *d, device_status_t *out, size_t max);
+static size_t shard_scan_changed(registry_shard_t *sh, registry_delta_t *d, device_status_t *out, size_t max);
+static uint32_t battery_bucket(uint8_t battery);
+static void bitmap_index_add(registry_shard_t *sh, uint32_t slot);
+static void bitmap_index_drop(registry_shard_t *sh, uint32_t slot);
+static size_t shard_scan_filter(registry_shard_t *sh, registry_filter_t *f, device_status_t *out, size_t max, int *at_end);
+static uint64_t shard_temperature_bits(const registry_shard_t *sh, uint32_t w, float lo, float hi);
+
+int registry_init(size_t capacity, size_t shard_count) {
+    registry_layout_t l;
+    if(layout_for(capacity, shard_count, &l) < 0) {
+        return -1;
+    }
+
+    // One mapping for all shard tables; pages are only touched as devices arrive.
+    void *region = mmap(NULL, l.region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(region == MAP_FAILED) {
+        return -1;
+    }
+    header_init(region, capacity, &l);
+    if(registry_attach(region, &l, -1) < 0) {
+        munmap(region, l.region_size);
+        return -1;
+    }
+    return 0;
+}
+
+int registry_open(const char *path, size_t capacity, size_t shard_count) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        return -1;
+    }
+    if(flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        close(fd); // EWOULDBLOCK: another server has it open
+        return -1;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // An existing store keeps the geometry it was created with.
+    int existing = (st.st_size > 0);
+    registry_header_t hdr;
+    if(existing) {
+        if(pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+           memcmp(hdr.magic, REGISTRY_STORE_MAGIC, sizeof(hdr.magic)) != 0 ||
+           hdr.version != REGISTRY_STORE_VERSION) {
+            close(fd);
+            errno = EINVAL;
+            return -1;
+        }
+        capacity = hdr.capacity;
+        shard_count = hdr.shard_count;
+    }
+
+    registry_layout_t l;
+    if(layout_for(capacity, shard_count, &l) < 0) {
+        close(fd);
+        return -1;
+    }
+    if(existing && (hdr.region_size != l.region_size || (size_t)st.st_size < l.region_size)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    if(!existing && ftruncate(fd, (off_t)l.region_size) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Shared file mapping: the page cache holds the tables, and the
+    // kernel writes dirty pages back on its own or on registry_flush().
+    void *region = mmap(NULL, l.region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(region == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    if(!existing) {
+        header_init(region, capacity, &l);
+    }
+    if(registry_attach(region, &l, fd) < 0) {
+        munmap(region, l.region_size);
+        close(fd);
+        return -1;
+    }
+    if(existing && !g_registry.header->clean) {
+        repair_seqlocks();
+    }
+    g_registry.header->clean = 0;
+    return existing;
+}
+
+int registry_flush(int wait) {
+    if(g_registry.store_fd < 0) {
+        return 0;
+    }
+    if(wait) {
+        return msync(g_registry.region, g_registry.region_size, MS_SYNC);
+    }
+    return sync_file_range(g_registry.store_fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+}
+
+size_t registry_capacity(void) {
+    return g_registry.header ? (size_t)g_registry.header->capacity : 0;
+}
+
+size_t registry_shard_count(void) {
+    return g_registry.shard_count;
+}
+
+void registry_destroy(void) {
+    if(!g_registry.shards) {
+        return;
+    }
+    if(g_registry.store_fd >= 0) {
+        // Mark the store clean only once everything before it is on disk.
+        if(msync(g_registry.region, g_registry.region_size, MS_SYNC) == 0) {
+            g_registry.header->clean = 1;
+            msync(g_registry.region, REGISTRY_HEADER_SIZE, MS_SYNC);
+        }
+        close(g_registry.store_fd);
+    }
+    for(uint32_t i = 0; i < g_registry.shard_count; i++) {
+        pthread_mutex_destroy(&g_registry.shards[i].lock);
+    }
+    free(g_registry.shards);
+    munmap(g_registry.region, g_registry.region_size);
+    memset(&g_registry, 0, sizeof(g_registry));
+}
+
+int registry_insert(const device_status_t *dev) {
+    uint32_t h = hash_device_id(dev->device_id);
+    registry_shard_t *sh = shard_for(h);
+    int rc = 0;
+
+    shard_lock(sh);
+    uint32_t count = atomic_load_explicit(&sh->state->count, memory_order_relaxed);
+    if(index_find(sh, h, dev->device_id) != REGISTRY_NOT_FOUND) {
+        rc = 1;
+    } else if(count == sh->capacity) {
+        rc = -1;
+    } else {
+        uint32_t pos = h & sh->index_mask;
+        while(sh->index[pos].slot_ref != 0) {
+            pos = (pos + 1) & sh->index_mask;
+        }
+        seq_write_begin(&sh->layout_seq);
+        shard_store_row(sh, count, dev);
+        bitmap_index_add(sh, count);
+        sh->generation[count] = shard_log_change(sh, dev->device_id);
+        sh->index[pos].device_id = dev->device_id;
+        sh->index[pos].slot_ref = count + 1;
+        atomic_store_explicit(&sh->state->count, count + 1, memory_order_relaxed);
+        seq_write_end(&sh->layout_seq);
+    }
+    pthread_mutex_unlock(&sh->lock);
+
+    return rc;
+}
+
+int registry_remove(uint32_t device_id) {
+    uint32_t h = hash_device_id(device_id);
+    registry_shard_t *sh = shard_for(h);
+
+    shard_lock(sh);
+    uint32_t pos = index_find(sh, h, device_id);
+    if(pos == REGISTRY_NOT_FOUND) {
+        pthread_mutex_unlock(&sh->lock);
+        return 1;
+    }
+
+    uint32_t slot = sh->index[pos].slot_ref - 1;
+    uint32_t last = atomic_load_explicit(&sh->state->count, memory_order_relaxed) - 1;
+
+    seq_write_begin(&sh->layout_seq);
+    index_delete(sh, pos);
+    bitmap_index_drop(sh, slot);
+    // Keep the record array dense by moving the last record into the hole.
+    if(slot != last) {
+        uint32_t moved_id = sh->ids[last];
+        uint32_t moved_pos = index_find(sh, hash_device_id(moved_id), moved_id);
+        device_status_t moved;
+        shard_load_row(sh, last, &moved);
+        bitmap_index_drop(sh, last);
+        shard_store_row(sh, slot, &moved);
+        bitmap_index_add(sh, slot);
+        sh->generation[slot] = sh->generation[last];
+        sh->index[moved_pos].slot_ref = slot + 1;
+    }
+    atomic_store_explicit(&sh->state->count, last, memory_order_relaxed);
+    seq_write_end(&sh->layout_seq);
+    pthread_mutex_unlock(&sh->lock);
+    // Nothing is stamped, but cached listings must notice the device is gone.
+    atomic_fetch_add(&g_registry.header->generation, 1);
+
+    return 0;
+}
+
+int registry_get(uint32_t device_id, device_status_t *out) {
+    uint32_t h = hash_device_id(device_id);
+    registry_shard_t *sh = shard_for(h);
+
+    for(int attempt = 0; attempt < REGISTRY_READ_RETRIES; attempt++) {
+        uint32_t layout = seq_read_begin(&sh->layout_seq);
+
+        uint32_t pos = index_find(sh, h, device_id);
+        if(pos == REGISTRY_NOT_FOUND) {
+            if(!seq_read_retry(&sh->layout_seq, layout)) {
+                return 1;
+            }
+            continue;
+        }
+
+        uint32_t slot = sh->index[pos].slot_ref - 1;
+        if(slot < sh->capacity && shard_read_record(sh, slot, out) == 0 &&
+           !seq_read_retry(&sh->layout_seq, layout) && out->device_id == device_id) {
+            return 0;
+        }
+    }
+
+    // Persistent churn on this shard: take the lock rather than spin.
+    int rc = 1;
+    shard_lock(sh);
+    uint32_t pos = index_find(sh, h, device_id);
+    if(pos != REGISTRY_NOT_FOUND) {
+        shard_load_row(sh, sh->index[pos].slot_ref - 1, out);
+        rc = 0;
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return rc;
+}
+
+int registry_set_temperature(uint32_t device_id, float temperature) {
+    uint32_t h = hash_device_id(device_id);
+    registry_shard_t *sh = shard_for(h);
+
+    shard_lock(sh);
+    int rc = shard_set_temperature(sh, h, device_id, temperature);
+    pthread_mutex_unlock(&sh->lock);
+
+    return rc;
+}
+
+int registry_get_many(const uint32_t *ids, size_t count, device_status_t *out, uint8_t *results) {
+    for(size_t i = 0; i < count; i++) {
+        results[i] = (uint8_t)registry_get(ids[i], &out[i]);
+    }
+    return 0;
+}
+
+int registry_set_temperature_many(const uint32_t *ids, const float *temps, size_t count, uint8_t *results) {
+    uint32_t *hashes = malloc(count * sizeof(*hashes));
+    uint32_t *order = malloc(count * sizeof(*order));
+    if(!hashes || !order) {
+        free(hashes);
+        free(order);
+        return -1;
+    }
+
+    uint32_t starts[REGISTRY_MAX_SHARDS + 1];
+    for(size_t i = 0; i < count; i++) {
+        hashes[i] = hash_device_id(ids[i]);
+    }
+    group_by_shard(hashes, count, order, starts);
+
+    for(uint32_t s = 0; s < g_registry.shard_count; s++) {
+        if(starts[s] == starts[s + 1]) {
+            continue;
+        }
+        registry_shard_t *sh = &g_registry.shards[s];
+        shard_lock(sh);
+        for(uint32_t k = starts[s]; k < starts[s + 1]; k++) {
+            uint32_t i = order[k];
+            results[i] = (uint8_t)shard_set_temperature(sh, hashes[i], ids[i], temps[i]);
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+
+    free(hashes);
+    free(order);
+    return 0;
+}
+
+int registry_update(const device_status_t *dev) {
+    uint32_t h = hash_device_id(dev->device_id);
+    registry_shard_t *sh = shard_for(h);
+
+    shard_lock(sh);
+    int rc = shard_update(sh, h, dev);
+    pthread_mutex_unlock(&sh->lock);
+
+    return rc;
+}
+
+int registry_update_many(const device_status_t *devs, size_t count, uint8_t *results) {
+    uint32_t *hashes = malloc(count * sizeof(*hashes));
+    uint32_t *order = malloc(count * sizeof(*order));
+    if(!hashes || !order) {
+        free(hashes);
+        free(order);
+        return -1;
+    }
+
+    uint32_t starts[REGISTRY_MAX_SHARDS + 1];
+    for(size_t i = 0; i < count; i++) {
+        hashes[i] = hash_device_id(devs[i].device_id);
+    }
+    group_by_shard(hashes, count, order, starts);
+
+    for(uint32_t s = 0; s < g_registry.shard_count; s++) {
+        if(starts[s] == starts[s + 1]) {
+            continue;
+        }
+        registry_shard_t *sh = &g_registry.shards[s];
+        shard_lock(sh);
+        for(uint32_t k = starts[s]; k < starts[s + 1]; k++) {
+            uint32_t i = order[k];
+            results[i] = (uint8_t)shard_update(sh, hashes[i], &devs[i]);
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+
+    free(hashes);
+    free(order);
+    return 0;
+}
+
+size_t registry_count(void) {
+    size_t total = 0;
+    for(uint32_t i = 0; i < g_registry.shard_count; i++) {
+        total += atomic_load_explicit(&g_registry.shards[i].state->count, memory_order_relaxed);
+    }
+    return total;
+}
+
+void registry_visit_columns(void (*visit)(const registry_columns_t *cols, void *arg), void *arg) {
+    for(uint32_t s = 0; s < g_registry.shard_count; s++) {
+        registry_shard_t *sh = &g_registry.shards[s];
+        shard_lock(sh);
+        registry_columns_t cols = {
+            .temperature = sh->temperature,
+            .battery = sh->battery,
+            .status = sh->status,
+            .count = atomic_load_explicit(&sh->state->count, memory_order_relaxed),
+        };
+        visit(&cols, arg);
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
+
+uint64_t registry_generation(void) {
+    return atomic_load(&g_registry.header->generation);
+}
+
+// Records are copied under their own seqlocks, so SETs never wait for a
+// scan. A concurrent insert/remove in the shard restarts the chunk.
+size_t registry_scan(uint32_t cursor, device_status_t *out, size_t max, uint32_t *next) {
+    uint32_t shard = cursor >> REGISTRY_CURSOR_SLOT_BITS;
+    uint32_t slot = cursor & REGISTRY_CURSOR_SLOT_MASK;
+    size_t n = 0;
+
+    if(cursor == REGISTRY_CURSOR_END) {
+        shard = g_registry.shard_count;
+    }
+
+    while(shard < g_registry.shard_count && n < max) {
+        if(slot == 0) {
+            // Generations are allocated under the shard lock, so once it has
+            // been taken every change up to an earlier registry_generation()
+            // is complete and visible to the lock-free copy below.
+            shard_lock(&g_registry.shards[shard]);
+            pthread_mutex_unlock(&g_registry.shards[shard].lock);
+        }
+        int at_end = 0;
+        size_t taken = shard_scan(&g_registry.shards[shard], slot, out + n, max - n, &at_end);
+        n += taken;
+        slot += (uint32_t)taken;
+        if(at_end) {
+            shard++;
+            slot = 0;
+        }
+    }
+
+    *next = (shard < g_registry.shard_count) ? (shard << REGISTRY_CURSOR_SLOT_BITS) | slot : REGISTRY_CURSOR_END;
+    return n;
+}
+
+void registry_delta_init(registry_delta_t *d, uint64_t since) {
+    memset(d, 0, sizeof(*d));
+    d->since = since;
+    d->mode = DELTA_SHARD_START;
+}
+
+// Shards whose change log still reaches back to 'since' replay it, which
+// costs O(changes); the others fall back to scanning the generation column.
+size_t registry_scan_since(registry_delta_t *d, device_status_t *out, size_t max, int *done) {
+    size_t n = 0;
+
+    while(d->shard < g_registry.shard_count && n < max) {
+        registry_shard_t *sh = &g_registry.shards[d->shard];
+
+        shard_lock(sh);
+        if(d->mode == DELTA_SHARD_START) {
+            d->mode = (sh->state->log_floor <= d->since) ? DELTA_SHARD_LOG : DELTA_SHARD_SCAN;
+            d->after = d->since;
+            d->slot = 0;
+        }
+        if(d->mode == DELTA_SHARD_LOG && sh->state->log_floor > d->after) {
+            // Overwritten between chunks: finish this shard by scanning.
+            d->mode = DELTA_SHARD_SCAN;
+            d->slot = 0;
+        }
+        size_t taken = (d->mode == DELTA_SHARD_LOG) ? shard_scan_log(sh, d, out + n, max - n)
+                                                    : shard_scan_changed(sh, d, out + n, max - n);
+        pthread_mutex_unlock(&sh->lock);
+        n += taken;
+
+        if(d->mode == DELTA_SHARD_START) {
+            d->shard++;
+        }
+    }
+
+    *done = (d->shard >= g_registry.shard_count);
+    return n;
+}
+
+void registry_filter_init(registry_filter_t *f, const registry_predicate_t *pred) {
+    memset(f, 0, sizeof(*f));
+    f->pred = *pred;
+    // An empty range matches nothing: skip straight to the end.
+    if(pred->status_mask == 0 || pred->battery_min > pred->battery_max || !(pred->temp_min <= pred->temp_max)) {
+        f->shard = g_registry.shard_count;
+    }
+}
+
+size_t registry_scan_filter(registry_filter_t *f, device_status_t *out, size_t max, int *done) {
+    size_t n = 0;
+
+    while(f->shard < g_registry.shard_count && n < max) {
+        registry_shard_t *sh = &g_registry.shards[f->shard];
+        int at_end = 0;
+
+        shard_lock(sh);
+        n += shard_scan_filter(sh, f, out + n, max - n, &at_end);
+        pthread_mutex_unlock(&sh->lock);
+
+        if(at_end) {
+            f->shard++;
+            f->slot = 0;
+        }
+    }
+
+    *done = (f->shard >= g_registry.shard_count);
+    return n;
+}
+
+static int layout_for(size_t capacity, size_t shard_count, registry_layout_t *l) {
+    if(capacity == 0 || shard_count == 0 || shard_count > REGISTRY_MAX_SHARDS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    shard_count = round_pow2(shard_count);
+    uint32_t bits = 0;
+    while((1u << bits) < shard_count) bits++;
+
+    // Headroom for uneven hashing across shards.
+    size_t per_shard = (capacity + shard_count - 1) / shard_count;
+    per_shard += per_shard / 4 + 16;
+    if(per_shard > REGISTRY_CURSOR_SLOT_MASK) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Per-shard layout: state | index | record_seq | ids | temperature | battery | status
+    //                   | generation | log | status maps | battery maps
+    l->shard_count = (uint32_t)shard_count;
+    l->shard_shift = 32 - bits;
+    l->per_shard = per_shard;
+    l->index_size = round_pow2(per_shard * 2);
+    l->index_bytes = align_up(l->index_size * sizeof(registry_entry_t));
+    l->word_col_bytes = align_up(per_shard * sizeof(uint32_t));
+    l->byte_col_bytes = align_up(per_shard);
+    l->gen_col_bytes = align_up(per_shard * sizeof(uint64_t));
+    l->log_bytes = align_up(REGISTRY_CHANGE_LOG_SIZE * sizeof(registry_change_t));
+    l->map_bytes = align_up((per_shard + 63) / 64 * sizeof(uint64_t));
+    l->shard_bytes = align_up(sizeof(registry_shard_state_t)) + l->index_bytes + 3 * l->word_col_bytes +
+                     2 * l->byte_col_bytes + l->gen_col_bytes + l->log_bytes +
+                     (REGISTRY_STATUS_VALUES + REGISTRY_BATTERY_BUCKETS) * l->map_bytes;
+    l->region_size = REGISTRY_HEADER_SIZE + l->shard_bytes * shard_count;
+    return 0;
+}
+
+static void header_init(registry_header_t *h, size_t capacity, const registry_layout_t *l) {
+    memcpy(h->magic, REGISTRY_STORE_MAGIC, sizeof(h->magic));
+    h->version = REGISTRY_STORE_VERSION;
+    h->shard_count = l->shard_count;
+    h->capacity = capacity;
+    h->region_size = l->region_size;
+    atomic_store(&h->generation, 0);
+}
+
+// Point the shard descriptors at their parts of 'region'.
+static int registry_attach(void *region, const registry_layout_t *l, int store_fd) {
+    registry_shard_t *shards = aligned_alloc(64, l->shard_count * sizeof(*shards));
+    if(!shards) {
+        return -1;
+    }
+
+    for(size_t i = 0; i < l->shard_count; i++) {
+        registry_shard_t *sh = &shards[i];
+        uint8_t *base = (uint8_t *)region + REGISTRY_HEADER_SIZE + i * l->shard_bytes;
+
+        memset(sh, 0, sizeof(*sh));
+        pthread_mutex_init(&sh->lock, NULL);
+        sh->state = (registry_shard_state_t *)base;
+        base += align_up(sizeof(registry_shard_state_t));
+        sh->index = (registry_entry_t *)base;
+        sh->index_mask = (uint32_t)(l->index_size - 1);
+        base += l->index_bytes;
+        sh->record_seq = (_Atomic uint32_t *)base;
+        base += l->word_col_bytes;
+        sh->ids = (uint32_t *)base;
+        base += l->word_col_bytes;
+        sh->temperature = (float *)base;
+        base += l->word_col_bytes;
+        sh->battery = base;
+        base += l->byte_col_bytes;
+        sh->status = base;
+        base += l->byte_col_bytes;
+        sh->generation = (uint64_t *)base;
+        base += l->gen_col_bytes;
+        sh->log = (registry_change_t *)base;
+        base += l->log_bytes;
+        // map_bytes is a multiple of 8, so the maps of a kind are one array.
+        sh->map_words = (uint32_t)(l->map_bytes / sizeof(uint64_t));
+        sh->status_map = (uint64_t *)base;
+        base += REGISTRY_STATUS_VALUES * l->map_bytes;
+        sh->battery_map = (uint64_t *)base;
+        sh->capacity = (uint32_t)l->per_shard;
+    }
+
+    g_registry.shards = shards;
+    g_registry.shard_count = l->shard_count;
+    g_registry.shard_shift = l->shard_shift;
+    g_registry.region = region;
+    g_registry.region_size = l->region_size;
+    g_registry.header = region;
+    g_registry.store_fd = store_fd;
+    return 0;
+}
+
+// A store that was not closed cleanly may hold a record seqlock left odd by
+// a writer that never finished; readers would spin on it forever.
+static void repair_seqlocks(void) {
+    for(uint32_t s = 0; s < g_registry.shard_count; s++) {
+        registry_shard_t *sh = &g_registry.shards[s];
+        uint32_t count = atomic_load_explicit(&sh->state->count, memory_order_relaxed);
+        for(uint32_t slot = 0; slot < count; slot++) {
+            uint32_t seq = atomic_load_explicit(&sh->record_seq[slot], memory_order_relaxed);
+            if(seq & 1u) {
+                atomic_store_explicit(&sh->record_seq[slot], seq + 1, memory_order_relaxed);
+            }
+        }
+    }
+}
+
+static registry_shard_t *shard_for(uint32_t hash) {
+    if(g_registry.shard_count == 1) {
+        return &g_registry.shards[0];
+    }
+    return &g_registry.shards[hash >> g_registry.shard_shift];
+}
+
+// Returns the index position holding device_id, or REGISTRY_NOT_FOUND.
+static uint32_t index_find(const registry_shard_t *sh, uint32_t hash, uint32_t device_id) {
+    uint32_t pos = hash & sh->index_mask;
+    while(sh->index[pos].slot_ref != 0) {
+        if(sh->index[pos].device_id == device_id) {
+            return pos;
+        }
+        pos = (pos + 1) & sh->index_mask;
+    }
+    return REGISTRY_NOT_FOUND;
+}
+
+// Backward-shift deletion keeps probe chains intact without tombstones.
+static void index_delete(registry_shard_t *sh, uint32_t pos) {
+    uint32_t hole = pos;
+    uint32_t next = (pos + 1) & sh->index_mask;
+
+    while(sh->index[next].slot_ref != 0) {
+        uint32_t home = hash_device_id(sh->index[next].device_id) & sh->index_mask;
+        // Move the entry back unless its home lies cyclically in (hole, next].
+        uint32_t dist_next = (next - home) & sh->index_mask;
+        uint32_t dist_hole = (next - hole) & sh->index_mask;
+        if(dist_next >= dist_hole) {
+            sh->index[hole] = sh->index[next];
+            hole = next;
+        }
+        next = (next + 1) & sh->index_mask;
+    }
+    sh->index[hole].slot_ref = 0;
+}
+
+// Copy one record under its seqlock; -1 if it kept changing underneath us.
+static int shard_read_record(registry_shard_t *sh, uint32_t slot, device_status_t *out) {
+    for(int attempt = 0; attempt < REGISTRY_READ_RETRIES; attempt++) {
+        uint32_t seq = seq_read_begin(&sh->record_seq[slot]);
+        shard_load_row(sh, slot, out);
+        if(!seq_read_retry(&sh->record_seq[slot], seq)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Copy up to 'max' records from slot 'start'; *at_end is set once the
+// shard has nothing past the copied range.
+static size_t shard_scan(registry_shard_t *sh, uint32_t start, device_status_t *out, size_t max, int *at_end) {
+    for(int attempt = 0; attempt < REGISTRY_READ_RETRIES; attempt++) {
+        uint32_t layout = seq_read_begin(&sh->layout_seq);
+        uint32_t count = atomic_load_explicit(&sh->state->count, memory_order_relaxed);
+        size_t take = (start < count) ? count - start : 0;
+        if(take > max) {
+            take = max;
+        }
+
+        size_t j = 0;
+        for(; j < take; j++) {
+            if(shard_read_record(sh, start + (uint32_t)j, &out[j]) < 0) {
+                break;
+            }
+        }
+        if(j == take && !seq_read_retry(&sh->layout_seq, layout)) {
+            *at_end = (start + take >= count);
+            return take;
+        }
+    }
+
+    shard_lock(sh);
+    uint32_t count = atomic_load_explicit(&sh->state->count, memory_order_relaxed);
+    size_t take = (start < count) ? count - start : 0;
+    if(take > max) {
+        take = max;
+    }
+    for(size_t j = 0; j < take; j++) {
+        shard_load_row(sh, start + (uint32_t)j, &out[j]);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    *at_end = (start + take >= count);
+    return take;
+}
+
+// Caller holds sh->lock.
+static int shard_set_temperature(registry_shard_t *sh, uint32_t hash, uint32_t device_id, float temperature) {
+    uint32_t pos = index_find(sh, hash, device_id);
+    if(pos == REGISTRY_NOT_FOUND) {
+        return 1;
+    }
+    uint32_t slot = sh->index[pos].slot_ref - 1;
+    seq_write_begin(&sh->record_seq[slot]);
+    sh->temperature[slot] = temperature;
+    sh->generation[slot] = shard_log_change(sh, device_id);
+    seq_write_end(&sh->record_seq[slot]);
+    return 0;
+}
+
+// Caller holds sh->lock.
+static int shard_update(registry_shard_t *sh, uint32_t hash, const device_status_t *dev) {
+    uint32_t pos = index_find(sh, hash, dev->device_id);
+    if(pos == REGISTRY_NOT_FOUND) {
+        return 1;
+    }
+    uint32_t slot = sh->index[pos].slot_ref - 1;
+    seq_write_begin(&sh->record_seq[slot]);
+    bitmap_index_drop(sh, slot);
+    shard_store_row(sh, slot, dev);
+    bitmap_index_add(sh, slot);
+    sh->generation[slot] = shard_log_change(sh, dev->device_id);
+    seq_write_end(&sh->record_seq[slot]);
+    return 0;
+}
+
+// Counting sort of a batch by shard: the batch indexes of shard s end up in
+// order[starts[s] .. starts[s + 1]).
+static void group_by_shard(const uint32_t *hashes, size_t count, uint32_t *order, uint32_t *starts) {
+    memset(starts, 0, (g_registry.shard_count + 1) * sizeof(*starts));
+    for(size_t i = 0; i < count; i++) {
+        starts[(shard_for(hashes[i]) - g_registry.shards) + 1]++;
+    }
+    for(uint32_t s = 0; s < g_registry.shard_count; s++) {
+        starts[s + 1] += starts[s];
+    }
+    uint32_t fill[REGISTRY_MAX_SHARDS];
+    memcpy(fill, starts, g_registry.shard_count * sizeof(*fill));
+    for(size_t i = 0; i < count; i++) {
+        order[fill[shard_for(hashes[i]) - g_registry.shards]++] = (uint32_t)i;
+    }
+}
+
+// Caller holds sh->lock. Allocates the change's generation and records it in
+// the log; the caller stores it in the generation column.
+static uint64_t shard_log_change(registry_shard_t *sh, uint32_t device_id) {
+    uint64_t generation = atomic_fetch_add(&g_registry.header->generation, 1) + 1;
+    registry_change_t *e = &sh->log[sh->state->log_head & (REGISTRY_CHANGE_LOG_SIZE - 1)];
+    if(sh->state->log_head >= REGISTRY_CHANGE_LOG_SIZE) {
+        sh->state->log_floor = e->generation;
+    }
+    e->generation = generation;
+    e->device_id = device_id;
+    sh->state->log_head++;
+    return generation;
+}
+
+// Caller holds sh->lock. Copies devices from log entries newer than d->after;
+// a device is reported at its latest entry only, so it appears once. Sets
+// d->mode back to DELTA_SHARD_START once the log is exhausted.
+static size_t shard_scan_log(registry_shard_t *sh, registry_delta_t *d, device_status_t *out, size_t max) {
+    uint64_t lo = (sh->state->log_head > REGISTRY_CHANGE_LOG_SIZE) ? sh->state->log_head - REGISTRY_CHANGE_LOG_SIZE : 0;
+    uint64_t hi = sh->state->log_head;
+    // Generations grow along the ring: binary search for the first new entry.
+    while(lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if(sh->log[mid & (REGISTRY_CHANGE_LOG_SIZE - 1)].generation <= d->after) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    size_t n = 0;
+    for(size_t visited = 0; lo < sh->state->log_head && n < max && visited < REGISTRY_DELTA_WINDOW; lo++, visited++) {
+        const registry_change_t *e = &sh->log[lo & (REGISTRY_CHANGE_LOG_SIZE - 1)];
+        uint32_t pos = index_find(sh, hash_device_id(e->device_id), e->device_id);
+        if(pos != REGISTRY_NOT_FOUND) {
+            uint32_t slot = sh->index[pos].slot_ref - 1;
+            if(sh->generation[slot] == e->generation) {
+                shard_load_row(sh, slot, &out[n++]);
+            }
+        }
+        d->after = e->generation;
+    }
+    if(lo == sh->state->log_head) {
+        d->mode = DELTA_SHARD_START;
+    }
+    return n;
+}
+
+// Caller holds sh->lock. Copies records whose generation is newer than
+// d->since, resuming at d->slot; sets d->mode back to DELTA_SHARD_START at the end.
+static size_t shard_scan_changed(registry_shard_t *sh, registry_delta_t *d, device_status_t *out, size_t max) {
+    uint32_t count = atomic_load_explicit(&sh->state->count, memory_order_relaxed);
+    uint32_t end = count;
+    if(d->slot < count && count - d->slot > REGISTRY_DELTA_WINDOW) {
+        end = d->slot + REGISTRY_DELTA_WINDOW;
+    }
+
+    size_t n = 0;
+    uint32_t slot = d->slot;
+    for(; slot < end && n < max; slot++) {
+        if(sh->generation[slot] > d->since) {
+            shard_load_row(sh, slot, &out[n++]);
+        }
+    }
+    d->slot = slot;
+    if(slot >= count) {
+        d->mode = DELTA_SHARD_START;
+    }
+    return n;
+}
+
+// Caller holds sh->lock. Walks the bitmaps a word at a time from f->slot:
+// the union of the admitted status maps ANDed with the union of the battery
+// buckets overlapping the range gives the candidates, which are then checked
+// against the exact bounds. *at_end is set once the shard is exhausted.
+static size_t shard_scan_filter(registry_shard_t *sh, registry_filter_t *f, device_status_t *out, size_t max, int *at_end) {
+    const registry_predicate_t *p = &f->pred;
+    uint32_t count = atomic_load_explicit(&sh->state->count, memory_order_relaxed);
+    uint32_t end = count;
+    if(f->slot < count && count - f->slot > REGISTRY_DELTA_WINDOW) {
+        end = f->slot + REGISTRY_DELTA_WINDOW;
+    }
+    uint32_t bucket_lo = battery_bucket(p->battery_min);
+    uint32_t bucket_hi = battery_bucket(p->battery_max);
+    int temperature_bounded = !(p->temp_min == -HUGE_VALF && p->temp_max == HUGE_VALF);
+
+    size_t n = 0;
+    uint32_t slot = f->slot;
+    while(slot < end && n < max) {
+        uint32_t w = slot / 64;
+        uint64_t status_bits = 0;
+        for(uint32_t mask = p->status_mask; mask != 0; mask &= mask - 1) {
+            status_bits |= sh->status_map[(uint32_t)__builtin_ctz(mask) * sh->map_words + w];
+        }
+        uint64_t candidates = 0;
+        if(status_bits != 0) {
+            for(uint32_t b = bucket_lo; b <= bucket_hi; b++) {
+                candidates |= sh->battery_map[b * sh->map_words + w];
+            }
+            candidates &= status_bits;
+        }
+
+        uint32_t word_end = (w + 1) * 64;
+        candidates &= ~0ull << (slot % 64);
+        if(word_end > end) {
+            candidates &= (1ull << (end % 64)) - 1;
+            word_end = end;
+        }
+        // Temperature has no index: with many candidates left, test the
+        // whole word branch-free rather than one mispredicted slot at a time.
+        if(temperature_bounded && __builtin_popcountll(candidates) > 8) {
+            candidates &= shard_temperature_bits(sh, w, p->temp_min, p->temp_max);
+        }
+
+        while(candidates != 0 && n < max) {
+            uint32_t s = w * 64 + (uint32_t)__builtin_ctzll(candidates);
+            candidates &= candidates - 1;
+            float t = sh->temperature[s];
+            if(sh->battery[s] >= p->battery_min && sh->battery[s] <= p->battery_max &&
+               t >= p->temp_min && t <= p->temp_max) {
+                shard_load_row(sh, s, &out[n++]);
+            }
+            slot = s + 1;
+        }
+        if(candidates == 0) {
+            slot = word_end;
+        }
+    }
+
+    f->slot = slot;
+    *at_end = (slot >= count);
+    return n;
+}
+
+// Bit j set when slot w * 64 + j has a temperature within [lo, hi].
+static uint64_t shard_temperature_bits(const registry_shard_t *sh, uint32_t w, float lo, float hi) {
+    const float *t = sh->temperature + w * 64;
+    uint32_t n = sh->capacity - w * 64;
+    if(n > 64) {
+        n = 64;
+    }
+    uint64_t bits = 0;
+    for(uint32_t j = 0; j < n; j++) {
+        bits |= (uint64_t)(t[j] >= lo && t[j] <= hi) << j;
+    }
+    return bits;
+}
+
+static uint32_t battery_bucket(uint8_t battery) {
+    return (battery < 10 * (REGISTRY_BATTERY_BUCKETS - 1)) ? battery / 10u : REGISTRY_BATTERY_BUCKETS - 1;
+}
+
+// Caller holds sh->lock; both use the status and battery stored at 'slot'.
+static void bitmap_index_add(registry_shard_t *sh, uint32_t slot) {
+    uint64_t bit = 1ull << (slot % 64);
+    uint32_t w = slot / 64;
+    if(sh->status[slot] < REGISTRY_STATUS_VALUES) {
+        sh->status_map[sh->status[slot] * sh->map_words + w] |= bit;
+    }
+    sh->battery_map[battery_bucket(sh->battery[slot]) * sh->map_words + w] |= bit;
+}
+
+static void bitmap_index_drop(registry_shard_t *sh, uint32_t slot) {
+    uint64_t bit = 1ull << (slot % 64);
+    uint32_t w = slot / 64;
+    if(sh->status[slot] < REGISTRY_STATUS_VALUES) {
+        sh->status_map[sh->status[slot] * sh->map_words + w] &= ~bit;
+    }
+    sh->battery_map[battery_bucket(sh->battery[slot]) * sh->map_words + w] &= ~bit;
+}
+
+static void shard_load_row(const registry_shard_t *sh, uint32_t slot, device_status_t *out) {
+    out->device_id = sh->ids[slot];
+    out->temperature = sh->temperature[slot];
+    out->battery = sh->battery[slot];
+    out->status = sh->status[slot];
+}
+
+static void shard_store_row(registry_shard_t *sh, uint32_t slot, const device_status_t *dev) {
+    sh->ids[slot] = dev->device_id;
+    sh->temperature[slot] = dev->temperature;
+    sh->battery[slot] = dev->battery;
+    sh->status[slot] = dev->status;
+}
+
+// pthread_mutex_lock() that reports to the metrics how long it waited.
+static void shard_lock(registry_shard_t *sh) {
+    if(pthread_mutex_trylock(&sh->lock) == 0) {
+        metrics_lock_acquired(0, 0);
+        return;
+    }
+    uint64_t t0 = metrics_now_ns();
+    pthread_mutex_lock(&sh->lock);
+    metrics_lock_acquired(1, metrics_now_ns() - t0);
+}
+
+// Seqlock primitives: the counter is odd while a writer is mid-update.
+static void seq_write_begin(_Atomic uint32_t *seq) {
+    uint32_t s = atomic_load_explicit(seq, memory_order_relaxed);
+    atomic_store_explicit(seq, s + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void seq_write_end(_Atomic uint32_t *seq) {
+    uint32_t s = atomic_load_explicit(seq, memory_order_relaxed);
+    atomic_store_explicit(seq, s + 1, memory_order_release);
+}
+
+static uint32_t seq_read_begin(_Atomic uint32_t *seq) {
+    uint32_t s;
+    while((s = atomic_load_explicit(seq, memory_order_acquire)) & 1u) {
+        // writer in progress
+    }
+    return s;
+}
+
+static int seq_read_retry(_Atomic uint32_t *seq, uint32_t start) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(seq, memory_order_relaxed) != start;
+}
+
+static size_t align_up(size_t v) {
+    return (v + REGISTRY_ALIGN - 1) & ~(size_t)(REGISTRY_ALIGN - 1);
+}
+
+static size_t round_pow2(size_t v) {
+    size_t p = 1;
+    while(p < v) p <<= 1;
+    return p;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "protocol.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define REGISTRY_DEFAULT_CAPACITY (1u << 20)
+#define REGISTRY_DEFAULT_SHARDS 16
+#define REGISTRY_MAX_SHARDS 256
+
+// Bitmap indexes: one per status value below REGISTRY_STATUS_VALUES and one
+// per 10 % battery bucket, the last bucket holding everything from 90 %.
+#define REGISTRY_STATUS_VALUES 8
+#define REGISTRY_BATTERY_BUCKETS 10
+
+// Scan cursors pack (shard, slot); slots per shard are limited to 24 bits.
+#define REGISTRY_CURSOR_SLOT_BITS 24
+#define REGISTRY_CURSOR_SLOT_MASK ((1u << REGISTRY_CURSOR_SLOT_BITS) - 1)
+#define REGISTRY_CURSOR_START 0u
+#define REGISTRY_CURSOR_END UINT32_MAX
+
+// Sizes the shards for 'capacity' devices; shard_count is rounded up to a power of two.
+int registry_init(size_t capacity, size_t shard_count);
+// Like registry_init(), but the tables live in the store file at 'path',
+// created if missing. An existing store is mapped as it is, with the
+// capacity and shard count it was created with, and served without a load
+// phase. Returns 0 for a new store, 1 for an existing one, -1 on error with
+// errno set (EINVAL: not a compatible store, EWOULDBLOCK: in use).
+int registry_open(const char *path, size_t capacity, size_t shard_count);
+// Start writing the store's dirty pages back without waiting, or with
+// 'wait' write them and wait for the disk. No-op without a store.
+int registry_flush(int wait);
+// Flushes and closes the store, if any.
+void registry_destroy(void);
+
+size_t registry_capacity(void);
+size_t registry_shard_count(void);
+
+// 0 on success, 1 if the id is already registered, -1 if its shard is full.
+int registry_insert(const device_status_t *dev);
+// 0 on success, 1 if the id is unknown.
+int registry_remove(uint32_t device_id);
+
+// 0 and a copy of the record when found, 1 if the id is unknown.
+int registry_get(uint32_t device_id, device_status_t *out);
+// 0 on success, 1 if the id is unknown.
+int registry_set_temperature(uint32_t device_id, float temperature);
+
+// Batch variants. Updates are grouped by shard so each shard lock is taken
+// once per batch; results[i] is 0 on success, 1 if ids[i] is unknown.
+// Both return 0, or -1 if scratch memory could not be allocated.
+int registry_get_many(const uint32_t *ids, size_t count, device_status_t *out, uint8_t *results);
+int registry_set_temperature_many(const uint32_t *ids, const float *temps, size_t count, uint8_t *results);
+// Replace temperature, battery and status of known devices, keeping the
+// bitmap indexes in step. Same results and return value as above.
+int registry_update(const device_status_t *dev);
+int registry_update_many(const device_status_t *devs, size_t count, uint8_t *results);
+
+size_t registry_count(void);
+
+// Column view of one shard's live records, slots [0, count).
+typedef struct {
+    const float *temperature;
+    const uint8_t *battery;
+    const uint8_t *status;
+    size_t count;
+} registry_columns_t;
+
+// Call 'visit' once per shard with the shard lock held, so the columns are
+// stable for the duration of the call; 'visit' must not call back into the registry.
+void registry_visit_columns(void (*visit)(const registry_columns_t *cols, void *arg), void *arg);
+
+// Every insert and update stamps the record with the next value of a global
+// generation counter. This returns the latest one handed out.
+uint64_t registry_generation(void);
+
+// Copy up to 'max' records starting at 'cursor' and return how many were
+// copied; *next is where to resume, REGISTRY_CURSOR_END once every shard is
+// done. No lock is held between calls, so devices inserted or removed
+// mid-scan may be missed or repeated.
+size_t registry_scan(uint32_t cursor, device_status_t *out, size_t max, uint32_t *next);
+
+// Resumable state of a registry_scan_since() pass.
+typedef struct {
+    uint64_t since; // report records changed after this generation
+    uint32_t shard;
+    int mode;
+    uint32_t slot;  // generation-column scan position
+    uint64_t after; // change-log replay position
+} registry_delta_t;
+
+void registry_delta_init(registry_delta_t *d, uint64_t since);
+// Copy up to 'max' records changed after d->since and return how many were
+// copied; *done is set once every shard is finished. A changed device is
+// reported once, or again if it changes during the pass. A scan that starts after registry_generation()
+// returned G covers every change up to G; later ones may also be included.
+size_t registry_scan_since(registry_delta_t *d, device_status_t *out, size_t max, int *done);
+
+// Predicate of a filtered scan: status bit set in status_mask, battery and
+// temperature within the inclusive bounds.
+typedef struct {
+    uint8_t status_mask;
+    uint8_t battery_min;
+    uint8_t battery_max;
+    float temp_min;
+    float temp_max;
+} registry_predicate_t;
+
+// Resumable state of a registry_scan_filter() pass.
+typedef struct {
+    registry_predicate_t pred;
+    uint32_t shard;
+    uint32_t slot;
+} registry_filter_t;
+
+void registry_filter_init(registry_filter_t *f, const registry_predicate_t *pred);
+// Copy up to 'max' records matching f->pred and return how many were
+// copied; *done is set once every shard is finished. Candidates come from
+// the status and battery bitmaps, so the work grows with the matches and
+// only touches one bit per slot otherwise. Like registry_scan(), devices
+// inserted or removed mid-pass may be missed or repeated.
+size_t registry_scan_filter(registry_filter_t *f, device_status_t *out, size_t max, int *done);
@@ -1,5 +1,15 @@
 #include "protocol.h"
 #include "server.h"
+#include "conn.h"
+#include "reactor.h"
+#include "aggregate.h"
+#include "history.h"
+#include "ingest.h"
+#include "list_cache.h"
+#include "metrics.h"
+#include "registry.h"
+#include "subscription.h"
+#include "wal.h"
 
 #include <errno.h>
 #include <signal.h>
@@ -7,9 +17,11 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
 
 #include <arpa/inet.h>
+#include <endian.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -17,10 +29,16 @@
 #include <syslog.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/random.h>
+#include <sys/resource.h>
 
 #define DISCOVERY_MCAST_ADDR "239.0.0.1"
 #define DISCOVERY_PORT 5000
 #define SERVER_PORT 5001
+// Discovery answers are re-encoded at most this often ...
+#define DISCOVERY_REFRESH_MS 1000
+// ... and sent at most this many times per second, with bursts of as many.
+#define DISCOVERY_REPLY_RATE 50
 
 typedef enum {
     SET_OK = 0,
@@ -28,42 +46,283 @@ typedef enum {
     SET_BAD_REQUEST = 2
 } set_result_t;
 
-typedef struct {
-    int client_fd;
-} client_ctx_t;
-
 
 int g_use_syslog = 0;
 volatile sig_atomic_t g_running = 1;
 
+// Woken by the WAL thread after each commit; their counters go into STATS.
+static reactor_t *g_reactors;
+static int g_reactor_count;
+static struct timespec g_started;
+static int g_list_cache;
+// Reported in DISCOVER_RESPONSE.
+static uint32_t g_server_id;
+static _Atomic uint32_t g_request_rate;
 
-static device_status_t g_devices[] = {
+
+static const device_status_t g_default_devices[] = {
     { .device_id = 1, .temperature = 22.5, .battery = 85, .status = 1 },
     { .device_id = 2, .temperature = 19.0, .battery = 60, .status = 1 },
     { .device_id = 3, .temperature = 25.3, .battery = 40, .status = 0 },
     { .device_id = 4, .temperature = 30.1, .battery = 20, .status = 2 },
     { .device_id = 5, .temperature = 18.7, .battery = 90, .status = 1 },
 };
-static const size_t g_device_count = sizeof(g_devices) / sizeof(g_devices[0]);
-static pthread_mutex_t g_devices_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-static device_status_t* find_device(uint32_t device_id);
-static int handle_list(int fd);
-static int handle_get(int fd, const uint8_t *payload, uint16_t len);
-static int handle_set(int fd, const uint8_t *payload, uint16_t len);
-static int dispatch_request(int fd, uint16_t type, const uint8_t *payload, uint16_t len);
-static void devices_lock(void);
-static void devices_unlock(void);
-static void *client_thread(void *arg);
+static const size_t g_default_device_count = sizeof(g_default_devices) / sizeof(g_default_devices[0]);
+
+static int seed_devices(size_t count);
+static void replay_set(const device_status_t *dev, int temperature_only, int64_t ts_ms);
+static void notify_durable(void *arg);
+static double elapsed_ms(const struct timespec *since);
+static int handle_list(conn_t *c, const uint8_t *payload, uint16_t len);
+static int handle_list_since(conn_t *c, const uint8_t *payload, uint16_t len);
+static int handle_list_filter(conn_t *c, const uint8_t *payload, uint16_t len);
+static int handle_get(conn_t *c, const uint8_t *payload, uint16_t len);
+static int handle_set(conn_t *c, const uint8_t *payload, uint16_t len);
+static int handle_multi_get(conn_t *c, const uint8_t *payload, uint16_t len);
+static int handle_multi_set(conn_t *c, const uint8_t *payload, uint16_t len);
+static int handle_subscribe(conn_t *c, const uint8_t *payload, uint16_t len);
+static int handle_unsubscribe(conn_t *c, const uint8_t *payload, uint16_t len);
+static int handle_history(conn_t *c, const uint8_t *payload, uint16_t len);
+static int handle_aggregate(conn_t *c, const uint8_t *payload, uint16_t len);
+static int handle_stats(conn_t *c, const uint8_t *payload, uint16_t len);
+static void aggregate_shard(const registry_columns_t *cols, void *arg);
+static float float_from_net(const uint8_t *p);
+static int open_listen_socket(void);
+static void log_worker_stats(reactor_t *reactors, int workers);
+static metrics_snapshot_t *collect_metrics(void);
+static void write_metrics(const char *path);
+static void raise_fd_limit(void);
 static void *discovery_thread(void *arg);
+static size_t discovery_encode(uint8_t *out, size_t size);
+static uint32_t pick_server_id(void);
+
+int server_run(const server_config_t *cfg) {
+    int workers = (cfg->workers > 0) ? cfg->workers : 1;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    clock_gettime(CLOCK_MONOTONIC, &g_started);
+    raise_fd_limit();
+
+    int existing = 0;
+    if(cfg->store_path) {
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        existing = registry_open(cfg->store_path, cfg->capacity, cfg->shards);
+        if(existing < 0) {
+            LOGE("cannot open store %s: %s", cfg->store_path, strerror(errno));
+            return 1;
+        }
+        LOGI("%s store %s in %.2f ms", existing ? "mapped" : "created", cfg->store_path, elapsed_ms(&t0));
+    } else if(registry_init(cfg->capacity, cfg->shards) < 0) {
+        LOGE("registry init failed: %s", strerror(errno));
+        return 1;
+    }
+    if(history_init(registry_capacity(), cfg->history_depth) < 0) {
+        LOGE("history init failed: %s", strerror(errno));
+        registry_destroy();
+        return 1;
+    }
+    if(existing) {
+        LOGI("registry holds %zu devices, generation %llu", registry_count(),
+             (unsigned long long)registry_generation());
+    } else if(seed_devices(cfg->devices) < 0) {
+        history_destroy();
+        registry_destroy();
+        return 1;
+    }
+    if(cfg->wal_path) {
+        // SETs logged after the store (or seed) state was last saved.
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        long replayed = wal_open(cfg->wal_path, cfg->durability, cfg->store_path != NULL, replay_set);
+        if(replayed < 0) {
+            LOGE("cannot open WAL %s: %s", cfg->wal_path, strerror(errno));
+            history_destroy();
+            registry_destroy();
+            return 1;
+        }
+        LOGI("replayed %ld WAL records from %s in %.2f ms, durability %s", replayed, cfg->wal_path,
+             elapsed_ms(&t0), wal_durability_name(cfg->durability));
+    }
+
+    g_list_cache = cfg->list_cache;
+    if(g_list_cache && list_cache_init(cfg->list_cache_ms) < 0) {
+        LOGE("LIST cache builder start failed: %s", strerror(errno));
+        g_list_cache = 0;
+    }
 
-int server_run(void) {
+    reactor_t *reactors = calloc((size_t)workers, sizeof(*reactors));
+    if(!reactors) {
+        LOGE("worker allocation failed");
+        wal_close();
+        history_destroy();
+        registry_destroy();
+        return 1;
+    }
+
+    int ready = 0;
+    for(; ready < workers; ready++) {
+        int listen_fd = open_listen_socket();
+        if(listen_fd < 0) {
+            break;
+        }
+        // A single worker keeps the old unpinned behaviour.
+        int cpu = (workers > 1 && cpus > 0) ? (int)(ready % cpus) : -1;
+        if(reactor_init(&reactors[ready], ready, listen_fd, cpu, cfg->io_backend) < 0) {
+            close(listen_fd);
+            break;
+        }
+    }
+    if(ready < workers) {
+        for(int i = 0; i < ready; i++) {
+            close(reactors[i].listen_fd);
+            reactor_destroy(&reactors[i]);
+        }
+        free(reactors);
+        wal_close();
+        history_destroy();
+        registry_destroy();
+        return 1;
+    }
+    g_reactors = reactors;
+    g_reactor_count = workers;
+    if(cfg->wal_path && wal_start(notify_durable, NULL) < 0) {
+        LOGE("WAL thread start failed: %s", strerror(errno));
+        g_running = 0;
+    }
+    int ingesting = 0;
+    if(g_running && cfg->ingest_threads > 0) {
+        if(ingest_start(cfg->ingest_threads, cfg->ingest_bind) < 0) {
+            LOGE("telemetry ingest start failed: %s", strerror(errno));
+            g_running = 0;
+        } else {
+            ingesting = 1;
+        }
+    }
+
+    LOGI("listening on port %d with %d %s worker%s...", SERVER_PORT, workers,
+         reactor_backend_name(cfg->io_backend), workers == 1 ? "" : "s");
+    LOGI("aggregate kernel: %s", aggregate_kernel_name());
+    g_server_id = pick_server_id();
+    LOGI("server id %08x", g_server_id);
+
+    pthread_t disc_thread;
+    pthread_create(&disc_thread, NULL, discovery_thread, NULL);
+    pthread_detach(disc_thread);
+
+    int started = 0;
+    for(; started < workers; started++) {
+        if(reactor_start(&reactors[started]) < 0) {
+            g_running = 0;
+            break;
+        }
+    }
+
+    unsigned elapsed = 0;
+    uint64_t last_requests = 0;
+    while(g_running) {
+        sleep(1);
+        elapsed++;
+        uint64_t requests = 0;
+        for(int i = 0; i < workers; i++) {
+            requests += atomic_load_explicit(&reactors[i].stats.requests, memory_order_relaxed);
+        }
+        atomic_store_explicit(&g_request_rate, (uint32_t)(requests - last_requests), memory_order_relaxed);
+        last_requests = requests;
+        if(cfg->stats_interval > 0 && elapsed % cfg->stats_interval == 0) {
+            log_worker_stats(reactors, workers);
+            ingest_log_stats();
+        }
+        if(cfg->metrics_path && cfg->metrics_interval > 0 && elapsed % cfg->metrics_interval == 0) {
+            write_metrics(cfg->metrics_path);
+        }
+        if(cfg->store_path && cfg->flush_interval > 0 && elapsed % cfg->flush_interval == 0 &&
+           registry_flush(0) < 0) {
+            LOGE("store writeback failed: %s", strerror(errno));
+        }
+    }
+
+    for(int i = 0; i < started; i++) {
+        reactor_join(&reactors[i]);
+    }
+    log_worker_stats(reactors, workers);
+    if(cfg->metrics_path) {
+        write_metrics(cfg->metrics_path);
+    }
+    if(ingesting) {
+        ingest_log_stats();
+        ingest_stop();
+    }
+    // Before the reactors go: the WAL thread still wakes them.
+    wal_close();
+
+    for(int i = 0; i < workers; i++) {
+        close(reactors[i].listen_fd);
+        reactor_destroy(&reactors[i]);
+    }
+    free(reactors);
+    list_cache_shutdown();
+    history_destroy();
+    registry_destroy();
+    return (started == workers) ? 0 : 1;
+}
+
+// The first ids get the fixed demo devices, the rest synthetic readings.
+static int seed_devices(size_t count) {
+    uint32_t rng = 0x2545f491u;
+
+    for(size_t i = 0; i < count; i++) {
+        device_status_t dev;
+        if(i < g_default_device_count) {
+            dev = g_default_devices[i];
+        } else {
+            rng = rng * 1664525u + 1013904223u;
+            dev.device_id = (uint32_t)(i + 1);
+            dev.temperature = 15.0f + (float)(rng >> 16) / 65535.0f * 20.0f;
+            dev.battery = (uint8_t)((rng >> 8) % 101);
+            dev.status = (uint8_t)((rng >> 4) % 3);
+        }
+
+        int rc = registry_insert(&dev);
+        if(rc < 0) {
+            LOGE("registry full after %zu devices", i);
+            return -1;
+        }
+    }
+
+    LOGI("registry holds %zu devices", registry_count());
+    return 0;
+}
+
+static void replay_set(const device_status_t *dev, int temperature_only, int64_t ts_ms) {
+    int rc = temperature_only ? registry_set_temperature(dev->device_id, dev->temperature) : registry_update(dev);
+    if(rc == 0 && ts_ms > 0) {
+        history_record(dev->device_id, ts_ms, dev->temperature);
+    }
+}
+
+static void notify_durable(void *arg) {
+    (void)arg;
+    for(int i = 0; i < g_reactor_count; i++) {
+        reactor_notify_durable(&g_reactors[i]);
+    }
+}
+
+static double elapsed_ms(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - since->tv_sec) * 1e3 + (double)(now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+// Each worker binds its own socket; SO_REUSEPORT lets the kernel spread
+// incoming connections across them.
+static int open_listen_socket(void) {
     int listen_fd, status, opt;
 
     listen_fd = socket(AF_INET, SOCK_STREAM, 0);
     if(listen_fd < 0) {
         LOGE("socket creation failed: %s", strerror(errno));
-        return 1;
+        return -1;
     }
 
     opt = 1;
@@ -71,7 +330,14 @@ int server_run(void) {
     if(status < 0) {
         LOGE("setsockopt SO_REUSEADDR failed: %s", strerror(errno));
         close(listen_fd);
-        return 1;
+        return -1;
+    }
+
+    status = setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+    if(status < 0) {
+        LOGE("setsockopt SO_REUSEPORT failed: %s", strerror(errno));
+        close(listen_fd);
+        return -1;
     }
 
     struct sockaddr_in addr;
@@ -84,121 +350,244 @@ int server_run(void) {
     if(status < 0) {
         LOGE("bind failed: %s", strerror(errno));
         close(listen_fd);
-        return 1;
+        return -1;
     }
 
-    status = listen(listen_fd, 5);
+    status = listen(listen_fd, SOMAXCONN);
     if(status < 0) {
         LOGE("listen failed: %s", strerror(errno));
         close(listen_fd);
-        return 1;
+        return -1;
     }
 
-    LOGI("listening on port %d...", SERVER_PORT);
-
+    return listen_fd;
+}
 
-    pthread_t disc_thread;
-    pthread_create(&disc_thread, NULL, discovery_thread, NULL);
-    pthread_detach(disc_thread);
+static void log_worker_stats(reactor_t *reactors, int workers) {
+    for(int i = 0; i < workers; i++) {
+        reactor_stats_t *st = &reactors[i].stats;
+        LOGI("worker %d cpu=%d active=%llu accepted=%llu requests=%llu",
+             reactors[i].id, reactors[i].cpu,
+             (unsigned long long)atomic_load_explicit(&st->active, memory_order_relaxed),
+             (unsigned long long)atomic_load_explicit(&st->accepted, memory_order_relaxed),
+             (unsigned long long)atomic_load_explicit(&st->requests, memory_order_relaxed));
+    }
+}
 
+// Every thread's request metrics plus the workers' connection counts.
+static metrics_snapshot_t *collect_metrics(void) {
+    metrics_snapshot_t *snap = malloc(sizeof(*snap));
+    if(!snap) {
+        LOGE("metrics snapshot allocation failed");
+        return NULL;
+    }
+    metrics_collect(snap);
+    snap->uptime_ms = (uint64_t)elapsed_ms(&g_started);
+    for(int i = 0; i < g_reactor_count; i++) {
+        reactor_stats_t *st = &g_reactors[i].stats;
+        snap->connections_active += atomic_load_explicit(&st->active, memory_order_relaxed);
+        snap->connections_accepted += atomic_load_explicit(&st->accepted, memory_order_relaxed);
+    }
+    list_cache_stats_t lc;
+    list_cache_stats(&lc);
+    snap->list_cache_hits = lc.hits;
+    snap->list_cache_misses = lc.misses;
+    snap->list_cache_rebuilds = lc.rebuilds;
+    return snap;
+}
 
+static void write_metrics(const char *path) {
+    metrics_snapshot_t *snap = collect_metrics();
+    if(!snap) {
+        return;
+    }
+    if(metrics_write_prometheus(path, snap) < 0) {
+        LOGE("cannot write metrics to %s: %s", path, strerror(errno));
+    }
+    free(snap);
+}
 
-    while(g_running) {
-        int client_fd = accept(listen_fd, NULL, NULL);
-        if(client_fd < 0) {
-            LOGE("accept failed: %s", strerror(errno));
-            continue;
-        }
 
-        client_ctx_t *ctx = malloc(sizeof(*ctx));
-        if(!ctx) {
-            close(client_fd);
-            continue;
-        }
-        ctx->client_fd = client_fd;
+int dispatch_request(conn_t *c, uint16_t type, const uint8_t *payload, uint16_t len) {
+    switch(type) {
+        case TLV_TYPE_LIST_REQUEST:
+            return handle_list(c, payload, len);
+        case TLV_TYPE_LIST_SINCE_REQUEST:
+            return handle_list_since(c, payload, len);
+        case TLV_TYPE_LIST_FILTER_REQUEST:
+            return handle_list_filter(c, payload, len);
+        case TLV_TYPE_GET_REQUEST:
+            return handle_get(c, payload, len);
+        case TLV_TYPE_SET_REQUEST:
+            return handle_set(c, payload, len);
+        case TLV_TYPE_MULTI_GET_REQUEST:
+            return handle_multi_get(c, payload, len);
+        case TLV_TYPE_MULTI_SET_REQUEST:
+            return handle_multi_set(c, payload, len);
+        case TLV_TYPE_SUBSCRIBE_REQUEST:
+            return handle_subscribe(c, payload, len);
+        case TLV_TYPE_UNSUBSCRIBE_REQUEST:
+            return handle_unsubscribe(c, payload, len);
+        case TLV_TYPE_HISTORY_REQUEST:
+            return handle_history(c, payload, len);
+        case TLV_TYPE_AGGREGATE_REQUEST:
+            return handle_aggregate(c, payload, len);
+        case TLV_TYPE_STATS_REQUEST:
+            return handle_stats(c, payload, len);
+        default:
+            LOGI("unknown request type 0x%04x", type);
+            return 0; // ignore unknown types
+    }
+}
 
-        pthread_t th;
+// LIST is streamed as LIST_CHUNK frames produced by dispatch_stream() as
+// the socket drains, so neither a lock nor the whole table is held. A LIST
+// from the start is normally answered with the cached encoded frames instead,
+// and streamed only while they are stale and being rebuilt.
+static int handle_list(conn_t *c, const uint8_t *payload, uint16_t len) {
+    uint32_t cursor = REGISTRY_CURSOR_START;
+    if(len == sizeof(uint32_t)) {
+        uint32_t cursor_net;
+        memcpy(&cursor_net, payload, sizeof(cursor_net));
+        cursor = ntohl(cursor_net);
+    } else if(len != 0) {
+        LOGI("LIST bad len=%u", len);
+    }
 
-        if(pthread_create(&th, NULL, client_thread, ctx) != 0) {
-            LOGE("pthread_create failed: %s", strerror(errno));
-            close(client_fd);
-            free(ctx);
-            continue;
+    c->stream.active = 1;
+    c->stream.sent = 0;
+    if(g_list_cache && cursor == REGISTRY_CURSOR_START) {
+        list_frame_t *f = list_cache_acquire();
+        if(f) {
+            c->stream.mode = CONN_STREAM_CACHED;
+            c->stream.frame = f;
+            c->stream.frame_off = 0;
+            c->stream.generation = f->generation;
+            return 0;
         }
+    }
+    c->stream.cursor = cursor;
+    c->stream.generation = registry_generation();
+    c->stream.mode = CONN_STREAM_CURSOR;
+    return 0;
+}
 
-        pthread_detach(th);
+// Same stream, restricted to devices changed after the client's generation.
+static int handle_list_since(conn_t *c, const uint8_t *payload, uint16_t len) {
+    uint64_t since = 0;
+    if(len == sizeof(uint64_t)) {
+        uint64_t since_net;
+        memcpy(&since_net, payload, sizeof(since_net));
+        since = be64toh(since_net);
+    } else {
+        LOGI("LIST_SINCE bad len=%u", len);
     }
 
-    close(listen_fd);
+    // Read before the scan starts, so it never claims a change the scan missed.
+    c->stream.generation = registry_generation();
+    c->stream.active = 1;
+    c->stream.cursor = 0;
+    c->stream.sent = 0;
+    c->stream.mode = CONN_STREAM_SINCE;
+    registry_delta_init(&c->stream.changes, since);
     return 0;
 }
 
-
-static device_status_t* find_device(uint32_t device_id) {
-    for(size_t i = 0; i < g_device_count; i++) {
-        if(g_devices[i].device_id == device_id) {
-            return &g_devices[i];
-        }
+// Same stream, restricted to devices matching the predicate; candidates come
+// from the registry's status and battery bitmaps.
+static int handle_list_filter(conn_t *c, const uint8_t *payload, uint16_t len) {
+    registry_predicate_t pred = { 0 };
+    if(len == TLV_LIST_FILTER_REQUEST_LEN) {
+        pred.status_mask = payload[0] ? payload[0] : 0xff;
+        pred.battery_min = payload[1];
+        pred.battery_max = payload[2];
+        pred.temp_min = float_from_net(payload + 4);
+        pred.temp_max = float_from_net(payload + 8);
+    } else {
+        LOGI("LIST_FILTER bad len=%u", len); // status_mask 0 matches nothing
     }
-    return NULL;
+
+    c->stream.generation = registry_generation();
+    c->stream.active = 1;
+    c->stream.cursor = 0;
+    c->stream.sent = 0;
+    c->stream.mode = CONN_STREAM_FILTER;
+    registry_filter_init(&c->stream.filter, &pred);
+    return 0;
 }
 
-static int dispatch_request(int fd, uint16_t type, const uint8_t *payload, uint16_t len) {
-    switch(type) {
-        case TLV_TYPE_LIST_REQUEST:
-            return handle_list(fd);
-        case TLV_TYPE_GET_REQUEST:
-            return handle_get(fd, payload, len);
-        case TLV_TYPE_SET_REQUEST:
-            return handle_set(fd, payload, len);
-        default:
-            LOGI("unknown request type 0x%04x", type);
-            return 0; // ignore unknown types
+int dispatch_stream(conn_t *c) {
+    uint8_t chunk[sizeof(uint32_t) + TLV_LIST_CHUNK_MAX_DEVICES * sizeof(device_status_t)];
+    device_status_t *devs = (device_status_t *)(chunk + sizeof(uint32_t));
+
+    uint32_t next = REGISTRY_CURSOR_END;
+    size_t count;
+    if(c->stream.mode == CONN_STREAM_SINCE) {
+        int done = 0;
+        count = registry_scan_since(&c->stream.changes, devs, TLV_LIST_CHUNK_MAX_DEVICES, &done);
+        next = done ? REGISTRY_CURSOR_END : 0;
+    } else if(c->stream.mode == CONN_STREAM_FILTER) {
+        int done = 0;
+        count = registry_scan_filter(&c->stream.filter, devs, TLV_LIST_CHUNK_MAX_DEVICES, &done);
+        next = done ? REGISTRY_CURSOR_END : 0;
+    } else {
+        count = registry_scan(c->stream.cursor, devs, TLV_LIST_CHUNK_MAX_DEVICES, &next);
     }
-}
 
-static int handle_list(int fd) {
-    devices_lock();
-    uint16_t payload_len = (uint16_t)(g_device_count * sizeof(device_status_t));
-    int status = send_tlv(fd, TLV_TYPE_LIST_RESPONSE, g_devices, payload_len);
-    devices_unlock();
+    if(count > 0) {
+        uint32_t next_net = htonl(c->stream.mode == CONN_STREAM_CURSOR ? next : 0);
+        memcpy(chunk, &next_net, sizeof(next_net));
+        uint16_t chunk_len = (uint16_t)(sizeof(uint32_t) + count * sizeof(device_status_t));
+        if(conn_send_tlv(c, TLV_TYPE_LIST_CHUNK, chunk, chunk_len) < 0) {
+            LOGE("queue LIST_CHUNK failed");
+            return -1;
+        }
+    }
 
-    if(status < 0) {
-        LOGE("send LIST_RESPONSE failed");
-        return -1;
+    c->stream.cursor = next;
+    c->stream.sent += (uint32_t)count;
+
+    if(next == REGISTRY_CURSOR_END) {
+        c->stream.active = 0;
+        uint8_t end[sizeof(uint32_t) + sizeof(uint64_t)];
+        uint32_t sent_net = htonl(c->stream.sent);
+        uint64_t generation_net = htobe64(c->stream.generation);
+        memcpy(end, &sent_net, sizeof(sent_net));
+        memcpy(end + sizeof(sent_net), &generation_net, sizeof(generation_net));
+        if(conn_send_tlv(c, TLV_TYPE_LIST_END, end, sizeof(end)) < 0) {
+            LOGE("queue LIST_END failed");
+            return -1;
+        }
     }
     return 0;
 }
 
-static int handle_get(int fd, const uint8_t *payload, uint16_t len) {
+static int handle_get(conn_t *c, const uint8_t *payload, uint16_t len) {
     if(len != sizeof(uint32_t)) {
         LOGI("GET bad len=%u", len);
-        return send_tlv(fd, TLV_TYPE_GET_RESPONSE, NULL, 0);
+        return conn_send_tlv(c, TLV_TYPE_GET_RESPONSE, NULL, 0);
     }
 
     uint32_t id_net = 0;
     memcpy(&id_net, payload, sizeof(id_net));
     uint32_t device_id = ntohl(id_net);
-    devices_lock();
-    device_status_t *dev = find_device(device_id);
-    if(dev == NULL) {
-        devices_unlock();
+    device_status_t dev;
+    if(registry_get(device_id, &dev) != 0) {
         LOGE("device ID %u not found", device_id);
-        return send_tlv(fd, TLV_TYPE_GET_RESPONSE, NULL, 0);
+        return conn_send_tlv(c, TLV_TYPE_GET_RESPONSE, NULL, 0);
     }
 
-    int rc = send_tlv(fd, TLV_TYPE_GET_RESPONSE, dev, sizeof(device_status_t));
-    devices_unlock();
+    int rc = conn_send_tlv(c, TLV_TYPE_GET_RESPONSE, &dev, sizeof(device_status_t));
 
     return (rc < 0) ? -1 : 0;
 
 }
 
-static int handle_set(int fd, const uint8_t *payload, uint16_t len) {
+static int handle_set(conn_t *c, const uint8_t *payload, uint16_t len) {
     if(len != sizeof(uint32_t) * 2) {
         LOGI("SET bad len=%u", len);
         uint8_t code = SET_BAD_REQUEST;
-        return send_tlv(fd, TLV_TYPE_SET_RESPONSE, &code, sizeof(code));
+        return conn_send_tlv(c, TLV_TYPE_SET_RESPONSE, &code, sizeof(code));
     }
 
     uint32_t id_net = 0, temp_bits_net = 0;
@@ -210,50 +599,312 @@ static int handle_set(int fd, const uint8_t *payload, uint16_t len) {
     float temperature;
     memcpy(&temperature, &temp_bits, sizeof(temperature));
 
-    devices_lock();
-    device_status_t *dev = find_device(device_id);
     uint8_t code = SET_OK;
-    if(dev == NULL) {
+    if(registry_set_temperature(device_id, temperature) != 0) {
         LOGI("device ID %u not found for SET", device_id);
         code = SET_NOT_FOUND;
     } else {
-        dev->temperature = temperature;
-        LOGI("updated device ID %u temperature to %.2f", device_id, temperature);
+        LOGD("updated device ID %u temperature to %.2f", device_id, temperature);
+        int64_t now_ms = history_now_ms();
+        uint64_t lsn = wal_append(device_id, temperature, now_ms);
+        if(lsn != 0) {
+            c->wal_lsn = lsn; // the response waits for it
+        }
+        history_record(device_id, now_ms, temperature);
+        subscription_notify(device_id);
     }
-    devices_unlock();
 
-    return send_tlv(fd, TLV_TYPE_SET_RESPONSE, &code, sizeof(code));
+    return conn_send_tlv(c, TLV_TYPE_SET_RESPONSE, &code, sizeof(code));
 }
 
-static void devices_lock(void) {
-    pthread_mutex_lock(&g_devices_mutex);
-}
-static void devices_unlock(void) {
-    pthread_mutex_unlock(&g_devices_mutex);
+static int handle_multi_get(conn_t *c, const uint8_t *payload, uint16_t len) {
+    size_t count = len / sizeof(uint32_t);
+    if(count == 0 || len % sizeof(uint32_t) != 0 || count > TLV_MULTI_MAX_ITEMS) {
+        LOGI("MULTI_GET bad len=%u", len);
+        return conn_send_tlv(c, TLV_TYPE_MULTI_GET_RESPONSE, NULL, 0);
+    }
+
+    uint32_t ids[TLV_MULTI_MAX_ITEMS];
+    for(size_t i = 0; i < count; i++) {
+        uint32_t id_net;
+        memcpy(&id_net, payload + i * sizeof(id_net), sizeof(id_net));
+        ids[i] = ntohl(id_net);
+    }
+
+    device_status_t *devs = malloc(count * sizeof(*devs));
+    uint8_t *out = malloc(count + count * sizeof(device_status_t));
+    if(!devs || !out) {
+        free(devs);
+        free(out);
+        return -1;
+    }
+
+    // Result vector first, then the found records packed behind it.
+    registry_get_many(ids, count, devs, out);
+    size_t out_len = count;
+    for(size_t i = 0; i < count; i++) {
+        if(out[i] == 0) {
+            memcpy(out + out_len, &devs[i], sizeof(device_status_t));
+            out_len += sizeof(device_status_t);
+        }
+    }
+
+    int rc = conn_send_tlv(c, TLV_TYPE_MULTI_GET_RESPONSE, out, (uint16_t)out_len);
+    free(devs);
+    free(out);
+    return (rc < 0) ? -1 : 0;
 }
 
-static void *client_thread(void *arg) {
-    client_ctx_t *ctx = (client_ctx_t*)arg;
-    int fd = ctx->client_fd;
-    free(ctx);
+static int handle_multi_set(conn_t *c, const uint8_t *payload, uint16_t len) {
+    const size_t item_len = sizeof(uint32_t) * 2;
+    size_t count = len / item_len;
+    if(count == 0 || len % item_len != 0 || count > TLV_MULTI_MAX_ITEMS) {
+        LOGI("MULTI_SET bad len=%u", len);
+        return conn_send_tlv(c, TLV_TYPE_MULTI_SET_RESPONSE, NULL, 0);
+    }
 
-    uint8_t buffer[1024];
+    uint32_t ids[TLV_MULTI_MAX_ITEMS];
+    float temps[TLV_MULTI_MAX_ITEMS];
+    uint8_t codes[TLV_MULTI_MAX_ITEMS];
+    for(size_t i = 0; i < count; i++) {
+        uint32_t id_net, temp_bits_net;
+        memcpy(&id_net, payload + i * item_len, sizeof(id_net));
+        memcpy(&temp_bits_net, payload + i * item_len + sizeof(id_net), sizeof(temp_bits_net));
+        ids[i] = ntohl(id_net);
+        uint32_t temp_bits = ntohl(temp_bits_net);
+        memcpy(&temps[i], &temp_bits, sizeof(temps[i]));
+    }
 
-    while(1) {
-        uint16_t type = 0, len = 0;
-        int rc = recv_tlv(fd, &type, buffer, sizeof(buffer), &len);
+    if(registry_set_temperature_many(ids, temps, count, codes) < 0) {
+        return -1;
+    }
 
-        if(rc == 1) break;
-        if (rc < 0) break;
+    size_t updated = 0;
+    int64_t now_ms = history_now_ms();
+    for(size_t i = 0; i < count; i++) {
+        codes[i] = (codes[i] == 0) ? SET_OK : SET_NOT_FOUND;
+        if(codes[i] == SET_OK) {
+            uint64_t lsn = wal_append(ids[i], temps[i], now_ms);
+            if(lsn != 0) {
+                c->wal_lsn = lsn;
+            }
+            history_record(ids[i], now_ms, temps[i]);
+            subscription_notify(ids[i]);
+            updated++;
+        }
+    }
+    LOGD("MULTI_SET updated %zu of %zu devices", updated, count);
 
-        if(dispatch_request(fd, type, buffer, len) < 0) {
-            break;
+    return conn_send_tlv(c, TLV_TYPE_MULTI_SET_RESPONSE, codes, (uint16_t)count);
+}
+
+static int handle_subscribe(conn_t *c, const uint8_t *payload, uint16_t len) {
+    uint8_t code = 0;
+    if(len % sizeof(uint32_t) != 0) {
+        LOGI("SUBSCRIBE bad len=%u", len);
+        code = 1;
+        return conn_send_tlv(c, TLV_TYPE_SUBSCRIBE_RESPONSE, &code, sizeof(code));
+    }
+
+    size_t count = len / sizeof(uint32_t);
+    uint32_t *ids = NULL;
+    if(count > 0) {
+        ids = malloc(count * sizeof(*ids));
+        if(!ids) {
+            return -1;
+        }
+        for(size_t i = 0; i < count; i++) {
+            uint32_t id_net;
+            memcpy(&id_net, payload + i * sizeof(id_net), sizeof(id_net));
+            ids[i] = ntohl(id_net);
         }
+    }
 
+    if(subscription_open(c, ids, count) < 0) {
+        LOGE("SUBSCRIBE failed: out of memory");
+        code = 1;
+    } else if(count == 0) {
+        LOGI("connection subscribed to all devices");
+    } else {
+        LOGI("connection subscribed to %zu devices", count);
     }
+    free(ids);
 
-    close(fd);
-    return NULL;
+    return conn_send_tlv(c, TLV_TYPE_SUBSCRIBE_RESPONSE, &code, sizeof(code));
+}
+
+static int handle_unsubscribe(conn_t *c, const uint8_t *payload, uint16_t len) {
+    (void)payload;
+    (void)len;
+
+    subscription_close(c);
+    uint8_t code = 0;
+    return conn_send_tlv(c, TLV_TYPE_SUBSCRIBE_RESPONSE, &code, sizeof(code));
+}
+
+static int handle_history(conn_t *c, const uint8_t *payload, uint16_t len) {
+    uint8_t out[UINT16_MAX];
+    if(len != TLV_HISTORY_REQUEST_LEN && len != TLV_HISTORY_REQUEST_LEN + sizeof(uint32_t)) {
+        LOGI("HISTORY bad len=%u", len);
+        memset(out, 0, TLV_HISTORY_HEADER_LEN);
+        out[0] = 2;
+        return conn_send_tlv(c, TLV_TYPE_HISTORY_RESPONSE, out, TLV_HISTORY_HEADER_LEN);
+    }
+
+    uint32_t id_net, bucket_net;
+    uint64_t from_net, to_net;
+    memcpy(&id_net, payload, sizeof(id_net));
+    memcpy(&from_net, payload + 4, sizeof(from_net));
+    memcpy(&to_net, payload + 12, sizeof(to_net));
+    memcpy(&bucket_net, payload + 20, sizeof(bucket_net));
+    uint32_t device_id = ntohl(id_net);
+    int64_t from_ms = (int64_t)be64toh(from_net);
+    int64_t to_ms = (int64_t)be64toh(to_net);
+    int64_t bucket_ms = ntohl(bucket_net);
+    uint32_t skip = 0;
+    if(len > TLV_HISTORY_REQUEST_LEN) {
+        uint32_t skip_net;
+        memcpy(&skip_net, payload + TLV_HISTORY_REQUEST_LEN, sizeof(skip_net));
+        skip = ntohl(skip_net);
+    }
+
+    // Records are decoded straight into the response behind the header; the
+    // record types are packed, so the unaligned offset is fine.
+    uint8_t *records = out + TLV_HISTORY_HEADER_LEN;
+    size_t room = sizeof(out) - TLV_HISTORY_HEADER_LEN;
+    size_t count = 0;
+    int64_t resume_ms = 0;
+    uint32_t resume_skip = 0;
+    int rc;
+    if(bucket_ms == 0) {
+        history_sample_t *samples = (history_sample_t *)records;
+        rc = history_query(device_id, from_ms, skip, to_ms, samples, room / sizeof(*samples), &count, &resume_ms,
+                           &resume_skip);
+        count *= sizeof(*samples);
+    } else {
+        history_bucket_t *buckets = (history_bucket_t *)records;
+        rc = history_query_buckets(device_id, from_ms, to_ms, bucket_ms, buckets, room / sizeof(*buckets), &count, &resume_ms);
+        count *= sizeof(*buckets);
+    }
+
+    out[0] = (uint8_t)rc;
+    out[1] = (bucket_ms == 0) ? 0 : 1;
+    uint64_t resume_net = htobe64((uint64_t)resume_ms);
+    uint32_t resume_skip_net = htonl(resume_skip);
+    memcpy(out + 2, &resume_net, sizeof(resume_net));
+    memcpy(out + 2 + sizeof(resume_net), &resume_skip_net, sizeof(resume_skip_net));
+    return conn_send_tlv(c, TLV_TYPE_HISTORY_RESPONSE, out, (uint16_t)(TLV_HISTORY_HEADER_LEN + count));
+}
+
+typedef struct {
+    aggregate_t agg;
+    aggregate_filter_t filter;
+} aggregate_job_t;
+
+// Reduced over the registry columns shard by shard, without materializing rows.
+static int handle_aggregate(conn_t *c, const uint8_t *payload, uint16_t len) {
+    aggregate_job_t job;
+    aggregate_filter_all(&job.filter);
+
+    if(len == TLV_AGGREGATE_REQUEST_LEN) {
+        job.filter.status_mask = payload[0] ? payload[0] : 0xff;
+        job.filter.battery_min = payload[1];
+        job.filter.battery_max = payload[2];
+        job.filter.temp_min = float_from_net(payload + 4);
+        job.filter.temp_max = float_from_net(payload + 8);
+        job.filter.hist_lo = float_from_net(payload + 12);
+        job.filter.hist_hi = float_from_net(payload + 16);
+    } else if(len != 0) {
+        LOGI("AGGREGATE bad len=%u", len);
+        return conn_send_tlv(c, TLV_TYPE_AGGREGATE_RESPONSE, NULL, 0);
+    }
+
+    aggregate_init(&job.agg);
+    registry_visit_columns(aggregate_shard, &job);
+
+    aggregate_stats_t stats;
+    aggregate_finish(&job.agg, &stats);
+    return conn_send_tlv(c, TLV_TYPE_AGGREGATE_RESPONSE, &stats, sizeof(stats));
+}
+
+static int handle_stats(conn_t *c, const uint8_t *payload, uint16_t len) {
+    (void)payload;
+    if(len != 0) {
+        LOGI("STATS bad len=%u", len);
+        return conn_send_tlv(c, TLV_TYPE_STATS_RESPONSE, NULL, 0);
+    }
+    metrics_snapshot_t *snap = collect_metrics();
+    if(!snap) {
+        return conn_send_tlv(c, TLV_TYPE_STATS_RESPONSE, NULL, 0);
+    }
+
+    uint8_t buf[sizeof(stats_header_t) + METRICS_REQ_KINDS * sizeof(stats_request_t)];
+    stats_header_t hdr = {
+        .uptime_ms = snap->uptime_ms,
+        .connections_active = snap->connections_active,
+        .connections_accepted = snap->connections_accepted,
+        .bytes_in = snap->bytes_in,
+        .bytes_out = snap->bytes_out,
+        .lock_acquired = snap->lock_acquired,
+        .lock_contended = snap->lock_contended,
+        .lock_wait_ns = snap->lock_wait_ns,
+        .list_cache_hits = snap->list_cache_hits,
+        .list_cache_misses = snap->list_cache_misses,
+        .list_cache_rebuilds = snap->list_cache_rebuilds,
+        .type_count = 0,
+    };
+    size_t off = sizeof(hdr);
+    for(int k = 0; k < METRICS_REQ_KINDS; k++) {
+        const metrics_requests_t *h = &snap->requests[k];
+        if(h->count == 0) {
+            continue;
+        }
+        stats_request_t rec = {
+            .type = metrics_kind_type(k),
+            .count = h->count,
+            .failed = h->failed,
+            .mean_ns = h->sum_ns / h->count,
+            .p50_ns = metrics_percentile(h, 0.5),
+            .p90_ns = metrics_percentile(h, 0.9),
+            .p99_ns = metrics_percentile(h, 0.99),
+            .p999_ns = metrics_percentile(h, 0.999),
+            .max_ns = metrics_percentile(h, 1.0),
+        };
+        memcpy(buf + off, &rec, sizeof(rec));
+        off += sizeof(rec);
+        hdr.type_count++;
+    }
+    memcpy(buf, &hdr, sizeof(hdr));
+    free(snap);
+    return conn_send_tlv(c, TLV_TYPE_STATS_RESPONSE, buf, (uint16_t)off);
+}
+
+static void aggregate_shard(const registry_columns_t *cols, void *arg) {
+    aggregate_job_t *job = arg;
+    aggregate_columns(&job->agg, &job->filter, cols->temperature, cols->battery, cols->status, cols->count);
+}
+
+static float float_from_net(const uint8_t *p) {
+    uint32_t bits;
+    float value;
+    memcpy(&bits, p, sizeof(bits));
+    bits = ntohl(bits);
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Every connection holds a descriptor, so lift the soft limit to the hard one.
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        return;
+    }
+    if(rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if(setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+            LOGE("setrlimit RLIMIT_NOFILE failed: %s", strerror(errno));
+        }
+    }
 }
 
 static void *discovery_thread(void *arg) {
@@ -299,6 +950,14 @@ static void *discovery_thread(void *arg) {
     LOGI("discovery thread listening on %s:%d...", DISCOVERY_MCAST_ADDR, DISCOVERY_PORT);
 
     uint8_t buffer[1024];
+    // Answers are served from this frame, refreshed once it is stale, and
+    // limited by a token bucket so a request flood cannot turn the server
+    // into a multicast amplifier.
+    uint8_t frame[sizeof(tlv_header_t) + TLV_DISCOVER_RESPONSE_LEN];
+    size_t frame_len = 0;
+    uint64_t frame_ns = 0;
+    double tokens = DISCOVERY_REPLY_RATE;
+    uint64_t tokens_ns = metrics_now_ns();
 
     while(g_running) {
         struct sockaddr_in src_addr;
@@ -322,19 +981,27 @@ static void *discovery_thread(void *arg) {
             continue;
         }
 
-        LOGI("discovery request received from %s", inet_ntoa(src_addr.sin_addr));
+        uint64_t now = metrics_now_ns();
+        tokens += (double)(now - tokens_ns) * DISCOVERY_REPLY_RATE / 1e9;
+        if(tokens > DISCOVERY_REPLY_RATE) {
+            tokens = DISCOVERY_REPLY_RATE;
+        }
+        tokens_ns = now;
+        if(tokens < 1.0) {
+            LOGD("discovery request from %s dropped: over %d replies/s", inet_ntoa(src_addr.sin_addr),
+                 DISCOVERY_REPLY_RATE);
+            continue;
+        }
+        tokens -= 1.0;
 
-        uint16_t tcp_port_net = htons((uint16_t)SERVER_PORT);
-        uint8_t tx[1024];
-        size_t tx_len = 0;
+        LOGI("discovery request received from %s", inet_ntoa(src_addr.sin_addr));
 
-        rc = tlv_encode_buf(tx, sizeof(tx), TLV_TYPE_DISCOVER_RESPONSE, &tcp_port_net, sizeof(tcp_port_net), &tx_len);
-        if(rc < 0) {
-            LOGE("discovery tlv_encode_buf failed: %s", strerror(errno));
-            continue;
+        if(frame_len == 0 || now - frame_ns >= DISCOVERY_REFRESH_MS * 1000000ull) {
+            frame_len = discovery_encode(frame, sizeof(frame));
+            frame_ns = now;
         }
 
-        n = sendto(fd, tx, tx_len, 0, (struct sockaddr *)&src_addr, src_addr_len);
+        n = sendto(fd, frame, frame_len, 0, (struct sockaddr *)&src_addr, src_addr_len);
         if(n < 0) {
             LOGE("discovery sendto failed: %s", strerror(errno));
             continue;
@@ -343,3 +1010,40 @@ static void *discovery_thread(void *arg) {
     close(fd);
     return NULL;
 }
+
+static size_t discovery_encode(uint8_t *out, size_t size) {
+    uint64_t connections = 0;
+    for(int i = 0; i < g_reactor_count; i++) {
+        connections += atomic_load_explicit(&g_reactors[i].stats.active, memory_order_relaxed);
+    }
+    size_t devices = registry_count();
+
+    uint8_t value[TLV_DISCOVER_RESPONSE_LEN];
+    uint16_t port_net = htons((uint16_t)SERVER_PORT);
+    uint32_t id_net = htonl(g_server_id);
+    uint16_t workers_net = htons((uint16_t)g_reactor_count);
+    uint32_t connections_net = htonl(connections > UINT32_MAX ? UINT32_MAX : (uint32_t)connections);
+    uint32_t rate_net = htonl(atomic_load_explicit(&g_request_rate, memory_order_relaxed));
+    uint32_t shards_net = htonl((uint32_t)registry_shard_count());
+    uint32_t devices_net = htonl(devices > UINT32_MAX ? UINT32_MAX : (uint32_t)devices);
+    memcpy(value, &port_net, 2);
+    memcpy(value + 2, &id_net, 4);
+    memcpy(value + 6, &workers_net, 2);
+    memcpy(value + 8, &connections_net, 4);
+    memcpy(value + 12, &rate_net, 4);
+    memcpy(value + 16, &shards_net, 4);
+    memcpy(value + 20, &devices_net, 4);
+
+    size_t len = 0;
+    tlv_encode_buf(out, size, TLV_TYPE_DISCOVER_RESPONSE, value, sizeof(value), &len);
+    return len;
+}
+
+// Tells apart servers sharing a host and port, and a restarted server.
+static uint32_t pick_server_id(void) {
+    uint32_t id = 0;
+    if(getrandom(&id, sizeof(id), 0) != (ssize_t)sizeof(id) || id == 0) {
+        id = ((uint32_t)getpid() ^ (uint32_t)metrics_now_ns()) | 1u;
+    }
+    return id;
+}
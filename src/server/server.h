@@ -1,22 +1,42 @@
 #pragma once
 
+#include "log.h"
+
 #include <stdio.h>
 #include <syslog.h>
 #include <signal.h>
+#include <stdint.h>
+
+extern int g_use_syslog;
+extern volatile sig_atomic_t g_running;
 
 
-#define LOGI(fmt, ...) do { \
-  if (g_use_syslog) syslog(LOG_INFO, fmt __VA_OPT__(,) __VA_ARGS__); \
-  else printf("[server] " fmt "\n" __VA_OPT__(,) __VA_ARGS__); \
-} while(0)
+struct conn;
 
-#define LOGE(fmt, ...) do { \
-  if (g_use_syslog) syslog(LOG_ERR, fmt __VA_OPT__(,) __VA_ARGS__); \
-  else fprintf(stderr, "[server] " fmt "\n" __VA_OPT__(,) __VA_ARGS__); \
-} while(0)
+typedef struct {
+    int workers;             // event loop threads, one SO_REUSEPORT socket each
+    int io_backend;          // REACTOR_BACKEND_*
+    unsigned stats_interval; // seconds between per-worker stats logs, 0 = on exit only
+    size_t capacity;         // registry size limit
+    size_t shards;           // registry lock stripes
+    size_t devices;          // devices registered at startup
+    size_t history_depth;    // compressed history blocks per device, 0 = off
+    const char *store_path;  // registry store file, NULL = memory only
+    unsigned flush_interval; // seconds between store writebacks, 0 = left to the kernel
+    const char *wal_path;    // write-ahead log of SETs, NULL = none
+    int durability;          // WAL_DURABILITY_*
+    int ingest_threads;      // UDP telemetry receivers, 0 = no ingest port
+    const char *ingest_bind; // their IPv4 address, NULL = all interfaces
+    const char *metrics_path;  // Prometheus text file of the metrics, NULL = none
+    unsigned metrics_interval; // seconds between metrics file writes, 0 = on exit only
+    int list_cache;            // serve full LISTs from a shared encoded frame
+    unsigned list_cache_ms;    // ... stale for up to this long after a change
+} server_config_t;
 
-extern int g_use_syslog;
-extern volatile sig_atomic_t g_running;
+int server_run(const server_config_t *cfg);
 
+// Handle one decoded request, queueing the response on the connection.
+int dispatch_request(struct conn *c, uint16_t type, const uint8_t *payload, uint16_t len);
 
-int server_run(void);
\ No newline at end of file
+// Queue the next frame of the connection's active stream.
+int dispatch_stream(struct conn *c);
\ No newline at end of file
@@ -0,0 +1,262 @@
+#include "subscription.h"
+#include "hash.h"
+#include "reactor.h"
+#include "registry.h"
+#include "server.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PENDING_INITIAL_CAPACITY 64
+
+// Changed devices waiting to be pushed. The set makes a device that changes
+// again before it is sent a no-op, so a slow consumer costs at most one
+// entry per followed device instead of one per change. The ring keeps the
+// arrival order; its capacity matches the set's, which stays under half full.
+typedef struct subscription {
+    conn_t *conn;
+    uint32_t *filter; // sorted ids, NULL follows every device
+    size_t filter_count;
+
+    pthread_mutex_t lock; // guards everything below
+    uint64_t *set;        // device_id + 1, 0 = empty
+    uint32_t *ring;
+    size_t mask;          // capacity - 1, 0 until the first change
+    size_t head;
+    _Atomic size_t count;
+} subscription_t;
+
+// Subscribers are few and long-lived, so notifiers scan all of them under
+// the read lock; g_sub_active lets updates skip the lock when there are none.
+static pthread_rwlock_t g_subs_lock = PTHREAD_RWLOCK_INITIALIZER;
+static subscription_t **g_subs;
+static size_t g_sub_count;
+static size_t g_sub_cap;
+static _Atomic size_t g_sub_active;
+
+static int cmp_u32(const void *a, const void *b);
+static int pending_add(subscription_t *s, uint32_t device_id);
+static uint32_t pending_pop(subscription_t *s);
+static int pending_grow(subscription_t *s);
+static void subscription_free(subscription_t *s);
+
+int subscription_open(conn_t *c, const uint32_t *ids, size_t count) {
+    subscription_t *s = calloc(1, sizeof(*s));
+    if(!s) {
+        return -1;
+    }
+    s->conn = c;
+    pthread_mutex_init(&s->lock, NULL);
+
+    if(count > 0) {
+        s->filter = malloc(count * sizeof(*s->filter));
+        if(!s->filter) {
+            subscription_free(s);
+            return -1;
+        }
+        memcpy(s->filter, ids, count * sizeof(*s->filter));
+        qsort(s->filter, count, sizeof(*s->filter), cmp_u32);
+        s->filter_count = count;
+    }
+
+    subscription_close(c);
+
+    pthread_rwlock_wrlock(&g_subs_lock);
+    if(g_sub_count == g_sub_cap) {
+        size_t cap = g_sub_cap ? g_sub_cap * 2 : 16;
+        subscription_t **subs = realloc(g_subs, cap * sizeof(*subs));
+        if(!subs) {
+            pthread_rwlock_unlock(&g_subs_lock);
+            subscription_free(s);
+            return -1;
+        }
+        g_subs = subs;
+        g_sub_cap = cap;
+    }
+    g_subs[g_sub_count++] = s;
+    atomic_store_explicit(&g_sub_active, g_sub_count, memory_order_release);
+    pthread_rwlock_unlock(&g_subs_lock);
+
+    c->sub = s;
+    return 0;
+}
+
+void subscription_close(conn_t *c) {
+    subscription_t *s = c->sub;
+    if(!s) {
+        return;
+    }
+
+    pthread_rwlock_wrlock(&g_subs_lock);
+    for(size_t i = 0; i < g_sub_count; i++) {
+        if(g_subs[i] == s) {
+            g_subs[i] = g_subs[--g_sub_count];
+            break;
+        }
+    }
+    atomic_store_explicit(&g_sub_active, g_sub_count, memory_order_release);
+    pthread_rwlock_unlock(&g_subs_lock);
+
+    c->sub = NULL;
+    subscription_free(s);
+}
+
+void subscription_notify(uint32_t device_id) {
+    if(atomic_load_explicit(&g_sub_active, memory_order_acquire) == 0) {
+        return;
+    }
+
+    pthread_rwlock_rdlock(&g_subs_lock);
+    for(size_t i = 0; i < g_sub_count; i++) {
+        subscription_t *s = g_subs[i];
+        if(s->filter && !bsearch(&device_id, s->filter, s->filter_count, sizeof(*s->filter), cmp_u32)) {
+            continue;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        int rc = pending_add(s, device_id);
+        size_t count = atomic_load_explicit(&s->count, memory_order_relaxed);
+        pthread_mutex_unlock(&s->lock);
+
+        if(rc < 0) {
+            LOGE("subscriber update dropped: out of memory");
+        } else if(rc > 0 && count == 1) {
+            // Only the first pending change needs a wakeup; later ones are
+            // picked up by the same drain or by the EPOLLOUT that resumes it.
+            reactor_wake(s->conn->reactor, s->conn);
+        }
+    }
+    pthread_rwlock_unlock(&g_subs_lock);
+}
+
+size_t subscription_pending(const conn_t *c) {
+    return c->sub ? atomic_load_explicit(&c->sub->count, memory_order_relaxed) : 0;
+}
+
+int subscription_drain(conn_t *c) {
+    subscription_t *s = c->sub;
+    if(subscription_pending(c) == 0) {
+        return 0;
+    }
+
+    uint32_t ids[TLV_STATUS_UPDATE_MAX_DEVICES];
+    size_t n = 0;
+    pthread_mutex_lock(&s->lock);
+    while(n < TLV_STATUS_UPDATE_MAX_DEVICES && atomic_load_explicit(&s->count, memory_order_relaxed) > 0) {
+        ids[n++] = pending_pop(s);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    // The registry is read at send time, so every frame carries the latest
+    // state even when several changes were coalesced. Removed devices are skipped.
+    device_status_t devs[TLV_STATUS_UPDATE_MAX_DEVICES];
+    size_t found = 0;
+    for(size_t i = 0; i < n; i++) {
+        if(registry_get(ids[i], &devs[found]) == 0) {
+            found++;
+        }
+    }
+    if(found == 0) {
+        return 1;
+    }
+
+    if(conn_send_tlv(c, TLV_TYPE_STATUS_UPDATE, devs, (uint16_t)(found * sizeof(device_status_t))) < 0) {
+        LOGE("queue STATUS_UPDATE failed");
+        return -1;
+    }
+    return 1;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// 1 if the device was added, 0 if it was already pending, -1 on allocation failure.
+static int pending_add(subscription_t *s, uint32_t device_id) {
+    size_t count = atomic_load_explicit(&s->count, memory_order_relaxed);
+    if(s->mask == 0 || (count + 1) * 2 > s->mask + 1) {
+        if(pending_grow(s) < 0) {
+            return -1;
+        }
+    }
+
+    uint64_t key = (uint64_t)device_id + 1;
+    size_t pos = hash_device_id(device_id) & s->mask;
+    while(s->set[pos] != 0) {
+        if(s->set[pos] == key) {
+            return 0;
+        }
+        pos = (pos + 1) & s->mask;
+    }
+    s->set[pos] = key;
+    s->ring[(s->head + count) & s->mask] = device_id;
+    atomic_store_explicit(&s->count, count + 1, memory_order_relaxed);
+    return 1;
+}
+
+// Removes the oldest pending device; the caller checked count > 0.
+static uint32_t pending_pop(subscription_t *s) {
+    uint32_t device_id = s->ring[s->head];
+    s->head = (s->head + 1) & s->mask;
+    atomic_fetch_sub_explicit(&s->count, 1, memory_order_relaxed);
+
+    uint64_t key = (uint64_t)device_id + 1;
+    size_t hole = hash_device_id(device_id) & s->mask;
+    while(s->set[hole] != key) {
+        hole = (hole + 1) & s->mask;
+    }
+
+    // Backward-shift deletion, as in the registry index.
+    size_t next = (hole + 1) & s->mask;
+    while(s->set[next] != 0) {
+        size_t home = hash_device_id((uint32_t)(s->set[next] - 1)) & s->mask;
+        if(((next - home) & s->mask) >= ((next - hole) & s->mask)) {
+            s->set[hole] = s->set[next];
+            hole = next;
+        }
+        next = (next + 1) & s->mask;
+    }
+    s->set[hole] = 0;
+    return device_id;
+}
+
+static int pending_grow(subscription_t *s) {
+    size_t cap = s->mask ? (s->mask + 1) * 2 : PENDING_INITIAL_CAPACITY;
+    uint64_t *set = calloc(cap, sizeof(*set));
+    uint32_t *ring = malloc(cap * sizeof(*ring));
+    if(!set || !ring) {
+        free(set);
+        free(ring);
+        return -1;
+    }
+
+    size_t count = atomic_load_explicit(&s->count, memory_order_relaxed);
+    for(size_t i = 0; i < count; i++) {
+        uint32_t device_id = s->ring[(s->head + i) & s->mask];
+        size_t pos = hash_device_id(device_id) & (cap - 1);
+        while(set[pos] != 0) {
+            pos = (pos + 1) & (cap - 1);
+        }
+        set[pos] = (uint64_t)device_id + 1;
+        ring[i] = device_id;
+    }
+
+    free(s->set);
+    free(s->ring);
+    s->set = set;
+    s->ring = ring;
+    s->mask = cap - 1;
+    s->head = 0;
+    return 0;
+}
+
+static void subscription_free(subscription_t *s) {
+    pthread_mutex_destroy(&s->lock);
+    free(s->filter);
+    free(s->set);
+    free(s->ring);
+    free(s);
+}
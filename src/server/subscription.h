@@ -0,0 +1,24 @@
+#pragma once
+
+#include "conn.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Replace the connection's subscription. count == 0 follows every device,
+// otherwise only the listed ids. 0 on success, -1 if allocation failed.
+int subscription_open(conn_t *c, const uint32_t *ids, size_t count);
+// Drop the connection's subscription, if any. Once it returns no other
+// thread can reach the connection through it.
+void subscription_close(conn_t *c);
+
+// Mark a device as changed for every subscriber that follows it. Safe to
+// call from any thread, after the registry update is visible.
+void subscription_notify(uint32_t device_id);
+
+// Number of changed devices not yet sent to this connection.
+size_t subscription_pending(const conn_t *c);
+// Queue one STATUS_UPDATE frame with the current state of up to
+// TLV_STATUS_UPDATE_MAX_DEVICES pending devices. 1 if pending devices were
+// consumed, 0 if there were none, -1 on error.
+int subscription_drain(conn_t *c);
@@ -0,0 +1,257 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Setup flags that only tune scheduling; older kernels get a ring without them.
+#define URING_OPTIONAL_FLAGS (IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN)
+
+static int uring_setup(unsigned entries, struct io_uring_params *p);
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz);
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args);
+
+int uring_init(uring_t *u, unsigned entries, unsigned cq_entries, unsigned flags) {
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = flags | IORING_SETUP_CQSIZE;
+    p.cq_entries = cq_entries;
+    int fd = uring_setup(entries, &p);
+    if(fd < 0 && errno == EINVAL && (flags & URING_OPTIONAL_FLAGS)) {
+        memset(&p, 0, sizeof(p));
+        p.flags = (flags & ~URING_OPTIONAL_FLAGS) | IORING_SETUP_CQSIZE;
+        p.cq_entries = cq_entries;
+        fd = uring_setup(entries, &p);
+    }
+    if(fd < 0) {
+        return -1;
+    }
+    u->fd = fd;
+    u->flags = p.flags;
+
+    u->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if(single && u->cq_map_len > u->sq_map_len) {
+        u->sq_map_len = u->cq_map_len;
+    }
+    u->sq_map = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(u->sq_map == MAP_FAILED) {
+        u->sq_map = NULL;
+        goto fail;
+    }
+    uint8_t *cq = u->sq_map;
+    if(!single) {
+        u->cq_map = mmap(NULL, u->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if(u->cq_map == MAP_FAILED) {
+            u->cq_map = NULL;
+            goto fail;
+        }
+        cq = u->cq_map;
+    }
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto fail;
+    }
+
+    uint8_t *sq = u->sq_map;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->sq_local_tail = *u->sq_tail;
+    // SQE slots are used in ring order, so the indirection array is fixed.
+    unsigned *array = (unsigned *)(sq + p.sq_off.array);
+    for(unsigned i = 0; i < p.sq_entries; i++) {
+        array[i] = i;
+    }
+
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:;
+    int saved = errno;
+    uring_free(u);
+    errno = saved;
+    return -1;
+}
+
+void uring_free(uring_t *u) {
+    if(u->sqes) {
+        munmap(u->sqes, u->sqes_len);
+    }
+    if(u->cq_map) {
+        munmap(u->cq_map, u->cq_map_len);
+    }
+    if(u->sq_map) {
+        munmap(u->sq_map, u->sq_map_len);
+    }
+    if(u->fd >= 0) {
+        close(u->fd);
+    }
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+int uring_enable(uring_t *u) {
+    if(!(u->flags & IORING_SETUP_R_DISABLED)) {
+        return 0;
+    }
+    return uring_register(u->fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0);
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *u) {
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if(u->sq_local_tail - head >= u->sq_entries) {
+        if(uring_submit_and_wait(u, 0, 0) < 0) {
+            return NULL;
+        }
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if(u->sq_local_tail - head >= u->sq_entries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &u->sqes[u->sq_local_tail & u->sq_mask];
+    u->sq_local_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_submit_and_wait(uring_t *u, unsigned wait_nr, int timeout_ms) {
+    // Counted from the kernel's head, so SQEs a failed call left behind go
+    // out with the next one.
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+    unsigned flags = 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    void *argp = NULL;
+    size_t argsz = 0;
+    // Deferred task work only runs when asked for events.
+    if(wait_nr > 0 || (u->flags & IORING_SETUP_DEFER_TASKRUN)) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+    if(wait_nr > 0 && timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof(arg);
+    }
+    if(to_submit == 0 && flags == 0) {
+        return 0;
+    }
+
+    int rc = uring_enter(u->fd, to_submit, wait_nr, flags, argp, argsz);
+    if(rc < 0 && (errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+        return 0; // the caller reaps what is there and comes back
+    }
+    return rc;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *u) {
+    unsigned head = *u->cq_head;
+    if(head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &u->cqes[head & u->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *u) {
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int uring_buf_ring_init(uring_t *u, uring_buf_ring_t *br, uint16_t bgid, unsigned entries, unsigned buf_size) {
+    memset(br, 0, sizeof(*br));
+    br->entries = entries;
+    br->buf_size = buf_size;
+    br->bgid = bgid;
+
+    // The kernel wants the ring page aligned.
+    br->ring_len = entries * sizeof(struct io_uring_buf);
+    void *ring = mmap(NULL, br->ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring == MAP_FAILED) {
+        return -1;
+    }
+    br->ring = ring;
+    br->bufs = malloc((size_t)entries * buf_size);
+    if(!br->bufs) {
+        munmap(br->ring, br->ring_len);
+        br->ring = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)br->ring;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if(uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int saved = errno;
+        free(br->bufs);
+        munmap(br->ring, br->ring_len);
+        memset(br, 0, sizeof(*br));
+        errno = saved;
+        return -1;
+    }
+
+    for(unsigned i = 0; i < entries; i++) {
+        uring_buf_ring_recycle(br, (uint16_t)i);
+    }
+    return 0;
+}
+
+void uring_buf_ring_free(uring_t *u, uring_buf_ring_t *br) {
+    if(!br->ring) {
+        return;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = br->bgid;
+    uring_register(u->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    free(br->bufs);
+    munmap(br->ring, br->ring_len);
+    memset(br, 0, sizeof(*br));
+}
+
+uint8_t *uring_buf_ring_buffer(const uring_buf_ring_t *br, uint16_t bid) {
+    return br->bufs + (size_t)bid * br->buf_size;
+}
+
+void uring_buf_ring_recycle(uring_buf_ring_t *br, uint16_t bid) {
+    struct io_uring_buf *b = &br->ring->bufs[br->tail & (br->entries - 1)];
+    b->addr = (uint64_t)(uintptr_t)uring_buf_ring_buffer(br, bid);
+    b->len = br->buf_size;
+    b->bid = bid;
+    br->tail++;
+    __atomic_store_n(&br->ring->tail, br->tail, __ATOMIC_RELEASE);
+}
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
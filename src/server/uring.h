@@ -0,0 +1,70 @@
+#pragma once
+
+// Minimal io_uring wrapper over the raw system calls: ring setup and
+// mapping, SQE allocation, submission and CQE iteration, and provided
+// buffer rings. Only the thread that owns a ring may use it.
+
+#include <linux/io_uring.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    int fd;
+    unsigned flags; // IORING_SETUP_* the ring was created with
+
+    void *sq_map;
+    size_t sq_map_len;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail; // SQEs handed out, published by the next submit
+
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+
+    void *cq_map; // NULL when it shares sq_map
+    size_t cq_map_len;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+} uring_t;
+
+// Kernel-shared ring of receive buffers; the kernel picks one per completion
+// and reports its id in the CQE flags.
+typedef struct {
+    struct io_uring_buf_ring *ring;
+    size_t ring_len;
+    uint8_t *bufs;
+    unsigned entries;
+    unsigned buf_size;
+    uint16_t bgid;
+    uint16_t tail;
+} uring_buf_ring_t;
+
+// 'flags' are IORING_SETUP_* wishes; those the kernel rejects are dropped.
+// -1 with errno set on failure.
+int uring_init(uring_t *u, unsigned entries, unsigned cq_entries, unsigned flags);
+void uring_free(uring_t *u);
+// Start a ring created with IORING_SETUP_R_DISABLED; its caller becomes the
+// single issuer.
+int uring_enable(uring_t *u);
+
+// Next free SQE, zeroed; submits the queued ones first when the ring is full.
+// NULL only if that submission fails.
+struct io_uring_sqe *uring_get_sqe(uring_t *u);
+// Submit the queued SQEs and wait up to 'timeout_ms' (-1 = forever) for
+// 'wait_nr' completions. Returns the number submitted or -1 with errno set;
+// a timeout is not an error.
+int uring_submit_and_wait(uring_t *u, unsigned wait_nr, int timeout_ms);
+// Oldest unconsumed completion, or NULL; release it with uring_cqe_seen().
+struct io_uring_cqe *uring_peek_cqe(uring_t *u);
+void uring_cqe_seen(uring_t *u);
+
+int uring_buf_ring_init(uring_t *u, uring_buf_ring_t *br, uint16_t bgid, unsigned entries, unsigned buf_size);
+void uring_buf_ring_free(uring_t *u, uring_buf_ring_t *br);
+uint8_t *uring_buf_ring_buffer(const uring_buf_ring_t *br, uint16_t bid);
+// Give buffer 'bid' back to the kernel.
+void uring_buf_ring_recycle(uring_buf_ring_t *br, uint16_t bid);
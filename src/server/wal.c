@@ -0,0 +1,451 @@
+#include "wal.h"
+#include "registry.h"
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#define WAL_MAGIC "IOTWAL02"
+#define WAL_HEADER_SIZE 8
+// Devices copied per registry_scan() call while writing a snapshot.
+#define WAL_SNAPSHOT_CHUNK 4096
+
+enum {
+    WAL_RECORD_TEMPERATURE = 1, // SET: battery and status unused
+    WAL_RECORD_STATUS = 2,      // telemetry and snapshots: the whole record
+};
+
+// On-disk record; crc covers the bytes before it.
+typedef struct {
+    uint32_t device_id;
+    uint32_t temperature_bits;
+    uint8_t kind;
+    uint8_t battery;
+    uint8_t status;
+    uint8_t reserved;
+    int64_t ts_ms; // 0 for snapshot records, which are not added to history
+    uint32_t crc;
+} __attribute__((packed)) wal_record_t;
+
+typedef struct {
+    int fd;
+    int durability;
+    int store_backed;
+    char path[4096];
+    size_t file_bytes;
+
+    // Appenders fill 'pending' under 'lock'; the log thread swaps it with
+    // 'writing' and writes that one out without the lock.
+    pthread_mutex_t lock;
+    pthread_cond_t work;   // pending became non-empty, or stopping
+    pthread_cond_t space;  // pending was handed to the log thread
+    wal_record_t *pending;
+    wal_record_t *writing;
+    size_t pending_count;
+    uint64_t appended_lsn;
+    _Atomic uint64_t durable_lsn;
+    // A group failed to reach the disk. The log has a hole from then on,
+    // so durable_lsn stays where it was for the rest of the run.
+    atomic_int failed;
+    int stopping;
+
+    pthread_t thread;
+    int started;
+    void (*on_durable)(void *arg);
+    void *on_durable_arg;
+} wal_t;
+
+static wal_t g_wal = { .fd = -1 };
+static uint32_t g_crc_table[256];
+
+static void crc_init(void);
+static uint32_t crc32c(const void *data, size_t len);
+static int write_all(int fd, const void *buf, size_t len);
+static void *wal_thread(void *arg);
+static uint64_t wal_enqueue(const wal_record_t *recs, size_t count);
+static void record_init(wal_record_t *r, int kind, const device_status_t *dev, int64_t ts_ms);
+static void wal_checkpoint(void);
+static int wal_write_snapshot(void);
+
+int wal_parse_durability(const char *name) {
+    if(strcmp(name, "none") == 0) return WAL_DURABILITY_NONE;
+    if(strcmp(name, "batched") == 0) return WAL_DURABILITY_BATCHED;
+    if(strcmp(name, "strict") == 0) return WAL_DURABILITY_STRICT;
+    return -1;
+}
+
+const char *wal_durability_name(int durability) {
+    switch(durability) {
+        case WAL_DURABILITY_NONE: return "none";
+        case WAL_DURABILITY_BATCHED: return "batched";
+        default: return "strict";
+    }
+}
+
+long wal_open(const char *path, int durability, int store_backed,
+              void (*apply)(const device_status_t *dev, int temperature_only, int64_t ts_ms)) {
+    crc_init();
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    char magic[WAL_HEADER_SIZE];
+    if(st.st_size == 0) {
+        if(write_all(fd, WAL_MAGIC, WAL_HEADER_SIZE) < 0 || fdatasync(fd) < 0) {
+            close(fd);
+            return -1;
+        }
+    } else if(pread(fd, magic, sizeof(magic), 0) != (ssize_t)sizeof(magic) ||
+              memcmp(magic, WAL_MAGIC, WAL_HEADER_SIZE) != 0) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Replay up to the first record that is incomplete or fails its check.
+    long replayed = 0;
+    off_t offset = WAL_HEADER_SIZE;
+    wal_record_t *chunk = malloc(WAL_BUFFER_RECORDS * sizeof(*chunk));
+    if(!chunk) {
+        close(fd);
+        return -1;
+    }
+    while(1) {
+        ssize_t n = pread(fd, chunk, WAL_BUFFER_RECORDS * sizeof(*chunk), offset);
+        if(n < 0) {
+            free(chunk);
+            close(fd);
+            return -1;
+        }
+        size_t count = (size_t)n / sizeof(*chunk);
+        size_t i = 0;
+        for(; i < count; i++) {
+            const wal_record_t *r = &chunk[i];
+            if(crc32c(r, offsetof(wal_record_t, crc)) != r->crc) {
+                break;
+            }
+            device_status_t dev = { .device_id = r->device_id, .battery = r->battery, .status = r->status };
+            memcpy(&dev.temperature, &r->temperature_bits, sizeof(dev.temperature));
+            apply(&dev, r->kind == WAL_RECORD_TEMPERATURE, r->ts_ms);
+        }
+        replayed += (long)i;
+        offset += (off_t)(i * sizeof(*chunk));
+        if(i < count || (size_t)n < WAL_BUFFER_RECORDS * sizeof(*chunk)) {
+            break;
+        }
+    }
+    free(chunk);
+
+    if(offset < st.st_size && (ftruncate(fd, offset) < 0 || fdatasync(fd) < 0)) {
+        close(fd);
+        return -1;
+    }
+    if(lseek(fd, offset, SEEK_SET) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    g_wal.pending = malloc(WAL_BUFFER_RECORDS * sizeof(wal_record_t));
+    g_wal.writing = malloc(WAL_BUFFER_RECORDS * sizeof(wal_record_t));
+    if(!g_wal.pending || !g_wal.writing) {
+        free(g_wal.pending);
+        free(g_wal.writing);
+        close(fd);
+        return -1;
+    }
+    pthread_mutex_init(&g_wal.lock, NULL);
+    pthread_cond_init(&g_wal.work, NULL);
+    pthread_cond_init(&g_wal.space, NULL);
+    g_wal.fd = fd;
+    g_wal.durability = durability;
+    g_wal.store_backed = store_backed;
+    g_wal.file_bytes = (size_t)offset;
+    snprintf(g_wal.path, sizeof(g_wal.path), "%s", path);
+    return replayed;
+}
+
+int wal_start(void (*on_durable)(void *arg), void *arg) {
+    g_wal.on_durable = on_durable;
+    g_wal.on_durable_arg = arg;
+    int rc = pthread_create(&g_wal.thread, NULL, wal_thread, NULL);
+    if(rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    g_wal.started = 1;
+    return 0;
+}
+
+void wal_close(void) {
+    if(g_wal.fd < 0) {
+        return;
+    }
+    if(g_wal.started) {
+        pthread_mutex_lock(&g_wal.lock);
+        g_wal.stopping = 1;
+        pthread_cond_signal(&g_wal.work);
+        pthread_mutex_unlock(&g_wal.lock);
+        pthread_join(g_wal.thread, NULL);
+    }
+    fdatasync(g_wal.fd);
+    close(g_wal.fd);
+    free(g_wal.pending);
+    free(g_wal.writing);
+    pthread_mutex_destroy(&g_wal.lock);
+    pthread_cond_destroy(&g_wal.work);
+    pthread_cond_destroy(&g_wal.space);
+    memset(&g_wal, 0, sizeof(g_wal));
+    g_wal.fd = -1;
+}
+
+uint64_t wal_append(uint32_t device_id, float temperature, int64_t ts_ms) {
+    if(g_wal.fd < 0) {
+        return 0;
+    }
+    device_status_t dev = { .device_id = device_id, .temperature = temperature };
+    wal_record_t r;
+    record_init(&r, WAL_RECORD_TEMPERATURE, &dev, ts_ms);
+    return wal_enqueue(&r, 1);
+}
+
+uint64_t wal_append_status(const device_status_t *devs, size_t count, int64_t ts_ms) {
+    if(g_wal.fd < 0 || count == 0) {
+        return 0;
+    }
+    // Checksums are computed outside the lock, a stack chunk at a time.
+    wal_record_t recs[256];
+    uint64_t lsn = 0;
+    for(size_t done = 0; done < count;) {
+        size_t n = count - done;
+        n = (n < sizeof(recs) / sizeof(recs[0])) ? n : sizeof(recs) / sizeof(recs[0]);
+        for(size_t i = 0; i < n; i++) {
+            record_init(&recs[i], WAL_RECORD_STATUS, &devs[done + i], ts_ms);
+        }
+        lsn = wal_enqueue(recs, n);
+        done += n;
+    }
+    return lsn;
+}
+
+uint64_t wal_durable_lsn(void) {
+    return atomic_load(&g_wal.durable_lsn);
+}
+
+int wal_failed(void) {
+    return atomic_load(&g_wal.failed);
+}
+
+static uint64_t wal_enqueue(const wal_record_t *recs, size_t count) {
+    pthread_mutex_lock(&g_wal.lock);
+    while(count > 0) {
+        while(g_wal.pending_count == WAL_BUFFER_RECORDS) {
+            pthread_cond_wait(&g_wal.space, &g_wal.lock);
+        }
+        size_t n = WAL_BUFFER_RECORDS - g_wal.pending_count;
+        n = (n < count) ? n : count;
+        if(g_wal.pending_count == 0) {
+            pthread_cond_signal(&g_wal.work);
+        }
+        memcpy(&g_wal.pending[g_wal.pending_count], recs, n * sizeof(*recs));
+        g_wal.pending_count += n;
+        g_wal.appended_lsn += n;
+        recs += n;
+        count -= n;
+    }
+    uint64_t lsn = g_wal.appended_lsn;
+    pthread_mutex_unlock(&g_wal.lock);
+
+    return (g_wal.durability == WAL_DURABILITY_STRICT) ? lsn : 0;
+}
+
+static void record_init(wal_record_t *r, int kind, const device_status_t *dev, int64_t ts_ms) {
+    *r = (wal_record_t){
+        .device_id = dev->device_id,
+        .kind = (uint8_t)kind,
+        .battery = dev->battery,
+        .status = dev->status,
+        .ts_ms = ts_ms,
+    };
+    memcpy(&r->temperature_bits, &dev->temperature, sizeof(r->temperature_bits));
+    r->crc = crc32c(r, offsetof(wal_record_t, crc));
+}
+
+// Group commit: whatever was appended while the previous group was being
+// written goes out as the next group, with one write and one fdatasync.
+static void *wal_thread(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&g_wal.lock);
+    while(1) {
+        while(g_wal.pending_count == 0 && !g_wal.stopping) {
+            pthread_cond_wait(&g_wal.work, &g_wal.lock);
+        }
+        if(g_wal.pending_count == 0) {
+            break; // stopping with nothing left
+        }
+
+        wal_record_t *batch = g_wal.pending;
+        size_t count = g_wal.pending_count;
+        uint64_t last = g_wal.appended_lsn;
+        g_wal.pending = g_wal.writing;
+        g_wal.writing = batch;
+        g_wal.pending_count = 0;
+        pthread_cond_broadcast(&g_wal.space);
+        pthread_mutex_unlock(&g_wal.lock);
+
+        // A failed write or sync leaves durable_lsn behind for good, so
+        // strict acknowledgements are never sent rather than claim durability.
+        int ok = (write_all(g_wal.fd, batch, count * sizeof(*batch)) == 0);
+        if(ok) {
+            g_wal.file_bytes += count * sizeof(*batch);
+        } else {
+            LOGE("WAL write failed: %s", strerror(errno));
+        }
+        if(ok && g_wal.durability != WAL_DURABILITY_NONE && fdatasync(g_wal.fd) < 0) {
+            LOGE("WAL fdatasync failed: %s", strerror(errno));
+            ok = 0;
+        }
+
+        if(!ok && !atomic_exchange(&g_wal.failed, 1)) {
+            LOGE("WAL failed: updates after record %llu will not be acknowledged as durable",
+                 (unsigned long long)atomic_load(&g_wal.durable_lsn));
+        }
+        if(ok && !atomic_load(&g_wal.failed)) {
+            atomic_store(&g_wal.durable_lsn, last);
+        }
+        // Also after a failure, so that waiting connections give up.
+        if(g_wal.on_durable) {
+            g_wal.on_durable(g_wal.on_durable_arg);
+        }
+
+        if(g_wal.file_bytes >= WAL_CHECKPOINT_BYTES) {
+            wal_checkpoint();
+        }
+        pthread_mutex_lock(&g_wal.lock);
+    }
+    pthread_mutex_unlock(&g_wal.lock);
+    return NULL;
+}
+
+// Every record in the file was applied to the registry before it was
+// appended, so once the registry state is durable the file can go. Runs on
+// the log thread between groups; appends queue up in memory meanwhile.
+static void wal_checkpoint(void) {
+    if(g_wal.store_backed) {
+        if(registry_flush(1) < 0) {
+            LOGE("WAL checkpoint: store sync failed: %s", strerror(errno));
+            return;
+        }
+        if(ftruncate(g_wal.fd, WAL_HEADER_SIZE) < 0 || lseek(g_wal.fd, WAL_HEADER_SIZE, SEEK_SET) < 0 ||
+           fdatasync(g_wal.fd) < 0) {
+            LOGE("WAL checkpoint: truncate failed: %s", strerror(errno));
+            return;
+        }
+        g_wal.file_bytes = WAL_HEADER_SIZE;
+    } else if(wal_write_snapshot() < 0) {
+        LOGE("WAL checkpoint: snapshot failed: %s", strerror(errno));
+        return;
+    }
+    LOGI("WAL checkpoint: log trimmed to %zu bytes", g_wal.file_bytes);
+}
+
+// Without a store the log is replaced by one record per device holding its
+// current state, written to a new file that is renamed over the log.
+static int wal_write_snapshot(void) {
+    char tmp[sizeof(g_wal.path) + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", g_wal.path);
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        return -1;
+    }
+
+    device_status_t *devs = malloc(WAL_SNAPSHOT_CHUNK * sizeof(*devs));
+    wal_record_t *recs = malloc(WAL_SNAPSHOT_CHUNK * sizeof(*recs));
+    size_t bytes = WAL_HEADER_SIZE;
+    int rc = (devs && recs) ? write_all(fd, WAL_MAGIC, WAL_HEADER_SIZE) : -1;
+
+    uint32_t cursor = REGISTRY_CURSOR_START;
+    while(rc == 0 && cursor != REGISTRY_CURSOR_END) {
+        size_t n = registry_scan(cursor, devs, WAL_SNAPSHOT_CHUNK, &cursor);
+        for(size_t i = 0; i < n; i++) {
+            record_init(&recs[i], WAL_RECORD_STATUS, &devs[i], 0);
+        }
+        rc = write_all(fd, recs, n * sizeof(*recs));
+        bytes += n * sizeof(*recs);
+    }
+    free(devs);
+    free(recs);
+
+    if(rc == 0 && fdatasync(fd) == 0 && rename(tmp, g_wal.path) == 0) {
+        // Make the rename itself durable.
+        char dir_buf[sizeof(g_wal.path)];
+        snprintf(dir_buf, sizeof(dir_buf), "%s", g_wal.path);
+        int dir_fd = open(dirname(dir_buf), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(dir_fd >= 0) {
+            fsync(dir_fd);
+            close(dir_fd);
+        }
+        close(g_wal.fd);
+        g_wal.fd = fd;
+        g_wal.file_bytes = bytes;
+        return 0;
+    }
+
+    int saved = errno;
+    close(fd);
+    unlink(tmp);
+    errno = saved;
+    return -1;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while(len > 0) {
+        ssize_t n = write(fd, p, len);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// CRC-32C (Castagnoli), reflected, table driven.
+static void crc_init(void) {
+    for(uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for(int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ 0x82f63b78u : c >> 1;
+        }
+        g_crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32c(const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint32_t c = ~0u;
+    for(size_t i = 0; i < len; i++) {
+        c = g_crc_table[(c ^ p[i]) & 0xff] ^ (c >> 8);
+    }
+    return ~c;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "protocol.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// none:    records are written by the log thread but never synced; they
+//          survive a server crash, not a power loss.
+// batched: every group of records is written with one write + fdatasync,
+//          but SETs are acknowledged without waiting for it, so an
+//          acknowledged SET can still be lost to a power loss.
+// strict:  as batched, and a SET is only acknowledged once its group is
+//          durable. The default.
+enum {
+    WAL_DURABILITY_NONE = 0,
+    WAL_DURABILITY_BATCHED,
+    WAL_DURABILITY_STRICT,
+};
+
+// Records kept in memory waiting for the log thread; appenders block when full.
+#define WAL_BUFFER_RECORDS 65536
+// The log is checkpointed and trimmed once it grows past this size.
+#define WAL_CHECKPOINT_BYTES (64u << 20)
+
+// -1 for an unknown name.
+int wal_parse_durability(const char *name);
+const char *wal_durability_name(int durability);
+
+// Open or create the log at 'path' and replay its records through 'apply',
+// oldest first; a torn tail left by a crash is cut off. Records logged by
+// wal_append() only carry a temperature and are flagged 'temperature_only'. 'store_backed'
+// selects how checkpoints trim the log: by syncing the registry store, or
+// by rewriting the log as a snapshot of the registry. Returns the number
+// of records replayed, or -1 with errno set.
+long wal_open(const char *path, int durability, int store_backed,
+              void (*apply)(const device_status_t *dev, int temperature_only, int64_t ts_ms));
+// Start the log thread; 'on_durable' runs on it after every group commit.
+int wal_start(void (*on_durable)(void *arg), void *arg);
+// Write out everything appended so far and close the log; no-op without one.
+void wal_close(void);
+
+// Log a temperature update that has been applied to the registry. Returns
+// the record's sequence number if the acknowledgement must wait for it to
+// become durable, 0 otherwise (also when no log is open).
+uint64_t wal_append(uint32_t device_id, float temperature, int64_t ts_ms);
+// Log full status updates in one go; returns the last record's sequence
+// number on the same terms as wal_append().
+uint64_t wal_append_status(const device_status_t *devs, size_t count, int64_t ts_ms);
+// Highest sequence number known to be durable.
+uint64_t wal_durable_lsn(void);
+// 1 once a group failed to be written or synced. Sequence numbers above
+// wal_durable_lsn() will then never become durable.
+int wal_failed(void);
@@ -0,0 +1,153 @@
+// Registry insert/remove against the open-addressing index: removing an
+// entry from the middle of a probe chain must leave the entries behind it
+// reachable, and the freed slot must be usable again.
+
+#include "hash.h"
+#include "registry.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHAIN_LEN 5
+#define RANDOM_IDS 2000
+#define RANDOM_OPS 200000
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if(!(cond)) {                                                        \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            return 1;                                                        \
+        }                                                                    \
+    } while(0)
+
+static int test_chain(void);
+static int test_random(void);
+static int insert(uint32_t id, float temperature);
+static int expect_device(uint32_t id, float temperature);
+
+int main(void) {
+    int failed = 0;
+    failed |= test_chain();
+    failed |= test_random();
+    printf("registry test %s\n", failed ? "FAILED" : "passed");
+    return failed;
+}
+
+// Ids that share a home bucket in any index of up to 2^16 entries form
+// one contiguous probe chain in a single shard.
+static int test_chain(void) {
+    CHECK(registry_init(256, 1) == 0);
+
+    uint32_t chain[CHAIN_LEN];
+    uint32_t target = hash_device_id(1) & 0xffff;
+    size_t found = 0;
+    for(uint32_t id = 1; found < CHAIN_LEN; id++) {
+        if((hash_device_id(id) & 0xffff) == target) {
+            chain[found++] = id;
+        }
+    }
+    for(size_t i = 0; i < CHAIN_LEN; i++) {
+        CHECK(insert(chain[i], (float)i) == 0);
+    }
+    CHECK(insert(chain[2], 0.0f) == 1);
+
+    // Middle of the chain: everything after it must still be found.
+    CHECK(registry_remove(chain[2]) == 0);
+    CHECK(registry_remove(chain[2]) == 1);
+    device_status_t dev;
+    CHECK(registry_get(chain[2], &dev) == 1);
+    CHECK(registry_set_temperature(chain[2], 1.0f) == 1);
+    for(size_t i = 0; i < CHAIN_LEN; i++) {
+        if(i == 2) {
+            continue;
+        }
+        CHECK(expect_device(chain[i], (float)i) == 0);
+        CHECK(registry_set_temperature(chain[i], 100.0f + (float)i) == 0);
+        CHECK(expect_device(chain[i], 100.0f + (float)i) == 0);
+    }
+    CHECK(registry_count() == CHAIN_LEN - 1);
+
+    // The freed entry takes the id again; then drop the chain's head.
+    CHECK(insert(chain[2], 42.0f) == 0);
+    CHECK(expect_device(chain[2], 42.0f) == 0);
+    CHECK(registry_remove(chain[0]) == 0);
+    CHECK(registry_get(chain[0], &dev) == 1);
+    for(size_t i = 1; i < CHAIN_LEN; i++) {
+        CHECK(expect_device(chain[i], i == 2 ? 42.0f : 100.0f + (float)i) == 0);
+    }
+    CHECK(registry_count() == CHAIN_LEN - 1);
+
+    registry_destroy();
+    return 0;
+}
+
+// Random inserts, removes and updates on a nearly full shard, checked
+// against a plain array after every operation.
+static int test_random(void) {
+    CHECK(registry_init(RANDOM_IDS, 1) == 0);
+
+    static float model[RANDOM_IDS + 1];
+    static int present[RANDOM_IDS + 1];
+    size_t count = 0;
+    srand(1);
+    for(int op = 0; op < RANDOM_OPS; op++) {
+        uint32_t id = (uint32_t)(rand() % RANDOM_IDS) + 1;
+        float temperature = (float)(rand() % 1000) / 10.0f;
+        switch(rand() % 3) {
+            case 0:
+                CHECK(insert(id, temperature) == (present[id] ? 1 : 0));
+                if(!present[id]) {
+                    present[id] = 1;
+                    model[id] = temperature;
+                    count++;
+                }
+                break;
+            case 1:
+                CHECK(registry_remove(id) == (present[id] ? 0 : 1));
+                if(present[id]) {
+                    present[id] = 0;
+                    count--;
+                }
+                break;
+            default:
+                CHECK(registry_set_temperature(id, temperature) == (present[id] ? 0 : 1));
+                if(present[id]) {
+                    model[id] = temperature;
+                }
+                break;
+        }
+        CHECK(registry_count() == count);
+    }
+
+    for(uint32_t id = 1; id <= RANDOM_IDS; id++) {
+        if(present[id]) {
+            CHECK(expect_device(id, model[id]) == 0);
+        } else {
+            device_status_t dev;
+            CHECK(registry_get(id, &dev) == 1);
+        }
+    }
+
+    registry_destroy();
+    return 0;
+}
+
+static int insert(uint32_t id, float temperature) {
+    device_status_t dev = { .device_id = id, .temperature = temperature, .battery = 50, .status = 1 };
+    return registry_insert(&dev);
+}
+
+static int expect_device(uint32_t id, float temperature) {
+    device_status_t dev;
+    if(registry_get(id, &dev) != 0) {
+        fprintf(stderr, "device %u not found\n", id);
+        return 1;
+    }
+    if(dev.device_id != id || dev.temperature != temperature) {
+        fprintf(stderr, "device %u: got id %u temperature %.1f, want %.1f\n", id, dev.device_id,
+                (double)dev.temperature, (double)temperature);
+        return 1;
+    }
+    return 0;
+}